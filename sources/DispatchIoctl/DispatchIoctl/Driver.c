@@ -1,5 +1,7 @@
 #include <ntddk.h>
 #include <ntstrsafe.h>
+#include "Ioctl.h"
+#include "Queue.h"
 
 
 // User mode controller
@@ -7,22 +9,101 @@
 // CloseHandle(hDevice) ==> will trigger the IRP_MJ_CLOSE.
 
 // #include "winioctl.h" // so you can use the CTL_CODE macro
+// #include "Ioctl.h"
 // WCHAR* szMessage = L"dummy message from userland";
 //  == Send ioctl ==
 // DeviceIoControl(hDevice, DEVICE_SEND, wcslen(szMessage)*sizeof(WCHAR)+2, NULL, 0, &ReturnLength, NULL);
 // == Recv ioctl ==
 // WCHAR szMessage [1024] = {0};
 // DeviceIoControl(hDevice, DEVICE_RECV, NULL, 0, szMessage, 1024, &ReturnLength, NULL, );
+// == Large payloads: see Ioctl.h ==
 
 
-// Supported IOCTLs
-#define DEVICE_SEND CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_WRITE_DATA)
-#define DEVICE_RECV CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_READ_DATA)
+#define CLIENT_TAG 'tilC'
+#define PAYLOAD_TAG 'lyaP'
+
+#define RING_IDLE 0
+#define RING_MAPPED 1
+
+// InsertContext of a DEVICE_RECV_WAIT put back in front of the queue, where it was.
+#define RECV_INSERT_HEAD ((PVOID)1)
+
+// Everything a handle sends and receives is its own, so that clients on separate handles
+// share no lock. Created on IRP_MJ_CREATE in FileObject->FsContext, freed on IRP_MJ_CLOSE.
+typedef struct _CLIENT_CONTEXT {
+	// Messages sent on the handle that no DEVICE_RECV_WAIT took yet, for DEVICE_RECV.
+	MESSAGE_QUEUE Queue;
+
+	// DEVICE_RECV_WAIT requests waiting for a message, oldest first. RecvWaiting counts them,
+	// so that sending a message with nobody waiting does not take the lock.
+	IO_CSQ RecvCsq;
+	KSPIN_LOCK RecvLock;
+	LIST_ENTRY RecvQueue;
+	volatile LONG RecvWaiting;
+
+	// Last payload stored by DEVICE_SEND_DIRECT. The buffer only grows.
+	FAST_MUTEX PayloadLock;
+	PVOID Payload;
+	ULONG PayloadLength;
+	ULONG PayloadCapacity;
+
+	// The ring of DEVICE_MAP_RING and the thread consuming it. The ring is the output buffer of
+	// the request, which stays pending in RingCsq, as RingIrp, for as long as the thread runs.
+	// Starting and stopping the thread must run at PASSIVE_LEVEL, so rather than hold a mutex
+	// across them, RingState turns away a second DEVICE_MAP_RING until it is RING_IDLE again.
+	volatile LONG RingState;
+	IO_CSQ RingCsq;
+	KSPIN_LOCK RingLock;
+	PIRP RingIrp;
+	PDEVICE_RING Ring;
+	PKEVENT RingEvent;
+	PETHREAD RingThread;
+	volatile LONG RingStop;
+
+	// Set by the thread on the ring while it waits for room in Queue. Whoever takes a message
+	// off Queue then clears it and sets RingSpace.
+	volatile LONG RingStalled;
+	KEVENT RingSpace;
+
+	// DEVICE_QUERY_STATISTICS.
+	volatile LONG64 FastIoRequests;
+	volatile LONG64 IrpRequests;
+} CLIENT_CONTEXT, *PCLIENT_CONTEXT;
+
+C_ASSERT(MESSAGE_QUEUE_LENGTH == DEVICE_QUEUE_LENGTH);
+C_ASSERT(MESSAGE_MAXIMUM_LENGTH == DEVICE_MAXIMUM_MESSAGE);
 
 // Globals
 PDEVICE_OBJECT g_DeviceObject = NULL;
 UNICODE_STRING DeviceName = RTL_CONSTANT_STRING(L"\\Device\\dummydriver");
 UNICODE_STRING SymLinkName = RTL_CONSTANT_STRING(L"\\??\\dummydriverlink");
+FAST_IO_DISPATCH g_FastIoDispatch;
+
+PCLIENT_CONTEXT
+CreateClient(
+	VOID
+);
+
+VOID
+DeleteClient(
+	_In_ PCLIENT_CONTEXT Client
+);
+
+VOID
+StopRing(
+	_In_ PCLIENT_CONTEXT Client,
+	_In_ PIRP Irp
+);
+
+VOID
+CancelRing(
+	_In_ PCLIENT_CONTEXT Client
+);
+
+VOID
+CancelRecvWaits(
+	_In_ PCLIENT_CONTEXT Client
+);
 
 NTSTATUS
 DispatchPassThru(
@@ -37,9 +118,19 @@ DispatchPassThru(
 	switch (IoStack->MajorFunction) {
 	case IRP_MJ_CREATE:
 		KdPrint(("create request \r\n"));
+		IoStack->FileObject->FsContext = CreateClient();
+		if (IoStack->FileObject->FsContext == NULL) {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+		break;
+	case IRP_MJ_CLEANUP:
+		CancelRing(IoStack->FileObject->FsContext);
+		CancelRecvWaits(IoStack->FileObject->FsContext);
 		break;
 	case IRP_MJ_CLOSE:
 		KdPrint(("close request \r\n"));
+		DeleteClient(IoStack->FileObject->FsContext);
+		IoStack->FileObject->FsContext = NULL;
 		break;
 	default:
 		status = STATUS_INVALID_PARAMETER;
@@ -52,6 +143,731 @@ DispatchPassThru(
 	return status;
 }
 
+NTSTATUS
+SendMessage(
+	_In_ PCWSTR Message,
+	_In_ ULONG Length,
+	_Out_ PULONG ReturnLength
+)
+{
+	size_t cbLength = 0;
+
+	*ReturnLength = 0;
+	if (!NT_SUCCESS(RtlStringCbLengthW(Message, min(Length, 511), &cbLength))) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	KdPrint(("sended data is %ws \r\n request \r\n", Message));
+	*ReturnLength = (ULONG)cbLength + 2;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+RecvCsqInsert(
+	_In_ PIO_CSQ Csq,
+	_In_ PIRP Irp,
+	_In_opt_ PVOID InsertContext
+)
+{
+	PCLIENT_CONTEXT Client = CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RecvCsq);
+
+	if (InsertContext == RECV_INSERT_HEAD) {
+		InsertHeadList(&Client->RecvQueue, &Irp->Tail.Overlay.ListEntry);
+	}
+	else {
+		InsertTailList(&Client->RecvQueue, &Irp->Tail.Overlay.ListEntry);
+	}
+	InterlockedIncrement(&Client->RecvWaiting);
+	return STATUS_SUCCESS;
+}
+
+VOID
+RecvCsqRemove(
+	_In_ PIO_CSQ Csq,
+	_In_ PIRP Irp
+)
+{
+	PCLIENT_CONTEXT Client = CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RecvCsq);
+
+	RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+	InterlockedDecrement(&Client->RecvWaiting);
+}
+
+PIRP
+RecvCsqPeekNext(
+	_In_ PIO_CSQ Csq,
+	_In_opt_ PIRP Irp,
+	_In_opt_ PVOID PeekContext
+)
+{
+	UNREFERENCED_PARAMETER(PeekContext);
+	PCLIENT_CONTEXT Client = CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RecvCsq);
+	PLIST_ENTRY Entry = Irp == NULL ? Client->RecvQueue.Flink : Irp->Tail.Overlay.ListEntry.Flink;
+
+	if (Entry == &Client->RecvQueue) {
+		return NULL;
+	}
+	return CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+}
+
+VOID
+RecvCsqAcquireLock(
+	_In_ PIO_CSQ Csq,
+	_Out_ PKIRQL Irql
+)
+{
+	PCLIENT_CONTEXT Client = CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RecvCsq);
+
+	KeAcquireSpinLock(&Client->RecvLock, Irql);
+}
+
+VOID
+RecvCsqReleaseLock(
+	_In_ PIO_CSQ Csq,
+	_In_ KIRQL Irql
+)
+{
+	PCLIENT_CONTEXT Client = CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RecvCsq);
+
+	KeReleaseSpinLock(&Client->RecvLock, Irql);
+}
+
+VOID
+RecvCsqCompleteCanceled(
+	_In_ PIO_CSQ Csq,
+	_In_ PIRP Irp
+)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	Irp->IoStatus.Information = 0;
+	Irp->IoStatus.Status = STATUS_CANCELLED;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+VOID
+CancelRecvWaits(
+	_In_ PCLIENT_CONTEXT Client
+)
+{
+	PIRP Irp = NULL;
+
+	while ((Irp = IoCsqRemoveNextIrp(&Client->RecvCsq, NULL)) != NULL) {
+		RecvCsqCompleteCanceled(&Client->RecvCsq, Irp);
+	}
+}
+
+// RingCsq holds one request at most, the DEVICE_MAP_RING of the running ring.
+VOID
+RingCsqInsert(
+	_In_ PIO_CSQ Csq,
+	_In_ PIRP Irp
+)
+{
+	PCLIENT_CONTEXT Client = CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RingCsq);
+
+	Client->RingIrp = Irp;
+}
+
+VOID
+RingCsqRemove(
+	_In_ PIO_CSQ Csq,
+	_In_ PIRP Irp
+)
+{
+	UNREFERENCED_PARAMETER(Irp);
+	PCLIENT_CONTEXT Client = CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RingCsq);
+
+	Client->RingIrp = NULL;
+}
+
+PIRP
+RingCsqPeekNext(
+	_In_ PIO_CSQ Csq,
+	_In_opt_ PIRP Irp,
+	_In_opt_ PVOID PeekContext
+)
+{
+	UNREFERENCED_PARAMETER(PeekContext);
+	PCLIENT_CONTEXT Client = CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RingCsq);
+
+	return Irp == NULL ? Client->RingIrp : NULL;
+}
+
+VOID
+RingCsqAcquireLock(
+	_In_ PIO_CSQ Csq,
+	_Out_ PKIRQL Irql
+)
+{
+	PCLIENT_CONTEXT Client = CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RingCsq);
+
+	KeAcquireSpinLock(&Client->RingLock, Irql);
+}
+
+VOID
+RingCsqReleaseLock(
+	_In_ PIO_CSQ Csq,
+	_In_ KIRQL Irql
+)
+{
+	PCLIENT_CONTEXT Client = CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RingCsq);
+
+	KeReleaseSpinLock(&Client->RingLock, Irql);
+}
+
+// The request is cancelled by CancelIoEx, at PASSIVE_LEVEL, or by the exit of the thread that
+// sent it, at APC_LEVEL at most, so the thread on the ring can be waited for right here.
+VOID
+RingCsqCompleteCanceled(
+	_In_ PIO_CSQ Csq,
+	_In_ PIRP Irp
+)
+{
+	StopRing(CONTAINING_RECORD(Csq, CLIENT_CONTEXT, RingCsq), Irp);
+}
+
+// Stops the ring on cleanup, when the request was still pending: the handle can be closed
+// by another process, which the ring has nothing to do with.
+VOID
+CancelRing(
+	_In_ PCLIENT_CONTEXT Client
+)
+{
+	PIRP Irp = IoCsqRemoveNextIrp(&Client->RingCsq, NULL);
+
+	if (Irp != NULL) {
+		StopRing(Client, Irp);
+	}
+}
+
+// Copies a message, Length bytes with its terminator, into a buffer of BufferLength bytes,
+// cutting it short with STATUS_BUFFER_OVERFLOW when it does not fit. BufferLength holds a
+// WCHAR at least.
+NTSTATUS
+CopyMessage(
+	_Out_ PWCHAR Buffer,
+	_In_ ULONG BufferLength,
+	_In_ PCWSTR Message,
+	_In_ ULONG Length,
+	_Out_ PULONG ReturnLength
+)
+{
+	ULONG Chars = BufferLength / sizeof(WCHAR);
+
+	if (Length <= BufferLength) {
+		RtlCopyMemory(Buffer, Message, Length);
+		*ReturnLength = Length;
+		return STATUS_SUCCESS;
+	}
+	RtlCopyMemory(Buffer, Message, (Chars - 1) * sizeof(WCHAR));
+	Buffer[Chars - 1] = L'\0';
+	*ReturnLength = Chars * sizeof(WCHAR);
+	return STATUS_BUFFER_OVERFLOW;
+}
+
+// Completes a DEVICE_RECV_WAIT taken off the queue with a message, later: it goes on
+// Completed, and the caller completes them all once it is done sending, so that a burst of
+// messages completes its requests together.
+VOID
+GiveMessage(
+	_In_ PIRP Irp,
+	_In_ PCWSTR Message,
+	_In_ ULONG Length,
+	_Inout_ PLIST_ENTRY Completed
+)
+{
+	ULONG OutBufferLength = IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.OutputBufferLength;
+	ULONG ReturnLength = 0;
+
+	Irp->IoStatus.Status = CopyMessage(Irp->AssociatedIrp.SystemBuffer, OutBufferLength, Message, Length,
+		&ReturnLength);
+	Irp->IoStatus.Information = ReturnLength;
+	InsertTailList(Completed, &Irp->Tail.Overlay.ListEntry);
+}
+
+// Called once a message is taken off the queue, for the thread on the ring, which may be
+// waiting for room. The barrier orders the dequeue before RingStalled is read, as the thread
+// sets RingStalled before it looks at the queue again.
+VOID
+ResumeRing(
+	_In_ PCLIENT_CONTEXT Client
+)
+{
+	KeMemoryBarrier();
+	if (Client->RingStalled && InterlockedExchange(&Client->RingStalled, 0) != 0) {
+		KeSetEvent(&Client->RingSpace, IO_NO_INCREMENT, FALSE);
+	}
+}
+
+// Gives queued messages to waiting DEVICE_RECV_WAIT requests until either runs out. A message
+// and a request can each arrive just as the other side looked and found nothing, so both the
+// sender and the request call this once they are in: each makes itself visible with a full
+// barrier before it looks for the other, so at least one of them finds the pair.
+VOID
+PumpMessages(
+	_In_ PCLIENT_CONTEXT Client,
+	_Inout_ PLIST_ENTRY Completed
+)
+{
+	WCHAR Message[MESSAGE_MAXIMUM_LENGTH / sizeof(WCHAR)];
+	ULONG Length = 0;
+	PIRP Irp = NULL;
+
+	while (Client->RecvWaiting != 0 && !IsMessageQueueEmpty(&Client->Queue)) {
+		Irp = IoCsqRemoveNextIrp(&Client->RecvCsq, NULL);
+		if (Irp == NULL) {
+			break;
+		}
+		if (!DequeueMessage(&Client->Queue, Message, &Length)) {
+			// A DEVICE_RECV took it first. The request goes back in front, so that it is still the
+			// next one served, and the queue is looked at again now that the request is visible.
+			IoCsqInsertIrpEx(&Client->RecvCsq, Irp, NULL, RECV_INSERT_HEAD);
+			continue;
+		}
+		GiveMessage(Irp, Message, Length, Completed);
+		ResumeRing(Client);
+	}
+}
+
+// Hands a sent message to the oldest DEVICE_RECV_WAIT on the handle, or else queues it for
+// DEVICE_RECV. Fails with STATUS_DEVICE_BUSY when the queue is full.
+NTSTATUS
+DeliverMessage(
+	_In_ PCLIENT_CONTEXT Client,
+	_In_ PCWSTR Message,
+	_In_ ULONG Length,
+	_Inout_ PLIST_ENTRY Completed
+)
+{
+	PIRP Irp = NULL;
+
+	if (Client->RecvWaiting != 0 && IsMessageQueueEmpty(&Client->Queue)) {
+		Irp = IoCsqRemoveNextIrp(&Client->RecvCsq, NULL);
+		if (Irp != NULL) {
+			GiveMessage(Irp, Message, Length, Completed);
+			return STATUS_SUCCESS;
+		}
+	}
+
+	if (!EnqueueMessage(&Client->Queue, Message, Length)) {
+		return STATUS_DEVICE_BUSY;
+	}
+	KeMemoryBarrier();
+	if (Client->RecvWaiting != 0) {
+		PumpMessages(Client, Completed);
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID
+CompleteDelivered(
+	_Inout_ PLIST_ENTRY Completed
+)
+{
+	while (!IsListEmpty(Completed)) {
+		PIRP Irp = CONTAINING_RECORD(RemoveHeadList(Completed), IRP, Tail.Overlay.ListEntry);
+
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	}
+}
+
+// DEVICE_RECV: the oldest message queued on the handle, or a message from the driver when
+// there is none.
+NTSTATUS
+RecvMessage(
+	_In_ PCLIENT_CONTEXT Client,
+	_Out_ PWCHAR Buffer,
+	_In_ ULONG OutBufferLength,
+	_Out_ PULONG ReturnLength
+)
+{
+	CONST WCHAR* SecondBuffer = L"message returned from the driver";
+	WCHAR Message[MESSAGE_MAXIMUM_LENGTH / sizeof(WCHAR)];
+	ULONG Length = 0;
+	size_t cbLength = 0;
+
+	*ReturnLength = 0;
+	if (OutBufferLength >= sizeof(WCHAR) && DequeueMessage(&Client->Queue, Message, &Length)) {
+		ResumeRing(Client);
+		return CopyMessage(Buffer, OutBufferLength, Message, Length, ReturnLength);
+	}
+	if (!NT_SUCCESS(RtlStringCbCopyW(Buffer, min(OutBufferLength, 511), SecondBuffer))) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+	RtlStringCbLengthW(Buffer, 511, &cbLength);
+	*ReturnLength = (ULONG)cbLength + 2;
+	KdPrint(("received data is %ws \r\n request \r\n", Buffer));
+	return STATUS_SUCCESS;
+}
+
+PCLIENT_CONTEXT
+CreateClient(
+	VOID
+)
+{
+	PCLIENT_CONTEXT Client = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(CLIENT_CONTEXT), CLIENT_TAG);
+
+	if (Client == NULL) {
+		return NULL;
+	}
+	RtlZeroMemory(Client, sizeof(CLIENT_CONTEXT));
+
+	InitializeMessageQueue(&Client->Queue);
+	KeInitializeSpinLock(&Client->RecvLock);
+	InitializeListHead(&Client->RecvQueue);
+	IoCsqInitializeEx(&Client->RecvCsq, RecvCsqInsert, RecvCsqRemove, RecvCsqPeekNext, RecvCsqAcquireLock,
+		RecvCsqReleaseLock, RecvCsqCompleteCanceled);
+	KeInitializeSpinLock(&Client->RingLock);
+	KeInitializeEvent(&Client->RingSpace, SynchronizationEvent, FALSE);
+	IoCsqInitialize(&Client->RingCsq, RingCsqInsert, RingCsqRemove, RingCsqPeekNext, RingCsqAcquireLock,
+		RingCsqReleaseLock, RingCsqCompleteCanceled);
+	ExInitializeFastMutex(&Client->PayloadLock);
+	Client->RingState = RING_IDLE;
+	return Client;
+}
+
+// By IRP_MJ_CLOSE the cleanup has stopped the ring and cancelled the waits, and no other
+// request on the handle is left.
+VOID
+DeleteClient(
+	_In_ PCLIENT_CONTEXT Client
+)
+{
+	if (Client == NULL) {
+		return;
+	}
+	if (Client->Payload != NULL) {
+		ExFreePoolWithTag(Client->Payload, PAYLOAD_TAG);
+	}
+	ExFreePoolWithTag(Client, CLIENT_TAG);
+}
+
+NTSTATUS
+SendBatch(
+	_In_ PCLIENT_CONTEXT Client,
+	_In_ PVOID Buffer,
+	_In_ ULONG InBufferLength,
+	_In_ ULONG OutBufferLength,
+	_Inout_ PLIST_ENTRY Completed,
+	_Out_ PULONG ReturnLength
+)
+{
+	// The statuses overwrite the batch in the system buffer as it is parsed. Each message takes
+	// at least as many bytes as its status, so a status never lands on a message not yet read.
+	PUCHAR Input = (PUCHAR)Buffer;
+	PLONG Statuses = (PLONG)Buffer;
+	NTSTATUS status = STATUS_SUCCESS;
+	ULONG Offset = FIELD_OFFSET(DEVICE_BATCH, Messages);
+	ULONG Header = FIELD_OFFSET(DEVICE_MESSAGE, Data);
+	ULONG Count = 0;
+	ULONG i = 0;
+
+	*ReturnLength = 0;
+	if (InBufferLength < Offset) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	Count = ((PDEVICE_BATCH)Buffer)->Count;
+	if (Count > DEVICE_MAXIMUM_BATCH) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (OutBufferLength < Count * sizeof(LONG)) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	for (i = 0; i < Count; i++) {
+		PDEVICE_MESSAGE Message = (PDEVICE_MESSAGE)(Input + Offset);
+		ULONG MessageLength = 0;
+		ULONG Sent = 0;
+
+		if (InBufferLength - Offset < Header) {
+			break;
+		}
+		MessageLength = Message->Length;
+		if (MessageLength > InBufferLength - Offset - Header) {
+			break;
+		}
+		Offset += min(DEVICE_MESSAGE_SIZE(MessageLength), InBufferLength - Offset);
+		status = SendMessage(Message->Data, MessageLength, &Sent);
+		if (NT_SUCCESS(status)) {
+			status = DeliverMessage(Client, Message->Data, Sent, Completed);
+		}
+		Statuses[i] = status;
+	}
+	for (; i < Count; i++) {
+		Statuses[i] = STATUS_INVALID_PARAMETER;
+	}
+
+	*ReturnLength = Count * sizeof(LONG);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+SendDirect(
+	_In_ PCLIENT_CONTEXT Client,
+	_In_ PIRP Irp,
+	_In_ ULONG Length,
+	_Out_ PULONG ReturnLength
+)
+{
+	// The caller's pages are mapped, not copied: the copy into our buffer is the only one.
+	PVOID Buffer = NULL;
+
+	*ReturnLength = 0;
+	if (Length > DEVICE_MAXIMUM_PAYLOAD) {
+		return STATUS_INVALID_BUFFER_SIZE;
+	}
+	if (Length != 0) {
+		Buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+		if (Buffer == NULL) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	ExAcquireFastMutex(&Client->PayloadLock);
+	if (Length > Client->PayloadCapacity) {
+		PVOID NewPayload = ExAllocatePoolWithTag(PagedPool, Length, PAYLOAD_TAG);
+		if (NewPayload == NULL) {
+			ExReleaseFastMutex(&Client->PayloadLock);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		if (Client->Payload != NULL) {
+			ExFreePoolWithTag(Client->Payload, PAYLOAD_TAG);
+		}
+		Client->Payload = NewPayload;
+		Client->PayloadCapacity = Length;
+	}
+	if (Length != 0) {
+		RtlCopyMemory(Client->Payload, Buffer, Length);
+	}
+	Client->PayloadLength = Length;
+	ExReleaseFastMutex(&Client->PayloadLock);
+
+	KdPrint(("sended payload of %u bytes \r\n", Length));
+	*ReturnLength = Length;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+RecvDirect(
+	_In_ PCLIENT_CONTEXT Client,
+	_In_ PIRP Irp,
+	_In_ ULONG Length,
+	_Out_ PULONG ReturnLength
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	PVOID Buffer = NULL;
+
+	*ReturnLength = 0;
+	if (Length != 0) {
+		Buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+		if (Buffer == NULL) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	ExAcquireFastMutex(&Client->PayloadLock);
+	if (Length < Client->PayloadLength) {
+		status = STATUS_BUFFER_TOO_SMALL;
+	}
+	else {
+		if (Client->PayloadLength != 0) {
+			RtlCopyMemory(Buffer, Client->Payload, Client->PayloadLength);
+		}
+		*ReturnLength = Client->PayloadLength;
+	}
+	ExReleaseFastMutex(&Client->PayloadLock);
+	return status;
+}
+
+// Delivers a message from the ring, waiting for as long as the queue is full rather than
+// drop it. Head stays where it is meanwhile, so the ring fills up and the caller waits too.
+// Returns FALSE when the ring is stopped.
+BOOLEAN
+DeliverRingMessage(
+	_In_ PCLIENT_CONTEXT Client,
+	_In_ PCWSTR Message,
+	_In_ ULONG Length,
+	_Inout_ PLIST_ENTRY Completed
+)
+{
+	while (DeliverMessage(Client, Message, Length, Completed) == STATUS_DEVICE_BUSY) {
+		// A message taken off the queue before RingStalled is set goes unsignalled, so the
+		// queue is looked at once more after.
+		InterlockedExchange(&Client->RingStalled, 1);
+		if (DeliverMessage(Client, Message, Length, Completed) != STATUS_DEVICE_BUSY) {
+			InterlockedExchange(&Client->RingStalled, 0);
+			break;
+		}
+		CompleteDelivered(Completed);
+		KeWaitForSingleObject(&Client->RingSpace, Executive, KernelMode, FALSE, NULL);
+		if (Client->RingStop) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+VOID
+RingWorker(
+	_In_ PVOID Context
+)
+{
+	PCLIENT_CONTEXT Client = Context;
+	WCHAR Message[RTL_FIELD_SIZE(DEVICE_RING_SLOT, Data) / sizeof(WCHAR)];
+	LIST_ENTRY Completed;
+	ULONG Head = 0;
+	ULONG Tail = 0;
+
+	InitializeListHead(&Completed);
+
+	for (;;) {
+		KeWaitForSingleObject(Client->RingEvent, Executive, KernelMode, FALSE, NULL);
+		if (Client->RingStop) {
+			break;
+		}
+
+		Tail = ReadULongAcquire(&Client->Ring->Tail);
+		while (Head != Tail) {
+			// Tail and the slots belong to the caller, who can write anything there at any time:
+			// a Tail more than a ring ahead drops what is in it, and each slot is read once.
+			if (Tail - Head > DEVICE_RING_SLOTS) {
+				Head = Tail;
+			}
+			else {
+				PDEVICE_RING_SLOT Slot = &Client->Ring->Slots[Head % DEVICE_RING_SLOTS];
+				ULONG Length = min(*(volatile ULONG*)&Slot->Length, sizeof(Message));
+				ULONG Sent = 0;
+
+				RtlCopyMemory(Message, Slot->Data, Length);
+				// The ring has no status to report, so a message SendMessage refuses is skipped.
+				if (NT_SUCCESS(SendMessage(Message, Length, &Sent)) &&
+					!DeliverRingMessage(Client, Message, Sent, &Completed)) {
+					goto Stopped;
+				}
+				Head++;
+			}
+			WriteULongRelease(&Client->Ring->Head, Head);
+
+			// Head must be visible before Tail is read again, or a caller that saw the old Head
+			// skips the event while we go to sleep on the old Tail.
+			if (Head == Tail) {
+				CompleteDelivered(&Completed);
+				KeMemoryBarrier();
+				Tail = ReadULongAcquire(&Client->Ring->Tail);
+			}
+		}
+	}
+
+Stopped:
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// DEVICE_MAP_RING: starts the thread on the ring, the request's output buffer, and leaves the
+// request pending for as long as the thread runs. The I/O manager keeps the buffer locked
+// until the request completes, so the ring needs no mapping of its own, and it goes with the
+// process that allocated it: the exit of the thread that sent the request cancels it, and the
+// cancel stops the thread before the request completes.
+NTSTATUS
+MapRing(
+	_In_ PCLIENT_CONTEXT Client,
+	_In_ PIRP Irp,
+	_In_ PDEVICE_RING_SETUP Setup,
+	_In_ ULONG InBufferLength,
+	_In_ ULONG OutBufferLength
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	OBJECT_ATTRIBUTES Attributes;
+	HANDLE ThreadHandle = NULL;
+
+	if (InBufferLength < sizeof(DEVICE_RING_SETUP)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (OutBufferLength < sizeof(DEVICE_RING) || Irp->MdlAddress == NULL) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+	if (InterlockedCompareExchange(&Client->RingState, RING_MAPPED, RING_IDLE) != RING_IDLE) {
+		return STATUS_DEVICE_BUSY;
+	}
+
+	Client->Ring = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+	if (Client->Ring == NULL) {
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Failed;
+	}
+	Client->Ring->Head = 0;
+	Client->Ring->Tail = 0;
+
+	status = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)Setup->Event, EVENT_MODIFY_STATE | SYNCHRONIZE,
+		*ExEventObjectType, UserMode, (PVOID*)&Client->RingEvent, NULL);
+	if (!NT_SUCCESS(status)) {
+		Client->RingEvent = NULL;
+		goto Failed;
+	}
+
+	Client->RingStop = 0;
+	Client->RingStalled = 0;
+	KeClearEvent(&Client->RingSpace);
+	InitializeObjectAttributes(&Attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+	status = PsCreateSystemThread(&ThreadHandle, THREAD_ALL_ACCESS, &Attributes, NULL, NULL, RingWorker, Client);
+	if (!NT_SUCCESS(status)) {
+		goto Failed;
+	}
+	status = ObReferenceObjectByHandle(ThreadHandle, SYNCHRONIZE, *PsThreadType, KernelMode,
+		(PVOID*)&Client->RingThread, NULL);
+	if (!NT_SUCCESS(status)) {
+		// The thread is running on the ring, so it has to be gone before the request completes.
+		Client->RingThread = NULL;
+		InterlockedExchange(&Client->RingStop, 1);
+		KeSetEvent(Client->RingEvent, IO_NO_INCREMENT, FALSE);
+		ZwWaitForSingleObject(ThreadHandle, FALSE, NULL);
+		ZwClose(ThreadHandle);
+		goto Failed;
+	}
+	ZwClose(ThreadHandle);
+
+	KdPrint(("ring started \r\n"));
+	// A request already cancelled is stopped and completed right here.
+	IoCsqInsertIrp(&Client->RingCsq, Irp, NULL);
+	return STATUS_PENDING;
+
+Failed:
+	if (Client->RingEvent != NULL) {
+		ObDereferenceObject(Client->RingEvent);
+		Client->RingEvent = NULL;
+	}
+	Client->Ring = NULL;
+	InterlockedExchange(&Client->RingState, RING_IDLE);
+	return status;
+}
+
+// Stops the thread on the ring and completes its DEVICE_MAP_RING, taken off RingCsq, which
+// unlocks the ring.
+VOID
+StopRing(
+	_In_ PCLIENT_CONTEXT Client,
+	_In_ PIRP Irp
+)
+{
+	InterlockedExchange(&Client->RingStop, 1);
+	KeSetEvent(Client->RingEvent, IO_NO_INCREMENT, FALSE);
+	KeSetEvent(&Client->RingSpace, IO_NO_INCREMENT, FALSE);
+	KeWaitForSingleObject(Client->RingThread, Executive, KernelMode, FALSE, NULL);
+	ObDereferenceObject(Client->RingThread);
+	Client->RingThread = NULL;
+
+	ObDereferenceObject(Client->RingEvent);
+	Client->RingEvent = NULL;
+	Client->Ring = NULL;
+	InterlockedExchange(&Client->RingState, RING_IDLE);
+	KdPrint(("ring stopped \r\n"));
+
+	Irp->IoStatus.Information = 0;
+	Irp->IoStatus.Status = STATUS_CANCELLED;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
 NTSTATUS
 DispatchIoctl(
 	_In_ PDEVICE_OBJECT DeviceObject,
@@ -61,25 +877,86 @@ DispatchIoctl(
 	UNREFERENCED_PARAMETER(DeviceObject);
 	NTSTATUS status = STATUS_SUCCESS;
 	PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+	PCLIENT_CONTEXT Client = IoStack->FileObject->FsContext;
 
-	// ULONG InBufferLength = IoStack->Parameters.DeviceIoControl.InputBufferLength;
-	// ULONG OutBufferLength = IoStack->Parameters.DeviceIoControl.OutputBufferLength;
+	ULONG InBufferLength = IoStack->Parameters.DeviceIoControl.InputBufferLength;
+	ULONG OutBufferLength = IoStack->Parameters.DeviceIoControl.OutputBufferLength;
 	PVOID Buffer = Irp->AssociatedIrp.SystemBuffer;
 	ULONG ReturnLength = 0;
-	CONST WCHAR* SecondBuffer = L"message returned from the driver";
-	size_t *pcchLength = NULL;
+	WCHAR Message[MESSAGE_MAXIMUM_LENGTH / sizeof(WCHAR)];
+	ULONG Length = 0;
+	LIST_ENTRY Completed;
 
+	InitializeListHead(&Completed);
+	if (Client == NULL) {
+		Irp->IoStatus.Information = 0;
+		Irp->IoStatus.Status = STATUS_INVALID_DEVICE_STATE;
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+	InterlockedIncrement64(&Client->IrpRequests);
 	switch (IoStack->Parameters.DeviceIoControl.IoControlCode) {
 	case DEVICE_SEND:
-		KdPrint(("sended data is %ws \r\n request \r\n", Buffer));
-		RtlStringCbLengthW(Buffer, 511, pcchLength);
-		ReturnLength = *pcchLength + 2;
+		status = SendMessage(Buffer, InBufferLength, &ReturnLength);
+		if (NT_SUCCESS(status)) {
+			status = DeliverMessage(Client, Buffer, ReturnLength, &Completed);
+		}
+		if (!NT_SUCCESS(status)) {
+			ReturnLength = 0;
+		}
+		break;
+	case DEVICE_SEND_BATCH:
+		status = SendBatch(Client, Buffer, InBufferLength, OutBufferLength, &Completed, &ReturnLength);
 		break;
+	case DEVICE_RECV_WAIT:
+		if (OutBufferLength < sizeof(WCHAR)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		if (DequeueMessage(&Client->Queue, Message, &Length)) {
+			ResumeRing(Client);
+			status = CopyMessage(Buffer, OutBufferLength, Message, Length, &ReturnLength);
+			break;
+		}
+		// A message queued since we looked is left for the pump, once the request is visible.
+		IoCsqInsertIrp(&Client->RecvCsq, Irp, NULL);
+		PumpMessages(Client, &Completed);
+		CompleteDelivered(&Completed);
+		return STATUS_PENDING;
 	case DEVICE_RECV:
-		wcsncpy(Buffer, SecondBuffer, 511);
-		RtlStringCbLengthW(Buffer, 511, pcchLength);
-		ReturnLength = *pcchLength + 2;
-		KdPrint(("received data is %ws \r\n request \r\n"));
+		status = RecvMessage(Client, Buffer, OutBufferLength, &ReturnLength);
+		break;
+	case DEVICE_SEND_DIRECT:
+		status = SendDirect(Client, Irp, OutBufferLength, &ReturnLength);
+		break;
+	case DEVICE_RECV_DIRECT:
+		status = RecvDirect(Client, Irp, OutBufferLength, &ReturnLength);
+		break;
+	case DEVICE_MAP_RING:
+		status = MapRing(Client, Irp, Buffer, InBufferLength, OutBufferLength);
+		if (status == STATUS_PENDING) {
+			return STATUS_PENDING;
+		}
+		break;
+	case DEVICE_QUERY_PAYLOAD:
+		if (OutBufferLength < sizeof(DEVICE_PAYLOAD_INFO)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		((PDEVICE_PAYLOAD_INFO)Buffer)->MaximumLength = DEVICE_MAXIMUM_PAYLOAD;
+		ExAcquireFastMutex(&Client->PayloadLock);
+		((PDEVICE_PAYLOAD_INFO)Buffer)->Length = Client->PayloadLength;
+		ExReleaseFastMutex(&Client->PayloadLock);
+		ReturnLength = sizeof(DEVICE_PAYLOAD_INFO);
+		break;
+	case DEVICE_QUERY_STATISTICS:
+		if (OutBufferLength < sizeof(DEVICE_STATISTICS)) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+		((PDEVICE_STATISTICS)Buffer)->FastIoRequests = (ULONG64)Client->FastIoRequests;
+		((PDEVICE_STATISTICS)Buffer)->IrpRequests = (ULONG64)Client->IrpRequests;
+		ReturnLength = sizeof(DEVICE_STATISTICS);
 		break;
 	default:
 		status = STATUS_INVALID_PARAMETER;
@@ -88,9 +965,96 @@ DispatchIoctl(
 	Irp->IoStatus.Information = ReturnLength;
 	Irp->IoStatus.Status = status;
 	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	CompleteDelivered(&Completed);
 	return status;
 }
 
+// DEVICE_SEND and DEVICE_RECV without an IRP: the I/O manager calls this on the caller's
+// thread first, and builds an IRP for DispatchIoctl only if it returns FALSE. The buffers are
+// the caller's own, as with METHOD_NEITHER, so they are probed and go through one on the
+// stack; a buffer that faults before the request has done anything gets the IRP path, which
+// fails it the way it always did. Neither ioctl blocks, so Wait makes no difference.
+BOOLEAN
+FastIoDeviceControl(
+	_In_ PFILE_OBJECT FileObject,
+	_In_ BOOLEAN Wait,
+	_In_opt_ PVOID InputBuffer,
+	_In_ ULONG InputBufferLength,
+	_Out_opt_ PVOID OutputBuffer,
+	_In_ ULONG OutputBufferLength,
+	_In_ ULONG IoControlCode,
+	_Out_ PIO_STATUS_BLOCK IoStatus,
+	_In_ PDEVICE_OBJECT DeviceObject
+)
+{
+	UNREFERENCED_PARAMETER(Wait);
+	UNREFERENCED_PARAMETER(DeviceObject);
+	PCLIENT_CONTEXT Client = FileObject->FsContext;
+	NTSTATUS status = STATUS_SUCCESS;
+	WCHAR Buffer[(MESSAGE_MAXIMUM_LENGTH + 1) / sizeof(WCHAR)];
+	ULONG Length = 0;
+	ULONG ReturnLength = 0;
+	LIST_ENTRY Completed;
+
+	// The IRP path fails a handle without a context.
+	if (Client == NULL) {
+		return FALSE;
+	}
+	switch (IoControlCode) {
+	case DEVICE_SEND:
+		Length = min(InputBufferLength, sizeof(Buffer));
+		__try {
+			if (ExGetPreviousMode() != KernelMode) {
+				ProbeForRead(InputBuffer, InputBufferLength, sizeof(UCHAR));
+			}
+			if (Length != 0) {
+				RtlCopyMemory(Buffer, InputBuffer, Length);
+			}
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER) {
+			return FALSE;
+		}
+		InitializeListHead(&Completed);
+		status = SendMessage(Buffer, Length, &ReturnLength);
+		if (NT_SUCCESS(status)) {
+			status = DeliverMessage(Client, Buffer, ReturnLength, &Completed);
+		}
+		if (!NT_SUCCESS(status)) {
+			ReturnLength = 0;
+		}
+		CompleteDelivered(&Completed);
+		break;
+	case DEVICE_RECV:
+		__try {
+			if (ExGetPreviousMode() != KernelMode) {
+				ProbeForWrite(OutputBuffer, OutputBufferLength, sizeof(UCHAR));
+			}
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER) {
+			return FALSE;
+		}
+		status = RecvMessage(Client, Buffer, min(OutputBufferLength, sizeof(Buffer)), &ReturnLength);
+		// The message is dequeued by now, so a fault fails the request instead of falling back.
+		__try {
+			if (ReturnLength != 0) {
+				RtlCopyMemory(OutputBuffer, Buffer, ReturnLength);
+			}
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER) {
+			status = GetExceptionCode();
+			ReturnLength = 0;
+		}
+		break;
+	default:
+		return FALSE;
+	}
+
+	InterlockedIncrement64(&Client->FastIoRequests);
+	IoStatus->Status = status;
+	IoStatus->Information = ReturnLength;
+	return TRUE;
+}
+
 VOID
 Unload(
 	_In_ PDRIVER_OBJECT DriverObject
@@ -122,7 +1086,7 @@ DriverEntry(
 		return status;
 	}
 
-	IoCreateSymbolicLink(&SymLinkName, &DeviceName);
+	status = IoCreateSymbolicLink(&SymLinkName, &DeviceName);
 	if (!NT_SUCCESS(status)) {
 		KdPrint((L"Failed to create symlink ! \r\n"));
 		IoDeleteDevice(g_DeviceObject);
@@ -133,8 +1097,13 @@ DriverEntry(
 	for (UCHAR i = 0; i < IRP_MJ_MAXIMUM_FUNCTION; i++) {
 		DriverObject->MajorFunction[i] = DispatchPassThru;
 	}
-	DriverObject->MajorFunction[IRP_MJ_DEVICE_CHANGE] = DispatchIoctl;
+	DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DispatchIoctl;
+
+	RtlZeroMemory(&g_FastIoDispatch, sizeof(FAST_IO_DISPATCH));
+	g_FastIoDispatch.SizeOfFastIoDispatch = sizeof(FAST_IO_DISPATCH);
+	g_FastIoDispatch.FastIoDeviceControl = FastIoDeviceControl;
+	DriverObject->FastIoDispatch = &g_FastIoDispatch;
 
 	KdPrint((L"Driver load succeeded. \r\n"));
 	return status;
-}
\ No newline at end of file
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+// Shared with the user mode controller, which includes windows.h and winioctl.h first.
+// Each handle is a client of its own: the messages, payload and ring below are per handle.
+
+
+// Buffered: the message goes through the system buffer, 511 bytes at most. DEVICE_RECV
+// returns the oldest message sent on the handle that nobody received yet, or a message from
+// the driver when there is none. Up to DEVICE_QUEUE_LENGTH messages wait to be received;
+// past that, DEVICE_SEND fails with STATUS_DEVICE_BUSY (ERROR_BUSY) and the message is not kept.
+#define DEVICE_SEND CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_WRITE_DATA)
+#define DEVICE_RECV CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_READ_DATA)
+
+#define DEVICE_QUEUE_LENGTH 64
+#define DEVICE_MAXIMUM_MESSAGE 511
+
+// Inverted call: completes with the oldest message DEVICE_RECV would return, or pends until
+// one is sent on the same handle, with DEVICE_SEND, DEVICE_SEND_BATCH or the ring. Each
+// message goes to the oldest request waiting, and is queued for DEVICE_RECV if there is none.
+// A message longer than the output buffer is cut short and fails with STATUS_BUFFER_OVERFLOW
+// (ERROR_MORE_DATA). Requests still waiting are cancelled when their handle is closed, or by
+// CancelIoEx.
+// DeviceIoControl(hDevice, DEVICE_RECV_WAIT, NULL, 0, szMessage, sizeof(szMessage), NULL, &Overlapped);
+#define DEVICE_RECV_WAIT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_READ_DATA)
+
+// Direct: the payload is the caller's output buffer, which the I/O manager locks and
+// describes with an MDL instead of copying it. DEVICE_SEND_DIRECT stores it in the driver,
+// DEVICE_RECV_DIRECT returns the last one stored.
+// DeviceIoControl(hDevice, DEVICE_SEND_DIRECT, NULL, 0, pPayload, cbPayload, &ReturnLength, NULL);
+// DeviceIoControl(hDevice, DEVICE_RECV_DIRECT, NULL, 0, pPayload, cbPayload, &ReturnLength, NULL);
+#define DEVICE_SEND_DIRECT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_IN_DIRECT, FILE_WRITE_DATA)
+#define DEVICE_RECV_DIRECT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_OUT_DIRECT, FILE_READ_DATA)
+
+// Length negotiation for the direct ioctls: returns a DEVICE_PAYLOAD_INFO. A DEVICE_RECV_DIRECT
+// buffer smaller than the stored payload fails with STATUS_BUFFER_TOO_SMALL
+// (ERROR_INSUFFICIENT_BUFFER), and the caller queries again, as the payload may have changed.
+#define DEVICE_QUERY_PAYLOAD CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define DEVICE_MAXIMUM_PAYLOAD (64 * 1024 * 1024)
+
+typedef struct _DEVICE_PAYLOAD_INFO {
+	ULONG MaximumLength;	// largest payload DEVICE_SEND_DIRECT accepts
+	ULONG Length;			// size of the payload DEVICE_RECV_DIRECT would return
+} DEVICE_PAYLOAD_INFO, *PDEVICE_PAYLOAD_INFO;
+
+
+// Batched: one DEVICE_SEND per message of a DEVICE_BATCH, in a single round trip. The output
+// buffer receives one NTSTATUS per message and must hold Count of them. A message that runs
+// past the input buffer fails, and so do all the ones after it.
+// DeviceIoControl(hDevice, DEVICE_SEND_BATCH, pBatch, cbBatch, pStatuses, Count * sizeof(LONG), &ReturnLength, NULL);
+#define DEVICE_SEND_BATCH CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_WRITE_DATA)
+
+#define DEVICE_MAXIMUM_BATCH 4096
+
+typedef struct _DEVICE_MESSAGE {
+	ULONG Length;			// bytes of Data, terminator included
+	WCHAR Data[1];
+} DEVICE_MESSAGE, *PDEVICE_MESSAGE;
+
+// Messages follow each other, each aligned on a ULONG.
+#define DEVICE_MESSAGE_SIZE(Length) (FIELD_OFFSET(DEVICE_MESSAGE, Data) + (((Length) + 3) & ~3))
+
+typedef struct _DEVICE_BATCH {
+	ULONG Count;
+	DEVICE_MESSAGE Messages[1];
+} DEVICE_BATCH, *PDEVICE_BATCH;
+
+
+// Shared ring: starts a driver thread that sends each message put in a DEVICE_RING the caller
+// allocated, so that steady-state messaging takes no system call at all. The input is a
+// DEVICE_RING_SETUP with the handle of an auto-reset event the caller created; the output
+// buffer is the ring, whose Head and Tail the driver sets to 0. The request stays pending for
+// as long as the thread runs, so it has to be overlapped: it completes with STATUS_CANCELLED
+// once CancelIoEx, the exit of the thread that sent it or closing the handle cancels it, and
+// only then can the ring be freed. Each handle can have one ring.
+// DeviceIoControl(hDevice, DEVICE_MAP_RING, &Setup, sizeof(Setup), Ring, sizeof(DEVICE_RING), NULL, &Overlapped);
+//
+// The caller produces, the driver consumes. Head and Tail count messages from 0 and wrap
+// around; a message goes in Slots[Tail % DEVICE_RING_SLOTS] and the ring is full when
+// Tail - Head == DEVICE_RING_SLOTS. To send a message:
+//   1. fill in the slot, Length included;
+//   2. store Tail + 1 with release semantics (WriteULongRelease, or InterlockedExchange);
+//   3. full barrier (MemoryBarrier), then read Head;
+//   4. SetEvent only if Head was the old Tail: the ring was empty and the thread may be asleep.
+// The thread stores Head after each message and rereads Tail after a full barrier before it
+// waits, so it never sleeps on a message whose event was skipped. Messages are sent as
+// DEVICE_SEND would, but while the handle's queue is full the thread leaves Head where it is
+// until a DEVICE_RECV or DEVICE_RECV_WAIT takes a message off it: the ring fills up and the
+// caller waits, rather than the message be lost. A message DEVICE_SEND would refuse is
+// skipped; no status is reported.
+#define DEVICE_MAP_RING CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_OUT_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
+
+#define DEVICE_RING_SLOTS 128
+
+typedef struct _DEVICE_RING_SLOT {
+	ULONG Length;			// bytes of Data, terminator included
+	WCHAR Data[254];
+} DEVICE_RING_SLOT, *PDEVICE_RING_SLOT;
+
+// Head and Tail have a cache line each, as they are written from either side.
+typedef struct _DEVICE_RING {
+	volatile ULONG Head;	// written by the driver
+	UCHAR Reserved1[60];
+	volatile ULONG Tail;	// written by the caller
+	UCHAR Reserved2[60];
+	DEVICE_RING_SLOT Slots[DEVICE_RING_SLOTS];
+} DEVICE_RING, *PDEVICE_RING;
+
+typedef struct _DEVICE_RING_SETUP {
+	ULONG64 Event;			// HANDLE of the event
+} DEVICE_RING_SETUP, *PDEVICE_RING_SETUP;
+
+
+// Counts the handle's requests by the way they came in. DEVICE_SEND and DEVICE_RECV take the
+// fast I/O path: the driver runs them on the caller's thread, straight from its buffers,
+// without the I/O manager building an IRP. A request fast I/O turns down, the query itself
+// included, comes as an IRP instead. Returns a DEVICE_STATISTICS.
+#define DEVICE_QUERY_STATISTICS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+typedef struct _DEVICE_STATISTICS {
+	ULONG64 FastIoRequests;	// completed without an IRP
+	ULONG64 IrpRequests;	// IRP_MJ_DEVICE_CONTROL requests
+} DEVICE_STATISTICS, *PDEVICE_STATISTICS;
@@ -0,0 +1,110 @@
+#include "Queue.h"
+
+// Positions count messages from 0 and wrap around: they are only ever compared by their
+// difference, taken unsigned so that the wrap is defined.
+
+VOID
+InitializeMessageQueue(
+	_Out_ PMESSAGE_QUEUE Queue
+)
+{
+	LONG i = 0;
+
+	Queue->EnqueuePosition = 0;
+	Queue->DequeuePosition = 0;
+	for (i = 0; i < MESSAGE_QUEUE_LENGTH; i++) {
+		Queue->Cells[i].Sequence = i;
+		Queue->Cells[i].Length = 0;
+	}
+}
+
+// Copies Length bytes of Message, cut to a cell, into the queue. Returns FALSE when it is full.
+BOOLEAN
+EnqueueMessage(
+	_Inout_ PMESSAGE_QUEUE Queue,
+	_In_ PCWSTR Message,
+	_In_ ULONG Length
+)
+{
+	LONG Position = ReadNoFence(&Queue->EnqueuePosition);
+	PMESSAGE_CELL Cell = NULL;
+
+	for (;;) {
+		LONG Difference = 0;
+
+		Cell = &Queue->Cells[(ULONG)Position % MESSAGE_QUEUE_LENGTH];
+		Difference = (LONG)((ULONG)ReadAcquire(&Cell->Sequence) - (ULONG)Position);
+		if (Difference == 0) {
+			LONG Current = InterlockedCompareExchange(&Queue->EnqueuePosition, (LONG)((ULONG)Position + 1), Position);
+			if (Current == Position) {
+				break;
+			}
+			Position = Current;
+		}
+		else if (Difference < 0) {
+			// The cell still holds the message from a lap ago.
+			return FALSE;
+		}
+		else {
+			// Another producer took the position first.
+			Position = ReadNoFence(&Queue->EnqueuePosition);
+		}
+	}
+
+	Cell->Length = min(Length, sizeof(Cell->Data));
+	RtlCopyMemory(Cell->Data, Message, Cell->Length);
+	WriteRelease(&Cell->Sequence, (LONG)((ULONG)Position + 1));
+	return TRUE;
+}
+
+// Copies the oldest message into Message, which holds MESSAGE_MAXIMUM_LENGTH bytes, and its
+// length into Length. Returns FALSE when the queue is empty.
+BOOLEAN
+DequeueMessage(
+	_Inout_ PMESSAGE_QUEUE Queue,
+	_Out_ PWCHAR Message,
+	_Out_ PULONG Length
+)
+{
+	LONG Position = ReadNoFence(&Queue->DequeuePosition);
+	PMESSAGE_CELL Cell = NULL;
+
+	*Length = 0;
+	for (;;) {
+		LONG Difference = 0;
+
+		Cell = &Queue->Cells[(ULONG)Position % MESSAGE_QUEUE_LENGTH];
+		Difference = (LONG)((ULONG)ReadAcquire(&Cell->Sequence) - ((ULONG)Position + 1));
+		if (Difference == 0) {
+			LONG Current = InterlockedCompareExchange(&Queue->DequeuePosition, (LONG)((ULONG)Position + 1), Position);
+			if (Current == Position) {
+				break;
+			}
+			Position = Current;
+		}
+		else if (Difference < 0) {
+			// Nothing there yet, or a producer is still filling the cell in.
+			return FALSE;
+		}
+		else {
+			Position = ReadNoFence(&Queue->DequeuePosition);
+		}
+	}
+
+	*Length = Cell->Length;
+	RtlCopyMemory(Message, Cell->Data, Cell->Length);
+	WriteRelease(&Cell->Sequence, (LONG)((ULONG)Position + MESSAGE_QUEUE_LENGTH));
+	return TRUE;
+}
+
+// TRUE when DequeueMessage would find nothing to take, as of the moment it looked.
+BOOLEAN
+IsMessageQueueEmpty(
+	_In_ PMESSAGE_QUEUE Queue
+)
+{
+	LONG Position = ReadAcquire(&Queue->DequeuePosition);
+	PMESSAGE_CELL Cell = &Queue->Cells[(ULONG)Position % MESSAGE_QUEUE_LENGTH];
+
+	return ReadAcquire(&Cell->Sequence) != (LONG)((ULONG)Position + 1);
+}
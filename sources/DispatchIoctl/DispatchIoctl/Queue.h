@@ -0,0 +1,53 @@
+#pragma once
+
+#include <ntddk.h>
+
+
+// Defines
+#define MESSAGE_QUEUE_LENGTH    64      // a power of 2
+#define MESSAGE_MAXIMUM_LENGTH  511     // bytes, as DEVICE_SEND takes them
+
+
+// Structures
+
+// Sequence says whose turn the cell is: it is Position when the cell is free for the enqueue
+// at Position, and Position + 1 once that enqueue is done and the dequeue at Position may
+// take it, which hands it back as Position + MESSAGE_QUEUE_LENGTH.
+typedef struct _MESSAGE_CELL {
+	volatile LONG Sequence;
+	ULONG Length;				// bytes of Data, terminator included
+	WCHAR Data[MESSAGE_MAXIMUM_LENGTH / sizeof(WCHAR)];
+} MESSAGE_CELL, *PMESSAGE_CELL;
+
+// Bounded queue of messages for any number of producers and consumers, without a lock: each
+// claims a position with one compare-exchange and hands the cell over with its Sequence.
+// The two positions have a cache line each, as producers and consumers write them apart.
+typedef struct _MESSAGE_QUEUE {
+	volatile LONG EnqueuePosition;
+	UCHAR Reserved1[60];
+	volatile LONG DequeuePosition;
+	UCHAR Reserved2[60];
+	MESSAGE_CELL Cells[MESSAGE_QUEUE_LENGTH];
+} MESSAGE_QUEUE, *PMESSAGE_QUEUE;
+
+
+// Prototypes
+VOID InitializeMessageQueue(
+	_Out_ PMESSAGE_QUEUE Queue
+);
+
+BOOLEAN EnqueueMessage(
+	_Inout_ PMESSAGE_QUEUE Queue,
+	_In_    PCWSTR         Message,
+	_In_    ULONG          Length
+);
+
+BOOLEAN DequeueMessage(
+	_Inout_ PMESSAGE_QUEUE Queue,
+	_Out_   PWCHAR         Message,
+	_Out_   PULONG         Length
+);
+
+BOOLEAN IsMessageQueueEmpty(
+	_In_ PMESSAGE_QUEUE Queue
+);
@@ -4,10 +4,52 @@
 // HANDLE hDevice = CreateFile(L"\\\\.\\dummydriverlink", GENERIC_ALL, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_SYSTEM, 0) ==> will trigger the IRP_MJ_CREATE.
 // CloseHandle(hDevice) ==> will trigger the IRP_MJ_CLOSE.
 
+// == Read ==
+// The device is an endless stream: each read returns the next Length bytes of it, whatever its
+// offset. Each ULONG of the stream holds its offset in the stream divided by 4, modulo
+// STREAM_PATTERN_SIZE / 4, so a client can check what it gets.
+// ReadFile(hDevice, pBuffer, cbBuffer, &BytesRead, NULL);
+// Reads on a handle opened as L"\\\\.\\dummydriverlink\\pending" are queued and completed by
+// the driver's threads instead, so that an overlapped client can keep many in flight:
+// HANDLE hDevice = CreateFile(L"\\\\.\\dummydriverlink\\pending", ..., FILE_FLAG_OVERLAPPED, 0);
+// ReadFile(hDevice, pBuffer, cbBuffer, NULL, &Overlapped);
 
+
+#define STREAM_TAG 'mrtS'
+#define STREAM_PATTERN_SIZE (64 * 1024)
+#define READ_WORKERS 4
+
+// Per handle, in FileObject->FsContext, from IRP_MJ_CREATE to IRP_MJ_CLOSE.
+typedef struct _STREAM_CONTEXT {
+	// Where the next read starts. Each read takes its range when it comes in, so reads in flight
+	// together get the stream in the order they were issued, whatever order they complete in.
+	volatile LONG64 Position;
+	BOOLEAN Pending;
+} STREAM_CONTEXT, *PSTREAM_CONTEXT;
+
+// Globals
 PDEVICE_OBJECT g_DeviceObject = NULL;
 UNICODE_STRING DeviceName = RTL_CONSTANT_STRING(L"\\Device\\dummydriver");
 UNICODE_STRING SymLinkName = RTL_CONSTANT_STRING(L"\\??\\dummydriverlink");
+UNICODE_STRING PendingName = RTL_CONSTANT_STRING(L"\\pending");
+
+// The stream, one pattern's worth: reads copy it out, wrapping around.
+PUCHAR g_Pattern = NULL;
+
+// Reads from the pending handles of every client, oldest first, and the threads completing them.
+// ReadEvent wakes one thread; a thread that takes a read and leaves more behind wakes the next.
+IO_CSQ g_ReadCsq;
+KSPIN_LOCK g_ReadLock;
+LIST_ENTRY g_ReadQueue;
+volatile LONG g_ReadWaiting = 0;
+KEVENT g_ReadEvent;
+volatile LONG g_ReadStop = 0;
+PETHREAD g_ReadWorkers[READ_WORKERS];
+
+VOID
+CancelReads(
+	_In_ PFILE_OBJECT FileObject
+);
 
 NTSTATUS
 DispatchPassThru(
@@ -18,16 +60,34 @@ DispatchPassThru(
 	UNREFERENCED_PARAMETER(DeviceObject);
 	NTSTATUS status = STATUS_SUCCESS;
 	PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+	PSTREAM_CONTEXT Stream = NULL;
 
 	switch (IoStack->MajorFunction) {
 	case IRP_MJ_CREATE:
 		KdPrint(("create request \r\n"));
+		if (IoStack->FileObject->FileName.Length != 0 &&
+			!RtlEqualUnicodeString(&IoStack->FileObject->FileName, &PendingName, TRUE)) {
+			status = STATUS_OBJECT_NAME_NOT_FOUND;
+			break;
+		}
+		Stream = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(STREAM_CONTEXT), STREAM_TAG);
+		if (Stream == NULL) {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			break;
+		}
+		Stream->Position = 0;
+		Stream->Pending = IoStack->FileObject->FileName.Length != 0;
+		IoStack->FileObject->FsContext = Stream;
+		break;
+	case IRP_MJ_CLEANUP:
+		CancelReads(IoStack->FileObject);
 		break;
 	case IRP_MJ_CLOSE:
 		KdPrint(("close request \r\n"));
-		break;
-	case IRP_MJ_READ:
-		KdPrint(("read request \r\n"));
+		if (IoStack->FileObject->FsContext != NULL) {
+			ExFreePoolWithTag(IoStack->FileObject->FsContext, STREAM_TAG);
+			IoStack->FileObject->FsContext = NULL;
+		}
 		break;
 	default:
 		break;
@@ -39,6 +99,242 @@ DispatchPassThru(
 	return status;
 }
 
+// Fills the read's buffer with the stream from the position DispatchRead gave it, and
+// completes it.
+VOID
+CompleteRead(
+	_In_ PIRP Irp
+)
+{
+	PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+	ULONG Length = IoStack->Parameters.Read.Length;
+	ULONG Offset = (ULONG)(IoStack->Parameters.Read.ByteOffset.QuadPart % STREAM_PATTERN_SIZE);
+	ULONG Done = 0;
+	PUCHAR Buffer = NULL;
+
+	Irp->IoStatus.Status = STATUS_SUCCESS;
+	if (Length != 0) {
+		// Direct I/O: the caller's pages are locked and described by the MDL; mapping them in
+		// system space lets any thread fill them, not only one in the caller's process.
+		Buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+		if (Buffer == NULL) {
+			Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+			Length = 0;
+		}
+	}
+	while (Done < Length) {
+		ULONG Chunk = min(Length - Done, STREAM_PATTERN_SIZE - Offset);
+
+		RtlCopyMemory(Buffer + Done, g_Pattern + Offset, Chunk);
+		Done += Chunk;
+		Offset = 0;
+	}
+
+	Irp->IoStatus.Information = Done;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+NTSTATUS
+DispatchRead(
+	_In_ PDEVICE_OBJECT DeviceObject,
+	_In_ PIRP Irp
+)
+{
+	UNREFERENCED_PARAMETER(DeviceObject);
+	PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+	PSTREAM_CONTEXT Stream = IoStack->FileObject->FsContext;
+
+	// The stack location is ours: ByteOffset carries the read's place in the stream from here
+	// to CompleteRead, on whichever thread that runs.
+	IoStack->Parameters.Read.ByteOffset.QuadPart =
+		InterlockedExchangeAdd64(&Stream->Position, IoStack->Parameters.Read.Length);
+
+	if (!Stream->Pending) {
+		CompleteRead(Irp);
+		return STATUS_SUCCESS;
+	}
+
+	IoCsqInsertIrp(&g_ReadCsq, Irp, NULL);
+	KeSetEvent(&g_ReadEvent, IO_NO_INCREMENT, FALSE);
+	return STATUS_PENDING;
+}
+
+VOID
+ReadCsqInsert(
+	_In_ PIO_CSQ Csq,
+	_In_ PIRP Irp
+)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	InsertTailList(&g_ReadQueue, &Irp->Tail.Overlay.ListEntry);
+	InterlockedIncrement(&g_ReadWaiting);
+}
+
+VOID
+ReadCsqRemove(
+	_In_ PIO_CSQ Csq,
+	_In_ PIRP Irp
+)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+	InterlockedDecrement(&g_ReadWaiting);
+}
+
+// PeekContext, when there is one, is the file object whose reads to return.
+PIRP
+ReadCsqPeekNext(
+	_In_ PIO_CSQ Csq,
+	_In_opt_ PIRP Irp,
+	_In_opt_ PVOID PeekContext
+)
+{
+	UNREFERENCED_PARAMETER(Csq);
+	PLIST_ENTRY Entry = Irp == NULL ? g_ReadQueue.Flink : Irp->Tail.Overlay.ListEntry.Flink;
+
+	for (; Entry != &g_ReadQueue; Entry = Entry->Flink) {
+		PIRP Next = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+
+		if (PeekContext == NULL || IoGetCurrentIrpStackLocation(Next)->FileObject == PeekContext) {
+			return Next;
+		}
+	}
+	return NULL;
+}
+
+VOID
+ReadCsqAcquireLock(
+	_In_ PIO_CSQ Csq,
+	_Out_ PKIRQL Irql
+)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	KeAcquireSpinLock(&g_ReadLock, Irql);
+}
+
+VOID
+ReadCsqReleaseLock(
+	_In_ PIO_CSQ Csq,
+	_In_ KIRQL Irql
+)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	KeReleaseSpinLock(&g_ReadLock, Irql);
+}
+
+VOID
+ReadCsqCompleteCanceled(
+	_In_ PIO_CSQ Csq,
+	_In_ PIRP Irp
+)
+{
+	UNREFERENCED_PARAMETER(Csq);
+
+	Irp->IoStatus.Information = 0;
+	Irp->IoStatus.Status = STATUS_CANCELLED;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+VOID
+CancelReads(
+	_In_ PFILE_OBJECT FileObject
+)
+{
+	PIRP Irp = NULL;
+
+	while ((Irp = IoCsqRemoveNextIrp(&g_ReadCsq, FileObject)) != NULL) {
+		ReadCsqCompleteCanceled(&g_ReadCsq, Irp);
+	}
+}
+
+VOID
+ReadWorker(
+	_In_ PVOID Context
+)
+{
+	UNREFERENCED_PARAMETER(Context);
+	PIRP Irp = NULL;
+
+	for (;;) {
+		KeWaitForSingleObject(&g_ReadEvent, Executive, KernelMode, FALSE, NULL);
+		if (g_ReadStop) {
+			// Pass it on to the next thread.
+			KeSetEvent(&g_ReadEvent, IO_NO_INCREMENT, FALSE);
+			break;
+		}
+
+		while ((Irp = IoCsqRemoveNextIrp(&g_ReadCsq, NULL)) != NULL) {
+			if (g_ReadWaiting != 0) {
+				KeSetEvent(&g_ReadEvent, IO_NO_INCREMENT, FALSE);
+			}
+			CompleteRead(Irp);
+		}
+	}
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+VOID
+StopReadWorkers(
+	VOID
+)
+{
+	ULONG i = 0;
+
+	InterlockedExchange(&g_ReadStop, 1);
+	KeSetEvent(&g_ReadEvent, IO_NO_INCREMENT, FALSE);
+	for (i = 0; i < READ_WORKERS; i++) {
+		if (g_ReadWorkers[i] != NULL) {
+			KeWaitForSingleObject(g_ReadWorkers[i], Executive, KernelMode, FALSE, NULL);
+			ObDereferenceObject(g_ReadWorkers[i]);
+			g_ReadWorkers[i] = NULL;
+		}
+	}
+}
+
+NTSTATUS
+StartReadWorkers(
+	VOID
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	OBJECT_ATTRIBUTES Attributes;
+	HANDLE ThreadHandle = NULL;
+	ULONG i = 0;
+
+	InitializeListHead(&g_ReadQueue);
+	KeInitializeSpinLock(&g_ReadLock);
+	IoCsqInitialize(&g_ReadCsq, ReadCsqInsert, ReadCsqRemove, ReadCsqPeekNext, ReadCsqAcquireLock,
+		ReadCsqReleaseLock, ReadCsqCompleteCanceled);
+	KeInitializeEvent(&g_ReadEvent, SynchronizationEvent, FALSE);
+	g_ReadStop = 0;
+
+	InitializeObjectAttributes(&Attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+	for (i = 0; i < READ_WORKERS; i++) {
+		status = PsCreateSystemThread(&ThreadHandle, THREAD_ALL_ACCESS, &Attributes, NULL, NULL, ReadWorker, NULL);
+		if (!NT_SUCCESS(status)) {
+			StopReadWorkers();
+			return status;
+		}
+		status = ObReferenceObjectByHandle(ThreadHandle, SYNCHRONIZE, *PsThreadType, KernelMode,
+			(PVOID*)&g_ReadWorkers[i], NULL);
+		if (!NT_SUCCESS(status)) {
+			// This one is stopped with the others, but waited for through its handle.
+			g_ReadWorkers[i] = NULL;
+			StopReadWorkers();
+			ZwWaitForSingleObject(ThreadHandle, FALSE, NULL);
+			ZwClose(ThreadHandle);
+			return status;
+		}
+		ZwClose(ThreadHandle);
+	}
+	return status;
+}
+
 VOID
 Unload(
 	_In_ PDRIVER_OBJECT DriverObject
@@ -48,6 +344,8 @@ Unload(
 
 	IoDeleteSymbolicLink(&SymLinkName);
 	IoDeleteDevice(g_DeviceObject);
+	StopReadWorkers();
+	ExFreePoolWithTag(g_Pattern, STREAM_TAG);
 
 	KdPrint((L"Driver Unload \r\n"));
 
@@ -62,18 +360,38 @@ DriverEntry(
 {
 	UNREFERENCED_PARAMETER(RegistryPath);
 	NTSTATUS status = STATUS_SUCCESS;
+	ULONG Word = 0;
+
+	g_Pattern = ExAllocatePoolWithTag(NonPagedPoolNx, STREAM_PATTERN_SIZE, STREAM_TAG);
+	if (g_Pattern == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	for (Word = 0; Word < STREAM_PATTERN_SIZE / sizeof(ULONG); Word++) {
+		((PULONG)g_Pattern)[Word] = Word;
+	}
+
+	status = StartReadWorkers();
+	if (!NT_SUCCESS(status)) {
+		ExFreePoolWithTag(g_Pattern, STREAM_TAG);
+		return status;
+	}
 
 	DriverObject->DriverUnload = Unload;
 	status = IoCreateDevice(DriverObject, 0, &DeviceName, FILE_DEVICE_UNKNOWN, FILE_DEVICE_SECURE_OPEN, FALSE, &g_DeviceObject);
 	if (!NT_SUCCESS(status)) {
 		KdPrint((L"Failed to create device ! \r\n"));
+		StopReadWorkers();
+		ExFreePoolWithTag(g_Pattern, STREAM_TAG);
 		return status;
 	}
+	g_DeviceObject->Flags |= DO_DIRECT_IO;
 
-	IoCreateSymbolicLink(&SymLinkName, &DeviceName);
+	status = IoCreateSymbolicLink(&SymLinkName, &DeviceName);
 	if (!NT_SUCCESS(status)) {
 		KdPrint((L"Failed to create symlink ! \r\n"));
 		IoDeleteDevice(g_DeviceObject);
+		StopReadWorkers();
+		ExFreePoolWithTag(g_Pattern, STREAM_TAG);
 		return status;
 
 	}
@@ -81,7 +399,8 @@ DriverEntry(
 	for (UCHAR i = 0; i < IRP_MJ_MAXIMUM_FUNCTION; i++) {
 		DriverObject->MajorFunction[i] = DispatchPassThru;
 	}
+	DriverObject->MajorFunction[IRP_MJ_READ] = DispatchRead;
 
 	KdPrint((L"Driver load succeeded. \r\n"));
 	return status;
-}
\ No newline at end of file
+}
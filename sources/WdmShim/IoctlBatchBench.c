@@ -0,0 +1,430 @@
+// IoctlBatchBench.c : Sends the same messages to DispatchIoctl one
+// DEVICE_SEND at a time, then in DEVICE_SEND_BATCH batches of growing size,
+// then through the DEVICE_MAP_RING ring, and prints what each message costs
+// in time, requests (system calls on Windows) and IRPs. DEVICE_SEND takes the
+// driver's fast I/O path and needs no IRP; "batch 1" is the same message in
+// an IRP. Every message is delivered: ahead of each stretch of messages, as
+// many DEVICE_RECV_WAIT requests are posted, and each message sent completes
+// one of them. Posting them is not timed nor counted, the completions are.
+// The messages the full queue turns away are counted as "full".
+//
+// gcc -O2 -fshort-wchar -fcommon -Wno-multichar -I WdmShim/include -I WdmShim -pthread WdmShim/WdmShim.c
+//     WdmShim/IoctlBatchBench.c DispatchIoctl/DispatchIoctl/*.c -o batchbench
+// batchbench [--messages n] [--size bytes]
+//
+
+#define _GNU_SOURCE
+
+#include "WdmShim.h"
+#include "../DispatchIoctl/DispatchIoctl/Ioctl.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+DRIVER_INITIALIZE DriverEntry;
+
+//
+// Messages are timed by stretches of BENCH_STRETCH, each preceded by as many
+// DEVICE_RECV_WAIT requests.
+//
+#define BENCH_STRETCH                   DEVICE_MAXIMUM_BATCH
+
+static const ULONG BenchBatchSizes[] = { 1, 8, 64, 512, DEVICE_MAXIMUM_BATCH };
+
+//
+// The timed stretches of a run, added up.
+//
+typedef struct _BENCH_TIMER {
+	ULONGLONG Elapsed;
+	ULONGLONG Requests;
+	ULONGLONG Irps;
+	ULONGLONG Start;
+	WDM_STATS Before;
+} BENCH_TIMER, *PBENCH_TIMER;
+
+//
+// The DEVICE_RECV_WAIT requests of a run. The driver completes them oldest
+// first, so request n can reuse the IO_STATUS_BLOCK and buffer of request
+// n - BENCH_STRETCH, which has completed by the time n is posted.
+//
+typedef struct _BENCH_RECEIVER {
+	PFILE_OBJECT FileObject;
+	ULONG Posted;
+	volatile ULONG Received;
+	PIO_STATUS_BLOCK IoStatus;
+	PWCHAR Buffers;
+} BENCH_RECEIVER, *PBENCH_RECEIVER;
+
+#define BENCH_RECEIVE_LENGTH            (DEVICE_MAXIMUM_MESSAGE + 1)
+
+static ULONGLONG BenchNow(
+	VOID
+)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (ULONGLONG)Now.tv_sec * 1000000000 + Now.tv_nsec;
+}
+
+static VOID BenchResume(
+	_Inout_ PBENCH_TIMER Timer
+)
+{
+	WdmQueryStats(&Timer->Before);
+	Timer->Start = BenchNow();
+}
+
+static VOID BenchPause(
+	_Inout_ PBENCH_TIMER Timer
+)
+{
+	WDM_STATS After;
+
+	Timer->Elapsed += BenchNow() - Timer->Start;
+	WdmQueryStats(&After);
+	Timer->Requests += After.Requests - Timer->Before.Requests;
+	Timer->Irps += After.IrpsAllocated - Timer->Before.IrpsAllocated;
+}
+
+static VOID BenchReceived(
+	_In_ PVOID             ApcContext,
+	_In_ PIO_STATUS_BLOCK  IoStatusBlock,
+	_In_ ULONG             Reserved
+)
+{
+	PBENCH_RECEIVER Receiver = (PBENCH_RECEIVER)ApcContext;
+
+	UNREFERENCED_PARAMETER(IoStatusBlock);
+	UNREFERENCED_PARAMETER(Reserved);
+
+	InterlockedIncrement((volatile LONG *)&Receiver->Received);
+}
+
+static BOOLEAN BenchCreateReceiver(
+	_Out_ PBENCH_RECEIVER  Receiver,
+	_In_ PFILE_OBJECT      FileObject
+)
+{
+	Receiver->FileObject = FileObject;
+	Receiver->Posted = 0;
+	Receiver->Received = 0;
+	Receiver->IoStatus = calloc(BENCH_STRETCH, sizeof(IO_STATUS_BLOCK));
+	Receiver->Buffers = calloc(BENCH_STRETCH, BENCH_RECEIVE_LENGTH);
+	if (Receiver->IoStatus == NULL || Receiver->Buffers == NULL) {
+		free(Receiver->IoStatus);
+		free(Receiver->Buffers);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+//
+// Posts requests until Count of them are waiting. A request that finds a
+// message queued completes right away, and is replaced.
+//
+static VOID BenchPostReceives(
+	_Inout_ PBENCH_RECEIVER    Receiver,
+	_In_ ULONG                 Count
+)
+{
+	while (Receiver->Posted - ReadULongAcquire(&Receiver->Received) < Count) {
+		ULONG Index = Receiver->Posted % BENCH_STRETCH;
+
+		Receiver->Posted++;
+		WdmDeviceIoControlFile(Receiver->FileObject, BenchReceived, Receiver, &Receiver->IoStatus[Index],
+			DEVICE_RECV_WAIT, NULL, 0, (PUCHAR)Receiver->Buffers + (size_t)Index * BENCH_RECEIVE_LENGTH,
+			BENCH_RECEIVE_LENGTH);
+	}
+}
+
+//
+// Cancels the requests still waiting, and any other asynchronous request on
+// the file, and returns once they have completed.
+//
+static VOID BenchDeleteReceiver(
+	_Inout_ PBENCH_RECEIVER Receiver
+)
+{
+	WdmCancelIoFile(Receiver->FileObject);
+	while (ReadULongAcquire(&Receiver->Received) != Receiver->Posted) {
+		sched_yield();
+	}
+	free(Receiver->IoStatus);
+	free(Receiver->Buffers);
+}
+
+//
+// Sends Messages messages of Size bytes, BatchSize to a request, or each
+// with DEVICE_SEND when BatchSize is 0. Returns how many failed, not
+// counting the ones the full queue turned away, which go in Full.
+//
+static ULONG BenchRun(
+	_In_ PFILE_OBJECT  FileObject,
+	_In_ ULONG         Messages,
+	_In_ ULONG         Size,
+	_In_ ULONG         BatchSize,
+	_Inout_ PBENCH_TIMER Timer,
+	_Out_ PULONG       Full
+)
+{
+	ULONG MessageSize = DEVICE_MESSAGE_SIZE(Size);
+	ULONG BatchLength = FIELD_OFFSET(DEVICE_BATCH, Messages) + max(BatchSize, 1) * MessageSize;
+	PUCHAR Batch = calloc(1, BatchLength);
+	PLONG Statuses = calloc(max(BatchSize, 1), sizeof(LONG));
+	BENCH_RECEIVER Receiver;
+	IO_STATUS_BLOCK IoStatus;
+	ULONG Failed = 0;
+	ULONG Stretch;
+	ULONG Sent;
+	ULONG i;
+
+	*Full = 0;
+	if (Batch == NULL || Statuses == NULL || !BenchCreateReceiver(&Receiver, FileObject)) {
+		free(Statuses);
+		free(Batch);
+		return Messages;
+	}
+	for (i = 0; i < max(BatchSize, 1); i++) {
+		PDEVICE_MESSAGE Message = (PDEVICE_MESSAGE)(Batch + FIELD_OFFSET(DEVICE_BATCH, Messages) + i * MessageSize);
+		ULONG j;
+
+		Message->Length = Size;
+		for (j = 0; j + 1 < Size / sizeof(WCHAR); j++) {
+			Message->Data[j] = L'a' + (WCHAR)(j % 26);
+		}
+	}
+
+	for (Stretch = 0; Stretch < Messages; Stretch += BENCH_STRETCH) {
+		ULONG End = min(Stretch + BENCH_STRETCH, Messages);
+
+		BenchPostReceives(&Receiver, End - Stretch);
+		BenchResume(Timer);
+		for (Sent = Stretch; Sent < End; Sent += max(BatchSize, 1)) {
+			ULONG Count = min(max(BatchSize, 1), End - Sent);
+
+			if (BatchSize == 0) {
+				PDEVICE_MESSAGE Message = (PDEVICE_MESSAGE)(Batch + FIELD_OFFSET(DEVICE_BATCH, Messages));
+				NTSTATUS status = WdmDeviceIoControlFile(FileObject, NULL, NULL, &IoStatus, DEVICE_SEND,
+					Message->Data, Size, NULL, 0);
+
+				if (status == STATUS_DEVICE_BUSY) {
+					(*Full)++;
+				}
+				else if (!NT_SUCCESS(status)) {
+					Failed++;
+				}
+				continue;
+			}
+
+			((PDEVICE_BATCH)Batch)->Count = Count;
+			if (!NT_SUCCESS(WdmDeviceIoControlFile(FileObject, NULL, NULL, &IoStatus, DEVICE_SEND_BATCH, Batch,
+				FIELD_OFFSET(DEVICE_BATCH, Messages) + Count * MessageSize, Statuses, Count * sizeof(LONG)))) {
+				Failed += Count;
+				continue;
+			}
+			for (i = 0; i < Count; i++) {
+				if (Statuses[i] == STATUS_DEVICE_BUSY) {
+					(*Full)++;
+				}
+				else if (!NT_SUCCESS(Statuses[i])) {
+					Failed++;
+				}
+			}
+		}
+		BenchPause(Timer);
+	}
+
+	BenchDeleteReceiver(&Receiver);
+	free(Statuses);
+	free(Batch);
+	return Failed;
+}
+
+static VOID BenchRingStopped(
+	_In_ PVOID             ApcContext,
+	_In_ PIO_STATUS_BLOCK  IoStatusBlock,
+	_In_ ULONG             Reserved
+)
+{
+	UNREFERENCED_PARAMETER(IoStatusBlock);
+	UNREFERENCED_PARAMETER(Reserved);
+
+	WriteULongRelease((volatile ULONG*)ApcContext, TRUE);
+}
+
+//
+// Sends Messages messages of Size bytes through the shared ring, following
+// the protocol in Ioctl.h. A stretch is timed until its messages have all
+// been received. The driver does not report failures there, so the messages
+// no request received by the end count as failed. The ring is freed once its
+// DEVICE_MAP_RING, cancelled, has completed.
+//
+static ULONG BenchRing(
+	_In_ PFILE_OBJECT  FileObject,
+	_In_ ULONG         Messages,
+	_In_ ULONG         Size,
+	_Inout_ PBENCH_TIMER Timer
+)
+{
+	WCHAR Template[RTL_NUMBER_OF(((PDEVICE_RING)0)->Slots[0].Data)] = { 0 };
+	DEVICE_RING_SETUP Setup;
+	IO_STATUS_BLOCK IoStatus;
+	BENCH_RECEIVER Receiver;
+	volatile ULONG Stopped = FALSE;
+	PDEVICE_RING Ring;
+	HANDLE Event;
+	NTSTATUS status;
+	ULONG Stretch;
+	ULONG Received;
+	ULONG Tail;
+	ULONG i;
+
+	for (i = 0; i + 1 < Size / sizeof(WCHAR); i++) {
+		Template[i] = L'a' + (WCHAR)(i % 26);
+	}
+
+	Ring = calloc(1, sizeof(DEVICE_RING));
+	if (Ring == NULL) {
+		return Messages;
+	}
+	if (!NT_SUCCESS(WdmCreateEvent(&Event, SynchronizationEvent, FALSE))) {
+		free(Ring);
+		return Messages;
+	}
+	if (!BenchCreateReceiver(&Receiver, FileObject)) {
+		WdmCloseHandle(Event);
+		free(Ring);
+		return Messages;
+	}
+	Setup.Event = (ULONG64)(ULONG_PTR)Event;
+	status = WdmDeviceIoControlFile(FileObject, BenchRingStopped, (PVOID)&Stopped, &IoStatus, DEVICE_MAP_RING,
+		&Setup, sizeof(Setup), Ring, sizeof(DEVICE_RING));
+	if (status != STATUS_PENDING) {
+		BenchDeleteReceiver(&Receiver);
+		WdmCloseHandle(Event);
+		free(Ring);
+		return Messages;
+	}
+
+	for (Stretch = 0; Stretch < Messages; Stretch += BENCH_STRETCH) {
+		ULONG End = min(Stretch + BENCH_STRETCH, Messages);
+
+		BenchPostReceives(&Receiver, End - Stretch);
+		Received = Receiver.Received;
+		BenchResume(Timer);
+		for (Tail = Stretch; Tail < End; Tail++) {
+			PDEVICE_RING_SLOT Slot = &Ring->Slots[Tail % DEVICE_RING_SLOTS];
+
+			while (Tail - ReadULongAcquire(&Ring->Head) == DEVICE_RING_SLOTS) {
+				sched_yield();
+			}
+			memcpy(Slot->Data, Template, Size);
+			Slot->Length = Size;
+			WriteULongRelease(&Ring->Tail, Tail + 1);
+			KeMemoryBarrier();
+			if (ReadULongAcquire(&Ring->Head) == Tail) {
+				WdmSetEvent(Event);
+			}
+		}
+		while (ReadULongAcquire(&Ring->Head) != End ||
+			ReadULongAcquire(&Receiver.Received) - Received != End - Stretch) {
+			sched_yield();
+		}
+		BenchPause(Timer);
+	}
+
+	// Cancels the ring along with the requests.
+	Received = Receiver.Received;
+	BenchDeleteReceiver(&Receiver);
+	while (!ReadULongAcquire(&Stopped)) {
+		sched_yield();
+	}
+	WdmCloseHandle(Event);
+	free(Ring);
+	return Messages - Received;
+}
+
+int main(int argc, char **argv)
+{
+	ULONG Messages = 1000000;
+	ULONG Size = 64;
+	PDRIVER_OBJECT Driver;
+	PFILE_OBJECT FileObject;
+	DEVICE_STATISTICS Statistics;
+	IO_STATUS_BLOCK IoStatus;
+	NTSTATUS status;
+	ULONG i;
+
+	for (i = 1; i + 1 < (ULONG)argc; i += 2) {
+		if (strcmp(argv[i], "--messages") == 0) {
+			Messages = (ULONG)strtoul(argv[i + 1], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--size") == 0) {
+			Size = (ULONG)strtoul(argv[i + 1], NULL, 0);
+		}
+		else {
+			break;
+		}
+	}
+	if (i != (ULONG)argc || Messages == 0 || Size < sizeof(WCHAR) || Size > 511) {
+		fprintf(stderr, "usage: batchbench [--messages n] [--size bytes, 2 to 511]\n");
+		return 2;
+	}
+
+	status = WdmLoadDriver(DriverEntry, L"\\Driver\\DispatchIoctl", &Driver);
+	if (NT_SUCCESS(status)) {
+		status = WdmOpenFile(L"\\\\.\\dummydriverlink", &FileObject);
+	}
+	if (!NT_SUCCESS(status)) {
+		fprintf(stderr, "failed to open the device: 0x%08X\n", status);
+		return 1;
+	}
+
+	printf("%u messages of %u bytes\n", Messages, Size);
+	printf("%-12s %12s %10s %14s %12s %8s %8s\n", "batch", "messages/s", "ns/msg", "requests/msg", "irps/msg", "full",
+		"failed");
+	for (i = 0; i <= RTL_NUMBER_OF(BenchBatchSizes) + 1; i++) {
+		BOOLEAN UseRing = i == RTL_NUMBER_OF(BenchBatchSizes) + 1;
+		ULONG BatchSize = i == 0 || UseRing ? 0 : BenchBatchSizes[i - 1];
+		BENCH_TIMER Timer = { 0 };
+		ULONG Failed;
+		ULONG Full = 0;
+		char Label[32];
+
+		if (UseRing && Size > RTL_FIELD_SIZE(DEVICE_RING_SLOT, Data)) {
+			printf("%-12s (messages over %u bytes do not fit a slot)\n", "ring",
+				(ULONG)RTL_FIELD_SIZE(DEVICE_RING_SLOT, Data));
+			continue;
+		}
+
+		Failed = UseRing ? BenchRing(FileObject, Messages, Size, &Timer) : BenchRun(FileObject, Messages, Size,
+			BatchSize, &Timer, &Full);
+
+		if (UseRing) {
+			strcpy(Label, "ring");
+		}
+		else if (BatchSize == 0) {
+			strcpy(Label, "DEVICE_SEND");
+		}
+		else {
+			snprintf(Label, sizeof(Label), "batch %u", BatchSize);
+		}
+		printf("%-12s %12.0f %10.1f %14.4f %12.4f %8u %8u\n", Label, Messages * 1e9 / Timer.Elapsed,
+			(double)Timer.Elapsed / Messages, (double)Timer.Requests / Messages, (double)Timer.Irps / Messages, Full,
+			Failed);
+	}
+
+	if (NT_SUCCESS(WdmDeviceIoControlFile(FileObject, NULL, NULL, &IoStatus, DEVICE_QUERY_STATISTICS, NULL, 0,
+		&Statistics, sizeof(Statistics)))) {
+		printf("driver: %llu requests by fast I/O, %llu by IRP\n", (unsigned long long)Statistics.FastIoRequests,
+			(unsigned long long)Statistics.IrpRequests);
+	}
+
+	WdmCloseFile(FileObject);
+	WdmUnloadDriver(Driver);
+	return 0;
+}
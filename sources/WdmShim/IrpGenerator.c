@@ -0,0 +1,532 @@
+// IrpGenerator.c : Loads one of the drivers of this repository in user mode
+// and sends it a stream of requests from any number of threads.
+//
+// Linked with WdmShim.c and the sources of the driver under test, whose
+// DriverEntry it calls. Two drivers of its own are loaded first, for the
+// filters to attach to: a keyboard class driver, \Device\KeyboardClass0,
+// and a file system whose control device is registered as such and whose
+// volume is \Device\ShimVolume.
+//
+// The default ioctl is DispatchIoctl's DEVICE_SEND, which queues each
+// message on the handle until a DEVICE_RECV takes it, so each one is
+// followed by a DEVICE_RECV on the same handle, --drain: the queue never
+// fills and every message sent is delivered. The drain is left out of the
+// latencies, not out of the throughput. With --ioctl there is no drain
+// unless --drain gives one; --drain 0 turns it off.
+//
+// irpgen [--device name] [--workload create-close|read|write|ioctl]
+//        [--ioctl code] [--drain code] [--size bytes] [--count n] [--threads n]
+//
+
+#define _GNU_SOURCE
+
+#include "WdmShim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define GEN_MAXIMUM_THREADS             64
+#define GEN_MAXIMUM_STATUSES            8
+#define GEN_DRAIN_LENGTH                512
+
+typedef enum _GEN_WORKLOAD {
+	GenCreateClose,
+	GenRead,
+	GenWrite,
+	GenIoctl
+} GEN_WORKLOAD;
+
+typedef struct _GEN_STATUS_COUNT {
+	NTSTATUS Status;
+	ULONG Count;
+} GEN_STATUS_COUNT, *PGEN_STATUS_COUNT;
+
+typedef struct _GEN_THREAD {
+	pthread_t Thread;
+	ULONG Count;
+	PULONGLONG Latencies;
+	NTSTATUS OpenStatus;
+	ULONG StatusCount;
+	GEN_STATUS_COUNT Statuses[GEN_MAXIMUM_STATUSES];
+} GEN_THREAD, *PGEN_THREAD;
+
+typedef struct _KEYBOARD_INPUT_DATA {
+	USHORT UnitId;
+	USHORT MakeCode;
+	USHORT Flags;
+	USHORT Reserved;
+	ULONG ExtraInformation;
+} KEYBOARD_INPUT_DATA, *PKEYBOARD_INPUT_DATA;
+
+DRIVER_INITIALIZE DriverEntry;
+
+static PCWSTR GenDevice = L"\\??\\dummydriverlink";
+static GEN_WORKLOAD GenWorkload = GenCreateClose;
+static ULONG GenIoControlCode = CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_WRITE_DATA);
+static ULONG GenDrainCode = CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_READ_DATA);
+static ULONG GenSize = 512;
+
+static PDEVICE_OBJECT GenKeyboardDevice;
+static PDEVICE_OBJECT GenFsControlDevice;
+static PDEVICE_OBJECT GenFsVolumeDevice;
+
+/*
+	Keyboard class driver
+*/
+
+static NTSTATUS GenKeyboardDispatch(
+	_In_ PDEVICE_OBJECT DeviceObject,
+	_In_ PIRP           Irp
+)
+{
+	PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+	NTSTATUS status = STATUS_SUCCESS;
+	ULONG_PTR Information = 0;
+
+	UNREFERENCED_PARAMETER(DeviceObject);
+
+	//
+	// Hands back as many key strokes as fit, pressed and released in turn.
+	//
+	if (IoStack->MajorFunction == IRP_MJ_READ) {
+		PKEYBOARD_INPUT_DATA Keys = (PKEYBOARD_INPUT_DATA)Irp->AssociatedIrp.SystemBuffer;
+		ULONG NumKeys = IoStack->Parameters.Read.Length / sizeof(KEYBOARD_INPUT_DATA);
+		ULONG i;
+
+		if (Keys == NULL || NumKeys == 0) {
+			status = STATUS_INVALID_PARAMETER;
+		}
+		else {
+			for (i = 0; i < NumKeys; i++) {
+				RtlZeroMemory(&Keys[i], sizeof(KEYBOARD_INPUT_DATA));
+				Keys[i].MakeCode = 0x1e + (USHORT)(i / 2 % 26);
+				Keys[i].Flags = (USHORT)(i % 2);
+			}
+			Information = NumKeys * sizeof(KEYBOARD_INPUT_DATA);
+		}
+	}
+
+	Irp->IoStatus.Status = status;
+	Irp->IoStatus.Information = Information;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return status;
+}
+
+static VOID GenKeyboardUnload(
+	_In_ PDRIVER_OBJECT DriverObject
+)
+{
+	UNREFERENCED_PARAMETER(DriverObject);
+
+	IoDeleteDevice(GenKeyboardDevice);
+}
+
+static NTSTATUS GenKeyboardEntry(
+	_In_ PDRIVER_OBJECT    DriverObject,
+	_In_ PUNICODE_STRING   RegistryPath
+)
+{
+	UNICODE_STRING DeviceName = RTL_CONSTANT_STRING(L"\\Device\\KeyboardClass0");
+	NTSTATUS status;
+	ULONG i;
+
+	UNREFERENCED_PARAMETER(RegistryPath);
+
+	status = IoCreateDevice(DriverObject, 0, &DeviceName, FILE_DEVICE_KEYBOARD, 0, FALSE, &GenKeyboardDevice);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	GenKeyboardDevice->Flags |= DO_BUFFERED_IO;
+
+	for (i = IRP_MJ_CREATE; i <= IRP_MJ_READ; i++) {
+		DriverObject->MajorFunction[i] = GenKeyboardDispatch;
+	}
+	DriverObject->MajorFunction[IRP_MJ_CLEANUP] = GenKeyboardDispatch;
+	DriverObject->DriverUnload = GenKeyboardUnload;
+	return status;
+}
+
+/*
+	File system
+*/
+
+//
+// Succeeds at everything, reading zeroes and writing nowhere.
+//
+static NTSTATUS GenFsDispatch(
+	_In_ PDEVICE_OBJECT DeviceObject,
+	_In_ PIRP           Irp
+)
+{
+	PIO_STACK_LOCATION IoStack = IoGetCurrentIrpStackLocation(Irp);
+	ULONG_PTR Information = 0;
+
+	UNREFERENCED_PARAMETER(DeviceObject);
+
+	switch (IoStack->MajorFunction) {
+	case IRP_MJ_READ:
+		if (Irp->MdlAddress != NULL) {
+			PVOID Buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority);
+
+			if (Buffer == NULL) {
+				Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+				Irp->IoStatus.Information = 0;
+				IoCompleteRequest(Irp, IO_NO_INCREMENT);
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+			RtlZeroMemory(Buffer, IoStack->Parameters.Read.Length);
+		}
+		Information = IoStack->Parameters.Read.Length;
+		break;
+	case IRP_MJ_WRITE:
+		Information = IoStack->Parameters.Write.Length;
+		break;
+	case IRP_MJ_DEVICE_CONTROL:
+		Information = IoStack->Parameters.DeviceIoControl.OutputBufferLength;
+		break;
+	default:
+		break;
+	}
+
+	Irp->IoStatus.Status = STATUS_SUCCESS;
+	Irp->IoStatus.Information = Information;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return STATUS_SUCCESS;
+}
+
+static VOID GenFsUnload(
+	_In_ PDRIVER_OBJECT DriverObject
+)
+{
+	UNREFERENCED_PARAMETER(DriverObject);
+
+	IoUnregisterFileSystem(GenFsControlDevice);
+	IoDeleteDevice(GenFsVolumeDevice);
+	IoDeleteDevice(GenFsControlDevice);
+}
+
+static NTSTATUS GenFsEntry(
+	_In_ PDRIVER_OBJECT    DriverObject,
+	_In_ PUNICODE_STRING   RegistryPath
+)
+{
+	UNICODE_STRING ControlName = RTL_CONSTANT_STRING(L"\\Device\\ShimFs");
+	UNICODE_STRING VolumeName = RTL_CONSTANT_STRING(L"\\Device\\ShimVolume");
+	NTSTATUS status;
+	ULONG i;
+
+	UNREFERENCED_PARAMETER(RegistryPath);
+
+	status = IoCreateDevice(DriverObject, 0, &ControlName, FILE_DEVICE_DISK_FILE_SYSTEM, 0, FALSE,
+		&GenFsControlDevice);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	status = IoCreateDevice(DriverObject, 0, &VolumeName, FILE_DEVICE_DISK_FILE_SYSTEM, 0, FALSE,
+		&GenFsVolumeDevice);
+	if (!NT_SUCCESS(status)) {
+		IoDeleteDevice(GenFsControlDevice);
+		return status;
+	}
+	GenFsVolumeDevice->Flags |= DO_DIRECT_IO;
+	GenFsVolumeDevice->Flags &= ~DO_DEVICE_INITIALIZING;
+	GenFsControlDevice->Flags &= ~DO_DEVICE_INITIALIZING;
+
+	for (i = 0; i <= IRP_MJ_MAXIMUM_FUNCTION; i++) {
+		DriverObject->MajorFunction[i] = GenFsDispatch;
+	}
+	DriverObject->DriverUnload = GenFsUnload;
+
+	//
+	// Filters that are already loaded attach here, to the control device
+	// and then to the volume.
+	//
+	IoRegisterFileSystem(GenFsControlDevice);
+	return status;
+}
+
+/*
+	Workload
+*/
+
+static ULONGLONG GenNow(
+	VOID
+)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (ULONGLONG)Now.tv_sec * 1000000000 + Now.tv_nsec;
+}
+
+static VOID GenCountStatus(
+	_Inout_ PGEN_STATUS_COUNT  Statuses,
+	_Inout_ PULONG             StatusCount,
+	_In_ NTSTATUS              Status,
+	_In_ ULONG                 Count
+)
+{
+	ULONG i;
+
+	for (i = 0; i < *StatusCount; i++) {
+		if (Statuses[i].Status == Status) {
+			Statuses[i].Count += Count;
+			return;
+		}
+	}
+	if (*StatusCount < GEN_MAXIMUM_STATUSES) {
+		Statuses[*StatusCount].Status = Status;
+		Statuses[*StatusCount].Count = Count;
+		(*StatusCount)++;
+	}
+}
+
+static PVOID GenThread(
+	_In_ PVOID Context
+)
+{
+	PGEN_THREAD Thread = (PGEN_THREAD)Context;
+	PFILE_OBJECT FileObject = NULL;
+	IO_STATUS_BLOCK IoStatus;
+	PUCHAR Buffer = calloc(1, GenSize + sizeof(WCHAR));
+	WCHAR Drained[GEN_DRAIN_LENGTH / sizeof(WCHAR)];
+	ULONG i;
+
+	//
+	// A wide string filling the buffer, terminator included, for drivers
+	// that print what they are sent.
+	//
+	for (i = 0; i + 2 * sizeof(WCHAR) <= GenSize; i += sizeof(WCHAR)) {
+		((PWCHAR)Buffer)[i / sizeof(WCHAR)] = L'a' + (WCHAR)(i / sizeof(WCHAR) % 26);
+	}
+
+	if (GenWorkload != GenCreateClose) {
+		Thread->OpenStatus = WdmOpenFile(GenDevice, &FileObject);
+		if (!NT_SUCCESS(Thread->OpenStatus)) {
+			free(Buffer);
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < Thread->Count; i++) {
+		ULONGLONG Start = GenNow();
+		NTSTATUS status;
+
+		switch (GenWorkload) {
+		case GenCreateClose:
+			status = WdmOpenFile(GenDevice, &FileObject);
+			if (NT_SUCCESS(status)) {
+				WdmCloseFile(FileObject);
+			}
+			break;
+		case GenRead:
+			status = WdmReadFile(FileObject, NULL, NULL, &IoStatus, Buffer, GenSize, NULL);
+			break;
+		case GenWrite:
+			status = WdmWriteFile(FileObject, NULL, NULL, &IoStatus, Buffer, GenSize, NULL);
+			break;
+		default:
+			//
+			// A direct ioctl carries its payload in the output buffer; the
+			// input buffer would only add a copy.
+			//
+			if (METHOD_FROM_CTL_CODE(GenIoControlCode) == METHOD_IN_DIRECT ||
+				METHOD_FROM_CTL_CODE(GenIoControlCode) == METHOD_OUT_DIRECT) {
+				status = WdmDeviceIoControlFile(FileObject, NULL, NULL, &IoStatus, GenIoControlCode, NULL, 0,
+					Buffer, GenSize);
+			}
+			else {
+				status = WdmDeviceIoControlFile(FileObject, NULL, NULL, &IoStatus, GenIoControlCode, Buffer,
+					GenSize, Buffer, GenSize);
+			}
+			break;
+		}
+		Thread->Latencies[i] = GenNow() - Start;
+		GenCountStatus(Thread->Statuses, &Thread->StatusCount, status, 1);
+
+		if (GenWorkload == GenIoctl && GenDrainCode != 0) {
+			WdmDeviceIoControlFile(FileObject, NULL, NULL, &IoStatus, GenDrainCode, NULL, 0, Drained,
+				sizeof(Drained));
+		}
+	}
+
+	if (FileObject != NULL && GenWorkload != GenCreateClose) {
+		WdmCloseFile(FileObject);
+	}
+	free(Buffer);
+	return NULL;
+}
+
+static int GenCompareLatencies(
+	_In_ const void *Left,
+	_In_ const void *Right
+)
+{
+	ULONGLONG LeftLatency = *(const ULONGLONG *)Left;
+	ULONGLONG RightLatency = *(const ULONGLONG *)Right;
+
+	return LeftLatency < RightLatency ? -1 : LeftLatency > RightLatency;
+}
+
+static VOID GenUsage(
+	VOID
+)
+{
+	fprintf(stderr, "usage: irpgen [--device name] [--workload create-close|read|write|ioctl]\n"
+		"              [--ioctl code] [--drain code] [--size bytes] [--count n] [--threads n]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static WCHAR Device[256];
+	ULONG Count = 100000;
+	ULONG NumThreads = 1;
+	PDRIVER_OBJECT KeyboardDriver;
+	PDRIVER_OBJECT FsDriver;
+	PDRIVER_OBJECT Driver;
+	GEN_THREAD Threads[GEN_MAXIMUM_THREADS];
+	GEN_STATUS_COUNT Statuses[GEN_MAXIMUM_STATUSES];
+	ULONG StatusCount = 0;
+	PULONGLONG Latencies;
+	ULONGLONG Total = 0;
+	ULONGLONG Start;
+	ULONGLONG Elapsed;
+	WDM_STATS Stats;
+	NTSTATUS status;
+	BOOLEAN Drain = FALSE;
+	int i;
+	ULONG j;
+
+	for (i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			GenUsage();
+		}
+		if (strcmp(argv[i], "--device") == 0) {
+			size_t Length = strlen(argv[++i]);
+
+			if (Length >= RTL_NUMBER_OF(Device)) {
+				GenUsage();
+			}
+			for (j = 0; j <= Length; j++) {
+				Device[j] = (WCHAR)(UCHAR)argv[i][j];
+			}
+			GenDevice = Device;
+		}
+		else if (strcmp(argv[i], "--workload") == 0) {
+			i++;
+			if (strcmp(argv[i], "create-close") == 0) {
+				GenWorkload = GenCreateClose;
+			}
+			else if (strcmp(argv[i], "read") == 0) {
+				GenWorkload = GenRead;
+			}
+			else if (strcmp(argv[i], "write") == 0) {
+				GenWorkload = GenWrite;
+			}
+			else if (strcmp(argv[i], "ioctl") == 0) {
+				GenWorkload = GenIoctl;
+			}
+			else {
+				GenUsage();
+			}
+		}
+		else if (strcmp(argv[i], "--ioctl") == 0) {
+			GenIoControlCode = (ULONG)strtoul(argv[++i], NULL, 0);
+			if (!Drain) {
+				GenDrainCode = 0;
+			}
+		}
+		else if (strcmp(argv[i], "--drain") == 0) {
+			GenDrainCode = (ULONG)strtoul(argv[++i], NULL, 0);
+			Drain = TRUE;
+		}
+		else if (strcmp(argv[i], "--size") == 0) {
+			GenSize = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--count") == 0) {
+			Count = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--threads") == 0) {
+			NumThreads = (ULONG)strtoul(argv[++i], NULL, 0);
+			if (NumThreads == 0 || NumThreads > GEN_MAXIMUM_THREADS) {
+				GenUsage();
+			}
+		}
+		else {
+			GenUsage();
+		}
+	}
+	if (Count == 0) {
+		GenUsage();
+	}
+
+	status = WdmLoadDriver(GenKeyboardEntry, L"\\Driver\\kbdclass", &KeyboardDriver);
+	if (NT_SUCCESS(status)) {
+		status = WdmLoadDriver(GenFsEntry, L"\\FileSystem\\ShimFs", &FsDriver);
+	}
+	if (!NT_SUCCESS(status)) {
+		fprintf(stderr, "failed to load the lower drivers: 0x%08X\n", status);
+		return 1;
+	}
+	status = WdmLoadDriver(DriverEntry, L"\\Driver\\UnderTest", &Driver);
+	if (!NT_SUCCESS(status)) {
+		fprintf(stderr, "DriverEntry failed: 0x%08X\n", status);
+		return 1;
+	}
+
+	Latencies = malloc((size_t)Count * NumThreads * sizeof(ULONGLONG));
+	if (Latencies == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	Start = GenNow();
+	for (j = 0; j < NumThreads; j++) {
+		RtlZeroMemory(&Threads[j], sizeof(GEN_THREAD));
+		Threads[j].Count = Count;
+		Threads[j].Latencies = Latencies + (size_t)j * Count;
+		pthread_create(&Threads[j].Thread, NULL, GenThread, &Threads[j]);
+	}
+	for (j = 0; j < NumThreads; j++) {
+		pthread_join(Threads[j].Thread, NULL);
+	}
+	Elapsed = GenNow() - Start;
+
+	for (j = 0; j < NumThreads; j++) {
+		ULONG k;
+
+		if (!NT_SUCCESS(Threads[j].OpenStatus)) {
+			fprintf(stderr, "thread %u could not open the device: 0x%08X\n", j, Threads[j].OpenStatus);
+			return 1;
+		}
+		for (k = 0; k < Threads[j].StatusCount; k++) {
+			GenCountStatus(Statuses, &StatusCount, Threads[j].Statuses[k].Status, Threads[j].Statuses[k].Count);
+		}
+	}
+	for (j = 0; j < Count * NumThreads; j++) {
+		Total += Latencies[j];
+	}
+	qsort(Latencies, (size_t)Count * NumThreads, sizeof(ULONGLONG), GenCompareLatencies);
+
+	printf("%u ops on %u threads in %.3f s: %.0f ops/s\n", Count * NumThreads, NumThreads, Elapsed / 1e9,
+		(double)Count * NumThreads * 1e9 / Elapsed);
+	printf("latency mean %.0f ns, p50 %llu ns, p99 %llu ns\n", (double)Total / ((double)Count * NumThreads),
+		(unsigned long long)Latencies[(size_t)Count * NumThreads / 2],
+		(unsigned long long)Latencies[(size_t)Count * NumThreads * 99 / 100]);
+	for (j = 0; j < StatusCount; j++) {
+		printf("status 0x%08X: %u\n", Statuses[j].Status, Statuses[j].Count);
+	}
+
+	WdmQueryStats(&Stats);
+	printf("requests %llu, irps allocated %llu, pended %llu, fast i/o %llu\n", (unsigned long long)Stats.Requests,
+		(unsigned long long)Stats.IrpsAllocated, (unsigned long long)Stats.IrpsPended,
+		(unsigned long long)Stats.FastIoHandled);
+
+	WdmUnloadDriver(Driver);
+	WdmUnloadDriver(FsDriver);
+	WdmUnloadDriver(KeyboardDriver);
+	free(Latencies);
+	return 0;
+}
@@ -0,0 +1,2560 @@
+// WdmShim.c : A user-mode stand-in for the kernel routines in ntddk.h and
+// ntifs.h, and the requests of WdmShim.h that drive them.
+//
+// One mutex, IopDatabaseLock, guards the object namespace, the device lists
+// of drivers and every device stack; another, IopFileSystemLock, the file
+// systems and the routines watching them. Neither is held while calling
+// into a driver, except that file system notifications run under the
+// second, which they may not re-enter. ObpHandleLock guards the handle table
+// alone.
+//
+
+#define _GNU_SOURCE
+
+#include "WdmShim.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define IO_TYPE_DEVICE                  3
+#define IO_TYPE_DRIVER                  4
+#define IO_TYPE_FILE                    5
+#define IO_TYPE_IRP                     6
+
+#define IOP_POOL_TAG                    0x496f7049  // 'IpoI'
+
+#define IOP_MAXIMUM_NAME                512
+#define IOP_MAXIMUM_LINK_DEPTH          8
+
+//
+// Seconds from 1601, the start of system time, to 1970.
+//
+#define IOP_SYSTEM_TIME_TO_UNIX_EPOCH   11644473600LL
+
+#define OBP_MAXIMUM_HANDLES             1024
+
+//
+// Every object is preceded by its header, which counts references and knows
+// how to free the object once the last one is dropped. Only objects that can
+// have handles are given a type.
+//
+typedef struct _OBJECT_HEADER {
+	volatile LONG PointerCount;
+	VOID(*DeleteProcedure)(PVOID Object);
+	POBJECT_TYPE Type;
+	_Alignas(16) UCHAR Body[];
+} OBJECT_HEADER, *POBJECT_HEADER;
+
+//
+// What the I/O manager keeps about a device beyond the DEVICE_OBJECT. The
+// device extension follows.
+//
+typedef struct _IOP_DEVICE {
+	DEVICE_OBJECT DeviceObject;
+	PDEVICE_OBJECT AttachedTo;
+	BOOLEAN DeletePending;
+	_Alignas(16) UCHAR Extension[];
+} IOP_DEVICE, *PIOP_DEVICE;
+
+//
+// Precedes every IRP. OutputLength bounds the copy of a buffered request's
+// output back to the caller. ReferenceCount keeps an asynchronous request's
+// IRP allocated while WdmCancelIoFile may still be cancelling it.
+//
+typedef struct _IOP_IRP {
+	ULONG OutputLength;
+	volatile LONG ReferenceCount;
+	_Alignas(16) IRP Irp;
+} IOP_IRP, *PIOP_IRP;
+
+//
+// What the I/O manager keeps about a file beyond the FILE_OBJECT: the
+// asynchronous requests in flight on it, linked by ThreadListEntry, for
+// WdmCancelIoFile. The file name follows.
+//
+typedef struct _IOP_FILE {
+	FILE_OBJECT FileObject;
+	pthread_mutex_t Lock;
+	LIST_ENTRY Irps;
+	_Alignas(16) WCHAR FileName[];
+} IOP_FILE, *PIOP_FILE;
+
+//
+// A device name or a symbolic link in the object namespace.
+//
+typedef struct _IOP_NAME {
+	LIST_ENTRY Links;
+	UNICODE_STRING Name;
+	PDEVICE_OBJECT DeviceObject;
+	UNICODE_STRING Target;
+} IOP_NAME, *PIOP_NAME;
+
+typedef struct _IOP_FILE_SYSTEM {
+	LIST_ENTRY Links;
+	PDEVICE_OBJECT DeviceObject;
+} IOP_FILE_SYSTEM, *PIOP_FILE_SYSTEM;
+
+typedef struct _IOP_FS_NOTIFICATION {
+	LIST_ENTRY Links;
+	PDRIVER_OBJECT DriverObject;
+	PDRIVER_FS_NOTIFICATION Routine;
+} IOP_FS_NOTIFICATION, *PIOP_FS_NOTIFICATION;
+
+//
+// Counters are per thread, so that counting does not make threads that
+// share nothing else share a cache line. Only the owner writes them.
+//
+typedef struct _IOP_THREAD_STATS {
+	struct _IOP_THREAD_STATS *Next;
+	WDM_STATS Stats;
+} IOP_THREAD_STATS, *PIOP_THREAD_STATS;
+
+static pthread_mutex_t IopDatabaseLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY IopNames = { &IopNames, &IopNames };
+
+static pthread_mutex_t IopFileSystemLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY IopFileSystems = { &IopFileSystems, &IopFileSystems };
+static LIST_ENTRY IopFsNotifications = { &IopFsNotifications, &IopFsNotifications };
+
+struct _OBJECT_TYPE {
+	PCWSTR Name;
+};
+
+//
+// What is behind a PETHREAD. Exited comes first, so that a thread can be
+// waited for as the event it is signalled through.
+//
+struct _ETHREAD {
+	KEVENT Exited;
+	PKSTART_ROUTINE StartRoutine;
+	PVOID StartContext;
+};
+
+static pthread_mutex_t ObpHandleLock = PTHREAD_MUTEX_INITIALIZER;
+static PVOID ObpHandles[OBP_MAXIMUM_HANDLES];
+
+static struct _OBJECT_TYPE ObpEventObjectType = { L"Event" };
+static struct _OBJECT_TYPE ObpThreadObjectType = { L"Thread" };
+static POBJECT_TYPE ObpEventType = &ObpEventObjectType;
+static POBJECT_TYPE ObpThreadType = &ObpThreadObjectType;
+POBJECT_TYPE *ExEventObjectType = &ObpEventType;
+POBJECT_TYPE *PsThreadType = &ObpThreadType;
+
+static __thread PETHREAD PspCurrentThread;
+
+static KSPIN_LOCK IopCancelSpinLock;
+
+static pthread_mutex_t IopStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static PIOP_THREAD_STATS IopAllStats;
+static __thread PIOP_THREAD_STATS IopCurrentStats;
+
+#define OBJECT_TO_OBJECT_HEADER(Object) CONTAINING_RECORD((Object), OBJECT_HEADER, Body)
+#define IOP_DEVICE_FROM_OBJECT(Device) CONTAINING_RECORD((Device), IOP_DEVICE, DeviceObject)
+#define IOP_IRP_FROM_IRP(Irp) CONTAINING_RECORD((Irp), IOP_IRP, Irp)
+#define IOP_FILE_FROM_OBJECT(File) CONTAINING_RECORD((File), IOP_FILE, FileObject)
+
+/*
+	Debugging support
+*/
+
+//
+// Formats one conversion at a time with snprintf, taking the argument with
+// the type Windows gives it: l is 32 bits there, and w or S mean a wide
+// string, Z a counted one.
+//
+static VOID IopFormat(
+	_Out_ PCHAR    Output,
+	_In_ size_t    Size,
+	_In_ PCSTR     Format,
+	_In_ va_list   Arguments
+)
+{
+	size_t Length = 0;
+	va_list Args;
+
+	va_copy(Args, Arguments);
+	while (*Format != 0 && Length + 1 < Size) {
+		char Spec[32];
+		size_t SpecLength = 0;
+		int Size64 = 0;
+		int SizePointer = 0;
+		int Wide = 0;
+		char Conversion;
+		int Written;
+
+		if (*Format != '%') {
+			Output[Length++] = *Format++;
+			continue;
+		}
+		Spec[SpecLength++] = *Format++;
+		while (*Format != 0 && strchr("-+ #0123456789.", *Format) != NULL && SpecLength < 16) {
+			Spec[SpecLength++] = *Format++;
+		}
+		for (;;) {
+			if (*Format == 'l' && Format[1] == 'l') {
+				Size64 = 1;
+				Format += 2;
+			}
+			else if (Format[0] == 'I' && Format[1] == '6' && Format[2] == '4') {
+				Size64 = 1;
+				Format += 3;
+			}
+			else if (Format[0] == 'I' && Format[1] == '3' && Format[2] == '2') {
+				Format += 3;
+			}
+			else if (*Format == 'I' || *Format == 'z') {
+				SizePointer = 1;
+				Format++;
+			}
+			else if (*Format == 'w' || *Format == 'l') {
+				Wide = 1;
+				Format++;
+			}
+			else if (*Format == 'h') {
+				Format++;
+			}
+			else {
+				break;
+			}
+		}
+		Conversion = *Format;
+		if (Conversion == 0) {
+			break;
+		}
+		Format++;
+
+		if (Conversion == 's' || Conversion == 'S' || Conversion == 'Z') {
+			char Narrow[IOP_MAXIMUM_NAME];
+			PCWSTR WideString = NULL;
+			size_t WideLength = 0;
+			size_t Index;
+
+			if (Conversion == 's' && Wide == 0) {
+				PCSTR String = va_arg(Args, PCSTR);
+
+				Spec[SpecLength++] = 's';
+				Spec[SpecLength] = 0;
+				Written = snprintf(Output + Length, Size - Length, Spec, String != NULL ? String : "(null)");
+				Length += Written > 0 ? min((size_t)Written, Size - Length - 1) : 0;
+				continue;
+			}
+			if (Conversion == 'Z' && Wide == 0) {
+				PANSI_STRING String = va_arg(Args, PANSI_STRING);
+
+				Written = snprintf(Output + Length, Size - Length, "%.*s", String != NULL ? (int)String->Length : 6,
+					String != NULL ? String->Buffer : "(null)");
+				Length += Written > 0 ? min((size_t)Written, Size - Length - 1) : 0;
+				continue;
+			}
+			if (Conversion == 'Z') {
+				PUNICODE_STRING String = va_arg(Args, PUNICODE_STRING);
+
+				if (String != NULL) {
+					WideString = String->Buffer;
+					WideLength = String->Length / sizeof(WCHAR);
+				}
+			}
+			else {
+				WideString = va_arg(Args, PCWSTR);
+				WideLength = WideString != NULL ? wcslen(WideString) : 0;
+			}
+
+			//
+			// Characters outside ASCII print as '?'.
+			//
+			if (WideString == NULL) {
+				strcpy(Narrow, "(null)");
+			}
+			else {
+				for (Index = 0; Index < WideLength && Index + 1 < sizeof(Narrow); Index++) {
+					Narrow[Index] = WideString[Index] < 0x80 ? (char)WideString[Index] : '?';
+				}
+				Narrow[Index] = 0;
+			}
+			Spec[SpecLength++] = 's';
+			Spec[SpecLength] = 0;
+			Written = snprintf(Output + Length, Size - Length, Spec, Narrow);
+		}
+		else if (strchr("diouxXc", Conversion) != NULL) {
+			if (Size64 != 0 || SizePointer != 0) {
+				Spec[SpecLength++] = 'l';
+				Spec[SpecLength++] = 'l';
+				Spec[SpecLength++] = Conversion;
+				Spec[SpecLength] = 0;
+				Written = snprintf(Output + Length, Size - Length, Spec, va_arg(Args, long long));
+			}
+			else {
+				Spec[SpecLength++] = Conversion;
+				Spec[SpecLength] = 0;
+				Written = snprintf(Output + Length, Size - Length, Spec, va_arg(Args, int));
+			}
+		}
+		else if (Conversion == 'p') {
+			Written = snprintf(Output + Length, Size - Length, "%p", va_arg(Args, PVOID));
+		}
+		else if (strchr("eEfgG", Conversion) != NULL) {
+			Spec[SpecLength++] = Conversion;
+			Spec[SpecLength] = 0;
+			Written = snprintf(Output + Length, Size - Length, Spec, va_arg(Args, double));
+		}
+		else {
+			Output[Length++] = Conversion;
+			continue;
+		}
+		Length += Written > 0 ? min((size_t)Written, Size - Length - 1) : 0;
+	}
+	Output[Length] = 0;
+	va_end(Args);
+}
+
+ULONG DbgPrint(
+	_In_ PCSTR Format,
+	...
+)
+{
+	char Output[1024];
+	va_list Arguments;
+
+	va_start(Arguments, Format);
+	IopFormat(Output, sizeof(Output), Format, Arguments);
+	va_end(Arguments);
+	fputs(Output, stderr);
+	return STATUS_SUCCESS;
+}
+
+VOID RtlAssert(
+	_In_ PVOID     FailedAssertion,
+	_In_ PVOID     FileName,
+	_In_ ULONG     LineNumber,
+	_In_opt_ PSTR  Message
+)
+{
+	fprintf(stderr, "\n*** Assertion failed: %s%s\n***   Source File: %s, line %u\n\n",
+		Message != NULL ? Message : "", (PCSTR)FailedAssertion, (PCSTR)FileName, LineNumber);
+	abort();
+}
+
+VOID KeBugCheckEx(
+	_In_ ULONG      BugCheckCode,
+	_In_ ULONG_PTR  P1,
+	_In_ ULONG_PTR  P2,
+	_In_ ULONG_PTR  P3,
+	_In_ ULONG_PTR  P4
+)
+{
+	fprintf(stderr, "\n*** STOP: 0x%08X (0x%zX, 0x%zX, 0x%zX, 0x%zX)\n\n", BugCheckCode, (size_t)P1, (size_t)P2,
+		(size_t)P3, (size_t)P4);
+	abort();
+}
+
+/*
+	Statistics
+*/
+
+static PWDM_STATS IopGetThreadStats(
+	VOID
+)
+{
+	PIOP_THREAD_STATS ThreadStats = IopCurrentStats;
+
+	if (ThreadStats == NULL) {
+		ThreadStats = calloc(1, sizeof(IOP_THREAD_STATS));
+		if (ThreadStats == NULL) {
+			KeBugCheckEx(0, 0, 0, 0, 0);
+		}
+		pthread_mutex_lock(&IopStatsLock);
+		ThreadStats->Next = IopAllStats;
+		IopAllStats = ThreadStats;
+		pthread_mutex_unlock(&IopStatsLock);
+		IopCurrentStats = ThreadStats;
+	}
+	return &ThreadStats->Stats;
+}
+
+static VOID IopCount(
+	_Inout_ PULONGLONG Counter
+)
+{
+	__atomic_store_n(Counter, __atomic_load_n(Counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+VOID WdmQueryStats(
+	_Out_ PWDM_STATS Stats
+)
+{
+	PIOP_THREAD_STATS ThreadStats;
+
+	RtlZeroMemory(Stats, sizeof(WDM_STATS));
+	pthread_mutex_lock(&IopStatsLock);
+	for (ThreadStats = IopAllStats; ThreadStats != NULL; ThreadStats = ThreadStats->Next) {
+		Stats->Requests += __atomic_load_n(&ThreadStats->Stats.Requests, __ATOMIC_RELAXED);
+		Stats->IrpsAllocated += __atomic_load_n(&ThreadStats->Stats.IrpsAllocated, __ATOMIC_RELAXED);
+		Stats->IrpsPended += __atomic_load_n(&ThreadStats->Stats.IrpsPended, __ATOMIC_RELAXED);
+		Stats->FastIoHandled += __atomic_load_n(&ThreadStats->Stats.FastIoHandled, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&IopStatsLock);
+}
+
+/*
+	Run-time library
+*/
+
+static WCHAR RtlpUpcase(
+	_In_ WCHAR Character
+)
+{
+	return Character >= L'a' && Character <= L'z' ? Character - L'a' + L'A' : Character;
+}
+
+VOID RtlInitUnicodeString(
+	_Out_ PUNICODE_STRING  DestinationString,
+	_In_opt_ PCWSTR        SourceString
+)
+{
+	SIZE_T Length = SourceString != NULL ? wcslen(SourceString) * sizeof(WCHAR) : 0;
+
+	if (Length > 0xfffc) {
+		Length = 0xfffc;
+	}
+	DestinationString->Length = (USHORT)Length;
+	DestinationString->MaximumLength = SourceString != NULL ? (USHORT)(Length + sizeof(WCHAR)) : 0;
+	DestinationString->Buffer = (PWCH)SourceString;
+}
+
+BOOLEAN RtlPrefixUnicodeString(
+	_In_ PCUNICODE_STRING  String1,
+	_In_ PCUNICODE_STRING  String2,
+	_In_ BOOLEAN           CaseInSensitive
+)
+{
+	USHORT Index;
+
+	if (String1->Length > String2->Length) {
+		return FALSE;
+	}
+	for (Index = 0; Index < String1->Length / sizeof(WCHAR); Index++) {
+		WCHAR Character1 = String1->Buffer[Index];
+		WCHAR Character2 = String2->Buffer[Index];
+
+		if (CaseInSensitive) {
+			Character1 = RtlpUpcase(Character1);
+			Character2 = RtlpUpcase(Character2);
+		}
+		if (Character1 != Character2) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+BOOLEAN RtlEqualUnicodeString(
+	_In_ PCUNICODE_STRING  String1,
+	_In_ PCUNICODE_STRING  String2,
+	_In_ BOOLEAN           CaseInSensitive
+)
+{
+	return String1->Length == String2->Length && RtlPrefixUnicodeString(String1, String2, CaseInSensitive);
+}
+
+VOID RtlCopyUnicodeString(
+	_Inout_ PUNICODE_STRING    DestinationString,
+	_In_opt_ PCUNICODE_STRING  SourceString
+)
+{
+	USHORT Length = 0;
+
+	if (SourceString != NULL) {
+		Length = min(SourceString->Length, DestinationString->MaximumLength);
+		RtlCopyMemory(DestinationString->Buffer, SourceString->Buffer, Length);
+		if (Length + sizeof(WCHAR) <= DestinationString->MaximumLength) {
+			DestinationString->Buffer[Length / sizeof(WCHAR)] = 0;
+		}
+	}
+	DestinationString->Length = Length;
+}
+
+PVOID ExAllocatePoolWithTag(
+	_In_ POOL_TYPE  PoolType,
+	_In_ SIZE_T     NumberOfBytes,
+	_In_ ULONG      Tag
+)
+{
+	PVOID P = NULL;
+
+	UNREFERENCED_PARAMETER(PoolType);
+	UNREFERENCED_PARAMETER(Tag);
+
+	// A page or more starts on a page boundary, as on Windows.
+	if (NumberOfBytes >= PAGE_SIZE) {
+		return posix_memalign(&P, PAGE_SIZE, NumberOfBytes) == 0 ? P : NULL;
+	}
+	return malloc(NumberOfBytes != 0 ? NumberOfBytes : 1);
+}
+
+VOID ExFreePoolWithTag(
+	_In_ PVOID  P,
+	_In_ ULONG  Tag
+)
+{
+	UNREFERENCED_PARAMETER(Tag);
+
+	free(P);
+}
+
+VOID ExFreePool(
+	_In_ PVOID P
+)
+{
+	free(P);
+}
+
+/*
+	Events, mutexes and time
+*/
+
+VOID KeInitializeEvent(
+	_Out_ PRKEVENT     Event,
+	_In_ EVENT_TYPE    Type,
+	_In_ BOOLEAN       State
+)
+{
+	pthread_condattr_t Attributes;
+
+	Event->Type = Type;
+	Event->SignalState = State;
+	pthread_mutex_init(&Event->Lock, NULL);
+	pthread_condattr_init(&Attributes);
+	pthread_condattr_setclock(&Attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&Event->Signaled, &Attributes);
+	pthread_condattr_destroy(&Attributes);
+}
+
+LONG KeSetEvent(
+	_Inout_ PRKEVENT   Event,
+	_In_ LONG          Increment,
+	_In_ BOOLEAN       Wait
+)
+{
+	LONG Previous;
+
+	UNREFERENCED_PARAMETER(Increment);
+	UNREFERENCED_PARAMETER(Wait);
+
+	pthread_mutex_lock(&Event->Lock);
+	Previous = Event->SignalState;
+	Event->SignalState = 1;
+	if (Event->Type == SynchronizationEvent) {
+		pthread_cond_signal(&Event->Signaled);
+	}
+	else {
+		pthread_cond_broadcast(&Event->Signaled);
+	}
+	pthread_mutex_unlock(&Event->Lock);
+	return Previous;
+}
+
+LONG KeResetEvent(
+	_Inout_ PRKEVENT Event
+)
+{
+	LONG Previous;
+
+	pthread_mutex_lock(&Event->Lock);
+	Previous = Event->SignalState;
+	Event->SignalState = 0;
+	pthread_mutex_unlock(&Event->Lock);
+	return Previous;
+}
+
+VOID KeClearEvent(
+	_Inout_ PRKEVENT Event
+)
+{
+	KeResetEvent(Event);
+}
+
+LONG KeReadStateEvent(
+	_In_ PRKEVENT Event
+)
+{
+	LONG State;
+
+	pthread_mutex_lock(&Event->Lock);
+	State = Event->SignalState;
+	pthread_mutex_unlock(&Event->Lock);
+	return State;
+}
+
+VOID ExInitializeFastMutex(
+	_Out_ PFAST_MUTEX FastMutex
+)
+{
+	pthread_mutex_init(&FastMutex->Lock, NULL);
+}
+
+VOID ExAcquireFastMutex(
+	_Inout_ PFAST_MUTEX FastMutex
+)
+{
+	pthread_mutex_lock(&FastMutex->Lock);
+}
+
+VOID ExReleaseFastMutex(
+	_Inout_ PFAST_MUTEX FastMutex
+)
+{
+	pthread_mutex_unlock(&FastMutex->Lock);
+}
+
+VOID KeInitializeSpinLock(
+	_Out_ PKSPIN_LOCK SpinLock
+)
+{
+	*SpinLock = 0;
+}
+
+VOID KeAcquireSpinLockAtDpcLevel(
+	_Inout_ PKSPIN_LOCK SpinLock
+)
+{
+	ULONG Spins = 0;
+
+	while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(SpinLock, __ATOMIC_RELAXED) != 0) {
+			if (++Spins % 128 == 0) {
+				sched_yield();
+			}
+			else {
+				YieldProcessor();
+			}
+		}
+	}
+}
+
+VOID KeReleaseSpinLockFromDpcLevel(
+	_Inout_ PKSPIN_LOCK SpinLock
+)
+{
+	__atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+VOID KeAcquireSpinLock(
+	_Inout_ PKSPIN_LOCK    SpinLock,
+	_Out_ PKIRQL           OldIrql
+)
+{
+	*OldIrql = PASSIVE_LEVEL;
+	KeAcquireSpinLockAtDpcLevel(SpinLock);
+}
+
+VOID KeReleaseSpinLock(
+	_Inout_ PKSPIN_LOCK    SpinLock,
+	_In_ KIRQL             NewIrql
+)
+{
+	UNREFERENCED_PARAMETER(NewIrql);
+
+	KeReleaseSpinLockFromDpcLevel(SpinLock);
+}
+
+VOID KeQuerySystemTime(
+	_Out_ PLARGE_INTEGER CurrentTime
+)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_REALTIME, &Now);
+	CurrentTime->QuadPart = ((LONGLONG)Now.tv_sec + IOP_SYSTEM_TIME_TO_UNIX_EPOCH) * 10000000 + Now.tv_nsec / 100;
+}
+
+//
+// Turns a timeout in 100ns units, negative for relative and positive for
+// absolute system time, into a relative one in nanoseconds.
+//
+static LONGLONG IopRelativeTimeout(
+	_In_ PLARGE_INTEGER Timeout
+)
+{
+	LARGE_INTEGER Now;
+
+	if (Timeout->QuadPart <= 0) {
+		return -Timeout->QuadPart * 100;
+	}
+	KeQuerySystemTime(&Now);
+	return Timeout->QuadPart > Now.QuadPart ? (Timeout->QuadPart - Now.QuadPart) * 100 : 0;
+}
+
+NTSTATUS KeWaitForSingleObject(
+	_In_ PVOID             Object,
+	_In_ KWAIT_REASON      WaitReason,
+	_In_ KPROCESSOR_MODE   WaitMode,
+	_In_ BOOLEAN           Alertable,
+	_In_opt_ PLARGE_INTEGER Timeout
+)
+{
+	PRKEVENT Event = (PRKEVENT)Object;
+	NTSTATUS status = STATUS_SUCCESS;
+	struct timespec Deadline;
+
+	UNREFERENCED_PARAMETER(WaitReason);
+	UNREFERENCED_PARAMETER(WaitMode);
+	UNREFERENCED_PARAMETER(Alertable);
+
+	if (Timeout != NULL) {
+		LONGLONG Nanoseconds = IopRelativeTimeout(Timeout);
+
+		clock_gettime(CLOCK_MONOTONIC, &Deadline);
+		Deadline.tv_sec += Nanoseconds / 1000000000 + (Deadline.tv_nsec + Nanoseconds % 1000000000) / 1000000000;
+		Deadline.tv_nsec = (Deadline.tv_nsec + Nanoseconds % 1000000000) % 1000000000;
+	}
+
+	pthread_mutex_lock(&Event->Lock);
+	while (Event->SignalState == 0) {
+		if (Timeout == NULL) {
+			pthread_cond_wait(&Event->Signaled, &Event->Lock);
+		}
+		else if (pthread_cond_timedwait(&Event->Signaled, &Event->Lock, &Deadline) == ETIMEDOUT) {
+			status = STATUS_TIMEOUT;
+			break;
+		}
+	}
+	if (status == STATUS_SUCCESS && Event->Type == SynchronizationEvent) {
+		Event->SignalState = 0;
+	}
+	pthread_mutex_unlock(&Event->Lock);
+	return status;
+}
+
+//
+// A zero interval gives up the rest of the time slice, as on Windows.
+//
+NTSTATUS KeDelayExecutionThread(
+	_In_ KPROCESSOR_MODE   WaitMode,
+	_In_ BOOLEAN           Alertable,
+	_In_ PLARGE_INTEGER    Interval
+)
+{
+	LONGLONG Nanoseconds = IopRelativeTimeout(Interval);
+	struct timespec Remaining;
+
+	UNREFERENCED_PARAMETER(WaitMode);
+	UNREFERENCED_PARAMETER(Alertable);
+
+	if (Nanoseconds == 0) {
+		sched_yield();
+		return STATUS_SUCCESS;
+	}
+	Remaining.tv_sec = Nanoseconds / 1000000000;
+	Remaining.tv_nsec = Nanoseconds % 1000000000;
+	while (nanosleep(&Remaining, &Remaining) != 0 && errno == EINTR) {
+	}
+	return STATUS_SUCCESS;
+}
+
+/*
+	Objects and the namespace
+*/
+
+static PVOID ObpCreateObject(
+	_In_ SIZE_T    Size,
+	_In_ VOID(*DeleteProcedure)(PVOID Object)
+)
+{
+	POBJECT_HEADER Header = calloc(1, sizeof(OBJECT_HEADER) + Size);
+
+	if (Header == NULL) {
+		return NULL;
+	}
+	Header->PointerCount = 1;
+	Header->DeleteProcedure = DeleteProcedure;
+	return Header->Body;
+}
+
+VOID ObReferenceObject(
+	_In_ PVOID Object
+)
+{
+	InterlockedIncrement(&OBJECT_TO_OBJECT_HEADER(Object)->PointerCount);
+}
+
+VOID ObDereferenceObject(
+	_In_ PVOID Object
+)
+{
+	POBJECT_HEADER Header = OBJECT_TO_OBJECT_HEADER(Object);
+
+	if (InterlockedDecrement(&Header->PointerCount) == 0) {
+		if (Header->DeleteProcedure != NULL) {
+			Header->DeleteProcedure(Object);
+		}
+		free(Header);
+	}
+}
+
+static PIOP_NAME IopFindName(
+	_In_ PCUNICODE_STRING Name
+)
+{
+	PLIST_ENTRY Entry;
+
+	for (Entry = IopNames.Flink; Entry != &IopNames; Entry = Entry->Flink) {
+		PIOP_NAME Candidate = CONTAINING_RECORD(Entry, IOP_NAME, Links);
+
+		if (RtlEqualUnicodeString(&Candidate->Name, Name, TRUE)) {
+			return Candidate;
+		}
+	}
+	return NULL;
+}
+
+//
+// Inserts a device name, or a symbolic link when DeviceObject is NULL.
+// Called with the database lock held.
+//
+static NTSTATUS IopInsertName(
+	_In_ PCUNICODE_STRING      Name,
+	_In_opt_ PDEVICE_OBJECT    DeviceObject,
+	_In_opt_ PCUNICODE_STRING  Target
+)
+{
+	USHORT TargetLength = Target != NULL ? Target->Length : 0;
+	PIOP_NAME NameEntry;
+
+	if (Name->Length == 0 || Name->Buffer[0] != L'\\') {
+		return STATUS_OBJECT_NAME_INVALID;
+	}
+	if (IopFindName(Name) != NULL) {
+		return STATUS_OBJECT_NAME_COLLISION;
+	}
+	NameEntry = calloc(1, sizeof(IOP_NAME) + Name->Length + TargetLength);
+	if (NameEntry == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	NameEntry->Name.Buffer = (PWCH)(NameEntry + 1);
+	NameEntry->Name.Length = NameEntry->Name.MaximumLength = Name->Length;
+	RtlCopyMemory(NameEntry->Name.Buffer, Name->Buffer, Name->Length);
+	NameEntry->DeviceObject = DeviceObject;
+	if (Target != NULL) {
+		NameEntry->Target.Buffer = (PWCH)((PUCHAR)NameEntry->Name.Buffer + Name->Length);
+		NameEntry->Target.Length = NameEntry->Target.MaximumLength = TargetLength;
+		RtlCopyMemory(NameEntry->Target.Buffer, Target->Buffer, TargetLength);
+	}
+	InsertTailList(&IopNames, &NameEntry->Links);
+	return STATUS_SUCCESS;
+}
+
+//
+// Finds the device whose name is the longest prefix of Name, following
+// symbolic links, and returns it referenced. Remainder gets whatever follows
+// the device name, in a buffer of IOP_MAXIMUM_NAME characters.
+//
+static NTSTATUS IopLookupDevice(
+	_In_ PCUNICODE_STRING  Name,
+	_Out_ PDEVICE_OBJECT   *DeviceObject,
+	_Out_ PUNICODE_STRING  Remainder
+)
+{
+	WCHAR Buffers[2][IOP_MAXIMUM_NAME];
+	UNICODE_STRING Current = *Name;
+	ULONG Depth;
+
+	*DeviceObject = NULL;
+	pthread_mutex_lock(&IopDatabaseLock);
+	for (Depth = 0; Depth < IOP_MAXIMUM_LINK_DEPTH; Depth++) {
+		PIOP_NAME Match = NULL;
+		PLIST_ENTRY Entry;
+		USHORT Rest;
+
+		for (Entry = IopNames.Flink; Entry != &IopNames; Entry = Entry->Flink) {
+			PIOP_NAME Candidate = CONTAINING_RECORD(Entry, IOP_NAME, Links);
+			USHORT Length = Candidate->Name.Length;
+
+			if (RtlPrefixUnicodeString(&Candidate->Name, &Current, TRUE) &&
+				(Length == Current.Length || Current.Buffer[Length / sizeof(WCHAR)] == L'\\') &&
+				(Match == NULL || Length > Match->Name.Length)) {
+				Match = Candidate;
+			}
+		}
+		if (Match == NULL) {
+			break;
+		}
+
+		Rest = Current.Length - Match->Name.Length;
+		if (Match->DeviceObject != NULL) {
+			if (Rest > Remainder->MaximumLength) {
+				break;
+			}
+			RtlCopyMemory(Remainder->Buffer, Current.Buffer + Match->Name.Length / sizeof(WCHAR), Rest);
+			Remainder->Length = Rest;
+			*DeviceObject = Match->DeviceObject;
+			ObReferenceObject(*DeviceObject);
+			pthread_mutex_unlock(&IopDatabaseLock);
+			return STATUS_SUCCESS;
+		}
+
+		if (Match->Target.Length + Rest > sizeof(Buffers[0])) {
+			break;
+		}
+		RtlMoveMemory((PUCHAR)Buffers[Depth & 1] + Match->Target.Length,
+			Current.Buffer + Match->Name.Length / sizeof(WCHAR), Rest);
+		RtlCopyMemory(Buffers[Depth & 1], Match->Target.Buffer, Match->Target.Length);
+		Current.Buffer = Buffers[Depth & 1];
+		Current.Length = Current.MaximumLength = Match->Target.Length + Rest;
+	}
+	pthread_mutex_unlock(&IopDatabaseLock);
+	return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+NTSTATUS IoCreateSymbolicLink(
+	_In_ PUNICODE_STRING SymbolicLinkName,
+	_In_ PUNICODE_STRING DeviceName
+)
+{
+	NTSTATUS status;
+
+	pthread_mutex_lock(&IopDatabaseLock);
+	status = IopInsertName(SymbolicLinkName, NULL, DeviceName);
+	pthread_mutex_unlock(&IopDatabaseLock);
+	return status;
+}
+
+NTSTATUS IoDeleteSymbolicLink(
+	_In_ PUNICODE_STRING SymbolicLinkName
+)
+{
+	PIOP_NAME NameEntry;
+
+	pthread_mutex_lock(&IopDatabaseLock);
+	NameEntry = IopFindName(SymbolicLinkName);
+	if (NameEntry == NULL || NameEntry->DeviceObject != NULL) {
+		pthread_mutex_unlock(&IopDatabaseLock);
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	}
+	RemoveEntryList(&NameEntry->Links);
+	pthread_mutex_unlock(&IopDatabaseLock);
+	free(NameEntry);
+	return STATUS_SUCCESS;
+}
+
+/*
+	Handles and system threads
+*/
+
+//
+// Events and threads both start with a KEVENT.
+//
+static VOID ObpDeleteEvent(
+	_In_ PVOID Object
+)
+{
+	PRKEVENT Event = (PRKEVENT)Object;
+
+	pthread_cond_destroy(&Event->Signaled);
+	pthread_mutex_destroy(&Event->Lock);
+}
+
+//
+// Handles are small multiples of 4, as on Windows, and each one holds a
+// reference to its object, which it takes over from the caller.
+//
+static NTSTATUS ObpInsertHandle(
+	_In_ PVOID     Object,
+	_Out_ PHANDLE  Handle
+)
+{
+	ULONG Index;
+
+	pthread_mutex_lock(&ObpHandleLock);
+	for (Index = 0; Index < OBP_MAXIMUM_HANDLES; Index++) {
+		if (ObpHandles[Index] == NULL) {
+			ObpHandles[Index] = Object;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ObpHandleLock);
+
+	if (Index == OBP_MAXIMUM_HANDLES) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	*Handle = (HANDLE)(ULONG_PTR)((Index + 1) * 4);
+	return STATUS_SUCCESS;
+}
+
+//
+// Called with ObpHandleLock held.
+//
+static PVOID *ObpLookupHandle(
+	_In_ HANDLE Handle
+)
+{
+	ULONG_PTR Value = (ULONG_PTR)Handle;
+
+	if (Value == 0 || Value % 4 != 0 || Value / 4 > OBP_MAXIMUM_HANDLES || ObpHandles[Value / 4 - 1] == NULL) {
+		return NULL;
+	}
+	return &ObpHandles[Value / 4 - 1];
+}
+
+NTSTATUS ObReferenceObjectByHandle(
+	_In_ HANDLE                            Handle,
+	_In_ ACCESS_MASK                       DesiredAccess,
+	_In_opt_ POBJECT_TYPE                  ObjectType,
+	_In_ KPROCESSOR_MODE                   AccessMode,
+	_Out_ PVOID                            *Object,
+	_Out_opt_ POBJECT_HANDLE_INFORMATION   HandleInformation
+)
+{
+	PVOID *Entry;
+
+	UNREFERENCED_PARAMETER(AccessMode);
+
+	*Object = NULL;
+	pthread_mutex_lock(&ObpHandleLock);
+	Entry = ObpLookupHandle(Handle);
+	if (Entry == NULL) {
+		pthread_mutex_unlock(&ObpHandleLock);
+		return STATUS_INVALID_HANDLE;
+	}
+	if (ObjectType != NULL && OBJECT_TO_OBJECT_HEADER(*Entry)->Type != ObjectType) {
+		pthread_mutex_unlock(&ObpHandleLock);
+		return STATUS_OBJECT_TYPE_MISMATCH;
+	}
+	ObReferenceObject(*Entry);
+	*Object = *Entry;
+	pthread_mutex_unlock(&ObpHandleLock);
+
+	if (HandleInformation != NULL) {
+		HandleInformation->HandleAttributes = 0;
+		HandleInformation->GrantedAccess = DesiredAccess;
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwClose(
+	_In_ HANDLE Handle
+)
+{
+	PVOID *Entry;
+	PVOID Object;
+
+	pthread_mutex_lock(&ObpHandleLock);
+	Entry = ObpLookupHandle(Handle);
+	if (Entry == NULL) {
+		pthread_mutex_unlock(&ObpHandleLock);
+		return STATUS_INVALID_HANDLE;
+	}
+	Object = *Entry;
+	*Entry = NULL;
+	pthread_mutex_unlock(&ObpHandleLock);
+
+	ObDereferenceObject(Object);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwWaitForSingleObject(
+	_In_ HANDLE                Handle,
+	_In_ BOOLEAN               Alertable,
+	_In_opt_ PLARGE_INTEGER    Timeout
+)
+{
+	PVOID Object;
+	NTSTATUS status;
+
+	status = ObReferenceObjectByHandle(Handle, SYNCHRONIZE, NULL, KernelMode, &Object, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	status = KeWaitForSingleObject(Object, Executive, KernelMode, Alertable, Timeout);
+	ObDereferenceObject(Object);
+	return status;
+}
+
+static void *PspThreadStart(
+	_In_ void *Parameter
+)
+{
+	PETHREAD Thread = (PETHREAD)Parameter;
+
+	PspCurrentThread = Thread;
+	Thread->StartRoutine(Thread->StartContext);
+	PsTerminateSystemThread(STATUS_SUCCESS);
+	return NULL;
+}
+
+//
+// The thread holds a reference to itself until it exits, and the handle
+// another.
+//
+NTSTATUS PsCreateSystemThread(
+	_Out_ PHANDLE                  ThreadHandle,
+	_In_ ULONG                     DesiredAccess,
+	_In_opt_ POBJECT_ATTRIBUTES    ObjectAttributes,
+	_In_opt_ HANDLE                ProcessHandle,
+	_Out_opt_ PCLIENT_ID           ClientId,
+	_In_ PKSTART_ROUTINE           StartRoutine,
+	_In_opt_ PVOID                 StartContext
+)
+{
+	PETHREAD Thread = ObpCreateObject(sizeof(struct _ETHREAD), ObpDeleteEvent);
+	pthread_attr_t Attributes;
+	pthread_t Id;
+	NTSTATUS status;
+
+	UNREFERENCED_PARAMETER(DesiredAccess);
+	UNREFERENCED_PARAMETER(ObjectAttributes);
+	UNREFERENCED_PARAMETER(ProcessHandle);
+
+	if (Thread == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	OBJECT_TO_OBJECT_HEADER(Thread)->Type = ObpThreadType;
+	KeInitializeEvent(&Thread->Exited, NotificationEvent, FALSE);
+	Thread->StartRoutine = StartRoutine;
+	Thread->StartContext = StartContext;
+
+	ObReferenceObject(Thread);
+	status = ObpInsertHandle(Thread, ThreadHandle);
+	if (!NT_SUCCESS(status)) {
+		ObDereferenceObject(Thread);
+		ObDereferenceObject(Thread);
+		return status;
+	}
+
+	pthread_attr_init(&Attributes);
+	pthread_attr_setdetachstate(&Attributes, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&Id, &Attributes, PspThreadStart, Thread) != 0) {
+		ZwClose(*ThreadHandle);
+		ObDereferenceObject(Thread);
+		status = STATUS_INSUFFICIENT_RESOURCES;
+	}
+	pthread_attr_destroy(&Attributes);
+
+	if (NT_SUCCESS(status) && ClientId != NULL) {
+		ClientId->UniqueProcess = NULL;
+		ClientId->UniqueThread = *ThreadHandle;
+	}
+	return status;
+}
+
+NTSTATUS PsTerminateSystemThread(
+	_In_ NTSTATUS ExitStatus
+)
+{
+	PETHREAD Thread = PspCurrentThread;
+
+	UNREFERENCED_PARAMETER(ExitStatus);
+
+	if (Thread == NULL) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	PspCurrentThread = NULL;
+	KeSetEvent(&Thread->Exited, IO_NO_INCREMENT, FALSE);
+	ObDereferenceObject(Thread);
+	pthread_exit(NULL);
+}
+
+NTSTATUS WdmCreateEvent(
+	_Out_ PHANDLE      EventHandle,
+	_In_ EVENT_TYPE    Type,
+	_In_ BOOLEAN       InitialState
+)
+{
+	PRKEVENT Event = ObpCreateObject(sizeof(KEVENT), ObpDeleteEvent);
+	NTSTATUS status;
+
+	if (Event == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	OBJECT_TO_OBJECT_HEADER(Event)->Type = ObpEventType;
+	KeInitializeEvent(Event, Type, InitialState);
+
+	status = ObpInsertHandle(Event, EventHandle);
+	if (!NT_SUCCESS(status)) {
+		ObDereferenceObject(Event);
+	}
+	return status;
+}
+
+NTSTATUS WdmSetEvent(
+	_In_ HANDLE EventHandle
+)
+{
+	PRKEVENT Event;
+	NTSTATUS status;
+
+	IopCount(&IopGetThreadStats()->Requests);
+	status = ObReferenceObjectByHandle(EventHandle, EVENT_MODIFY_STATE, ObpEventType, UserMode, (PVOID *)&Event,
+		NULL);
+	if (NT_SUCCESS(status)) {
+		KeSetEvent(Event, IO_NO_INCREMENT, FALSE);
+		ObDereferenceObject(Event);
+	}
+	return status;
+}
+
+NTSTATUS WdmCloseHandle(
+	_In_ HANDLE Handle
+)
+{
+	return ZwClose(Handle);
+}
+
+/*
+	Devices and device stacks
+*/
+
+NTSTATUS IoCreateDevice(
+	_In_ PDRIVER_OBJECT        DriverObject,
+	_In_ ULONG                 DeviceExtensionSize,
+	_In_opt_ PUNICODE_STRING   DeviceName,
+	_In_ DEVICE_TYPE           DeviceType,
+	_In_ ULONG                 DeviceCharacteristics,
+	_In_ BOOLEAN               Exclusive,
+	_Out_ PDEVICE_OBJECT       *DeviceObject
+)
+{
+	PIOP_DEVICE Device = ObpCreateObject(sizeof(IOP_DEVICE) + DeviceExtensionSize, NULL);
+	NTSTATUS status = STATUS_SUCCESS;
+
+	*DeviceObject = NULL;
+	if (Device == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	Device->DeviceObject.Type = IO_TYPE_DEVICE;
+	Device->DeviceObject.Size = (USHORT)(sizeof(DEVICE_OBJECT) + DeviceExtensionSize);
+	Device->DeviceObject.DriverObject = DriverObject;
+	Device->DeviceObject.Flags = DO_DEVICE_INITIALIZING | (Exclusive ? DO_EXCLUSIVE : 0);
+	Device->DeviceObject.Characteristics = DeviceCharacteristics;
+	Device->DeviceObject.DeviceExtension = DeviceExtensionSize != 0 ? Device->Extension : NULL;
+	Device->DeviceObject.DeviceType = DeviceType;
+	Device->DeviceObject.StackSize = 1;
+	Device->DeviceObject.SectorSize = 512;
+
+	pthread_mutex_lock(&IopDatabaseLock);
+	if (DeviceName != NULL) {
+		status = IopInsertName(DeviceName, &Device->DeviceObject, NULL);
+	}
+	if (NT_SUCCESS(status)) {
+		Device->DeviceObject.NextDevice = DriverObject->DeviceObject;
+		DriverObject->DeviceObject = &Device->DeviceObject;
+	}
+	pthread_mutex_unlock(&IopDatabaseLock);
+
+	if (!NT_SUCCESS(status)) {
+		ObDereferenceObject(Device);
+		return status;
+	}
+	*DeviceObject = &Device->DeviceObject;
+	return STATUS_SUCCESS;
+}
+
+//
+// The device leaves the namespace and its driver's list at once, and is
+// freed with its last reference.
+//
+VOID IoDeleteDevice(
+	_In_ PDEVICE_OBJECT DeviceObject
+)
+{
+	PDEVICE_OBJECT *Link;
+	PLIST_ENTRY Entry;
+
+	pthread_mutex_lock(&IopDatabaseLock);
+	for (Entry = IopNames.Flink; Entry != &IopNames; Entry = Entry->Flink) {
+		PIOP_NAME NameEntry = CONTAINING_RECORD(Entry, IOP_NAME, Links);
+
+		if (NameEntry->DeviceObject == DeviceObject) {
+			RemoveEntryList(&NameEntry->Links);
+			free(NameEntry);
+			break;
+		}
+	}
+	for (Link = &DeviceObject->DriverObject->DeviceObject; *Link != NULL; Link = &(*Link)->NextDevice) {
+		if (*Link == DeviceObject) {
+			*Link = DeviceObject->NextDevice;
+			break;
+		}
+	}
+	IOP_DEVICE_FROM_OBJECT(DeviceObject)->DeletePending = TRUE;
+	pthread_mutex_unlock(&IopDatabaseLock);
+
+	ObDereferenceObject(DeviceObject);
+}
+
+PDEVICE_OBJECT IoGetAttachedDevice(
+	_In_ PDEVICE_OBJECT DeviceObject
+)
+{
+	while (DeviceObject->AttachedDevice != NULL) {
+		DeviceObject = DeviceObject->AttachedDevice;
+	}
+	return DeviceObject;
+}
+
+PDEVICE_OBJECT IoGetAttachedDeviceReference(
+	_In_ PDEVICE_OBJECT DeviceObject
+)
+{
+	pthread_mutex_lock(&IopDatabaseLock);
+	DeviceObject = IoGetAttachedDevice(DeviceObject);
+	ObReferenceObject(DeviceObject);
+	pthread_mutex_unlock(&IopDatabaseLock);
+	return DeviceObject;
+}
+
+PDEVICE_OBJECT IoGetLowerDeviceObject(
+	_In_ PDEVICE_OBJECT DeviceObject
+)
+{
+	PDEVICE_OBJECT Lower;
+
+	pthread_mutex_lock(&IopDatabaseLock);
+	Lower = IOP_DEVICE_FROM_OBJECT(DeviceObject)->AttachedTo;
+	if (Lower != NULL) {
+		ObReferenceObject(Lower);
+	}
+	pthread_mutex_unlock(&IopDatabaseLock);
+	return Lower;
+}
+
+//
+// Attaches to the top of TargetDevice's stack and sets *AttachedToDeviceObject
+// under the same lock, so the source never sees a request before it knows
+// where to pass it. Fails while that top device is still initializing or is
+// being deleted.
+//
+NTSTATUS IoAttachDeviceToDeviceStackSafe(
+	_In_ PDEVICE_OBJECT    SourceDevice,
+	_In_ PDEVICE_OBJECT    TargetDevice,
+	_Out_ PDEVICE_OBJECT   *AttachedToDeviceObject
+)
+{
+	PDEVICE_OBJECT Top;
+
+	pthread_mutex_lock(&IopDatabaseLock);
+	Top = IoGetAttachedDevice(TargetDevice);
+	if (FlagOn(Top->Flags, DO_DEVICE_INITIALIZING) || IOP_DEVICE_FROM_OBJECT(Top)->DeletePending) {
+		pthread_mutex_unlock(&IopDatabaseLock);
+		*AttachedToDeviceObject = NULL;
+		return STATUS_NO_SUCH_DEVICE;
+	}
+	Top->AttachedDevice = SourceDevice;
+	SourceDevice->StackSize = Top->StackSize + 1;
+	SourceDevice->AlignmentRequirement = Top->AlignmentRequirement;
+	SourceDevice->SectorSize = Top->SectorSize;
+	IOP_DEVICE_FROM_OBJECT(SourceDevice)->AttachedTo = Top;
+	*AttachedToDeviceObject = Top;
+	pthread_mutex_unlock(&IopDatabaseLock);
+	return STATUS_SUCCESS;
+}
+
+PDEVICE_OBJECT IoAttachDeviceToDeviceStack(
+	_In_ PDEVICE_OBJECT SourceDevice,
+	_In_ PDEVICE_OBJECT TargetDevice
+)
+{
+	PDEVICE_OBJECT AttachedTo;
+
+	return NT_SUCCESS(IoAttachDeviceToDeviceStackSafe(SourceDevice, TargetDevice, &AttachedTo)) ? AttachedTo : NULL;
+}
+
+//
+// Windows opens the target to find it, sending its stack a create and a
+// close; here it is only looked up.
+//
+NTSTATUS IoAttachDevice(
+	_In_ PDEVICE_OBJECT    SourceDevice,
+	_In_ PUNICODE_STRING   TargetDevice,
+	_Out_ PDEVICE_OBJECT   *AttachedDevice
+)
+{
+	WCHAR Buffer[IOP_MAXIMUM_NAME];
+	UNICODE_STRING Remainder = { 0, sizeof(Buffer), Buffer };
+	PDEVICE_OBJECT Target;
+	NTSTATUS status;
+
+	*AttachedDevice = NULL;
+	status = IopLookupDevice(TargetDevice, &Target, &Remainder);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	status = IoAttachDeviceToDeviceStackSafe(SourceDevice, Target, AttachedDevice);
+	ObDereferenceObject(Target);
+	return status;
+}
+
+VOID IoDetachDevice(
+	_In_ PDEVICE_OBJECT TargetDevice
+)
+{
+	pthread_mutex_lock(&IopDatabaseLock);
+	if (TargetDevice->AttachedDevice != NULL) {
+		IOP_DEVICE_FROM_OBJECT(TargetDevice->AttachedDevice)->AttachedTo = NULL;
+		TargetDevice->AttachedDevice = NULL;
+	}
+	pthread_mutex_unlock(&IopDatabaseLock);
+}
+
+NTSTATUS IoEnumerateDeviceObjectList(
+	_In_ PDRIVER_OBJECT    DriverObject,
+	_Out_ PDEVICE_OBJECT   *DeviceObjectList,
+	_In_ ULONG             DeviceObjectListSize,
+	_Out_ PULONG           ActualNumberDeviceObjects
+)
+{
+	PDEVICE_OBJECT DeviceObject;
+	ULONG Count = 0;
+
+	pthread_mutex_lock(&IopDatabaseLock);
+	for (DeviceObject = DriverObject->DeviceObject; DeviceObject != NULL; DeviceObject = DeviceObject->NextDevice) {
+		Count++;
+	}
+	*ActualNumberDeviceObjects = Count;
+	if (Count * sizeof(PDEVICE_OBJECT) > DeviceObjectListSize) {
+		pthread_mutex_unlock(&IopDatabaseLock);
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+	for (DeviceObject = DriverObject->DeviceObject; DeviceObject != NULL; DeviceObject = DeviceObject->NextDevice) {
+		ObReferenceObject(DeviceObject);
+		*DeviceObjectList++ = DeviceObject;
+	}
+	pthread_mutex_unlock(&IopDatabaseLock);
+	return STATUS_SUCCESS;
+}
+
+/*
+	File systems
+*/
+
+NTSTATUS IoRegisterFsRegistrationChange(
+	_In_ PDRIVER_OBJECT            DriverObject,
+	_In_ PDRIVER_FS_NOTIFICATION   DriverNotificationRoutine
+)
+{
+	PIOP_FS_NOTIFICATION Notification = calloc(1, sizeof(IOP_FS_NOTIFICATION));
+	PLIST_ENTRY Entry;
+
+	if (Notification == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	Notification->DriverObject = DriverObject;
+	Notification->Routine = DriverNotificationRoutine;
+
+	pthread_mutex_lock(&IopFileSystemLock);
+	InsertTailList(&IopFsNotifications, &Notification->Links);
+	for (Entry = IopFileSystems.Flink; Entry != &IopFileSystems; Entry = Entry->Flink) {
+		DriverNotificationRoutine(CONTAINING_RECORD(Entry, IOP_FILE_SYSTEM, Links)->DeviceObject, TRUE);
+	}
+	pthread_mutex_unlock(&IopFileSystemLock);
+	return STATUS_SUCCESS;
+}
+
+VOID IoUnregisterFsRegistrationChange(
+	_In_ PDRIVER_OBJECT            DriverObject,
+	_In_ PDRIVER_FS_NOTIFICATION   DriverNotificationRoutine
+)
+{
+	PLIST_ENTRY Entry;
+
+	pthread_mutex_lock(&IopFileSystemLock);
+	for (Entry = IopFsNotifications.Flink; Entry != &IopFsNotifications; Entry = Entry->Flink) {
+		PIOP_FS_NOTIFICATION Notification = CONTAINING_RECORD(Entry, IOP_FS_NOTIFICATION, Links);
+
+		if (Notification->DriverObject == DriverObject && Notification->Routine == DriverNotificationRoutine) {
+			RemoveEntryList(&Notification->Links);
+			free(Notification);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&IopFileSystemLock);
+}
+
+VOID IoRegisterFileSystem(
+	_In_ PDEVICE_OBJECT DeviceObject
+)
+{
+	PIOP_FILE_SYSTEM FileSystem = calloc(1, sizeof(IOP_FILE_SYSTEM));
+	PLIST_ENTRY Entry;
+
+	if (FileSystem == NULL) {
+		KeBugCheckEx(0, 0, 0, 0, 0);
+	}
+	FileSystem->DeviceObject = DeviceObject;
+
+	pthread_mutex_lock(&IopFileSystemLock);
+	InsertTailList(&IopFileSystems, &FileSystem->Links);
+	for (Entry = IopFsNotifications.Flink; Entry != &IopFsNotifications; Entry = Entry->Flink) {
+		CONTAINING_RECORD(Entry, IOP_FS_NOTIFICATION, Links)->Routine(DeviceObject, TRUE);
+	}
+	pthread_mutex_unlock(&IopFileSystemLock);
+}
+
+VOID IoUnregisterFileSystem(
+	_In_ PDEVICE_OBJECT DeviceObject
+)
+{
+	PLIST_ENTRY Entry;
+
+	pthread_mutex_lock(&IopFileSystemLock);
+	for (Entry = IopFileSystems.Flink; Entry != &IopFileSystems; Entry = Entry->Flink) {
+		PIOP_FILE_SYSTEM FileSystem = CONTAINING_RECORD(Entry, IOP_FILE_SYSTEM, Links);
+
+		if (FileSystem->DeviceObject == DeviceObject) {
+			RemoveEntryList(&FileSystem->Links);
+			free(FileSystem);
+			break;
+		}
+	}
+	for (Entry = IopFsNotifications.Flink; Entry != &IopFsNotifications; Entry = Entry->Flink) {
+		CONTAINING_RECORD(Entry, IOP_FS_NOTIFICATION, Links)->Routine(DeviceObject, FALSE);
+	}
+	pthread_mutex_unlock(&IopFileSystemLock);
+}
+
+/*
+	Memory descriptor lists
+*/
+
+PMDL IoAllocateMdl(
+	_In_opt_ PVOID     VirtualAddress,
+	_In_ ULONG         Length,
+	_In_ BOOLEAN       SecondaryBuffer,
+	_In_ BOOLEAN       ChargeQuota,
+	_Inout_opt_ PIRP   Irp
+)
+{
+	PMDL Mdl = malloc(sizeof(MDL));
+
+	UNREFERENCED_PARAMETER(ChargeQuota);
+
+	if (Mdl == NULL) {
+		return NULL;
+	}
+	Mdl->Next = NULL;
+	Mdl->Size = sizeof(MDL);
+	Mdl->MdlFlags = 0;
+	Mdl->Process = NULL;
+	Mdl->MappedSystemVa = NULL;
+	Mdl->StartVa = PAGE_ALIGN(VirtualAddress);
+	Mdl->ByteCount = Length;
+	Mdl->ByteOffset = BYTE_OFFSET(VirtualAddress);
+
+	if (Irp != NULL) {
+		if (SecondaryBuffer && Irp->MdlAddress != NULL) {
+			PMDL Last = Irp->MdlAddress;
+
+			while (Last->Next != NULL) {
+				Last = Last->Next;
+			}
+			Last->Next = Mdl;
+		}
+		else {
+			Irp->MdlAddress = Mdl;
+		}
+	}
+	return Mdl;
+}
+
+VOID IoFreeMdl(
+	_In_ PMDL Mdl
+)
+{
+	free(Mdl);
+}
+
+//
+// Nothing can be paged out, so locking only records that it was done.
+//
+VOID MmProbeAndLockPages(
+	_Inout_ PMDL               Mdl,
+	_In_ KPROCESSOR_MODE       AccessMode,
+	_In_ LOCK_OPERATION        Operation
+)
+{
+	UNREFERENCED_PARAMETER(AccessMode);
+	UNREFERENCED_PARAMETER(Operation);
+
+	Mdl->MdlFlags |= MDL_PAGES_LOCKED;
+}
+
+VOID MmUnlockPages(
+	_Inout_ PMDL Mdl
+)
+{
+	Mdl->MdlFlags &= ~(MDL_PAGES_LOCKED | MDL_MAPPED_TO_SYSTEM_VA);
+}
+
+VOID MmBuildMdlForNonPagedPool(
+	_Inout_ PMDL Mdl
+)
+{
+	Mdl->MappedSystemVa = MmGetMdlVirtualAddress(Mdl);
+	Mdl->MdlFlags |= MDL_SOURCE_IS_NONPAGED_POOL;
+}
+
+PVOID MmMapLockedPagesSpecifyCache(
+	_Inout_ PMDL               Mdl,
+	_In_ KPROCESSOR_MODE       AccessMode,
+	_In_ MEMORY_CACHING_TYPE   CacheType,
+	_In_opt_ PVOID             RequestedAddress,
+	_In_ ULONG                 BugCheckOnFailure,
+	_In_ ULONG                 Priority
+)
+{
+	UNREFERENCED_PARAMETER(CacheType);
+	UNREFERENCED_PARAMETER(RequestedAddress);
+	UNREFERENCED_PARAMETER(BugCheckOnFailure);
+	UNREFERENCED_PARAMETER(Priority);
+
+	if (AccessMode == UserMode) {
+		return MmGetMdlVirtualAddress(Mdl);
+	}
+	Mdl->MappedSystemVa = MmGetMdlVirtualAddress(Mdl);
+	Mdl->MdlFlags |= MDL_MAPPED_TO_SYSTEM_VA;
+	return Mdl->MappedSystemVa;
+}
+
+VOID MmUnmapLockedPages(
+	_In_ PVOID     BaseAddress,
+	_Inout_ PMDL   Mdl
+)
+{
+	if ((Mdl->MdlFlags & MDL_MAPPED_TO_SYSTEM_VA) && BaseAddress == Mdl->MappedSystemVa) {
+		Mdl->MdlFlags &= ~MDL_MAPPED_TO_SYSTEM_VA;
+	}
+}
+
+/*
+	IRPs
+*/
+
+PIRP IoAllocateIrp(
+	_In_ CCHAR     StackSize,
+	_In_ BOOLEAN   ChargeQuota
+)
+{
+	PIOP_IRP IopIrp = malloc(sizeof(IOP_IRP) + StackSize * sizeof(IO_STACK_LOCATION));
+	PIRP Irp;
+
+	UNREFERENCED_PARAMETER(ChargeQuota);
+
+	if (IopIrp == NULL) {
+		return NULL;
+	}
+	IopCount(&IopGetThreadStats()->IrpsAllocated);
+	IopIrp->OutputLength = 0;
+	IopIrp->ReferenceCount = 1;
+	Irp = &IopIrp->Irp;
+	RtlZeroMemory(Irp, IoSizeOfIrp(StackSize));
+	Irp->Type = IO_TYPE_IRP;
+	Irp->Size = IoSizeOfIrp(StackSize);
+	Irp->StackCount = StackSize;
+	Irp->CurrentLocation = StackSize + 1;
+	Irp->Tail.Overlay.CurrentStackLocation = (PIO_STACK_LOCATION)(Irp + 1) + StackSize;
+	InitializeListHead(&Irp->ThreadListEntry);
+	return Irp;
+}
+
+VOID IoFreeIrp(
+	_In_ PIRP Irp
+)
+{
+	free(IOP_IRP_FROM_IRP(Irp));
+}
+
+static VOID IopDereferenceIrp(
+	_In_ PIRP Irp
+)
+{
+	if (InterlockedDecrement(&IOP_IRP_FROM_IRP(Irp)->ReferenceCount) == 0) {
+		IoFreeIrp(Irp);
+	}
+}
+
+NTSTATUS IoCallDriver(
+	_In_ PDEVICE_OBJECT    DeviceObject,
+	_Inout_ PIRP           Irp
+)
+{
+	PIO_STACK_LOCATION IoStack;
+
+	IoSetNextIrpStackLocation(Irp);
+	if (Irp->CurrentLocation <= 0) {
+		KeBugCheckEx(NO_MORE_IRP_STACK_LOCATIONS, (ULONG_PTR)Irp, 0, 0, 0);
+	}
+	IoStack = IoGetCurrentIrpStackLocation(Irp);
+	IoStack->DeviceObject = DeviceObject;
+	return DeviceObject->DriverObject->MajorFunction[IoStack->MajorFunction](DeviceObject, Irp);
+}
+
+//
+// The I/O manager's share of completion, once every driver is done: copies
+// buffered output back, releases what it allocated for the request, and
+// tells the requester.
+//
+static VOID IopCompleteRequest(
+	_In_ PIRP Irp
+)
+{
+	PIO_APC_ROUTINE ApcRoutine = Irp->Overlay.AsynchronousParameters.UserApcRoutine;
+	PVOID ApcContext = Irp->Overlay.AsynchronousParameters.UserApcContext;
+	PIO_STATUS_BLOCK UserIosb = Irp->UserIosb;
+	PKEVENT UserEvent = Irp->UserEvent;
+	PMDL Mdl;
+
+	if (FlagOn(Irp->Flags, IRP_BUFFERED_IO)) {
+		if (FlagOn(Irp->Flags, IRP_INPUT_OPERATION) && ((ULONG)Irp->IoStatus.Status >> 30) != 3 &&
+			Irp->IoStatus.Information != 0) {
+			RtlCopyMemory(Irp->UserBuffer, Irp->AssociatedIrp.SystemBuffer,
+				min(Irp->IoStatus.Information, IOP_IRP_FROM_IRP(Irp)->OutputLength));
+		}
+		if (FlagOn(Irp->Flags, IRP_DEALLOCATE_BUFFER)) {
+			ExFreePool(Irp->AssociatedIrp.SystemBuffer);
+		}
+	}
+	while ((Mdl = Irp->MdlAddress) != NULL) {
+		Irp->MdlAddress = Mdl->Next;
+		MmUnlockPages(Mdl);
+		IoFreeMdl(Mdl);
+	}
+	if (UserIosb != NULL) {
+		*UserIosb = Irp->IoStatus;
+	}
+	if (!IsListEmpty(&Irp->ThreadListEntry)) {
+		PFILE_OBJECT FileObject = Irp->Tail.Overlay.OriginalFileObject;
+		PIOP_FILE File = IOP_FILE_FROM_OBJECT(FileObject);
+
+		pthread_mutex_lock(&File->Lock);
+		RemoveEntryList(&Irp->ThreadListEntry);
+		InitializeListHead(&Irp->ThreadListEntry);
+		pthread_mutex_unlock(&File->Lock);
+		ObDereferenceObject(FileObject);
+		IopDereferenceIrp(Irp);
+	}
+	else {
+		IoFreeIrp(Irp);
+	}
+
+	if (ApcRoutine != NULL) {
+		ApcRoutine(ApcContext, UserIosb, 0);
+	}
+	if (UserEvent != NULL) {
+		KeSetEvent(UserEvent, IO_NO_INCREMENT, FALSE);
+	}
+}
+
+//
+// Walks back up the stack, calling each completion routine that asked for
+// this outcome with the device of the driver that set it, and propagating
+// SL_PENDING_RETURNED to the drivers that set none.
+//
+VOID IoCompleteRequest(
+	_In_ PIRP  Irp,
+	_In_ CCHAR PriorityBoost
+)
+{
+	PIO_STACK_LOCATION IoStack;
+
+	UNREFERENCED_PARAMETER(PriorityBoost);
+
+	if (Irp->CurrentLocation > Irp->StackCount + 1 || Irp->Type != IO_TYPE_IRP) {
+		KeBugCheckEx(MULTIPLE_IRP_COMPLETE_REQUESTS, (ULONG_PTR)Irp, 0, 0, 0);
+	}
+	if (Irp->CancelRoutine != NULL) {
+		KeBugCheckEx(CANCEL_STATE_IN_COMPLETED_IRP, (ULONG_PTR)Irp, (ULONG_PTR)Irp->CancelRoutine, 0, 0);
+	}
+	for (IoStack = IoGetCurrentIrpStackLocation(Irp); Irp->CurrentLocation <= Irp->StackCount; IoStack++) {
+		PIO_COMPLETION_ROUTINE CompletionRoutine = IoStack->CompletionRoutine;
+		UCHAR Control = IoStack->Control;
+
+		IoSkipCurrentIrpStackLocation(Irp);
+		Irp->PendingReturned = FlagOn(Control, SL_PENDING_RETURNED) != 0;
+		IoStack->CompletionRoutine = NULL;
+		IoStack->Control = 0;
+
+		if (CompletionRoutine != NULL &&
+			((NT_SUCCESS(Irp->IoStatus.Status) && FlagOn(Control, SL_INVOKE_ON_SUCCESS)) ||
+			(!NT_SUCCESS(Irp->IoStatus.Status) && FlagOn(Control, SL_INVOKE_ON_ERROR)) ||
+			(Irp->Cancel && FlagOn(Control, SL_INVOKE_ON_CANCEL)))) {
+			PDEVICE_OBJECT DeviceObject = Irp->CurrentLocation == Irp->StackCount + 1 ?
+				NULL : IoGetCurrentIrpStackLocation(Irp)->DeviceObject;
+
+			if (CompletionRoutine(DeviceObject, Irp, IoStack->Context) == STATUS_MORE_PROCESSING_REQUIRED) {
+				return;
+			}
+		}
+		else if (Irp->CurrentLocation <= Irp->StackCount && Irp->PendingReturned) {
+			IoMarkIrpPending(Irp);
+		}
+	}
+	Irp->Type = 0;
+	IopCompleteRequest(Irp);
+}
+
+VOID IoAcquireCancelSpinLock(
+	_Out_ PKIRQL Irql
+)
+{
+	KeAcquireSpinLock(&IopCancelSpinLock, Irql);
+}
+
+VOID IoReleaseCancelSpinLock(
+	_In_ KIRQL Irql
+)
+{
+	KeReleaseSpinLock(&IopCancelSpinLock, Irql);
+}
+
+//
+// Marks the IRP cancelled and, if a cancel routine is set, takes it off the
+// IRP and calls it. The caller keeps the IRP from being freed meanwhile.
+//
+BOOLEAN IoCancelIrp(
+	_In_ PIRP Irp
+)
+{
+	PDRIVER_CANCEL CancelRoutine;
+	KIRQL Irql;
+
+	IoAcquireCancelSpinLock(&Irql);
+	Irp->Cancel = TRUE;
+	CancelRoutine = IoSetCancelRoutine(Irp, NULL);
+	if (CancelRoutine == NULL) {
+		IoReleaseCancelSpinLock(Irql);
+		return FALSE;
+	}
+	Irp->CancelIrql = Irql;
+	CancelRoutine(IoGetCurrentIrpStackLocation(Irp)->DeviceObject, Irp);
+	return TRUE;
+}
+
+static NTSTATUS IopInvalidDeviceRequest(
+	_In_ PDEVICE_OBJECT    DeviceObject,
+	_Inout_ PIRP           Irp
+)
+{
+	UNREFERENCED_PARAMETER(DeviceObject);
+
+	Irp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return STATUS_INVALID_DEVICE_REQUEST;
+}
+
+/*
+	Cancel-safe queues
+*/
+
+//
+// DriverContext[3] holds the IRP's IO_CSQ_IRP_CONTEXT if it was queued with
+// one, or else the queue itself; the Type both start with tells them apart.
+//
+static PIO_CSQ IopCsqFromIrp(
+	_In_ PIRP Irp
+)
+{
+	PIO_CSQ_IRP_CONTEXT Context = Irp->Tail.Overlay.DriverContext[3];
+
+	if (Context->Type == IO_TYPE_CSQ_IRP_CONTEXT) {
+		return Context->Csq;
+	}
+	return (PIO_CSQ)Context;
+}
+
+//
+// Called with the queue's lock held, once the IRP's cancel routine has been
+// taken off it by whoever is removing it.
+//
+static VOID IopCsqRemove(
+	_In_ PIO_CSQ   Csq,
+	_In_ PIRP      Irp
+)
+{
+	PIO_CSQ_IRP_CONTEXT Context = Irp->Tail.Overlay.DriverContext[3];
+
+	Csq->CsqRemoveIrp(Csq, Irp);
+	if (Context->Type == IO_TYPE_CSQ_IRP_CONTEXT) {
+		Context->Irp = NULL;
+	}
+	Irp->Tail.Overlay.DriverContext[3] = NULL;
+}
+
+static VOID IopCsqCancelRoutine(
+	_In_ PDEVICE_OBJECT    DeviceObject,
+	_Inout_ PIRP           Irp
+)
+{
+	PIO_CSQ Csq = IopCsqFromIrp(Irp);
+	KIRQL Irql;
+
+	UNREFERENCED_PARAMETER(DeviceObject);
+
+	IoReleaseCancelSpinLock(Irp->CancelIrql);
+	Csq->CsqAcquireLock(Csq, &Irql);
+	IopCsqRemove(Csq, Irp);
+	Csq->CsqReleaseLock(Csq, Irql);
+	Csq->CsqCompleteCanceledIrp(Csq, Irp);
+}
+
+NTSTATUS IoCsqInitialize(
+	_Out_ PIO_CSQ                          Csq,
+	_In_ PIO_CSQ_INSERT_IRP                CsqInsertIrp,
+	_In_ PIO_CSQ_REMOVE_IRP                CsqRemoveIrp,
+	_In_ PIO_CSQ_PEEK_NEXT_IRP             CsqPeekNextIrp,
+	_In_ PIO_CSQ_ACQUIRE_LOCK              CsqAcquireLock,
+	_In_ PIO_CSQ_RELEASE_LOCK              CsqReleaseLock,
+	_In_ PIO_CSQ_COMPLETE_CANCELED_IRP     CsqCompleteCanceledIrp
+)
+{
+	Csq->Type = IO_TYPE_CSQ;
+	Csq->CsqInsertIrp = (PVOID)CsqInsertIrp;
+	Csq->CsqRemoveIrp = CsqRemoveIrp;
+	Csq->CsqPeekNextIrp = CsqPeekNextIrp;
+	Csq->CsqAcquireLock = CsqAcquireLock;
+	Csq->CsqReleaseLock = CsqReleaseLock;
+	Csq->CsqCompleteCanceledIrp = CsqCompleteCanceledIrp;
+	Csq->ReservePointer = NULL;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS IoCsqInitializeEx(
+	_Out_ PIO_CSQ                          Csq,
+	_In_ PIO_CSQ_INSERT_IRP_EX             CsqInsertIrp,
+	_In_ PIO_CSQ_REMOVE_IRP                CsqRemoveIrp,
+	_In_ PIO_CSQ_PEEK_NEXT_IRP             CsqPeekNextIrp,
+	_In_ PIO_CSQ_ACQUIRE_LOCK              CsqAcquireLock,
+	_In_ PIO_CSQ_RELEASE_LOCK              CsqReleaseLock,
+	_In_ PIO_CSQ_COMPLETE_CANCELED_IRP     CsqCompleteCanceledIrp
+)
+{
+	IoCsqInitialize(Csq, NULL, CsqRemoveIrp, CsqPeekNextIrp, CsqAcquireLock, CsqReleaseLock,
+		CsqCompleteCanceledIrp);
+	Csq->Type = IO_TYPE_CSQ_EX;
+	Csq->CsqInsertIrp = (PVOID)CsqInsertIrp;
+	return STATUS_SUCCESS;
+}
+
+//
+// Marks the IRP pending once it is queued. An IRP cancelled before its
+// cancel routine was set is completed as cancelled right away.
+//
+NTSTATUS IoCsqInsertIrpEx(
+	_Inout_ PIO_CSQ                    Csq,
+	_Inout_ PIRP                       Irp,
+	_Out_opt_ PIO_CSQ_IRP_CONTEXT      Context,
+	_In_opt_ PVOID                     InsertContext
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	KIRQL Irql;
+
+	if (Context != NULL) {
+		Context->Type = IO_TYPE_CSQ_IRP_CONTEXT;
+		Context->Irp = Irp;
+		Context->Csq = Csq;
+		Irp->Tail.Overlay.DriverContext[3] = Context;
+	}
+	else {
+		Irp->Tail.Overlay.DriverContext[3] = Csq;
+	}
+
+	Csq->CsqAcquireLock(Csq, &Irql);
+	if (Csq->Type == IO_TYPE_CSQ_EX) {
+		status = ((PIO_CSQ_INSERT_IRP_EX)Csq->CsqInsertIrp)(Csq, Irp, InsertContext);
+	}
+	else {
+		((PIO_CSQ_INSERT_IRP)Csq->CsqInsertIrp)(Csq, Irp);
+	}
+	if (!NT_SUCCESS(status)) {
+		Csq->CsqReleaseLock(Csq, Irql);
+		if (Context != NULL) {
+			Context->Irp = NULL;
+		}
+		Irp->Tail.Overlay.DriverContext[3] = NULL;
+		return status;
+	}
+
+	IoMarkIrpPending(Irp);
+	IoSetCancelRoutine(Irp, IopCsqCancelRoutine);
+	if (Irp->Cancel && IoSetCancelRoutine(Irp, NULL) != NULL) {
+		IopCsqRemove(Csq, Irp);
+		Csq->CsqReleaseLock(Csq, Irql);
+		Csq->CsqCompleteCanceledIrp(Csq, Irp);
+		return status;
+	}
+	Csq->CsqReleaseLock(Csq, Irql);
+	return status;
+}
+
+VOID IoCsqInsertIrp(
+	_Inout_ PIO_CSQ                    Csq,
+	_Inout_ PIRP                       Irp,
+	_Out_opt_ PIO_CSQ_IRP_CONTEXT      Context
+)
+{
+	IoCsqInsertIrpEx(Csq, Irp, Context, NULL);
+}
+
+//
+// Returns the first IRP the queue's peek routine offers that is not being
+// cancelled, taken off the queue, or NULL.
+//
+PIRP IoCsqRemoveNextIrp(
+	_Inout_ PIO_CSQ    Csq,
+	_In_opt_ PVOID     PeekContext
+)
+{
+	PIRP Irp;
+	KIRQL Irql;
+
+	Csq->CsqAcquireLock(Csq, &Irql);
+	for (Irp = Csq->CsqPeekNextIrp(Csq, NULL, PeekContext); Irp != NULL;
+		Irp = Csq->CsqPeekNextIrp(Csq, Irp, PeekContext)) {
+		if (IoSetCancelRoutine(Irp, NULL) != NULL) {
+			IopCsqRemove(Csq, Irp);
+			break;
+		}
+	}
+	Csq->CsqReleaseLock(Csq, Irql);
+	return Irp;
+}
+
+PIRP IoCsqRemoveIrp(
+	_Inout_ PIO_CSQ                Csq,
+	_Inout_ PIO_CSQ_IRP_CONTEXT    Context
+)
+{
+	PIRP Irp;
+	KIRQL Irql;
+
+	Csq->CsqAcquireLock(Csq, &Irql);
+	Irp = Context->Irp;
+	if (Irp != NULL) {
+		if (IoSetCancelRoutine(Irp, NULL) != NULL) {
+			IopCsqRemove(Csq, Irp);
+		}
+		else {
+			Irp = NULL;
+		}
+	}
+	Csq->CsqReleaseLock(Csq, Irql);
+	return Irp;
+}
+
+/*
+	Drivers
+*/
+
+static VOID IopDeleteDriver(
+	_In_ PVOID Object
+)
+{
+	UNREFERENCED_PARAMETER(Object);
+}
+
+NTSTATUS WdmLoadDriver(
+	_In_ PDRIVER_INITIALIZE    DriverInit,
+	_In_ PCWSTR                DriverName,
+	_Out_ PDRIVER_OBJECT       *DriverObject
+)
+{
+	static const WCHAR ServicesKey[] = L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\";
+	SIZE_T NameLength = wcslen(DriverName);
+	PCWSTR ServiceName = DriverName + NameLength;
+	SIZE_T ServiceLength;
+	PDRIVER_OBJECT Driver;
+	UNICODE_STRING RegistryPath;
+	PDEVICE_OBJECT DeviceObject;
+	NTSTATUS status;
+	ULONG Index;
+
+	*DriverObject = NULL;
+	while (ServiceName != DriverName && ServiceName[-1] != L'\\') {
+		ServiceName--;
+	}
+	ServiceLength = DriverName + NameLength - ServiceName;
+
+	Driver = ObpCreateObject(sizeof(DRIVER_OBJECT) + (NameLength + RTL_NUMBER_OF(ServicesKey) + ServiceLength) *
+		sizeof(WCHAR), IopDeleteDriver);
+	if (Driver == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	Driver->Type = IO_TYPE_DRIVER;
+	Driver->Size = sizeof(DRIVER_OBJECT);
+	Driver->DriverInit = DriverInit;
+	Driver->DriverName.Buffer = (PWCH)(Driver + 1);
+	Driver->DriverName.Length = Driver->DriverName.MaximumLength = (USHORT)(NameLength * sizeof(WCHAR));
+	RtlCopyMemory(Driver->DriverName.Buffer, DriverName, NameLength * sizeof(WCHAR));
+	for (Index = 0; Index <= IRP_MJ_MAXIMUM_FUNCTION; Index++) {
+		Driver->MajorFunction[Index] = IopInvalidDeviceRequest;
+	}
+
+	RegistryPath.Buffer = Driver->DriverName.Buffer + NameLength;
+	RegistryPath.Length = RegistryPath.MaximumLength =
+		(USHORT)((RTL_NUMBER_OF(ServicesKey) - 1 + ServiceLength) * sizeof(WCHAR));
+	RtlCopyMemory(RegistryPath.Buffer, ServicesKey, sizeof(ServicesKey) - sizeof(WCHAR));
+	RtlCopyMemory(RegistryPath.Buffer + RTL_NUMBER_OF(ServicesKey) - 1, ServiceName, ServiceLength * sizeof(WCHAR));
+
+	status = DriverInit(Driver, &RegistryPath);
+	if (!NT_SUCCESS(status)) {
+		if (Driver->DeviceObject != NULL) {
+			DbgPrint("WdmShim: %wZ failed to load with 0x%08X and left devices behind\n", &Driver->DriverName,
+				status);
+		}
+		else {
+			ObDereferenceObject(Driver);
+		}
+		return status;
+	}
+
+	//
+	// As the I/O manager does, the devices created while loading are made
+	// ready on the driver's behalf.
+	//
+	pthread_mutex_lock(&IopDatabaseLock);
+	for (DeviceObject = Driver->DeviceObject; DeviceObject != NULL; DeviceObject = DeviceObject->NextDevice) {
+		ClearFlag(DeviceObject->Flags, DO_DEVICE_INITIALIZING);
+	}
+	pthread_mutex_unlock(&IopDatabaseLock);
+
+	*DriverObject = Driver;
+	return status;
+}
+
+VOID WdmUnloadDriver(
+	_In_ PDRIVER_OBJECT DriverObject
+)
+{
+	if (DriverObject->DriverUnload == NULL) {
+		DbgPrint("WdmShim: %wZ has no unload routine\n", &DriverObject->DriverName);
+		return;
+	}
+	DriverObject->DriverUnload(DriverObject);
+	if (DriverObject->DeviceObject != NULL) {
+		DbgPrint("WdmShim: %wZ unloaded but left devices behind\n", &DriverObject->DriverName);
+		return;
+	}
+	ObDereferenceObject(DriverObject);
+}
+
+/*
+	Requests
+*/
+
+static VOID IopDeleteFile(
+	_In_ PVOID Object
+)
+{
+	pthread_mutex_destroy(&IOP_FILE_FROM_OBJECT(Object)->Lock);
+	ObDereferenceObject(((PFILE_OBJECT)Object)->DeviceObject);
+}
+
+//
+// Allocates an IRP for the device at the top of the file's stack, with its
+// first stack location filled in for MajorFunction.
+//
+static PIRP IopAllocateRequest(
+	_In_ PFILE_OBJECT      FileObject,
+	_In_ UCHAR             MajorFunction,
+	_Out_ PDEVICE_OBJECT   *TopDevice
+)
+{
+	PDEVICE_OBJECT Top = IoGetAttachedDevice(FileObject->DeviceObject);
+	PIO_STACK_LOCATION IoStack;
+	PIRP Irp;
+
+	IopCount(&IopGetThreadStats()->Requests);
+	*TopDevice = Top;
+	Irp = IoAllocateIrp(Top->StackSize, FALSE);
+	if (Irp == NULL) {
+		return NULL;
+	}
+	Irp->RequestorMode = UserMode;
+	Irp->Tail.Overlay.OriginalFileObject = FileObject;
+	IoStack = IoGetNextIrpStackLocation(Irp);
+	IoStack->MajorFunction = MajorFunction;
+	IoStack->FileObject = FileObject;
+	return Irp;
+}
+
+//
+// Sends the IRP down and, for a synchronous request, waits for it to
+// complete. The IRP belongs to the drivers from here on and is freed by
+// its completion, so it is not touched again.
+//
+static NTSTATUS IopSendRequest(
+	_In_ PDEVICE_OBJECT        DeviceObject,
+	_In_ PIRP                  Irp,
+	_In_opt_ PIO_APC_ROUTINE   ApcRoutine,
+	_In_opt_ PVOID             ApcContext,
+	_Out_ PIO_STATUS_BLOCK     IoStatusBlock
+)
+{
+	KEVENT Event;
+	NTSTATUS status;
+
+	Irp->UserIosb = IoStatusBlock;
+	if (ApcRoutine != NULL) {
+		PFILE_OBJECT FileObject = Irp->Tail.Overlay.OriginalFileObject;
+		PIOP_FILE File = IOP_FILE_FROM_OBJECT(FileObject);
+
+		Irp->Overlay.AsynchronousParameters.UserApcRoutine = ApcRoutine;
+		Irp->Overlay.AsynchronousParameters.UserApcContext = ApcContext;
+		ObReferenceObject(FileObject);
+		pthread_mutex_lock(&File->Lock);
+		InsertTailList(&File->Irps, &Irp->ThreadListEntry);
+		pthread_mutex_unlock(&File->Lock);
+	}
+	else {
+		KeInitializeEvent(&Event, NotificationEvent, FALSE);
+		Irp->UserEvent = &Event;
+	}
+
+	status = IoCallDriver(DeviceObject, Irp);
+	if (status == STATUS_PENDING) {
+		IopCount(&IopGetThreadStats()->IrpsPended);
+		if (ApcRoutine == NULL) {
+			KeWaitForSingleObject(&Event, Executive, UserMode, FALSE, NULL);
+			status = IoStatusBlock->Status;
+		}
+	}
+	return status;
+}
+
+//
+// Describes the caller's buffer for a device doing buffered or direct I/O;
+// anything else gets the caller's buffer as it is.
+//
+static BOOLEAN IopMapUserBuffer(
+	_In_ PIRP      Irp,
+	_In_ ULONG     Flags,
+	_In_ PVOID     Buffer,
+	_In_ ULONG     Length,
+	_In_ BOOLEAN   Input
+)
+{
+	Irp->UserBuffer = Buffer;
+	if (Length == 0) {
+		return TRUE;
+	}
+	if (FlagOn(Flags, DO_BUFFERED_IO)) {
+		Irp->AssociatedIrp.SystemBuffer = ExAllocatePoolWithTag(NonPagedPoolNx, Length, IOP_POOL_TAG);
+		if (Irp->AssociatedIrp.SystemBuffer == NULL) {
+			return FALSE;
+		}
+		Irp->Flags |= IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER;
+		if (Input) {
+			Irp->Flags |= IRP_INPUT_OPERATION;
+			IOP_IRP_FROM_IRP(Irp)->OutputLength = Length;
+		}
+		else {
+			RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, Buffer, Length);
+		}
+	}
+	else if (FlagOn(Flags, DO_DIRECT_IO)) {
+		if (IoAllocateMdl(Buffer, Length, FALSE, FALSE, Irp) == NULL) {
+			return FALSE;
+		}
+		MmProbeAndLockPages(Irp->MdlAddress, UserMode, Input ? IoWriteAccess : IoReadAccess);
+	}
+	return TRUE;
+}
+
+static VOID IopFreeRequest(
+	_In_ PIRP Irp
+)
+{
+	if (FlagOn(Irp->Flags, IRP_DEALLOCATE_BUFFER)) {
+		ExFreePool(Irp->AssociatedIrp.SystemBuffer);
+	}
+	if (Irp->MdlAddress != NULL) {
+		IoFreeMdl(Irp->MdlAddress);
+	}
+	IoFreeIrp(Irp);
+}
+
+NTSTATUS WdmOpenFile(
+	_In_ PCWSTR        FileName,
+	_Out_ PFILE_OBJECT *FileObject
+)
+{
+	WCHAR Buffer[IOP_MAXIMUM_NAME];
+	UNICODE_STRING Name;
+	UNICODE_STRING Remainder = { 0, sizeof(Buffer), Buffer };
+	IO_STATUS_BLOCK IoStatus;
+	PDEVICE_OBJECT DeviceObject;
+	PDEVICE_OBJECT Top;
+	PIOP_FILE IopFile;
+	PFILE_OBJECT File;
+	PIRP Irp;
+	NTSTATUS status;
+
+	*FileObject = NULL;
+	if (FileName[0] == L'\\' && FileName[1] == L'\\' && FileName[2] == L'.' && FileName[3] == L'\\') {
+		Buffer[0] = L'\\';
+		Buffer[1] = L'?';
+		Buffer[2] = L'?';
+		RtlInitUnicodeString(&Name, FileName + 3);
+		if (Name.Length > sizeof(Buffer) - 3 * sizeof(WCHAR)) {
+			return STATUS_OBJECT_NAME_INVALID;
+		}
+		RtlCopyMemory(Buffer + 3, Name.Buffer, Name.Length);
+		Name.Buffer = Buffer;
+		Name.Length += 3 * sizeof(WCHAR);
+	}
+	else {
+		RtlInitUnicodeString(&Name, FileName);
+	}
+
+	status = IopLookupDevice(&Name, &DeviceObject, &Remainder);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	IopFile = ObpCreateObject(sizeof(IOP_FILE) + Remainder.Length, IopDeleteFile);
+	if (IopFile == NULL) {
+		ObDereferenceObject(DeviceObject);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	pthread_mutex_init(&IopFile->Lock, NULL);
+	InitializeListHead(&IopFile->Irps);
+	File = &IopFile->FileObject;
+	File->Type = IO_TYPE_FILE;
+	File->Size = sizeof(FILE_OBJECT);
+	File->DeviceObject = DeviceObject;
+	File->Flags = FO_SYNCHRONOUS_IO;
+	File->ReadAccess = File->WriteAccess = TRUE;
+	File->FileName.Buffer = IopFile->FileName;
+	File->FileName.Length = File->FileName.MaximumLength = Remainder.Length;
+	RtlCopyMemory(File->FileName.Buffer, Remainder.Buffer, Remainder.Length);
+
+	if (IOP_DEVICE_FROM_OBJECT(DeviceObject)->DeletePending) {
+		ObDereferenceObject(File);
+		return STATUS_DELETE_PENDING;
+	}
+	Irp = IopAllocateRequest(File, IRP_MJ_CREATE, &Top);
+	if (Irp == NULL) {
+		ObDereferenceObject(File);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	status = IopSendRequest(Top, Irp, NULL, NULL, &IoStatus);
+	if (!NT_SUCCESS(status)) {
+		ObDereferenceObject(File);
+		return status;
+	}
+	*FileObject = File;
+	return status;
+}
+
+//
+// Sends the cleanup and the close that closing the last handle would.
+//
+VOID WdmCloseFile(
+	_In_ PFILE_OBJECT FileObject
+)
+{
+	static const UCHAR MajorFunctions[] = { IRP_MJ_CLEANUP, IRP_MJ_CLOSE };
+	IO_STATUS_BLOCK IoStatus;
+	PDEVICE_OBJECT Top;
+	ULONG Index;
+
+	for (Index = 0; Index < RTL_NUMBER_OF(MajorFunctions); Index++) {
+		PIRP Irp = IopAllocateRequest(FileObject, MajorFunctions[Index], &Top);
+
+		if (Irp == NULL) {
+			KeBugCheckEx(0, 0, 0, 0, 0);
+		}
+		IopSendRequest(Top, Irp, NULL, NULL, &IoStatus);
+	}
+	ObDereferenceObject(FileObject);
+}
+
+static NTSTATUS IopReadWrite(
+	_In_ PFILE_OBJECT          FileObject,
+	_In_ UCHAR                 MajorFunction,
+	_In_opt_ PIO_APC_ROUTINE   ApcRoutine,
+	_In_opt_ PVOID             ApcContext,
+	_Out_ PIO_STATUS_BLOCK     IoStatusBlock,
+	_In_ PVOID                 Buffer,
+	_In_ ULONG                 Length,
+	_In_opt_ PLARGE_INTEGER    ByteOffset
+)
+{
+	PDEVICE_OBJECT Top;
+	PIO_STACK_LOCATION IoStack;
+	PIRP Irp = IopAllocateRequest(FileObject, MajorFunction, &Top);
+
+	if (Irp == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	if (!IopMapUserBuffer(Irp, Top->Flags, Buffer, Length, MajorFunction == IRP_MJ_READ)) {
+		IopFreeRequest(Irp);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	IoStack = IoGetNextIrpStackLocation(Irp);
+	IoStack->Parameters.Read.Length = Length;
+	IoStack->Parameters.Read.ByteOffset.QuadPart = ByteOffset != NULL ?
+		ByteOffset->QuadPart : FileObject->CurrentByteOffset.QuadPart;
+	return IopSendRequest(Top, Irp, ApcRoutine, ApcContext, IoStatusBlock);
+}
+
+NTSTATUS WdmReadFile(
+	_In_ PFILE_OBJECT          FileObject,
+	_In_opt_ PIO_APC_ROUTINE   ApcRoutine,
+	_In_opt_ PVOID             ApcContext,
+	_Out_ PIO_STATUS_BLOCK     IoStatusBlock,
+	_Out_ PVOID                Buffer,
+	_In_ ULONG                 Length,
+	_In_opt_ PLARGE_INTEGER    ByteOffset
+)
+{
+	return IopReadWrite(FileObject, IRP_MJ_READ, ApcRoutine, ApcContext, IoStatusBlock, Buffer, Length, ByteOffset);
+}
+
+NTSTATUS WdmWriteFile(
+	_In_ PFILE_OBJECT          FileObject,
+	_In_opt_ PIO_APC_ROUTINE   ApcRoutine,
+	_In_opt_ PVOID             ApcContext,
+	_Out_ PIO_STATUS_BLOCK     IoStatusBlock,
+	_In_ PVOID                 Buffer,
+	_In_ ULONG                 Length,
+	_In_opt_ PLARGE_INTEGER    ByteOffset
+)
+{
+	return IopReadWrite(FileObject, IRP_MJ_WRITE, ApcRoutine, ApcContext, IoStatusBlock, Buffer, Length, ByteOffset);
+}
+
+NTSTATUS WdmDeviceIoControlFile(
+	_In_ PFILE_OBJECT          FileObject,
+	_In_opt_ PIO_APC_ROUTINE   ApcRoutine,
+	_In_opt_ PVOID             ApcContext,
+	_Out_ PIO_STATUS_BLOCK     IoStatusBlock,
+	_In_ ULONG                 IoControlCode,
+	_In_opt_ PVOID             InputBuffer,
+	_In_ ULONG                 InputBufferLength,
+	_Out_opt_ PVOID            OutputBuffer,
+	_In_ ULONG                 OutputBufferLength
+)
+{
+	PDEVICE_OBJECT Top = IoGetAttachedDevice(FileObject->DeviceObject);
+	PFAST_IO_DISPATCH FastIoDispatch = Top->DriverObject->FastIoDispatch;
+	PIO_STACK_LOCATION IoStack;
+	PIRP Irp;
+	BOOLEAN Mapped = TRUE;
+
+	if (FastIoDispatch != NULL &&
+		FastIoDispatch->SizeOfFastIoDispatch >= FIELD_OFFSET(FAST_IO_DISPATCH, FastIoDeviceControl) + sizeof(PVOID) &&
+		FastIoDispatch->FastIoDeviceControl != NULL &&
+		FastIoDispatch->FastIoDeviceControl(FileObject, TRUE, InputBuffer, InputBufferLength, OutputBuffer,
+			OutputBufferLength, IoControlCode, IoStatusBlock, Top)) {
+		IopCount(&IopGetThreadStats()->Requests);
+		IopCount(&IopGetThreadStats()->FastIoHandled);
+		if (ApcRoutine != NULL) {
+			ApcRoutine(ApcContext, IoStatusBlock, 0);
+		}
+		return IoStatusBlock->Status;
+	}
+
+	Irp = IopAllocateRequest(FileObject, IRP_MJ_DEVICE_CONTROL, &Top);
+	if (Irp == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	switch (METHOD_FROM_CTL_CODE(IoControlCode)) {
+	case METHOD_BUFFERED:
+		if (InputBufferLength != 0 || OutputBufferLength != 0) {
+			ULONG Length = max(InputBufferLength, OutputBufferLength);
+
+			Irp->AssociatedIrp.SystemBuffer = ExAllocatePoolWithTag(NonPagedPoolNx, Length, IOP_POOL_TAG);
+			Mapped = Irp->AssociatedIrp.SystemBuffer != NULL;
+			if (Mapped) {
+				Irp->Flags |= IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER;
+				if (InputBufferLength != 0) {
+					RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, InputBuffer, InputBufferLength);
+				}
+				if (OutputBufferLength != 0) {
+					Irp->Flags |= IRP_INPUT_OPERATION;
+					Irp->UserBuffer = OutputBuffer;
+					IOP_IRP_FROM_IRP(Irp)->OutputLength = OutputBufferLength;
+				}
+			}
+		}
+		break;
+	case METHOD_IN_DIRECT:
+	case METHOD_OUT_DIRECT:
+		if (InputBufferLength != 0) {
+			Irp->AssociatedIrp.SystemBuffer = ExAllocatePoolWithTag(NonPagedPoolNx, InputBufferLength, IOP_POOL_TAG);
+			Mapped = Irp->AssociatedIrp.SystemBuffer != NULL;
+			if (Mapped) {
+				Irp->Flags |= IRP_BUFFERED_IO | IRP_DEALLOCATE_BUFFER;
+				RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, InputBuffer, InputBufferLength);
+			}
+		}
+		if (Mapped && OutputBufferLength != 0) {
+			Mapped = IoAllocateMdl(OutputBuffer, OutputBufferLength, FALSE, FALSE, Irp) != NULL;
+			if (Mapped) {
+				MmProbeAndLockPages(Irp->MdlAddress, UserMode,
+					METHOD_FROM_CTL_CODE(IoControlCode) == METHOD_IN_DIRECT ? IoReadAccess : IoWriteAccess);
+			}
+		}
+		break;
+	default:
+		Irp->UserBuffer = OutputBuffer;
+		break;
+	}
+	if (!Mapped) {
+		IopFreeRequest(Irp);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	IoStack = IoGetNextIrpStackLocation(Irp);
+	IoStack->Parameters.DeviceIoControl.OutputBufferLength = OutputBufferLength;
+	IoStack->Parameters.DeviceIoControl.InputBufferLength = InputBufferLength;
+	IoStack->Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+	IoStack->Parameters.DeviceIoControl.Type3InputBuffer = InputBuffer;
+	return IopSendRequest(Top, Irp, ApcRoutine, ApcContext, IoStatusBlock);
+}
+
+//
+// Cancels the asynchronous requests in flight on the file, as CancelIoEx
+// with no OVERLAPPED would. Each one is referenced while it is cancelled,
+// since it may complete at any moment.
+//
+NTSTATUS WdmCancelIoFile(
+	_In_ PFILE_OBJECT FileObject
+)
+{
+	PIOP_FILE File = IOP_FILE_FROM_OBJECT(FileObject);
+	PLIST_ENTRY Entry;
+	PIRP *Irps;
+	ULONG Count = 0;
+	ULONG Index;
+
+	IopCount(&IopGetThreadStats()->Requests);
+	pthread_mutex_lock(&File->Lock);
+	for (Entry = File->Irps.Flink; Entry != &File->Irps; Entry = Entry->Flink) {
+		Count++;
+	}
+	Irps = malloc(max(Count, 1) * sizeof(PIRP));
+	if (Irps == NULL) {
+		pthread_mutex_unlock(&File->Lock);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	Count = 0;
+	for (Entry = File->Irps.Flink; Entry != &File->Irps; Entry = Entry->Flink) {
+		PIRP Irp = CONTAINING_RECORD(Entry, IRP, ThreadListEntry);
+
+		InterlockedIncrement(&IOP_IRP_FROM_IRP(Irp)->ReferenceCount);
+		Irps[Count++] = Irp;
+	}
+	pthread_mutex_unlock(&File->Lock);
+
+	for (Index = 0; Index < Count; Index++) {
+		IoCancelIrp(Irps[Index]);
+		IopDereferenceIrp(Irps[Index]);
+	}
+	free(Irps);
+	return Count != 0 ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
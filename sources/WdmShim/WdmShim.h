@@ -0,0 +1,79 @@
+// WdmShim.h : What a test program uses to load a driver built against the
+// shim and send it I/O, the way user mode would through a handle.
+//
+// The requests take the parameters of their NtXxxFile counterparts. With no
+// ApcRoutine a request is synchronous: it waits for the IRP to complete and
+// returns its final status. With one, it returns as soon as the driver does,
+// STATUS_PENDING if the IRP is still in flight, and the routine is called
+// with ApcContext once the IRP completes. There are no APCs here, so that
+// call is made on whichever thread completes the IRP, like a completion port
+// callback; *IoStatusBlock must stay valid until then.
+//
+
+#pragma once
+
+#include <ntifs.h>
+
+typedef struct _WDM_STATS {
+	ULONGLONG Requests;
+	ULONGLONG IrpsAllocated;
+	ULONGLONG IrpsPended;
+	ULONGLONG FastIoHandled;
+} WDM_STATS, *PWDM_STATS;
+
+//
+// Creates a driver object named DriverName, such as L"\\Driver\\Sample",
+// and calls DriverInit. Devices created meanwhile are ready for I/O once it
+// returns.
+//
+NTSTATUS WdmLoadDriver(PDRIVER_INITIALIZE DriverInit, PCWSTR DriverName, PDRIVER_OBJECT *DriverObject);
+
+//
+// Calls the driver's unload routine, if it has one, and deletes the driver
+// object.
+//
+VOID WdmUnloadDriver(PDRIVER_OBJECT DriverObject);
+
+//
+// Opens a device by name, through symbolic links; L"\\\\.\\name" stands for
+// L"\\??\\name" as for CreateFile. Whatever follows the device name becomes
+// the file object's FileName.
+//
+NTSTATUS WdmOpenFile(PCWSTR FileName, PFILE_OBJECT *FileObject);
+VOID WdmCloseFile(PFILE_OBJECT FileObject);
+
+NTSTATUS WdmReadFile(PFILE_OBJECT FileObject, PIO_APC_ROUTINE ApcRoutine, PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer, ULONG Length, PLARGE_INTEGER ByteOffset);
+NTSTATUS WdmWriteFile(PFILE_OBJECT FileObject, PIO_APC_ROUTINE ApcRoutine, PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer, ULONG Length, PLARGE_INTEGER ByteOffset);
+
+//
+// Tries the driver's FastIoDeviceControl first, as the I/O manager does,
+// and builds an IRP only when there is none or it declines.
+//
+NTSTATUS WdmDeviceIoControlFile(PFILE_OBJECT FileObject, PIO_APC_ROUTINE ApcRoutine, PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock, ULONG IoControlCode, PVOID InputBuffer, ULONG InputBufferLength,
+	PVOID OutputBuffer, ULONG OutputBufferLength);
+
+//
+// Cancels every asynchronous request in flight on the file, and fails with
+// STATUS_NOT_FOUND if there is none. The requests complete as their drivers
+// see fit, usually with STATUS_CANCELLED, and not necessarily before this
+// returns.
+//
+NTSTATUS WdmCancelIoFile(PFILE_OBJECT FileObject);
+
+//
+// Handles, for passing the driver objects it references by handle: an event
+// the caller signals, say. WdmSetEvent counts as a request, being a system
+// call on Windows.
+//
+NTSTATUS WdmCreateEvent(PHANDLE EventHandle, EVENT_TYPE Type, BOOLEAN InitialState);
+NTSTATUS WdmSetEvent(HANDLE EventHandle);
+NTSTATUS WdmCloseHandle(HANDLE Handle);
+
+//
+// Sums the counters of every thread that has used the shim. Exact once the
+// I/O is done.
+//
+VOID WdmQueryStats(PWDM_STATS Stats);
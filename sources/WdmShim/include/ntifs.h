@@ -0,0 +1,42 @@
+// ntifs.h : The installable file system kit additions the file system
+// filter sample uses, on top of ntddk.h.
+//
+
+#pragma once
+
+#include <ntddk.h>
+
+#define FlagOn(_F, _SF) ((_F) & (_SF))
+#define BooleanFlagOn(F, SF) ((BOOLEAN)(((F) & (SF)) != 0))
+#define SetFlag(_F, _SF) ((_F) |= (_SF))
+#define ClearFlag(_F, _SF) ((_F) &= ~(_SF))
+
+typedef struct _COMPRESSED_DATA_INFO {
+	USHORT CompressionFormatAndEngine;
+	UCHAR CompressionUnitShift;
+	UCHAR ChunkShift;
+	UCHAR ClusterShift;
+	UCHAR Reserved;
+	USHORT NumberOfChunks;
+	ULONG CompressedChunkSizes[ANYSIZE_ARRAY];
+} COMPRESSED_DATA_INFO, *PCOMPRESSED_DATA_INFO;
+
+typedef VOID DRIVER_FS_NOTIFICATION(PDEVICE_OBJECT DeviceObject, BOOLEAN FsActive);
+typedef DRIVER_FS_NOTIFICATION *PDRIVER_FS_NOTIFICATION;
+
+//
+// The notification routine is called right away for every file system
+// already registered, then for every one that registers or unregisters.
+//
+NTSTATUS IoRegisterFsRegistrationChange(PDRIVER_OBJECT DriverObject, PDRIVER_FS_NOTIFICATION DriverNotificationRoutine);
+VOID IoUnregisterFsRegistrationChange(PDRIVER_OBJECT DriverObject, PDRIVER_FS_NOTIFICATION DriverNotificationRoutine);
+VOID IoRegisterFileSystem(PDEVICE_OBJECT DeviceObject);
+VOID IoUnregisterFileSystem(PDEVICE_OBJECT DeviceObject);
+
+//
+// Every device returned is referenced. Fails with STATUS_BUFFER_TOO_SMALL,
+// referencing none, when they do not all fit.
+//
+NTSTATUS IoEnumerateDeviceObjectList(PDRIVER_OBJECT DriverObject, PDEVICE_OBJECT *DeviceObjectList,
+	ULONG DeviceObjectListSize, PULONG ActualNumberDeviceObjects);
+PDEVICE_OBJECT IoGetLowerDeviceObject(PDEVICE_OBJECT DeviceObject);
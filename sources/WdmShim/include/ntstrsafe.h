@@ -0,0 +1,72 @@
+// ntstrsafe.h : The bounded string functions of the kernel runtime, inline
+// as in the WDK.
+//
+
+#pragma once
+
+#include <ntddk.h>
+
+#define NTSTRSAFE_MAX_CCH 2147483647
+
+static inline NTSTATUS RtlStringCchLengthW(PCWSTR psz, size_t cchMax, size_t *pcchLength)
+{
+	size_t cchLength = 0;
+
+	if (psz == NULL || cchMax > NTSTRSAFE_MAX_CCH) {
+		if (pcchLength != NULL) {
+			*pcchLength = 0;
+		}
+		return STATUS_INVALID_PARAMETER;
+	}
+	while (cchLength < cchMax && psz[cchLength] != 0) {
+		cchLength++;
+	}
+	if (cchLength == cchMax) {
+		if (pcchLength != NULL) {
+			*pcchLength = 0;
+		}
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (pcchLength != NULL) {
+		*pcchLength = cchLength;
+	}
+	return STATUS_SUCCESS;
+}
+
+//
+// The length is in bytes here, as cbMax is.
+//
+static inline NTSTATUS RtlStringCbLengthW(PCWSTR psz, size_t cbMax, size_t *pcbLength)
+{
+	size_t cchLength = 0;
+	NTSTATUS status = RtlStringCchLengthW(psz, cbMax / sizeof(WCHAR), &cchLength);
+
+	if (pcbLength != NULL) {
+		*pcbLength = cchLength * sizeof(WCHAR);
+	}
+	return status;
+}
+
+//
+// Copies at most cchDest - 1 characters and always terminates; a truncated
+// copy returns STATUS_BUFFER_OVERFLOW.
+//
+static inline NTSTATUS RtlStringCchCopyW(PWSTR pszDest, size_t cchDest, PCWSTR pszSrc)
+{
+	size_t cch = 0;
+
+	if (cchDest == 0 || cchDest > NTSTRSAFE_MAX_CCH) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	while (cch < cchDest - 1 && pszSrc[cch] != 0) {
+		pszDest[cch] = pszSrc[cch];
+		cch++;
+	}
+	pszDest[cch] = 0;
+	return pszSrc[cch] == 0 ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
+
+static inline NTSTATUS RtlStringCbCopyW(PWSTR pszDest, size_t cbDest, PCWSTR pszSrc)
+{
+	return RtlStringCchCopyW(pszDest, cbDest / sizeof(WCHAR), pszSrc);
+}
@@ -0,0 +1,88 @@
+// benchmark-util.h : Latency histograms and name lists, shared by the
+// benchmarks.
+//
+// A histogram is an array of LATENCY_BUCKETS counters with log-linear
+// buckets: exact below 8ns, then LATENCY_SUB_BUCKETS per power of two, which
+// keeps every bucket within 12.5% of its value. Histograms of the same size
+// add up bucket by bucket.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LATENCY_SUB_BUCKETS             8
+#define LATENCY_BUCKETS                 (64 * LATENCY_SUB_BUCKETS)
+
+inline uint32_t LatencyBucket(uint64_t Nanoseconds)
+{
+    uint32_t Exponent = 3;
+
+    if (Nanoseconds < LATENCY_SUB_BUCKETS) {
+        return (uint32_t)Nanoseconds;
+    }
+    while ((Nanoseconds >> (Exponent + 1)) != 0) {
+        ++Exponent;
+    }
+    return Exponent * LATENCY_SUB_BUCKETS + (uint32_t)((Nanoseconds >> (Exponent - 3)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+//
+// The lowest value that falls in Bucket.
+//
+inline uint64_t LatencyBucketValue(uint32_t Bucket)
+{
+    uint32_t Exponent = Bucket / LATENCY_SUB_BUCKETS;
+
+    if (Bucket < LATENCY_SUB_BUCKETS) {
+        return Bucket;
+    }
+    return (uint64_t)(LATENCY_SUB_BUCKETS + Bucket % LATENCY_SUB_BUCKETS) << (Exponent - 3);
+}
+
+//
+// 0 for an empty histogram.
+//
+inline uint64_t LatencyPercentile(const uint64_t* Latency, double Percentile)
+{
+    uint64_t Total = 0;
+    uint64_t Target;
+    uint32_t Bucket;
+
+    for (Bucket = 0; Bucket < LATENCY_BUCKETS; ++Bucket) {
+        Total += Latency[Bucket];
+    }
+    if (Total == 0) {
+        return 0;
+    }
+    Target = (uint64_t)(Total * Percentile / 100.0);
+    for (Bucket = 0; Bucket < LATENCY_BUCKETS; ++Bucket) {
+        if (Latency[Bucket] > Target) {
+            break;
+        }
+        Target -= Latency[Bucket];
+    }
+    return LatencyBucketValue(Bucket);
+}
+
+//
+// Selection lists are comma-separated names; NULL selects everything.
+//
+inline bool Selected(const char* List, const char* Name)
+{
+    size_t Length = strlen(Name);
+    const char* Item = List;
+
+    if (List == NULL) {
+        return true;
+    }
+    while ((Item = strstr(Item, Name)) != NULL) {
+        if ((Item == List || Item[-1] == ',') && (Item[Length] == ',' || Item[Length] == '\0')) {
+            return true;
+        }
+        Item += Length;
+    }
+    return false;
+}
@@ -0,0 +1,409 @@
+// dump-file.cpp : Maps a minidump and translates target virtual addresses to file offsets.
+//
+
+#include "dump-file.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//
+// On-disk layout, see minidumpapiset.h. Everything is little endian and
+// packed to 4 bytes, so we read the fields at fixed offsets instead of
+// relying on the host compiler's structure layout.
+//
+#define MINIDUMP_SIGNATURE              0x504d444d  // 'MDMP'
+
+#define ThreadListStream                3
+#define MemoryListStream                5
+#define SystemInfoStream                7
+#define Memory64ListStream              9
+
+#define SIZEOF_MINIDUMP_HEADER          32
+#define SIZEOF_MINIDUMP_DIRECTORY       12
+#define SIZEOF_MINIDUMP_THREAD          48
+#define SIZEOF_MINIDUMP_MEMORY_DESCRIPTOR 16
+#define SIZEOF_MINIDUMP_MEMORY_DESCRIPTOR64 16
+
+//
+// TEB.ProcessEnvironmentBlock.
+//
+#define TEB32_PEB_OFFSET                0x30
+#define TEB64_PEB_OFFSET                0x60
+
+static bool ReadFileUlong(PDUMP_FILE Dump, uint64_t Offset, uint32_t* Value)
+{
+    if (Offset > Dump->ViewSize || Dump->ViewSize - Offset < sizeof(*Value)) {
+        return false;
+    }
+    memcpy(Value, Dump->View + Offset, sizeof(*Value));
+    return true;
+}
+
+static bool ReadFileUlong64(PDUMP_FILE Dump, uint64_t Offset, uint64_t* Value)
+{
+    if (Offset > Dump->ViewSize || Dump->ViewSize - Offset < sizeof(*Value)) {
+        return false;
+    }
+    memcpy(Value, Dump->View + Offset, sizeof(*Value));
+    return true;
+}
+
+static int CompareRanges(const void* Left, const void* Right)
+{
+    const DUMP_MEMORY_RANGE* A = (const DUMP_MEMORY_RANGE*)Left;
+    const DUMP_MEMORY_RANGE* B = (const DUMP_MEMORY_RANGE*)Right;
+
+    if (A->VirtualAddress < B->VirtualAddress) {
+        return -1;
+    }
+    return A->VirtualAddress > B->VirtualAddress;
+}
+
+static bool MapFile(const char* FileName, PDUMP_FILE Dump)
+{
+#ifdef _WIN32
+    LARGE_INTEGER FileSize;
+
+    Dump->hFile = CreateFileA(FileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (Dump->hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (GetFileSizeEx(Dump->hFile, &FileSize) == FALSE) {
+        return false;
+    }
+    Dump->hMapping = CreateFileMappingA(Dump->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (Dump->hMapping == NULL) {
+        return false;
+    }
+    Dump->View = (const uint8_t*)MapViewOfFile(Dump->hMapping, FILE_MAP_READ, 0, 0, 0);
+    Dump->ViewSize = (uint64_t)FileSize.QuadPart;
+#else
+    struct stat FileStat;
+    void* View;
+
+    Dump->Fd = open(FileName, O_RDONLY);
+    if (Dump->Fd < 0) {
+        return false;
+    }
+    if (fstat(Dump->Fd, &FileStat) != 0 || FileStat.st_size == 0) {
+        return false;
+    }
+
+    //
+    // Map the whole file without populating it. Heap walks jump around the
+    // address space, so tell the kernel not to bother with read-ahead.
+    //
+    View = mmap(NULL, (size_t)FileStat.st_size, PROT_READ, MAP_PRIVATE, Dump->Fd, 0);
+    if (View == MAP_FAILED) {
+        return false;
+    }
+    madvise(View, (size_t)FileStat.st_size, MADV_RANDOM);
+    Dump->View = (const uint8_t*)View;
+    Dump->ViewSize = (uint64_t)FileStat.st_size;
+#endif
+    return Dump->View != NULL;
+}
+
+static bool LoadMemoryList(PDUMP_FILE Dump, uint32_t Rva)
+{
+    uint32_t NumberOfRanges;
+    uint64_t Offset;
+    uint32_t DataSize;
+    uint32_t DataRva;
+    size_t Index;
+
+    if (ReadFileUlong(Dump, Rva, &NumberOfRanges) == false) {
+        return false;
+    }
+    if (NumberOfRanges > Dump->ViewSize / SIZEOF_MINIDUMP_MEMORY_DESCRIPTOR) {
+        return false;
+    }
+    Dump->Ranges = (PDUMP_MEMORY_RANGE)calloc(NumberOfRanges, sizeof(*Dump->Ranges));
+    if (Dump->Ranges == NULL && NumberOfRanges != 0) {
+        return false;
+    }
+
+    Offset = (uint64_t)Rva + sizeof(NumberOfRanges);
+    for (Index = 0; Index < NumberOfRanges; ++Index) {
+        if (ReadFileUlong64(Dump, Offset, &Dump->Ranges[Index].VirtualAddress) == false ||
+            ReadFileUlong(Dump, Offset + 8, &DataSize) == false ||
+            ReadFileUlong(Dump, Offset + 12, &DataRva) == false) {
+            return false;
+        }
+        Dump->Ranges[Index].Size = DataSize;
+        Dump->Ranges[Index].FileOffset = DataRva;
+        Offset += SIZEOF_MINIDUMP_MEMORY_DESCRIPTOR;
+    }
+    Dump->NumberOfRanges = NumberOfRanges;
+    return true;
+}
+
+static bool LoadMemory64List(PDUMP_FILE Dump, uint32_t Rva)
+{
+    uint64_t NumberOfRanges;
+    uint64_t FileOffset;
+    uint64_t Offset;
+    size_t Index;
+
+    //
+    // Full memory dumps store all range data back to back starting at
+    // BaseRva, so each range's file offset is the running sum of the sizes.
+    //
+    if (ReadFileUlong64(Dump, Rva, &NumberOfRanges) == false ||
+        ReadFileUlong64(Dump, (uint64_t)Rva + 8, &FileOffset) == false) {
+        return false;
+    }
+    if (NumberOfRanges > Dump->ViewSize / SIZEOF_MINIDUMP_MEMORY_DESCRIPTOR64) {
+        return false;
+    }
+    Dump->Ranges = (PDUMP_MEMORY_RANGE)calloc((size_t)NumberOfRanges, sizeof(*Dump->Ranges));
+    if (Dump->Ranges == NULL && NumberOfRanges != 0) {
+        return false;
+    }
+
+    Offset = (uint64_t)Rva + 16;
+    for (Index = 0; Index < NumberOfRanges; ++Index) {
+        if (ReadFileUlong64(Dump, Offset, &Dump->Ranges[Index].VirtualAddress) == false ||
+            ReadFileUlong64(Dump, Offset + 8, &Dump->Ranges[Index].Size) == false) {
+            return false;
+        }
+        Dump->Ranges[Index].FileOffset = FileOffset;
+        FileOffset += Dump->Ranges[Index].Size;
+        Offset += SIZEOF_MINIDUMP_MEMORY_DESCRIPTOR64;
+    }
+    Dump->NumberOfRanges = (size_t)NumberOfRanges;
+    return true;
+}
+
+static bool LoadPeb(PDUMP_FILE Dump, uint32_t Rva)
+{
+    uint32_t NumberOfThreads;
+    uint64_t Teb;
+
+    //
+    // Every thread's TEB points at the same PEB, the first one will do.
+    //
+    if (ReadFileUlong(Dump, Rva, &NumberOfThreads) == false || NumberOfThreads == 0) {
+        return false;
+    }
+    if (ReadFileUlong64(Dump, (uint64_t)Rva + 4 + 16, &Teb) == false) {
+        return false;
+    }
+    return DumpReadPointer(Dump, Teb +
+        (Dump->PointerSize == 8 ? TEB64_PEB_OFFSET : TEB32_PEB_OFFSET), &Dump->Peb);
+}
+
+bool DumpOpen(const char* FileName, PDUMP_FILE Dump)
+{
+    uint32_t Signature;
+    uint32_t NumberOfStreams;
+    uint32_t DirectoryRva;
+    uint32_t StreamType;
+    uint32_t StreamRva;
+    uint32_t ThreadListRva = 0;
+    uint32_t MemoryListRva = 0;
+    uint32_t Memory64ListRva = 0;
+    uint32_t Index;
+    uint16_t Architecture = 0xffff;
+
+    memset(Dump, 0, sizeof(*Dump));
+#ifndef _WIN32
+    Dump->Fd = -1;
+#endif
+    if (MapFile(FileName, Dump) == false) {
+        DumpClose(Dump);
+        return false;
+    }
+
+    if (ReadFileUlong(Dump, 0, &Signature) == false || Signature != MINIDUMP_SIGNATURE ||
+        ReadFileUlong(Dump, 8, &NumberOfStreams) == false ||
+        ReadFileUlong(Dump, 12, &DirectoryRva) == false) {
+        DumpClose(Dump);
+        return false;
+    }
+
+    for (Index = 0; Index < NumberOfStreams; ++Index) {
+        uint64_t Entry = (uint64_t)DirectoryRva + (uint64_t)Index * SIZEOF_MINIDUMP_DIRECTORY;
+
+        if (ReadFileUlong(Dump, Entry, &StreamType) == false ||
+            ReadFileUlong(Dump, Entry + 8, &StreamRva) == false) {
+            DumpClose(Dump);
+            return false;
+        }
+        switch (StreamType) {
+        case ThreadListStream:
+            ThreadListRva = StreamRva;
+            break;
+        case MemoryListStream:
+            MemoryListRva = StreamRva;
+            break;
+        case Memory64ListStream:
+            Memory64ListRva = StreamRva;
+            break;
+        case SystemInfoStream:
+            if (StreamRva + sizeof(Architecture) <= Dump->ViewSize) {
+                memcpy(&Architecture, Dump->View + StreamRva, sizeof(Architecture));
+            }
+            break;
+        }
+    }
+
+    switch (Architecture) {
+    case DUMP_ARCH_X86:
+        Dump->PointerSize = 4;
+        break;
+    case DUMP_ARCH_AMD64:
+    case DUMP_ARCH_ARM64:
+        Dump->PointerSize = 8;
+        break;
+    default:
+        DumpClose(Dump);
+        return false;
+    }
+    Dump->ProcessorArchitecture = Architecture;
+
+    //
+    // A full memory dump carries a Memory64ListStream, a small one only a
+    // MemoryListStream. Prefer the former, it is a superset.
+    //
+    if (Memory64ListRva != 0) {
+        if (LoadMemory64List(Dump, Memory64ListRva) == false) {
+            DumpClose(Dump);
+            return false;
+        }
+    }
+    else if (MemoryListRva != 0) {
+        if (LoadMemoryList(Dump, MemoryListRva) == false) {
+            DumpClose(Dump);
+            return false;
+        }
+    }
+    qsort(Dump->Ranges, Dump->NumberOfRanges, sizeof(*Dump->Ranges), CompareRanges);
+
+    if (ThreadListRva == 0 || LoadPeb(Dump, ThreadListRva) == false) {
+        DumpClose(Dump);
+        return false;
+    }
+    return true;
+}
+
+void DumpClose(PDUMP_FILE Dump)
+{
+    free(Dump->Ranges);
+    Dump->Ranges = NULL;
+    Dump->NumberOfRanges = 0;
+
+#ifdef _WIN32
+    if (Dump->View != NULL) {
+        UnmapViewOfFile(Dump->View);
+    }
+    if (Dump->hMapping != NULL) {
+        CloseHandle(Dump->hMapping);
+    }
+    if (Dump->hFile != NULL && Dump->hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(Dump->hFile);
+    }
+    Dump->hMapping = NULL;
+    Dump->hFile = NULL;
+#else
+    if (Dump->View != NULL) {
+        munmap((void*)Dump->View, (size_t)Dump->ViewSize);
+    }
+    if (Dump->Fd >= 0) {
+        close(Dump->Fd);
+    }
+    Dump->Fd = -1;
+#endif
+    Dump->View = NULL;
+}
+
+const uint8_t* DumpTranslate(PDUMP_FILE Dump, uint64_t Address, uint64_t* Available)
+{
+    size_t Low = 0;
+    size_t High = Dump->NumberOfRanges;
+
+    while (Low < High) {
+        size_t Middle = Low + (High - Low) / 2;
+        PDUMP_MEMORY_RANGE Range = &Dump->Ranges[Middle];
+
+        if (Address < Range->VirtualAddress) {
+            High = Middle;
+        }
+        else if (Address - Range->VirtualAddress >= Range->Size) {
+            Low = Middle + 1;
+        }
+        else {
+            uint64_t Delta = Address - Range->VirtualAddress;
+
+            if (Range->FileOffset + Delta >= Dump->ViewSize) {
+                return NULL;
+            }
+            *Available = Range->Size - Delta;
+            if (*Available > Dump->ViewSize - (Range->FileOffset + Delta)) {
+                *Available = Dump->ViewSize - (Range->FileOffset + Delta);
+            }
+            return Dump->View + Range->FileOffset + Delta;
+        }
+    }
+    return NULL;
+}
+
+bool DumpRead(PDUMP_FILE Dump, uint64_t Address, void* Buffer, size_t Size)
+{
+    uint8_t* Destination = (uint8_t*)Buffer;
+
+    //
+    // Adjacent ranges are common in full dumps, so a read may straddle two
+    // descriptors.
+    //
+    while (Size != 0) {
+        uint64_t Available;
+        const uint8_t* Source = DumpTranslate(Dump, Address, &Available);
+
+        if (Source == NULL) {
+            return false;
+        }
+        if (Available > Size) {
+            Available = Size;
+        }
+        memcpy(Destination, Source, (size_t)Available);
+        Destination += Available;
+        Address += Available;
+        Size -= (size_t)Available;
+    }
+    return true;
+}
+
+bool DumpReadPointer(PDUMP_FILE Dump, uint64_t Address, uint64_t* Value)
+{
+    uint32_t Value32;
+
+    if (Dump->PointerSize == 8) {
+        return DumpRead(Dump, Address, Value, sizeof(*Value));
+    }
+    if (DumpRead(Dump, Address, &Value32, sizeof(Value32)) == false) {
+        return false;
+    }
+    *Value = Value32;
+    return true;
+}
+
+bool DumpReadUlong(PDUMP_FILE Dump, uint64_t Address, uint32_t* Value)
+{
+    return DumpRead(Dump, Address, Value, sizeof(*Value));
+}
+
+bool DumpReadUshort(PDUMP_FILE Dump, uint64_t Address, uint16_t* Value)
+{
+    return DumpRead(Dump, Address, Value, sizeof(*Value));
+}
@@ -0,0 +1,61 @@
+// dump-file.h : Read-only view of a Windows user-mode minidump (or full memory dump).
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Values of MINIDUMP_SYSTEM_INFO.ProcessorArchitecture we know how to walk.
+//
+#define DUMP_ARCH_X86       0
+#define DUMP_ARCH_AMD64     9
+#define DUMP_ARCH_ARM64     12
+
+//
+// One captured range of the target address space. Ranges are kept sorted by
+// VirtualAddress so a lookup is a binary search; the data itself stays in the
+// file mapping and is only paged in when a walker actually reads it.
+//
+typedef struct _DUMP_MEMORY_RANGE {
+    uint64_t VirtualAddress;
+    uint64_t Size;
+    uint64_t FileOffset;
+} DUMP_MEMORY_RANGE, *PDUMP_MEMORY_RANGE;
+
+typedef struct _DUMP_FILE {
+    const uint8_t* View;
+    uint64_t ViewSize;
+#ifdef _WIN32
+    void* hFile;
+    void* hMapping;
+#else
+    int Fd;
+#endif
+    uint16_t ProcessorArchitecture;
+    uint32_t PointerSize;
+    uint64_t Peb;
+    PDUMP_MEMORY_RANGE Ranges;
+    size_t NumberOfRanges;
+} DUMP_FILE, *PDUMP_FILE;
+
+bool DumpOpen(const char* FileName, PDUMP_FILE Dump);
+void DumpClose(PDUMP_FILE Dump);
+
+//
+// Copy Size bytes of target memory at Address into Buffer. Fails if any part
+// of the range was not captured in the dump.
+//
+bool DumpRead(PDUMP_FILE Dump, uint64_t Address, void* Buffer, size_t Size);
+
+//
+// Return a pointer into the mapping for Address and the number of contiguous
+// bytes available from there, or NULL if Address was not captured. Nothing is
+// copied, so large reads only fault in the pages that are touched.
+//
+const uint8_t* DumpTranslate(PDUMP_FILE Dump, uint64_t Address, uint64_t* Available);
+
+bool DumpReadPointer(PDUMP_FILE Dump, uint64_t Address, uint64_t* Value);
+bool DumpReadUlong(PDUMP_FILE Dump, uint64_t Address, uint32_t* Value);
+bool DumpReadUshort(PDUMP_FILE Dump, uint64_t Address, uint16_t* Value);
@@ -0,0 +1,245 @@
+// dump-heap-walk.cpp : This file contains the 'main' function. Program execution begins and ends there.
+//
+// Offline counterpart of get-process-heaps and enumerate-heap: lists the heaps
+// of the process captured in a minidump (or full memory dump) and walks each
+// of them, printing the same report HeapWalk would have produced live. The
+// dump is memory-mapped and only the pages a walk touches are read, so it
+// runs on Linux as well as on Windows and opens multi-GB dumps immediately.
+//
+// Both NT heaps and segment heaps are walked. With --stats the entries are
+// not printed; each heap is summarized per LFH-sized bucket instead, which
+// is what to compare when choosing a heap type for a workload. With
+// --snapshot the entries are also written to a compact binary snapshot that
+// heap-snapshot-diff compares against a later one to find what grew.
+//
+// Outside Visual Studio: g++ -O2 -o dump-heap-walk *.cpp
+//
+
+#include "heap-snapshot.h"
+#include "heap-stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct _WALK_OPTIONS {
+    bool Stats;
+    const uint64_t* HeapKey;
+    const uint64_t* LfhKey;
+    uint64_t HeapKeyValue;
+    uint64_t LfhKeyValue;
+    PHEAP_SNAPSHOT_WRITER Snapshot;
+} WALK_OPTIONS, *PWALK_OPTIONS;
+
+static void PrintEntry(const HEAP_WALK_ENTRY* Entry)
+{
+    if ((Entry->wFlags & HEAP_WALK_SUBSEGMENT) != 0) {
+        if (Entry->Subsegment.Type == HEAP_WALK_SUBSEGMENT_LFH) {
+            printf("LFH subsegment\n  %u blocks of %u bytes, %u busy\n",
+                Entry->Subsegment.BlockCount,
+                Entry->Subsegment.BlockSize,
+                Entry->Subsegment.BusyCount);
+        }
+        else {
+            printf("VS subsegment\n");
+        }
+    }
+    else if ((Entry->wFlags & PROCESS_HEAP_ENTRY_BUSY) != 0) {
+        printf("Allocated block");
+
+        if ((Entry->wFlags & PROCESS_HEAP_ENTRY_MOVEABLE) != 0) {
+            printf(", movable with HANDLE %#llx", (unsigned long long)Entry->Block.hMem);
+        }
+
+        if ((Entry->wFlags & PROCESS_HEAP_ENTRY_DDESHARE) != 0) {
+            printf(", DDESHARE");
+        }
+    }
+    else if ((Entry->wFlags & PROCESS_HEAP_REGION) != 0) {
+        printf("Region\n  %llu bytes committed\n" \
+            "  %llu bytes uncommitted\n  First block address: %#llx\n" \
+            "  Last block address: %#llx\n",
+            (unsigned long long)Entry->Region.dwCommittedSize,
+            (unsigned long long)Entry->Region.dwUnCommittedSize,
+            (unsigned long long)Entry->Region.lpFirstBlock,
+            (unsigned long long)Entry->Region.lpLastBlock);
+    }
+    else if ((Entry->wFlags & PROCESS_HEAP_UNCOMMITTED_RANGE) != 0) {
+        printf("Uncommitted range\n");
+    }
+    else {
+        printf("Block\n");
+    }
+
+    printf("  Data portion begins at: %#llx\n  Size: %llu bytes\n" \
+        "  Overhead: %u bytes\n  Region index: %u\n\n",
+        (unsigned long long)Entry->lpData,
+        (unsigned long long)Entry->cbData,
+        Entry->cbOverhead,
+        Entry->iRegionIndex);
+}
+
+static int WalkHeap(PDUMP_FILE Dump, uint64_t Heap, PWALK_OPTIONS Options)
+{
+    HEAP_WALK Walk;
+    HEAP_WALK_ENTRY Entry;
+    HEAP_STATS Stats;
+
+    //
+    // The dump is a frozen image, so unlike enumerate-heap there is no need
+    // to lock the heap against other threads during the enumeration.
+    //
+    printf("Walking heap %#llx...\n\n", (unsigned long long)Heap);
+
+    if (HeapWalkBegin(&Walk, Dump, Heap, Options->HeapKey, Options->LfhKey) == false) {
+        printf("Failed to start walking heap with LastError %u.\n", Walk.LastError);
+        HeapWalkEnd(&Walk);
+        return 1;
+    }
+
+    memset(&Stats, 0, sizeof(Stats));
+    if (Options->Snapshot != NULL) {
+        HeapSnapshotBeginHeap(Options->Snapshot, Heap);
+    }
+    while (HeapWalkNext(&Walk, &Entry)) {
+        if (Options->Snapshot != NULL && HeapSnapshotAdd(Options->Snapshot, &Entry) == false) {
+            printf("Failed to add entry %#llx to the snapshot.\n", (unsigned long long)Entry.lpData);
+            Walk.LastError = ERROR_NOT_ENOUGH_MEMORY;
+            break;
+        }
+        if (Options->Stats) {
+            HeapStatsAdd(&Stats, &Entry);
+        }
+        else {
+            PrintEntry(&Entry);
+        }
+    }
+    if (Walk.LastError != ERROR_NO_MORE_ITEMS) {
+        printf("HeapWalk failed with LastError %u.\n", Walk.LastError);
+    }
+    if (Options->Snapshot != NULL && HeapSnapshotEndHeap(Options->Snapshot) == false) {
+        printf("Failed to write heap %#llx to the snapshot.\n", (unsigned long long)Heap);
+        Walk.LastError = ERROR_WRITE_FAULT;
+    }
+    if (Options->Stats) {
+        HeapStatsPrint(&Stats, Walk.Type == HEAP_TYPE_SEGMENT ? "Segment heap" : "NT heap");
+    }
+    HeapWalkEnd(&Walk);
+    return Walk.LastError == ERROR_NO_MORE_ITEMS ? 0 : 1;
+}
+
+static void Usage()
+{
+    printf("Usage: dump-heap-walk [--stats] [--snapshot <file>] [--heap-key <key>] " \
+        "[--lfh-key <key>] <dump file> [heap index]\n");
+}
+
+int main(int argc, char* argv[])
+{
+    DUMP_FILE Dump;
+    WALK_OPTIONS Options;
+    HEAP_SNAPSHOT_WRITER Snapshot;
+    const char* SnapshotName = NULL;
+    uint32_t NumberOfHeaps;
+    uint32_t HeapsIndex;
+    uint64_t* aHeaps;
+    const char* HeapIndex = NULL;
+    const char* FileName = NULL;
+    int ArgIndex;
+    int Result = 0;
+
+    memset(&Options, 0, sizeof(Options));
+    for (ArgIndex = 1; ArgIndex < argc; ++ArgIndex) {
+        if (strcmp(argv[ArgIndex], "--stats") == 0) {
+            Options.Stats = true;
+        }
+        else if (strcmp(argv[ArgIndex], "--snapshot") == 0 && ArgIndex + 1 < argc) {
+            SnapshotName = argv[++ArgIndex];
+        }
+        else if (strcmp(argv[ArgIndex], "--heap-key") == 0 && ArgIndex + 1 < argc) {
+            Options.HeapKeyValue = strtoull(argv[++ArgIndex], NULL, 16);
+            Options.HeapKey = &Options.HeapKeyValue;
+        }
+        else if (strcmp(argv[ArgIndex], "--lfh-key") == 0 && ArgIndex + 1 < argc) {
+            Options.LfhKeyValue = strtoull(argv[++ArgIndex], NULL, 16);
+            Options.LfhKey = &Options.LfhKeyValue;
+        }
+        else if (FileName == NULL) {
+            FileName = argv[ArgIndex];
+        }
+        else if (HeapIndex == NULL) {
+            HeapIndex = argv[ArgIndex];
+        }
+        else {
+            Usage();
+            return 1;
+        }
+    }
+    if (FileName == NULL) {
+        Usage();
+        return 1;
+    }
+
+    if (DumpOpen(FileName, &Dump) == false) {
+        printf("Failed to open %s as a user-mode minidump.\n", FileName);
+        return 1;
+    }
+
+    //
+    // Same two-step protocol as GetProcessHeaps: query the count, then fetch
+    // the handles into a buffer of the right size.
+    //
+    NumberOfHeaps = DumpGetProcessHeaps(&Dump, 0, NULL);
+    if (NumberOfHeaps == 0) {
+        printf("Failed to read PEB.ProcessHeaps from the dump.\n");
+        DumpClose(&Dump);
+        return 1;
+    }
+
+    aHeaps = (uint64_t*)calloc(NumberOfHeaps, sizeof(*aHeaps));
+    if (aHeaps == NULL) {
+        printf("Failed to allocate %u heap handles.\n", NumberOfHeaps);
+        DumpClose(&Dump);
+        return 1;
+    }
+    if (DumpGetProcessHeaps(&Dump, NumberOfHeaps, aHeaps) != NumberOfHeaps) {
+        printf("Failed to read PEB.ProcessHeaps from the dump.\n");
+        free(aHeaps);
+        DumpClose(&Dump);
+        return 1;
+    }
+
+    printf("Process has %u heaps.\n", NumberOfHeaps);
+    for (HeapsIndex = 0; HeapsIndex < NumberOfHeaps; ++HeapsIndex) {
+        printf("Heap %u at address: %#llx.\n",
+            HeapsIndex,
+            (unsigned long long)aHeaps[HeapsIndex]);
+    }
+    printf("\n");
+
+    if (SnapshotName != NULL) {
+        if (HeapSnapshotCreate(&Snapshot, SnapshotName, Dump.PointerSize) == false) {
+            printf("Failed to create snapshot %s.\n", SnapshotName);
+            free(aHeaps);
+            DumpClose(&Dump);
+            return 1;
+        }
+        Options.Snapshot = &Snapshot;
+    }
+
+    for (HeapsIndex = 0; HeapsIndex < NumberOfHeaps; ++HeapsIndex) {
+        if (HeapIndex != NULL && HeapsIndex != (uint32_t)strtoul(HeapIndex, NULL, 0)) {
+            continue;
+        }
+        Result |= WalkHeap(&Dump, aHeaps[HeapsIndex], &Options);
+    }
+
+    if (Options.Snapshot != NULL && HeapSnapshotClose(&Snapshot) == false) {
+        printf("Failed to write snapshot %s.\n", SnapshotName);
+        Result = 1;
+    }
+
+    free(aHeaps);
+    DumpClose(&Dump);
+    return Result;
+}
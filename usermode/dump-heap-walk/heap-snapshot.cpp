@@ -0,0 +1,386 @@
+// heap-snapshot.cpp : Encodes and decodes the heap snapshot format.
+//
+
+#include "heap-snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SIZEOF_SNAPSHOT_HEADER          16
+#define SIZEOF_SECTION_HEADER           24
+#define SIZEOF_BLOCK_HEADER             8
+
+//
+// Worst case per entry: two 10-byte varints plus a (value, run) pair for
+// each of the flags and region columns.
+//
+#define MAXIMUM_ENCODED_ENTRY           (10 + 10 + 3 + 5 + 5 + 5)
+#define MAXIMUM_ENCODED_BLOCK           (HEAP_SNAPSHOT_BLOCK_ENTRIES * MAXIMUM_ENCODED_ENTRY)
+
+static uint8_t* PutVarint(uint8_t* Cursor, uint64_t Value)
+{
+    while (Value >= 0x80) {
+        *Cursor++ = (uint8_t)(Value | 0x80);
+        Value >>= 7;
+    }
+    *Cursor++ = (uint8_t)Value;
+    return Cursor;
+}
+
+static const uint8_t* GetVarint(const uint8_t* Cursor, const uint8_t* End, uint64_t* Value)
+{
+    uint32_t Shift = 0;
+
+    *Value = 0;
+    while (Cursor < End && Shift < 64) {
+        uint8_t Byte = *Cursor++;
+
+        *Value |= (uint64_t)(Byte & 0x7f) << Shift;
+        if ((Byte & 0x80) == 0) {
+            return Cursor;
+        }
+        Shift += 7;
+    }
+    return NULL;
+}
+
+static bool WriteBytes(FILE* File, const void* Buffer, size_t Size)
+{
+    return fwrite(Buffer, 1, Size, File) == Size;
+}
+
+static bool ReadBytes(FILE* File, void* Buffer, size_t Size)
+{
+    return fread(Buffer, 1, Size, File) == Size;
+}
+
+static int CompareEntries(const void* Left, const void* Right)
+{
+    const HEAP_SNAPSHOT_ENTRY* A = (const HEAP_SNAPSHOT_ENTRY*)Left;
+    const HEAP_SNAPSHOT_ENTRY* B = (const HEAP_SNAPSHOT_ENTRY*)Right;
+
+    if (A->Address < B->Address) {
+        return -1;
+    }
+    return A->Address > B->Address;
+}
+
+static bool WriteHeader(FILE* File, uint32_t PointerSize, uint32_t NumberOfHeaps)
+{
+    uint8_t Header[SIZEOF_SNAPSHOT_HEADER];
+    uint32_t Magic = HEAP_SNAPSHOT_MAGIC;
+    uint16_t Version = HEAP_SNAPSHOT_VERSION;
+    uint16_t Pointer = (uint16_t)PointerSize;
+
+    memset(Header, 0, sizeof(Header));
+    memcpy(Header, &Magic, 4);
+    memcpy(Header + 4, &Version, 2);
+    memcpy(Header + 6, &Pointer, 2);
+    memcpy(Header + 8, &NumberOfHeaps, 4);
+    return WriteBytes(File, Header, sizeof(Header));
+}
+
+bool HeapSnapshotCreate(PHEAP_SNAPSHOT_WRITER Writer, const char* FileName, uint32_t PointerSize)
+{
+    memset(Writer, 0, sizeof(*Writer));
+    Writer->Buffer = (uint8_t*)malloc(MAXIMUM_ENCODED_BLOCK);
+    Writer->File = fopen(FileName, "w+b");
+    if (Writer->Buffer == NULL || Writer->File == NULL) {
+        HeapSnapshotClose(Writer);
+        return false;
+    }
+
+    //
+    // The heap count is patched in by HeapSnapshotClose.
+    //
+    return WriteHeader(Writer->File, PointerSize, 0);
+}
+
+bool HeapSnapshotBeginHeap(PHEAP_SNAPSHOT_WRITER Writer, uint64_t Heap)
+{
+    Writer->Heap = Heap;
+    Writer->NumberOfEntries = 0;
+    return true;
+}
+
+bool HeapSnapshotAdd(PHEAP_SNAPSHOT_WRITER Writer, const HEAP_WALK_ENTRY* Entry)
+{
+    PHEAP_SNAPSHOT_ENTRY Record;
+
+    if (Writer->NumberOfEntries == Writer->MaximumEntries) {
+        size_t MaximumEntries = Writer->MaximumEntries != 0 ? Writer->MaximumEntries * 2 : 4096;
+        PHEAP_SNAPSHOT_ENTRY Entries = (PHEAP_SNAPSHOT_ENTRY)realloc(Writer->Entries,
+            MaximumEntries * sizeof(*Entries));
+
+        if (Entries == NULL) {
+            return false;
+        }
+        Writer->Entries = Entries;
+        Writer->MaximumEntries = MaximumEntries;
+    }
+
+    Record = &Writer->Entries[Writer->NumberOfEntries++];
+    Record->Address = Entry->lpData;
+    Record->Size = Entry->cbData;
+    Record->RegionIndex = Entry->iRegionIndex;
+    Record->Flags = Entry->wFlags;
+    return true;
+}
+
+static uint8_t* EncodeBlock(uint8_t* Cursor, const HEAP_SNAPSHOT_ENTRY* Entries, uint32_t Count)
+{
+    uint64_t Previous = 0;
+    uint32_t Index;
+    uint32_t Run;
+
+    for (Index = 0; Index < Count; ++Index) {
+        Cursor = PutVarint(Cursor, Entries[Index].Address - Previous);
+        Previous = Entries[Index].Address;
+    }
+    for (Index = 0; Index < Count; ++Index) {
+        Cursor = PutVarint(Cursor, Entries[Index].Size);
+    }
+    for (Index = 0; Index < Count; Index += Run) {
+        for (Run = 1; Index + Run < Count && Entries[Index + Run].Flags == Entries[Index].Flags; ++Run) {
+        }
+        Cursor = PutVarint(Cursor, Entries[Index].Flags);
+        Cursor = PutVarint(Cursor, Run);
+    }
+    for (Index = 0; Index < Count; Index += Run) {
+        for (Run = 1; Index + Run < Count && Entries[Index + Run].RegionIndex == Entries[Index].RegionIndex; ++Run) {
+        }
+        Cursor = PutVarint(Cursor, Entries[Index].RegionIndex);
+        Cursor = PutVarint(Cursor, Run);
+    }
+    return Cursor;
+}
+
+bool HeapSnapshotEndHeap(PHEAP_SNAPSHOT_WRITER Writer)
+{
+    uint8_t Section[SIZEOF_SECTION_HEADER];
+    uint64_t NumberOfEntries = Writer->NumberOfEntries;
+    uint32_t NumberOfBlocks;
+    size_t Index;
+
+    qsort(Writer->Entries, Writer->NumberOfEntries, sizeof(*Writer->Entries), CompareEntries);
+
+    NumberOfBlocks = (uint32_t)((Writer->NumberOfEntries + HEAP_SNAPSHOT_BLOCK_ENTRIES - 1) /
+        HEAP_SNAPSHOT_BLOCK_ENTRIES);
+    memset(Section, 0, sizeof(Section));
+    memcpy(Section, &Writer->Heap, 8);
+    memcpy(Section + 8, &NumberOfEntries, 8);
+    memcpy(Section + 16, &NumberOfBlocks, 4);
+    if (WriteBytes(Writer->File, Section, sizeof(Section)) == false) {
+        return false;
+    }
+
+    for (Index = 0; Index < Writer->NumberOfEntries; Index += HEAP_SNAPSHOT_BLOCK_ENTRIES) {
+        uint8_t BlockHeader[SIZEOF_BLOCK_HEADER];
+        uint32_t Count = (uint32_t)(Writer->NumberOfEntries - Index < HEAP_SNAPSHOT_BLOCK_ENTRIES ?
+            Writer->NumberOfEntries - Index : HEAP_SNAPSHOT_BLOCK_ENTRIES);
+        uint32_t EncodedSize = (uint32_t)(EncodeBlock(Writer->Buffer, Writer->Entries + Index, Count) -
+            Writer->Buffer);
+
+        memcpy(BlockHeader, &Count, 4);
+        memcpy(BlockHeader + 4, &EncodedSize, 4);
+        if (WriteBytes(Writer->File, BlockHeader, sizeof(BlockHeader)) == false ||
+            WriteBytes(Writer->File, Writer->Buffer, EncodedSize) == false) {
+            return false;
+        }
+    }
+
+    Writer->NumberOfHeaps += 1;
+    Writer->NumberOfEntries = 0;
+    return true;
+}
+
+bool HeapSnapshotClose(PHEAP_SNAPSHOT_WRITER Writer)
+{
+    bool Result = Writer->File != NULL;
+
+    if (Writer->File != NULL) {
+        uint8_t Pointer[2];
+
+        //
+        // Rewrite the header now that the number of heaps is known.
+        //
+        if (fseek(Writer->File, 6, SEEK_SET) != 0 || ReadBytes(Writer->File, Pointer, 2) == false ||
+            fseek(Writer->File, 0, SEEK_SET) != 0 ||
+            WriteHeader(Writer->File, Pointer[0] | (Pointer[1] << 8), Writer->NumberOfHeaps) == false) {
+            Result = false;
+        }
+        if (fclose(Writer->File) != 0) {
+            Result = false;
+        }
+    }
+    free(Writer->Entries);
+    free(Writer->Buffer);
+    memset(Writer, 0, sizeof(*Writer));
+    return Result;
+}
+
+bool HeapSnapshotOpen(PHEAP_SNAPSHOT_READER Reader, const char* FileName)
+{
+    uint8_t Header[SIZEOF_SNAPSHOT_HEADER];
+    uint32_t Magic;
+    uint16_t Version;
+    uint16_t PointerSize;
+
+    memset(Reader, 0, sizeof(*Reader));
+    Reader->File = fopen(FileName, "rb");
+    Reader->Buffer = (uint8_t*)malloc(MAXIMUM_ENCODED_BLOCK);
+    Reader->Block = (PHEAP_SNAPSHOT_ENTRY)malloc(HEAP_SNAPSHOT_BLOCK_ENTRIES * sizeof(*Reader->Block));
+    if (Reader->File == NULL || Reader->Buffer == NULL || Reader->Block == NULL ||
+        ReadBytes(Reader->File, Header, sizeof(Header)) == false) {
+        HeapSnapshotCloseReader(Reader);
+        return false;
+    }
+
+    memcpy(&Magic, Header, 4);
+    memcpy(&Version, Header + 4, 2);
+    memcpy(&PointerSize, Header + 6, 2);
+    memcpy(&Reader->NumberOfHeaps, Header + 8, 4);
+    if (Magic != HEAP_SNAPSHOT_MAGIC || Version != HEAP_SNAPSHOT_VERSION) {
+        HeapSnapshotCloseReader(Reader);
+        return false;
+    }
+    Reader->PointerSize = PointerSize;
+    return true;
+}
+
+static bool DecodeBlock(PHEAP_SNAPSHOT_READER Reader, uint32_t Count, uint32_t EncodedSize)
+{
+    const uint8_t* Cursor = Reader->Buffer;
+    const uint8_t* End = Reader->Buffer + EncodedSize;
+    uint64_t Address = 0;
+    uint64_t Value;
+    uint64_t Run;
+    uint32_t Index;
+
+    for (Index = 0; Index < Count && Cursor != NULL; ++Index) {
+        Cursor = GetVarint(Cursor, End, &Value);
+        Address += Value;
+        Reader->Block[Index].Address = Address;
+    }
+    for (Index = 0; Index < Count && Cursor != NULL; ++Index) {
+        Cursor = GetVarint(Cursor, End, &Reader->Block[Index].Size);
+    }
+    for (Index = 0; Index < Count && Cursor != NULL; ) {
+        Cursor = GetVarint(Cursor, End, &Value);
+        Cursor = Cursor != NULL ? GetVarint(Cursor, End, &Run) : NULL;
+        if (Cursor == NULL || Run == 0 || Run > Count - Index) {
+            return false;
+        }
+        for (; Run != 0; --Run) {
+            Reader->Block[Index++].Flags = (uint16_t)Value;
+        }
+    }
+    for (Index = 0; Index < Count && Cursor != NULL; ) {
+        Cursor = GetVarint(Cursor, End, &Value);
+        Cursor = Cursor != NULL ? GetVarint(Cursor, End, &Run) : NULL;
+        if (Cursor == NULL || Run == 0 || Run > Count - Index) {
+            return false;
+        }
+        for (; Run != 0; --Run) {
+            Reader->Block[Index++].RegionIndex = (uint32_t)Value;
+        }
+    }
+    return Cursor == End;
+}
+
+static bool ReadBlock(PHEAP_SNAPSHOT_READER Reader)
+{
+    uint8_t BlockHeader[SIZEOF_BLOCK_HEADER];
+    uint32_t Count;
+    uint32_t EncodedSize;
+
+    if (ReadBytes(Reader->File, BlockHeader, sizeof(BlockHeader)) == false) {
+        Reader->Corrupt = true;
+        return false;
+    }
+    memcpy(&Count, BlockHeader, 4);
+    memcpy(&EncodedSize, BlockHeader + 4, 4);
+    if (Count == 0 || Count > HEAP_SNAPSHOT_BLOCK_ENTRIES || Count > Reader->RemainingEntries ||
+        EncodedSize > MAXIMUM_ENCODED_BLOCK ||
+        ReadBytes(Reader->File, Reader->Buffer, EncodedSize) == false ||
+        DecodeBlock(Reader, Count, EncodedSize) == false) {
+        Reader->Corrupt = true;
+        return false;
+    }
+    Reader->BlockEntries = Count;
+    Reader->BlockPosition = 0;
+    return true;
+}
+
+bool HeapSnapshotNextHeap(PHEAP_SNAPSHOT_READER Reader)
+{
+    uint8_t Section[SIZEOF_SECTION_HEADER];
+
+    while (Reader->RemainingEntries != 0 && Reader->Corrupt == false) {
+        uint8_t BlockHeader[SIZEOF_BLOCK_HEADER];
+        uint32_t Count;
+        uint32_t EncodedSize;
+
+        if (ReadBytes(Reader->File, BlockHeader, sizeof(BlockHeader)) == false) {
+            Reader->Corrupt = true;
+            break;
+        }
+        memcpy(&Count, BlockHeader, 4);
+        memcpy(&EncodedSize, BlockHeader + 4, 4);
+        if (Count == 0 || Count > Reader->RemainingEntries ||
+            fseek(Reader->File, (long)EncodedSize, SEEK_CUR) != 0) {
+            Reader->Corrupt = true;
+            break;
+        }
+        Reader->RemainingEntries -= Count;
+    }
+    Reader->BlockEntries = 0;
+    Reader->BlockPosition = 0;
+    if (Reader->Corrupt || Reader->HeapIndex == Reader->NumberOfHeaps) {
+        return false;
+    }
+
+    if (ReadBytes(Reader->File, Section, sizeof(Section)) == false) {
+        Reader->Corrupt = true;
+        return false;
+    }
+    memcpy(&Reader->Heap, Section, 8);
+    memcpy(&Reader->RemainingEntries, Section + 8, 8);
+    Reader->HeapIndex += 1;
+    return true;
+}
+
+bool HeapSnapshotRewind(PHEAP_SNAPSHOT_READER Reader)
+{
+    Reader->HeapIndex = 0;
+    Reader->Heap = 0;
+    Reader->RemainingEntries = 0;
+    Reader->BlockEntries = 0;
+    Reader->BlockPosition = 0;
+    Reader->Corrupt = fseek(Reader->File, SIZEOF_SNAPSHOT_HEADER, SEEK_SET) != 0;
+    return Reader->Corrupt == false;
+}
+
+bool HeapSnapshotNextEntry(PHEAP_SNAPSHOT_READER Reader, PHEAP_SNAPSHOT_ENTRY Entry)
+{
+    if (Reader->BlockPosition == Reader->BlockEntries) {
+        if (Reader->RemainingEntries == 0 || Reader->Corrupt || ReadBlock(Reader) == false) {
+            return false;
+        }
+        Reader->RemainingEntries -= Reader->BlockEntries;
+    }
+    *Entry = Reader->Block[Reader->BlockPosition++];
+    return true;
+}
+
+void HeapSnapshotCloseReader(PHEAP_SNAPSHOT_READER Reader)
+{
+    if (Reader->File != NULL) {
+        fclose(Reader->File);
+    }
+    free(Reader->Buffer);
+    free(Reader->Block);
+    Reader->File = NULL;
+    Reader->Buffer = NULL;
+    Reader->Block = NULL;
+}
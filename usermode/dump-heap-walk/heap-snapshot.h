@@ -0,0 +1,87 @@
+// heap-snapshot.h : Compact binary snapshot of walked heaps, for offline diffing.
+//
+// A snapshot is a header followed by one section per heap. Each section holds
+// that heap's entries sorted by address, packed into blocks of up to
+// HEAP_SNAPSHOT_BLOCK_ENTRIES records. Inside a block the four fields are
+// stored column by column: address deltas and sizes as LEB128 varints, flags
+// and region indices as (value, run length) pairs since they rarely change
+// from one entry to the next. A typical entry takes 3-4 bytes instead of the
+// 24 of a raw record, and sorted sections let two snapshots be compared with
+// a single streaming merge.
+//
+
+#pragma once
+
+#include "heap-walk.h"
+
+#include <stdio.h>
+
+#define HEAP_SNAPSHOT_MAGIC             0x504e5348  // 'HSNP'
+#define HEAP_SNAPSHOT_VERSION           1
+#define HEAP_SNAPSHOT_BLOCK_ENTRIES     65536
+
+typedef struct _HEAP_SNAPSHOT_ENTRY {
+    uint64_t Address;
+    uint64_t Size;
+    uint32_t RegionIndex;
+    uint16_t Flags;
+} HEAP_SNAPSHOT_ENTRY, *PHEAP_SNAPSHOT_ENTRY;
+
+//
+// Writer. Entries of the current heap are buffered and sorted when the heap
+// is ended, since walkers visit segments in list order rather than by address.
+//
+typedef struct _HEAP_SNAPSHOT_WRITER {
+    FILE* File;
+    uint32_t NumberOfHeaps;
+    uint64_t Heap;
+    PHEAP_SNAPSHOT_ENTRY Entries;
+    size_t NumberOfEntries;
+    size_t MaximumEntries;
+    uint8_t* Buffer;
+} HEAP_SNAPSHOT_WRITER, *PHEAP_SNAPSHOT_WRITER;
+
+bool HeapSnapshotCreate(PHEAP_SNAPSHOT_WRITER Writer, const char* FileName, uint32_t PointerSize);
+bool HeapSnapshotBeginHeap(PHEAP_SNAPSHOT_WRITER Writer, uint64_t Heap);
+bool HeapSnapshotAdd(PHEAP_SNAPSHOT_WRITER Writer, const HEAP_WALK_ENTRY* Entry);
+bool HeapSnapshotEndHeap(PHEAP_SNAPSHOT_WRITER Writer);
+bool HeapSnapshotClose(PHEAP_SNAPSHOT_WRITER Writer);
+
+//
+// Streaming reader: only one decoded block per snapshot is held in memory,
+// whatever the number of entries.
+//
+typedef struct _HEAP_SNAPSHOT_READER {
+    FILE* File;
+    uint32_t PointerSize;
+    uint32_t NumberOfHeaps;
+    uint32_t HeapIndex;
+    uint64_t Heap;
+    uint64_t RemainingEntries;
+    HEAP_SNAPSHOT_ENTRY* Block;
+    uint32_t BlockEntries;
+    uint32_t BlockPosition;
+    uint8_t* Buffer;
+    bool Corrupt;
+} HEAP_SNAPSHOT_READER, *PHEAP_SNAPSHOT_READER;
+
+bool HeapSnapshotOpen(PHEAP_SNAPSHOT_READER Reader, const char* FileName);
+
+//
+// Moves to the next heap section, skipping the unread blocks of the current
+// one without decoding them. Returns false after the last one.
+//
+bool HeapSnapshotNextHeap(PHEAP_SNAPSHOT_READER Reader);
+
+//
+// Goes back before the first heap section, so sections can be looked up by
+// heap address: only section and block headers are read while skipping.
+//
+bool HeapSnapshotRewind(PHEAP_SNAPSHOT_READER Reader);
+
+//
+// Returns the next entry of the current heap in address order, or false at
+// the end of the section (or on a truncated / corrupt file, see Corrupt).
+//
+bool HeapSnapshotNextEntry(PHEAP_SNAPSHOT_READER Reader, PHEAP_SNAPSHOT_ENTRY Entry);
+void HeapSnapshotCloseReader(PHEAP_SNAPSHOT_READER Reader);
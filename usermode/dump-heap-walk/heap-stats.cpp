@@ -0,0 +1,150 @@
+// heap-stats.cpp : Bins walked heap entries into LFH-sized buckets.
+//
+
+#include "heap-stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+uint32_t HeapBucketBlockSize(uint32_t BucketIndex)
+{
+    if (BucketIndex == 0 || BucketIndex > HEAP_BUCKET_COUNT - 1) {
+        return 0;
+    }
+    if (BucketIndex <= 64) {
+        return BucketIndex * 16;
+    }
+
+    //
+    // Buckets 65..128 come in groups of 16, each group doubling the range
+    // it covers: 1KB-2KB, 2KB-4KB, 4KB-8KB and 8KB-16KB.
+    //
+    uint32_t Group = (BucketIndex - 65) / 16;
+    uint32_t Step = 64u << Group;
+
+    return (1024u << Group) + ((BucketIndex - 65) % 16 + 1) * Step;
+}
+
+uint32_t HeapBucketIndex(uint64_t Size)
+{
+    uint32_t Group;
+
+    if (Size <= 1024) {
+        return Size == 0 ? 1 : (uint32_t)((Size + 15) / 16);
+    }
+    if (Size > 16384) {
+        return HEAP_BUCKET_LARGE;
+    }
+    for (Group = 0; (2048ull << Group) < Size; ++Group) {
+    }
+    return 65 + Group * 16 +
+        (uint32_t)((Size - (1024ull << Group) + (64ull << Group) - 1) / (64ull << Group)) - 1;
+}
+
+void HeapStatsAdd(PHEAP_STATS Stats, const HEAP_WALK_ENTRY* Entry)
+{
+    PHEAP_BUCKET_STATS Bucket;
+
+    if ((Entry->wFlags & PROCESS_HEAP_REGION) != 0) {
+        Stats->CommittedBytes += Entry->Region.dwCommittedSize;
+        Stats->UnCommittedBytes += Entry->Region.dwUnCommittedSize;
+        return;
+    }
+    if ((Entry->wFlags & PROCESS_HEAP_UNCOMMITTED_RANGE) != 0) {
+        return;
+    }
+
+    if ((Entry->wFlags & HEAP_WALK_SUBSEGMENT) != 0 &&
+        Entry->Subsegment.Type == HEAP_WALK_SUBSEGMENT_VS) {
+        Stats->UnwalkedBytes += Entry->cbData;
+        return;
+    }
+    if ((Entry->wFlags & HEAP_WALK_SUBSEGMENT) != 0) {
+        uint64_t Blocks = (uint64_t)Entry->Subsegment.BlockSize * Entry->Subsegment.BlockCount;
+
+        //
+        // Without the block headers the payload of a busy block is its full
+        // block size; whatever the blocks do not cover is subsegment metadata.
+        //
+        Bucket = &Stats->Buckets[HeapBucketIndex(Entry->Subsegment.BlockSize)];
+        Bucket->BusyBlocks += Entry->Subsegment.BusyCount;
+        Bucket->FreeBlocks += Entry->Subsegment.BlockCount - Entry->Subsegment.BusyCount;
+        Bucket->PayloadBytes += (uint64_t)Entry->Subsegment.BlockSize * Entry->Subsegment.BusyCount;
+        Bucket->FreeBytes += (uint64_t)Entry->Subsegment.BlockSize *
+            (Entry->Subsegment.BlockCount - Entry->Subsegment.BusyCount);
+        Bucket->OverheadBytes += Entry->cbData + Entry->cbOverhead > Blocks ?
+            Entry->cbData + Entry->cbOverhead - Blocks : 0;
+        return;
+    }
+
+    if ((Entry->wFlags & PROCESS_HEAP_ENTRY_BUSY) != 0) {
+        Bucket = &Stats->Buckets[HeapBucketIndex(Entry->cbData)];
+        Bucket->BusyBlocks += 1;
+        Bucket->PayloadBytes += Entry->cbData;
+        Bucket->OverheadBytes += Entry->cbOverhead;
+    }
+    else {
+        Bucket = &Stats->Buckets[HeapBucketIndex(Entry->cbData + Entry->cbOverhead)];
+        Bucket->FreeBlocks += 1;
+        Bucket->FreeBytes += Entry->cbData;
+        Bucket->OverheadBytes += Entry->cbOverhead;
+    }
+}
+
+void HeapStatsPrint(const HEAP_STATS* Stats, const char* HeapType)
+{
+    HEAP_BUCKET_STATS Total;
+    uint32_t Index;
+
+    memset(&Total, 0, sizeof(Total));
+
+    printf("%s statistics\n  %llu bytes committed\n  %llu bytes uncommitted\n\n",
+        HeapType,
+        (unsigned long long)Stats->CommittedBytes,
+        (unsigned long long)Stats->UnCommittedBytes);
+    printf("  %-8s %10s %10s %10s %14s %14s %10s\n",
+        "Bucket", "Size", "Busy", "Free", "Payload", "Overhead", "Overhead%");
+
+    for (Index = 0; Index <= HEAP_BUCKET_LARGE; ++Index) {
+        const HEAP_BUCKET_STATS* Bucket = &Stats->Buckets[Index];
+
+        if (Bucket->BusyBlocks == 0 && Bucket->FreeBlocks == 0) {
+            continue;
+        }
+        if (Index == HEAP_BUCKET_LARGE) {
+            printf("  %-8s %10s", "large", "> 16384");
+        }
+        else {
+            printf("  %-8u %10u", Index, HeapBucketBlockSize(Index));
+        }
+        printf(" %10llu %10llu %14llu %14llu %9.1f%%\n",
+            (unsigned long long)Bucket->BusyBlocks,
+            (unsigned long long)Bucket->FreeBlocks,
+            (unsigned long long)Bucket->PayloadBytes,
+            (unsigned long long)Bucket->OverheadBytes,
+            Bucket->PayloadBytes != 0 ?
+                100.0 * (double)Bucket->OverheadBytes / (double)Bucket->PayloadBytes : 0.0);
+
+        Total.BusyBlocks += Bucket->BusyBlocks;
+        Total.FreeBlocks += Bucket->FreeBlocks;
+        Total.PayloadBytes += Bucket->PayloadBytes;
+        Total.OverheadBytes += Bucket->OverheadBytes;
+        Total.FreeBytes += Bucket->FreeBytes;
+    }
+
+    printf("\n  %llu busy blocks, %llu bytes payload, %llu bytes overhead, %llu bytes free\n",
+        (unsigned long long)Total.BusyBlocks,
+        (unsigned long long)Total.PayloadBytes,
+        (unsigned long long)Total.OverheadBytes,
+        (unsigned long long)Total.FreeBytes);
+    if (Total.PayloadBytes != 0) {
+        printf("  Overhead: %.1f%% of payload, %.2f committed bytes per payload byte\n",
+            100.0 * (double)Total.OverheadBytes / (double)Total.PayloadBytes,
+            (double)Stats->CommittedBytes / (double)Total.PayloadBytes);
+    }
+    if (Stats->UnwalkedBytes != 0) {
+        printf("  %llu bytes of VS subsegments not broken down, pass --heap-key to walk them\n",
+            (unsigned long long)Stats->UnwalkedBytes);
+    }
+    printf("\n");
+}
@@ -0,0 +1,42 @@
+// heap-stats.h : Per-bucket occupancy and overhead accounting for walked heaps.
+//
+
+#pragma once
+
+#include "heap-walk.h"
+
+//
+// The segment heap's LFH buckets: 16-byte steps up to 1KB, then 16 buckets
+// per power of two up to 16KB. NT heap blocks are binned with the same table
+// so the two heap types can be compared bucket by bucket; everything above
+// the last bucket lands in HEAP_BUCKET_LARGE.
+//
+#define HEAP_BUCKET_COUNT       129
+#define HEAP_BUCKET_LARGE       HEAP_BUCKET_COUNT
+
+uint32_t HeapBucketBlockSize(uint32_t BucketIndex);
+uint32_t HeapBucketIndex(uint64_t Size);
+
+typedef struct _HEAP_BUCKET_STATS {
+    uint64_t BusyBlocks;
+    uint64_t FreeBlocks;
+    uint64_t PayloadBytes;
+    uint64_t OverheadBytes;
+    uint64_t FreeBytes;
+} HEAP_BUCKET_STATS, *PHEAP_BUCKET_STATS;
+
+typedef struct _HEAP_STATS {
+    uint64_t CommittedBytes;
+    uint64_t UnCommittedBytes;
+    uint64_t UnwalkedBytes;
+    HEAP_BUCKET_STATS Buckets[HEAP_BUCKET_COUNT + 1];
+} HEAP_STATS, *PHEAP_STATS;
+
+void HeapStatsAdd(PHEAP_STATS Stats, const HEAP_WALK_ENTRY* Entry);
+
+//
+// Prints the non-empty buckets, then the totals: overhead relative to the
+// payload and committed bytes per payload byte are the two numbers to compare
+// when choosing between the NT heap and the segment heap for a workload.
+//
+void HeapStatsPrint(const HEAP_STATS* Stats, const char* HeapType);
@@ -0,0 +1,96 @@
+// heap-walk.cpp : Locates the process heaps in the PEB and dispatches to the right walker.
+//
+
+#include "heap-walk.h"
+
+#include <string.h>
+
+//
+// PEB.NumberOfHeaps and PEB.ProcessHeaps.
+//
+#define PEB32_NUMBER_OF_HEAPS   0x88
+#define PEB32_PROCESS_HEAPS     0x90
+#define PEB64_NUMBER_OF_HEAPS   0xe8
+#define PEB64_PROCESS_HEAPS     0xf0
+
+uint32_t DumpGetProcessHeaps(PDUMP_FILE Dump, uint32_t NumberOfHeaps, uint64_t* Heaps)
+{
+    uint32_t ProcessHeapsCount;
+    uint64_t ProcessHeaps;
+    uint32_t HeapsIndex;
+
+    if (DumpReadUlong(Dump, Dump->Peb +
+            (Dump->PointerSize == 8 ? PEB64_NUMBER_OF_HEAPS : PEB32_NUMBER_OF_HEAPS),
+            &ProcessHeapsCount) == false ||
+        DumpReadPointer(Dump, Dump->Peb +
+            (Dump->PointerSize == 8 ? PEB64_PROCESS_HEAPS : PEB32_PROCESS_HEAPS),
+            &ProcessHeaps) == false) {
+        return 0;
+    }
+
+    //
+    // Like GetProcessHeaps, a buffer that is too small is not an error: the
+    // caller compares the return value with the length it passed in.
+    //
+    for (HeapsIndex = 0; HeapsIndex < ProcessHeapsCount && HeapsIndex < NumberOfHeaps; ++HeapsIndex) {
+        if (DumpReadPointer(Dump, ProcessHeaps + (uint64_t)HeapsIndex * Dump->PointerSize,
+                &Heaps[HeapsIndex]) == false) {
+            return 0;
+        }
+    }
+    return ProcessHeapsCount;
+}
+
+bool HeapWalkBegin(PHEAP_WALK Walk, PDUMP_FILE Dump, uint64_t Heap,
+    const uint64_t* HeapKey, const uint64_t* LfhKey)
+{
+    uint32_t Signature;
+
+    memset(Walk, 0, sizeof(*Walk));
+    Walk->Dump = Dump;
+    Walk->Heap = Heap;
+    if (HeapKey != NULL) {
+        Walk->HasHeapKey = true;
+        Walk->HeapKey = *HeapKey;
+    }
+    if (LfhKey != NULL) {
+        Walk->HasLfhKey = true;
+        Walk->LfhKey = *LfhKey;
+    }
+
+    //
+    // Both heap types keep a signature right after the first header: the
+    // NT heap in _HEAP_SEGMENT.SegmentSignature, the segment heap in
+    // _SEGMENT_HEAP.Signature.
+    //
+    if (DumpReadUlong(Dump, Heap + 2 * Dump->PointerSize, &Signature) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        return false;
+    }
+    switch (Signature) {
+    case NT_HEAP_SIGNATURE:
+        Walk->Type = HEAP_TYPE_NT;
+        return NtHeapWalkBegin(Walk);
+    case SEGMENT_HEAP_SIGNATURE:
+        Walk->Type = HEAP_TYPE_SEGMENT;
+        return SegmentHeapWalkBegin(Walk);
+    default:
+        Walk->LastError = ERROR_INVALID_DATA;
+        return false;
+    }
+}
+
+bool HeapWalkNext(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    if (Walk->Type == HEAP_TYPE_SEGMENT) {
+        return SegmentHeapWalkNext(Walk, Entry);
+    }
+    return NtHeapWalkNext(Walk, Entry);
+}
+
+void HeapWalkEnd(PHEAP_WALK Walk)
+{
+    if (Walk->Type == HEAP_TYPE_NT) {
+        NtHeapWalkEnd(Walk);
+    }
+}
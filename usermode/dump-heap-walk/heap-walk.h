@@ -0,0 +1,178 @@
+// heap-walk.h : HeapWalk-style enumeration of the heaps captured in a dump.
+//
+
+#pragma once
+
+#include "dump-file.h"
+
+//
+// Same values as the PROCESS_HEAP_ENTRY flags in winbase.h so that the
+// printing code can be shared with enumerate-heap.
+//
+#ifndef PROCESS_HEAP_REGION
+#define PROCESS_HEAP_REGION             0x0001
+#define PROCESS_HEAP_UNCOMMITTED_RANGE  0x0002
+#define PROCESS_HEAP_ENTRY_BUSY         0x0004
+#define PROCESS_HEAP_SEG_ALLOC          0x0008
+#define PROCESS_HEAP_ENTRY_MOVEABLE     0x0010
+#define PROCESS_HEAP_ENTRY_DDESHARE     0x0020
+#endif
+
+//
+// Set instead of individual blocks for segment heap LFH and VS subsegments
+// whose block headers cannot be decoded without the heap's random keys.
+//
+#define HEAP_WALK_SUBSEGMENT            0x0100
+
+#define HEAP_WALK_SUBSEGMENT_LFH        1
+#define HEAP_WALK_SUBSEGMENT_VS         2
+
+#ifndef ERROR_NO_MORE_ITEMS
+#define ERROR_NOT_ENOUGH_MEMORY         8
+#define ERROR_INVALID_DATA              13
+#define ERROR_WRITE_FAULT               29
+#define ERROR_NOT_SUPPORTED             50
+#define ERROR_NO_MORE_ITEMS             259
+#define ERROR_PARTIAL_COPY              299
+#endif
+
+//
+// PROCESS_HEAP_ENTRY with every address widened to 64 bits, so a 64-bit
+// host can walk a 32-bit dump and vice versa.
+//
+typedef struct _HEAP_WALK_ENTRY {
+    uint64_t lpData;
+    uint64_t cbData;
+    uint32_t cbOverhead;
+    uint32_t iRegionIndex;
+    uint16_t wFlags;
+    union {
+        struct {
+            uint64_t hMem;
+        } Block;
+        struct {
+            uint64_t dwCommittedSize;
+            uint64_t dwUnCommittedSize;
+            uint64_t lpFirstBlock;
+            uint64_t lpLastBlock;
+        } Region;
+        struct {
+            uint32_t Type;
+            uint32_t BlockSize;
+            uint32_t BlockCount;
+            uint32_t BusyCount;
+        } Subsegment;
+    };
+} HEAP_WALK_ENTRY, *PHEAP_WALK_ENTRY;
+
+typedef struct _NT_HEAP_UCR {
+    uint64_t Address;
+    uint64_t Size;
+} NT_HEAP_UCR, *PNT_HEAP_UCR;
+
+typedef struct _NT_HEAP_WALK {
+    uint32_t Phase;
+    uint64_t SegmentLink;
+    uint32_t SegmentIndex;
+    uint64_t Current;
+    uint64_t LastValidEntry;
+    uint8_t Encoding[16];
+    bool Encoded;
+    PNT_HEAP_UCR Ucrs;
+    uint32_t NumberOfUcrs;
+    uint64_t VirtualLink;
+} NT_HEAP_WALK, *PNT_HEAP_WALK;
+
+#define SEGMENT_HEAP_UNITS_PER_SEGMENT  256
+#define SEGMENT_HEAP_DESCRIPTOR_SIZE    0x20
+#define SEGMENT_HEAP_MAX_TREE_DEPTH     64
+
+typedef struct _SEGMENT_HEAP_WALK {
+    uint32_t Phase;
+    uint32_t ContextIndex;
+    uint64_t SegmentListHead;
+    uint64_t SegmentLink;
+    uint64_t Segment;
+    uint32_t SegmentIndex;
+    uint8_t UnitShift;
+    uint8_t FirstDescriptorIndex;
+    uint32_t DescriptorIndex;
+    uint8_t Descriptors[SEGMENT_HEAP_UNITS_PER_SEGMENT * SEGMENT_HEAP_DESCRIPTOR_SIZE];
+
+    //
+    // Subsegment whose blocks are being enumerated one by one.
+    //
+    uint32_t SubsegmentType;
+    uint64_t SubsegmentEnd;
+    uint64_t Block;
+    uint32_t BlockSize;
+    uint32_t BlockIndex;
+    uint32_t BlockCount;
+    uint64_t BlockBitmap;
+
+    //
+    // In-order traversal of the LargeAllocMetadata red-black tree.
+    //
+    bool LargeTreeEncoded;
+    uint64_t LargeNode;
+    uint64_t LargeStack[SEGMENT_HEAP_MAX_TREE_DEPTH];
+    uint32_t LargeDepth;
+} SEGMENT_HEAP_WALK, *PSEGMENT_HEAP_WALK;
+
+#define NT_HEAP_SIGNATURE               0xffeeffee
+#define SEGMENT_HEAP_SIGNATURE          0xddeeddee
+
+#define HEAP_TYPE_NT                    1
+#define HEAP_TYPE_SEGMENT               2
+
+typedef struct _HEAP_WALK {
+    PDUMP_FILE Dump;
+    uint64_t Heap;
+    uint32_t Type;
+    uint32_t LastError;
+
+    //
+    // RtlpHpHeapGlobals.HeapKey and .LfhKey, if the caller recovered them
+    // (e.g. with a debugger). Without them VS and LFH subsegments are
+    // reported as one HEAP_WALK_SUBSEGMENT entry each.
+    //
+    bool HasHeapKey;
+    uint64_t HeapKey;
+    bool HasLfhKey;
+    uint64_t LfhKey;
+
+    NT_HEAP_WALK Nt;
+    SEGMENT_HEAP_WALK Segment;
+} HEAP_WALK, *PHEAP_WALK;
+
+//
+// Equivalent of GetProcessHeaps for the dumped process: returns the number of
+// heaps in PEB.ProcessHeaps and copies at most NumberOfHeaps of them, or 0 if
+// the PEB or the array was not captured.
+//
+uint32_t DumpGetProcessHeaps(PDUMP_FILE Dump, uint32_t NumberOfHeaps, uint64_t* Heaps);
+
+//
+// Equivalent of HeapWalk. HeapWalkNext returns false with LastError set to
+// ERROR_NO_MORE_ITEMS once the heap is exhausted, ERROR_PARTIAL_COPY when it
+// needs memory that is not in the dump and ERROR_INVALID_DATA on corruption.
+// HeapWalkBegin detects whether Heap is an NT heap or a segment heap; the
+// keys are optional and only used for the latter.
+//
+bool HeapWalkBegin(PHEAP_WALK Walk, PDUMP_FILE Dump, uint64_t Heap,
+    const uint64_t* HeapKey, const uint64_t* LfhKey);
+bool HeapWalkNext(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry);
+void HeapWalkEnd(PHEAP_WALK Walk);
+
+//
+// NT heap (segment list and VirtualAllocdBlocks) walker, nt-heap.cpp.
+//
+bool NtHeapWalkBegin(PHEAP_WALK Walk);
+bool NtHeapWalkNext(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry);
+void NtHeapWalkEnd(PHEAP_WALK Walk);
+
+//
+// Segment heap (backend, VS, LFH and large allocations) walker, segment-heap.cpp.
+//
+bool SegmentHeapWalkBegin(PHEAP_WALK Walk);
+bool SegmentHeapWalkNext(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry);
@@ -0,0 +1,394 @@
+// nt-heap.cpp : Walks the segments, uncommitted ranges and large blocks of an NT heap.
+//
+
+#include "heap-walk.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HEAP_ENTRY_BUSY         0x01
+#define HEAP_ENTRY_LAST_ENTRY   0x10
+
+//
+// Guards against looping forever on a corrupt or partially captured list.
+//
+#define MAX_LIST_ENTRIES        0x10000
+
+#define PHASE_NEXT_SEGMENT      0
+#define PHASE_SEGMENT_ENTRIES   1
+#define PHASE_VIRTUAL_BLOCKS    2
+#define PHASE_DONE              3
+
+//
+// Field offsets of _HEAP, _HEAP_SEGMENT, _HEAP_UCR_DESCRIPTOR and
+// _HEAP_VIRTUAL_ALLOC_ENTRY as of Windows 8 through Windows 11. The first
+// segment of a heap is embedded at the start of the _HEAP itself.
+//
+typedef struct _NT_HEAP_LAYOUT {
+    uint32_t Granularity;
+    uint32_t SegmentSignature;
+    uint32_t SegmentListEntry;
+    uint32_t BaseAddress;
+    uint32_t NumberOfPages;
+    uint32_t FirstEntry;
+    uint32_t LastValidEntry;
+    uint32_t NumberOfUnCommittedPages;
+    uint32_t NumberOfUnCommittedRanges;
+    uint32_t UCRSegmentList;
+    uint32_t EncodeFlagMask;
+    uint32_t Encoding;
+    uint32_t VirtualAllocdBlocks;
+    uint32_t SegmentList;
+    uint32_t UcrSegmentEntry;
+    uint32_t UcrAddress;
+    uint32_t UcrSize;
+    uint32_t VirtualCommitSize;
+    uint32_t VirtualBusyBlock;
+} NT_HEAP_LAYOUT;
+
+static const NT_HEAP_LAYOUT NtHeapLayout32 = {
+    8, 0x08, 0x10, 0x1c, 0x20, 0x24, 0x28, 0x2c, 0x30, 0x38,
+    0x4c, 0x50, 0x9c, 0xa4,
+    0x08, 0x10, 0x14,
+    0x10, 0x18,
+};
+
+static const NT_HEAP_LAYOUT NtHeapLayout64 = {
+    16, 0x10, 0x18, 0x30, 0x38, 0x40, 0x48, 0x50, 0x54, 0x60,
+    0x7c, 0x80, 0x110, 0x120,
+    0x10, 0x20, 0x28,
+    0x20, 0x30,
+};
+
+#define PAGE_SIZE               0x1000
+
+static const NT_HEAP_LAYOUT* GetLayout(PHEAP_WALK Walk)
+{
+    return Walk->Dump->PointerSize == 8 ? &NtHeapLayout64 : &NtHeapLayout32;
+}
+
+//
+// Decoded view of a _HEAP_ENTRY.
+//
+typedef struct _NT_HEAP_ENTRY {
+    uint32_t Size;
+    uint8_t Flags;
+    uint8_t UnusedBytes;
+} NT_HEAP_ENTRY;
+
+static bool ReadHeapEntry(PHEAP_WALK Walk, uint64_t Address, NT_HEAP_ENTRY* Entry)
+{
+    const NT_HEAP_LAYOUT* Layout = GetLayout(Walk);
+    uint8_t Raw[16];
+    uint8_t* Header;
+    uint32_t Index;
+
+    if (DumpRead(Walk->Dump, Address, Raw, Layout->Granularity) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        return false;
+    }
+
+    //
+    // On 64-bit the first eight bytes belong to the previous block; the
+    // interesting half is the second one, which is also the encoded part.
+    //
+    Header = Layout->Granularity == 16 ? Raw + 8 : Raw;
+    if (Walk->Nt.Encoded) {
+        const uint8_t* Key = Walk->Nt.Encoding + (Layout->Granularity == 16 ? 8 : 0);
+
+        for (Index = 0; Index < 8; ++Index) {
+            Header[Index] ^= Key[Index];
+        }
+
+        //
+        // SmallTagIndex doubles as a checksum of the first three bytes.
+        //
+        if ((uint8_t)(Header[0] ^ Header[1] ^ Header[2]) != Header[3]) {
+            Walk->LastError = ERROR_INVALID_DATA;
+            return false;
+        }
+    }
+
+    Entry->Size = (uint32_t)(Header[0] | (Header[1] << 8)) * Layout->Granularity;
+    Entry->Flags = Header[2];
+    Entry->UnusedBytes = Header[7];
+    return true;
+}
+
+static int CompareUcrs(const void* Left, const void* Right)
+{
+    const NT_HEAP_UCR* A = (const NT_HEAP_UCR*)Left;
+    const NT_HEAP_UCR* B = (const NT_HEAP_UCR*)Right;
+
+    if (A->Address < B->Address) {
+        return -1;
+    }
+    return A->Address > B->Address;
+}
+
+//
+// Collect the uncommitted ranges of the current segment. HeapWalk reports
+// them inline with the blocks, so the walker needs to know where they start.
+//
+static bool LoadUncommittedRanges(PHEAP_WALK Walk, uint64_t Segment, uint32_t NumberOfRanges)
+{
+    const NT_HEAP_LAYOUT* Layout = GetLayout(Walk);
+    uint64_t Head = Segment + Layout->UCRSegmentList;
+    uint64_t Link;
+    uint32_t Count = 0;
+
+    free(Walk->Nt.Ucrs);
+    Walk->Nt.Ucrs = NULL;
+    Walk->Nt.NumberOfUcrs = 0;
+    if (NumberOfRanges == 0) {
+        return true;
+    }
+    if (NumberOfRanges > MAX_LIST_ENTRIES) {
+        Walk->LastError = ERROR_INVALID_DATA;
+        return false;
+    }
+
+    Walk->Nt.Ucrs = (PNT_HEAP_UCR)calloc(NumberOfRanges, sizeof(*Walk->Nt.Ucrs));
+    if (Walk->Nt.Ucrs == NULL) {
+        return false;
+    }
+
+    if (DumpReadPointer(Walk->Dump, Head, &Link) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        return false;
+    }
+    while (Link != Head && Count < NumberOfRanges) {
+        uint64_t Descriptor = Link - Layout->UcrSegmentEntry;
+
+        if (DumpReadPointer(Walk->Dump, Descriptor + Layout->UcrAddress, &Walk->Nt.Ucrs[Count].Address) == false ||
+            DumpReadPointer(Walk->Dump, Descriptor + Layout->UcrSize, &Walk->Nt.Ucrs[Count].Size) == false ||
+            DumpReadPointer(Walk->Dump, Link, &Link) == false) {
+            Walk->LastError = ERROR_PARTIAL_COPY;
+            return false;
+        }
+        ++Count;
+    }
+    qsort(Walk->Nt.Ucrs, Count, sizeof(*Walk->Nt.Ucrs), CompareUcrs);
+    Walk->Nt.NumberOfUcrs = Count;
+    return true;
+}
+
+static bool FindUncommittedRange(PHEAP_WALK Walk, uint64_t Address, uint64_t* Size)
+{
+    uint32_t Low = 0;
+    uint32_t High = Walk->Nt.NumberOfUcrs;
+
+    while (Low < High) {
+        uint32_t Middle = Low + (High - Low) / 2;
+
+        if (Walk->Nt.Ucrs[Middle].Address == Address) {
+            *Size = Walk->Nt.Ucrs[Middle].Size;
+            return true;
+        }
+        if (Walk->Nt.Ucrs[Middle].Address < Address) {
+            Low = Middle + 1;
+        }
+        else {
+            High = Middle;
+        }
+    }
+    return false;
+}
+
+bool NtHeapWalkBegin(PHEAP_WALK Walk)
+{
+    const NT_HEAP_LAYOUT* Layout = GetLayout(Walk);
+    uint32_t EncodeFlagMask;
+
+    memset(&Walk->Nt, 0, sizeof(Walk->Nt));
+    if (DumpReadUlong(Walk->Dump, Walk->Heap + Layout->EncodeFlagMask, &EncodeFlagMask) == false ||
+        DumpRead(Walk->Dump, Walk->Heap + Layout->Encoding, Walk->Nt.Encoding, Layout->Granularity) == false ||
+        DumpReadPointer(Walk->Dump, Walk->Heap + Layout->SegmentList, &Walk->Nt.SegmentLink) == false ||
+        DumpReadPointer(Walk->Dump, Walk->Heap + Layout->VirtualAllocdBlocks, &Walk->Nt.VirtualLink) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        return false;
+    }
+    Walk->Nt.Encoded = EncodeFlagMask != 0;
+    Walk->Nt.Phase = PHASE_NEXT_SEGMENT;
+    return true;
+}
+
+static bool NextSegment(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    const NT_HEAP_LAYOUT* Layout = GetLayout(Walk);
+    uint64_t Segment;
+    uint64_t BaseAddress;
+    uint64_t LastValidEntry;
+    uint32_t NumberOfPages;
+    uint32_t NumberOfUnCommittedPages;
+    uint32_t NumberOfUnCommittedRanges;
+    uint32_t Signature;
+
+    if (Walk->Nt.SegmentLink == Walk->Heap + Layout->SegmentList ||
+        Walk->Nt.SegmentIndex >= MAX_LIST_ENTRIES) {
+        Walk->Nt.Phase = PHASE_VIRTUAL_BLOCKS;
+        return false;
+    }
+
+    Segment = Walk->Nt.SegmentLink - Layout->SegmentListEntry;
+    if (DumpReadUlong(Walk->Dump, Segment + Layout->SegmentSignature, &Signature) == false ||
+        DumpReadPointer(Walk->Dump, Segment + Layout->BaseAddress, &BaseAddress) == false ||
+        DumpReadUlong(Walk->Dump, Segment + Layout->NumberOfPages, &NumberOfPages) == false ||
+        DumpReadPointer(Walk->Dump, Segment + Layout->FirstEntry, &Walk->Nt.Current) == false ||
+        DumpReadPointer(Walk->Dump, Segment + Layout->LastValidEntry, &LastValidEntry) == false ||
+        DumpReadUlong(Walk->Dump, Segment + Layout->NumberOfUnCommittedPages, &NumberOfUnCommittedPages) == false ||
+        DumpReadUlong(Walk->Dump, Segment + Layout->NumberOfUnCommittedRanges, &NumberOfUnCommittedRanges) == false ||
+        DumpReadPointer(Walk->Dump, Walk->Nt.SegmentLink, &Walk->Nt.SegmentLink) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        Walk->Nt.Phase = PHASE_DONE;
+        return false;
+    }
+    if (Signature != NT_HEAP_SIGNATURE) {
+        Walk->LastError = ERROR_INVALID_DATA;
+        Walk->Nt.Phase = PHASE_DONE;
+        return false;
+    }
+    if (LoadUncommittedRanges(Walk, Segment, NumberOfUnCommittedRanges) == false) {
+        Walk->Nt.Phase = PHASE_DONE;
+        return false;
+    }
+    Walk->Nt.LastValidEntry = LastValidEntry;
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->wFlags = PROCESS_HEAP_REGION;
+    Entry->lpData = BaseAddress;
+    Entry->cbData = (uint64_t)NumberOfPages * PAGE_SIZE;
+    Entry->cbOverhead = (uint32_t)(Walk->Nt.Current - BaseAddress);
+    Entry->iRegionIndex = Walk->Nt.SegmentIndex;
+    Entry->Region.dwCommittedSize = (uint64_t)(NumberOfPages - NumberOfUnCommittedPages) * PAGE_SIZE;
+    Entry->Region.dwUnCommittedSize = (uint64_t)NumberOfUnCommittedPages * PAGE_SIZE;
+    Entry->Region.lpFirstBlock = Walk->Nt.Current;
+    Entry->Region.lpLastBlock = LastValidEntry;
+
+    Walk->Nt.Phase = PHASE_SEGMENT_ENTRIES;
+    return true;
+}
+
+static bool NextSegmentEntry(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    const NT_HEAP_LAYOUT* Layout = GetLayout(Walk);
+    NT_HEAP_ENTRY Header;
+    uint64_t UncommittedSize;
+
+    if (Walk->Nt.Current >= Walk->Nt.LastValidEntry) {
+        Walk->Nt.SegmentIndex += 1;
+        Walk->Nt.Phase = PHASE_NEXT_SEGMENT;
+        return false;
+    }
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->iRegionIndex = Walk->Nt.SegmentIndex;
+
+    if (FindUncommittedRange(Walk, Walk->Nt.Current, &UncommittedSize)) {
+        Entry->wFlags = PROCESS_HEAP_UNCOMMITTED_RANGE;
+        Entry->lpData = Walk->Nt.Current;
+        Entry->cbData = UncommittedSize;
+        Walk->Nt.Current += UncommittedSize;
+        return true;
+    }
+
+    if (ReadHeapEntry(Walk, Walk->Nt.Current, &Header) == false) {
+        Walk->Nt.Phase = PHASE_DONE;
+        return false;
+    }
+    if (Header.Size == 0 || Header.Size > Walk->Nt.LastValidEntry - Walk->Nt.Current) {
+        Walk->LastError = ERROR_INVALID_DATA;
+        Walk->Nt.Phase = PHASE_DONE;
+        return false;
+    }
+
+    Entry->lpData = Walk->Nt.Current + Layout->Granularity;
+    if ((Header.Flags & HEAP_ENTRY_BUSY) != 0) {
+
+        //
+        // For busy blocks UnusedBytes already accounts for the header, which
+        // is how HeapWalk computes cbOverhead as well.
+        //
+        Entry->wFlags = PROCESS_HEAP_ENTRY_BUSY;
+        Entry->cbOverhead = Header.UnusedBytes >= Layout->Granularity &&
+            Header.UnusedBytes <= Header.Size ? Header.UnusedBytes : Layout->Granularity;
+        Entry->cbData = Header.Size - Entry->cbOverhead;
+    }
+    else {
+        Entry->cbOverhead = Layout->Granularity;
+        Entry->cbData = Header.Size - Layout->Granularity;
+    }
+
+    //
+    // A block followed by an uncommitted range carries HEAP_ENTRY_LAST_ENTRY;
+    // stepping over it lands exactly on the range descriptor's address.
+    //
+    Walk->Nt.Current += Header.Size;
+    return true;
+}
+
+static bool NextVirtualBlock(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    const NT_HEAP_LAYOUT* Layout = GetLayout(Walk);
+    uint64_t Block = Walk->Nt.VirtualLink;
+    uint64_t CommitSize;
+
+    if (Block == Walk->Heap + Layout->VirtualAllocdBlocks) {
+        Walk->Nt.Phase = PHASE_DONE;
+        Walk->LastError = ERROR_NO_MORE_ITEMS;
+        return false;
+    }
+
+    //
+    // The LIST_ENTRY is the first member of _HEAP_VIRTUAL_ALLOC_ENTRY.
+    //
+    if (DumpReadPointer(Walk->Dump, Block + Layout->VirtualCommitSize, &CommitSize) == false ||
+        DumpReadPointer(Walk->Dump, Block, &Walk->Nt.VirtualLink) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        Walk->Nt.Phase = PHASE_DONE;
+        return false;
+    }
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->wFlags = PROCESS_HEAP_ENTRY_BUSY;
+    Entry->lpData = Block + Layout->VirtualBusyBlock + Layout->Granularity;
+    Entry->cbOverhead = Layout->VirtualBusyBlock + Layout->Granularity;
+    Entry->cbData = CommitSize > Entry->cbOverhead ? CommitSize - Entry->cbOverhead : 0;
+    Entry->iRegionIndex = Walk->Nt.SegmentIndex;
+    return true;
+}
+
+bool NtHeapWalkNext(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    for (;;) {
+        switch (Walk->Nt.Phase) {
+        case PHASE_NEXT_SEGMENT:
+            if (NextSegment(Walk, Entry)) {
+                return true;
+            }
+            break;
+        case PHASE_SEGMENT_ENTRIES:
+            if (NextSegmentEntry(Walk, Entry)) {
+                return true;
+            }
+            break;
+        case PHASE_VIRTUAL_BLOCKS:
+            if (NextVirtualBlock(Walk, Entry)) {
+                return true;
+            }
+            break;
+        default:
+            if (Walk->LastError == 0) {
+                Walk->LastError = ERROR_NO_MORE_ITEMS;
+            }
+            return false;
+        }
+    }
+}
+
+void NtHeapWalkEnd(PHEAP_WALK Walk)
+{
+    free(Walk->Nt.Ucrs);
+    Walk->Nt.Ucrs = NULL;
+    Walk->Nt.NumberOfUcrs = 0;
+}
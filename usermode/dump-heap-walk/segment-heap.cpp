@@ -0,0 +1,559 @@
+// segment-heap.cpp : Walks the backend, VS, LFH and large allocations of a segment heap.
+//
+// Layouts follow the 64-bit _SEGMENT_HEAP of Windows 10 2004 and later, as
+// described in "Windows 10 Segment Heap Internals" (Mark Vincent Yason). The
+// backend page range descriptors are not encoded and are always walked. VS
+// chunk headers are XORed with RtlpHpHeapGlobals.HeapKey and the LFH block
+// offsets with RtlpHpHeapGlobals.LfhKey, so the individual blocks of those
+// subsegments are only reported when the caller supplies the matching key.
+//
+
+#include "heap-stats.h"
+
+#include <string.h>
+
+//
+// _SEGMENT_HEAP
+//
+#define SEGMENT_HEAP_LARGE_ALLOC_METADATA 0x40
+#define SEGMENT_HEAP_SEG_CONTEXTS       0x100
+#define SEGMENT_HEAP_SEG_CONTEXT_COUNT  2
+
+//
+// _HEAP_SEG_CONTEXT
+//
+#define SEG_CONTEXT_SIZE                0xc0
+#define SEG_CONTEXT_UNIT_SHIFT          0x08
+#define SEG_CONTEXT_FIRST_DESCRIPTOR    0x0a
+#define SEG_CONTEXT_SEGMENT_LIST_HEAD   0x48
+
+//
+// _HEAP_PAGE_RANGE_DESCRIPTOR, the array of which starts the _HEAP_PAGE_SEGMENT.
+//
+#define DESCRIPTOR_UNUSED_BYTES         0x04
+#define DESCRIPTOR_RANGE_FLAGS          0x18
+#define DESCRIPTOR_UNIT_SIZE            0x1f
+
+#define PAGE_RANGE_FLAGS_LFH_SUBSEGMENT 0x01
+#define PAGE_RANGE_FLAGS_COMMITTED      0x02
+#define PAGE_RANGE_FLAGS_ALLOCATED      0x04
+#define PAGE_RANGE_FLAGS_FIRST          0x08
+#define PAGE_RANGE_FLAGS_VS_SUBSEGMENT  0x20
+
+//
+// _HEAP_LFH_SUBSEGMENT and _HEAP_LFH_SUBSEGMENT_OWNER
+//
+#define LFH_SUBSEGMENT_OWNER            0x10
+#define LFH_SUBSEGMENT_FREE_COUNT       0x20
+#define LFH_SUBSEGMENT_BLOCK_COUNT      0x22
+#define LFH_SUBSEGMENT_BLOCK_OFFSETS    0x28
+#define LFH_SUBSEGMENT_BLOCK_BITMAP     0x30
+#define LFH_OWNER_BUCKET_INDEX          0x01
+
+//
+// _HEAP_VS_SUBSEGMENT and _HEAP_VS_CHUNK_HEADER
+//
+#define VS_SUBSEGMENT_SIZE              0x20
+#define VS_SUBSEGMENT_HEADER_SIZE       0x30
+#define VS_CHUNK_HEADER_SIZE            0x10
+#define VS_CHUNK_ALLOCATED_CHUNK_BITS   0x08
+#define VS_CHUNK_UNUSED_BYTES           0x100
+
+//
+// _RTL_RB_TREE and _HEAP_LARGE_ALLOC_DATA
+//
+#define RB_TREE_ENCODED                 0x08
+#define LARGE_ALLOC_LEFT                0x00
+#define LARGE_ALLOC_RIGHT               0x08
+#define LARGE_ALLOC_VIRTUAL_ADDRESS     0x18
+#define LARGE_ALLOC_ALLOCATED_PAGES     0x20
+
+#define PAGE_SIZE                       0x1000
+
+//
+// Guards against looping forever on a corrupt or partially captured list.
+//
+#define MAX_SEGMENTS                    0x10000
+
+#define PHASE_NEXT_CONTEXT              0
+#define PHASE_NEXT_SEGMENT              1
+#define PHASE_SEGMENT_RANGES            2
+#define PHASE_LFH_BLOCKS                3
+#define PHASE_VS_CHUNKS                 4
+#define PHASE_LARGE_BLOCKS              5
+#define PHASE_DONE                      6
+
+static const uint8_t* GetDescriptor(PSEGMENT_HEAP_WALK Segment, uint32_t Index)
+{
+    return Segment->Descriptors + (size_t)Index * SEGMENT_HEAP_DESCRIPTOR_SIZE;
+}
+
+static bool ReadLargeNode(PHEAP_WALK Walk, uint64_t Node, uint32_t Offset, uint64_t* Child)
+{
+    if (DumpReadPointer(Walk->Dump, Node + Offset, Child) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        return false;
+    }
+
+    //
+    // Encoded trees store each child pointer XORed with its parent's address.
+    //
+    if (Walk->Segment.LargeTreeEncoded && *Child != 0) {
+        *Child ^= Node;
+    }
+    return true;
+}
+
+//
+// Push Node and its chain of left children, the usual iterative in-order walk.
+//
+static bool PushLeftSpine(PHEAP_WALK Walk, uint64_t Node)
+{
+    PSEGMENT_HEAP_WALK Segment = &Walk->Segment;
+
+    while (Node != 0) {
+        if (Segment->LargeDepth == SEGMENT_HEAP_MAX_TREE_DEPTH) {
+            Walk->LastError = ERROR_INVALID_DATA;
+            return false;
+        }
+        Segment->LargeStack[Segment->LargeDepth++] = Node;
+        if (ReadLargeNode(Walk, Node, LARGE_ALLOC_LEFT, &Node) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SegmentHeapWalkBegin(PHEAP_WALK Walk)
+{
+    PSEGMENT_HEAP_WALK Segment = &Walk->Segment;
+
+    memset(Segment, 0, sizeof(*Segment));
+    if (Walk->Dump->PointerSize != 8) {
+        Walk->LastError = ERROR_NOT_SUPPORTED;
+        return false;
+    }
+    Segment->Phase = PHASE_NEXT_CONTEXT;
+    return true;
+}
+
+static bool NextContext(PHEAP_WALK Walk)
+{
+    PSEGMENT_HEAP_WALK Segment = &Walk->Segment;
+    uint64_t Context;
+    uint64_t Root;
+    uint8_t Encoded;
+
+    if (Segment->ContextIndex == SEGMENT_HEAP_SEG_CONTEXT_COUNT) {
+
+        //
+        // Backend and subsegments are done; large blocks come last.
+        //
+        if (DumpReadPointer(Walk->Dump, Walk->Heap + SEGMENT_HEAP_LARGE_ALLOC_METADATA, &Root) == false ||
+            DumpRead(Walk->Dump, Walk->Heap + SEGMENT_HEAP_LARGE_ALLOC_METADATA + RB_TREE_ENCODED,
+                &Encoded, sizeof(Encoded)) == false) {
+            Walk->LastError = ERROR_PARTIAL_COPY;
+            Segment->Phase = PHASE_DONE;
+            return false;
+        }
+        Segment->LargeTreeEncoded = (Encoded & 1) != 0;
+        if (Segment->LargeTreeEncoded && Root != 0) {
+            Root ^= Walk->Heap + SEGMENT_HEAP_LARGE_ALLOC_METADATA;
+        }
+        Segment->Phase = PushLeftSpine(Walk, Root) ? PHASE_LARGE_BLOCKS : PHASE_DONE;
+        return false;
+    }
+
+    Context = Walk->Heap + SEGMENT_HEAP_SEG_CONTEXTS + (uint64_t)Segment->ContextIndex * SEG_CONTEXT_SIZE;
+    Segment->ContextIndex += 1;
+    Segment->SegmentListHead = Context + SEG_CONTEXT_SEGMENT_LIST_HEAD;
+    if (DumpRead(Walk->Dump, Context + SEG_CONTEXT_UNIT_SHIFT, &Segment->UnitShift, 1) == false ||
+        DumpRead(Walk->Dump, Context + SEG_CONTEXT_FIRST_DESCRIPTOR, &Segment->FirstDescriptorIndex, 1) == false ||
+        DumpReadPointer(Walk->Dump, Segment->SegmentListHead, &Segment->SegmentLink) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        Segment->Phase = PHASE_DONE;
+        return false;
+    }
+    Segment->Phase = PHASE_NEXT_SEGMENT;
+    return false;
+}
+
+static bool NextSegment(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    PSEGMENT_HEAP_WALK Segment = &Walk->Segment;
+    uint64_t Committed = 0;
+    uint32_t Index;
+
+    if (Segment->SegmentLink == Segment->SegmentListHead) {
+        Segment->Phase = PHASE_NEXT_CONTEXT;
+        return false;
+    }
+    if (Segment->SegmentIndex >= MAX_SEGMENTS) {
+        Walk->LastError = ERROR_INVALID_DATA;
+        Segment->Phase = PHASE_DONE;
+        return false;
+    }
+
+    //
+    // The segment's LIST_ENTRY overlays the first descriptor, so the link is
+    // the segment address. Read all 256 descriptors at once, they are 8KB.
+    //
+    Segment->Segment = Segment->SegmentLink;
+    if (DumpRead(Walk->Dump, Segment->Segment, Segment->Descriptors, sizeof(Segment->Descriptors)) == false ||
+        DumpReadPointer(Walk->Dump, Segment->SegmentLink, &Segment->SegmentLink) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        Segment->Phase = PHASE_DONE;
+        return false;
+    }
+
+    for (Index = Segment->FirstDescriptorIndex; Index < SEGMENT_HEAP_UNITS_PER_SEGMENT; ) {
+        const uint8_t* Descriptor = GetDescriptor(Segment, Index);
+        uint32_t UnitSize = Descriptor[DESCRIPTOR_UNIT_SIZE] != 0 ? Descriptor[DESCRIPTOR_UNIT_SIZE] : 1;
+
+        if ((Descriptor[DESCRIPTOR_RANGE_FLAGS] & PAGE_RANGE_FLAGS_COMMITTED) != 0) {
+            Committed += (uint64_t)UnitSize << Segment->UnitShift;
+        }
+        Index += UnitSize;
+    }
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->wFlags = PROCESS_HEAP_REGION;
+    Entry->lpData = Segment->Segment;
+    Entry->cbData = (uint64_t)SEGMENT_HEAP_UNITS_PER_SEGMENT << Segment->UnitShift;
+    Entry->cbOverhead = (uint32_t)Segment->FirstDescriptorIndex << Segment->UnitShift;
+    Entry->iRegionIndex = Segment->SegmentIndex;
+    Entry->Region.dwCommittedSize = Committed;
+    Entry->Region.dwUnCommittedSize = Entry->cbData - Entry->cbOverhead - Committed;
+    Entry->Region.lpFirstBlock = Segment->Segment + Entry->cbOverhead;
+    Entry->Region.lpLastBlock = Segment->Segment + Entry->cbData;
+
+    Segment->DescriptorIndex = Segment->FirstDescriptorIndex;
+    Segment->Phase = PHASE_SEGMENT_RANGES;
+    return true;
+}
+
+static bool BeginLfhSubsegment(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry, uint64_t Subsegment, uint64_t Size)
+{
+    PSEGMENT_HEAP_WALK Segment = &Walk->Segment;
+    uint64_t Owner;
+    uint8_t BucketIndex;
+    uint16_t FreeCount;
+    uint16_t BlockCount;
+    uint32_t BlockOffsets;
+
+    if (DumpReadPointer(Walk->Dump, Subsegment + LFH_SUBSEGMENT_OWNER, &Owner) == false ||
+        DumpReadUshort(Walk->Dump, Subsegment + LFH_SUBSEGMENT_FREE_COUNT, &FreeCount) == false ||
+        DumpReadUshort(Walk->Dump, Subsegment + LFH_SUBSEGMENT_BLOCK_COUNT, &BlockCount) == false ||
+        DumpReadUlong(Walk->Dump, Subsegment + LFH_SUBSEGMENT_BLOCK_OFFSETS, &BlockOffsets) == false ||
+        DumpRead(Walk->Dump, (Owner & ~0xfull) + LFH_OWNER_BUCKET_INDEX, &BucketIndex, 1) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        return false;
+    }
+
+    //
+    // The owner's bucket gives the block size without needing the key.
+    //
+    Segment->BlockSize = HeapBucketBlockSize(BucketIndex);
+    Segment->BlockCount = BlockCount;
+    Segment->BlockIndex = 0;
+    Segment->BlockBitmap = Subsegment + LFH_SUBSEGMENT_BLOCK_BITMAP;
+    if (Segment->BlockSize == 0 || FreeCount > BlockCount ||
+        (uint64_t)BlockCount * Segment->BlockSize > Size) {
+        Walk->LastError = ERROR_INVALID_DATA;
+        return false;
+    }
+
+    if (Walk->HasLfhKey) {
+        BlockOffsets ^= (uint32_t)Walk->LfhKey ^ (uint32_t)(Subsegment >> 12);
+        if ((BlockOffsets & 0xffff) == Segment->BlockSize) {
+            Segment->Block = Subsegment + (BlockOffsets >> 16);
+            Segment->SubsegmentEnd = Subsegment + Size;
+            Segment->Phase = PHASE_LFH_BLOCKS;
+            return false;
+        }
+
+        //
+        // Wrong key for this heap; fall back to the summary below.
+        //
+    }
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->wFlags = PROCESS_HEAP_ENTRY_BUSY | HEAP_WALK_SUBSEGMENT;
+    Entry->lpData = Subsegment;
+    Entry->cbData = Size;
+    Entry->iRegionIndex = Segment->SegmentIndex;
+    Entry->Subsegment.Type = HEAP_WALK_SUBSEGMENT_LFH;
+    Entry->Subsegment.BlockSize = Segment->BlockSize;
+    Entry->Subsegment.BlockCount = BlockCount;
+    Entry->Subsegment.BusyCount = (uint32_t)(BlockCount - FreeCount);
+    return true;
+}
+
+static bool NextLfhBlock(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    PSEGMENT_HEAP_WALK Segment = &Walk->Segment;
+    uint8_t Bits;
+
+    if (Segment->BlockIndex == Segment->BlockCount) {
+        Segment->Phase = PHASE_SEGMENT_RANGES;
+        return false;
+    }
+
+    //
+    // Two bitmap bits per block: busy, and "unused bytes stored at the end".
+    //
+    if (DumpRead(Walk->Dump, Segment->BlockBitmap + Segment->BlockIndex / 4, &Bits, 1) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        Segment->Phase = PHASE_DONE;
+        return false;
+    }
+    Bits = (uint8_t)(Bits >> ((Segment->BlockIndex % 4) * 2));
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->lpData = Segment->Block + (uint64_t)Segment->BlockIndex * Segment->BlockSize;
+    Entry->cbData = Segment->BlockSize;
+    Entry->iRegionIndex = Segment->SegmentIndex;
+    if ((Bits & 1) != 0) {
+        uint16_t UnusedBytes = 0;
+
+        Entry->wFlags = PROCESS_HEAP_ENTRY_BUSY;
+        if ((Bits & 2) != 0 &&
+            DumpReadUshort(Walk->Dump, Entry->lpData + Segment->BlockSize - sizeof(UnusedBytes), &UnusedBytes) &&
+            (UnusedBytes & 0x7fff) < Segment->BlockSize) {
+            Entry->cbOverhead = UnusedBytes & 0x7fff;
+            Entry->cbData -= Entry->cbOverhead;
+        }
+    }
+    Segment->BlockIndex += 1;
+    return true;
+}
+
+static bool BeginVsSubsegment(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry, uint64_t Subsegment, uint64_t Size)
+{
+    PSEGMENT_HEAP_WALK Segment = &Walk->Segment;
+    uint16_t Units;
+
+    if (DumpReadUshort(Walk->Dump, Subsegment + VS_SUBSEGMENT_SIZE, &Units) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        return false;
+    }
+    if ((uint64_t)Units * 16 > Size || Units * 16 < VS_SUBSEGMENT_HEADER_SIZE) {
+        Walk->LastError = ERROR_INVALID_DATA;
+        return false;
+    }
+
+    if (Walk->HasHeapKey) {
+        Segment->Block = Subsegment + VS_SUBSEGMENT_HEADER_SIZE;
+        Segment->SubsegmentEnd = Subsegment + (uint64_t)Units * 16;
+        Segment->Phase = PHASE_VS_CHUNKS;
+        return false;
+    }
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->wFlags = PROCESS_HEAP_ENTRY_BUSY | HEAP_WALK_SUBSEGMENT;
+    Entry->lpData = Subsegment;
+    Entry->cbData = Size;
+    Entry->iRegionIndex = Segment->SegmentIndex;
+    Entry->Subsegment.Type = HEAP_WALK_SUBSEGMENT_VS;
+    return true;
+}
+
+static bool NextVsChunk(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    PSEGMENT_HEAP_WALK Segment = &Walk->Segment;
+    uint64_t HeaderBits;
+    uint32_t ChunkBits;
+    uint64_t Size;
+    bool Allocated;
+
+    if (Segment->Block + VS_CHUNK_HEADER_SIZE > Segment->SubsegmentEnd) {
+        Segment->Phase = PHASE_SEGMENT_RANGES;
+        return false;
+    }
+    if (DumpRead(Walk->Dump, Segment->Block, &HeaderBits, sizeof(HeaderBits)) == false ||
+        DumpReadUlong(Walk->Dump, Segment->Block + VS_CHUNK_ALLOCATED_CHUNK_BITS, &ChunkBits) == false) {
+        Walk->LastError = ERROR_PARTIAL_COPY;
+        Segment->Phase = PHASE_DONE;
+        return false;
+    }
+
+    //
+    // Sizes: MemoryCost:16, UnsafeSize:16, UnsafePrevSize:16, Allocated:8,
+    // all XORed with the chunk address and the heap key.
+    //
+    HeaderBits ^= Segment->Block ^ Walk->HeapKey;
+    Size = ((HeaderBits >> 16) & 0xffff) * 16;
+    Allocated = ((HeaderBits >> 48) & 0xff) != 0;
+    if (Size < VS_CHUNK_HEADER_SIZE || Size > Segment->SubsegmentEnd - Segment->Block) {
+        Walk->LastError = ERROR_INVALID_DATA;
+        Segment->Phase = PHASE_DONE;
+        return false;
+    }
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->lpData = Segment->Block + VS_CHUNK_HEADER_SIZE;
+    Entry->cbOverhead = VS_CHUNK_HEADER_SIZE;
+    Entry->cbData = Size - VS_CHUNK_HEADER_SIZE;
+    Entry->iRegionIndex = Segment->SegmentIndex;
+    if (Allocated) {
+        uint16_t UnusedBytes;
+
+        Entry->wFlags = PROCESS_HEAP_ENTRY_BUSY;
+        if ((ChunkBits & VS_CHUNK_UNUSED_BYTES) != 0 &&
+            DumpReadUshort(Walk->Dump, Segment->Block + Size - sizeof(UnusedBytes), &UnusedBytes) &&
+            UnusedBytes < Entry->cbData) {
+            Entry->cbOverhead += UnusedBytes;
+            Entry->cbData -= UnusedBytes;
+        }
+    }
+    Segment->Block += Size;
+    return true;
+}
+
+static bool NextRange(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    PSEGMENT_HEAP_WALK Segment = &Walk->Segment;
+    const uint8_t* Descriptor;
+    uint32_t UnitSize;
+    uint32_t UnusedBytes;
+    uint8_t RangeFlags;
+    uint64_t Range;
+    uint64_t Size;
+
+    if (Segment->DescriptorIndex >= SEGMENT_HEAP_UNITS_PER_SEGMENT) {
+        Segment->SegmentIndex += 1;
+        Segment->Phase = PHASE_NEXT_SEGMENT;
+        return false;
+    }
+
+    Descriptor = GetDescriptor(Segment, Segment->DescriptorIndex);
+    RangeFlags = Descriptor[DESCRIPTOR_RANGE_FLAGS];
+    UnitSize = Descriptor[DESCRIPTOR_UNIT_SIZE] != 0 ? Descriptor[DESCRIPTOR_UNIT_SIZE] : 1;
+    memcpy(&UnusedBytes, Descriptor + DESCRIPTOR_UNUSED_BYTES, sizeof(UnusedBytes));
+    Range = Segment->Segment + ((uint64_t)Segment->DescriptorIndex << Segment->UnitShift);
+    Size = (uint64_t)UnitSize << Segment->UnitShift;
+    Segment->DescriptorIndex += UnitSize;
+
+    if ((RangeFlags & PAGE_RANGE_FLAGS_ALLOCATED) != 0) {
+        if ((RangeFlags & PAGE_RANGE_FLAGS_LFH_SUBSEGMENT) != 0) {
+            if (BeginLfhSubsegment(Walk, Entry, Range, Size)) {
+                return true;
+            }
+            if (Walk->LastError != 0) {
+                Segment->Phase = PHASE_DONE;
+            }
+            return false;
+        }
+        if ((RangeFlags & PAGE_RANGE_FLAGS_VS_SUBSEGMENT) != 0) {
+            if (BeginVsSubsegment(Walk, Entry, Range, Size)) {
+                return true;
+            }
+            if (Walk->LastError != 0) {
+                Segment->Phase = PHASE_DONE;
+            }
+            return false;
+        }
+    }
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->lpData = Range;
+    Entry->cbData = Size;
+    Entry->iRegionIndex = Segment->SegmentIndex;
+    if ((RangeFlags & PAGE_RANGE_FLAGS_COMMITTED) == 0) {
+        Entry->wFlags = PROCESS_HEAP_UNCOMMITTED_RANGE;
+    }
+    else if ((RangeFlags & PAGE_RANGE_FLAGS_ALLOCATED) != 0) {
+
+        //
+        // Backend blocks have no header, their slack is kept in the descriptor.
+        //
+        Entry->wFlags = PROCESS_HEAP_ENTRY_BUSY;
+        if (UnusedBytes < Size) {
+            Entry->cbOverhead = UnusedBytes;
+            Entry->cbData = Size - UnusedBytes;
+        }
+    }
+    return true;
+}
+
+static bool NextLargeBlock(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    PSEGMENT_HEAP_WALK Segment = &Walk->Segment;
+    uint64_t Node;
+    uint64_t Right;
+    uint64_t VirtualAddress;
+    uint64_t AllocatedPages;
+    uint64_t Size;
+
+    if (Segment->LargeDepth == 0) {
+        Walk->LastError = ERROR_NO_MORE_ITEMS;
+        Segment->Phase = PHASE_DONE;
+        return false;
+    }
+
+    Node = Segment->LargeStack[--Segment->LargeDepth];
+    if (DumpReadPointer(Walk->Dump, Node + LARGE_ALLOC_VIRTUAL_ADDRESS, &VirtualAddress) == false ||
+        DumpReadPointer(Walk->Dump, Node + LARGE_ALLOC_ALLOCATED_PAGES, &AllocatedPages) == false ||
+        ReadLargeNode(Walk, Node, LARGE_ALLOC_RIGHT, &Right) == false ||
+        PushLeftSpine(Walk, Right) == false) {
+        if (Walk->LastError == 0) {
+            Walk->LastError = ERROR_PARTIAL_COPY;
+        }
+        Segment->Phase = PHASE_DONE;
+        return false;
+    }
+
+    //
+    // The low 16 bits of VirtualAddress hold the unused byte count, the low
+    // 12 bits of AllocatedPages are flags.
+    //
+    Size = (AllocatedPages >> 12) * PAGE_SIZE;
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->wFlags = PROCESS_HEAP_ENTRY_BUSY;
+    Entry->lpData = VirtualAddress & ~0xffffull;
+    Entry->cbOverhead = (uint32_t)(VirtualAddress & 0xffff);
+    Entry->cbData = Size > Entry->cbOverhead ? Size - Entry->cbOverhead : 0;
+    Entry->iRegionIndex = Segment->SegmentIndex;
+    return true;
+}
+
+bool SegmentHeapWalkNext(PHEAP_WALK Walk, PHEAP_WALK_ENTRY Entry)
+{
+    for (;;) {
+        switch (Walk->Segment.Phase) {
+        case PHASE_NEXT_CONTEXT:
+            NextContext(Walk);
+            break;
+        case PHASE_NEXT_SEGMENT:
+            if (NextSegment(Walk, Entry)) {
+                return true;
+            }
+            break;
+        case PHASE_SEGMENT_RANGES:
+            if (NextRange(Walk, Entry)) {
+                return true;
+            }
+            break;
+        case PHASE_LFH_BLOCKS:
+            if (NextLfhBlock(Walk, Entry)) {
+                return true;
+            }
+            break;
+        case PHASE_VS_CHUNKS:
+            if (NextVsChunk(Walk, Entry)) {
+                return true;
+            }
+            break;
+        case PHASE_LARGE_BLOCKS:
+            if (NextLargeBlock(Walk, Entry)) {
+                return true;
+            }
+            break;
+        default:
+            if (Walk->LastError == 0) {
+                Walk->LastError = ERROR_NO_MORE_ITEMS;
+            }
+            return false;
+        }
+    }
+}
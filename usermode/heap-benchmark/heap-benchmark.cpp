@@ -0,0 +1,780 @@
+// heap-benchmark.cpp : This file contains the 'main' function. Program execution begins and ends there.
+//
+// Runs the allocation patterns that decide which allocator a service should
+// use, against each candidate allocator, with 1, 2, 4 ... threads:
+//
+//  - prodcons: every thread allocates blocks and hands them to the next
+//    thread through a ring, which frees them.
+//  - churn: 64-byte blocks freed and allocated again at random in a window.
+//  - mixed: the same with sizes following an allocation trace: the busy
+//    blocks of a dump-heap-walk --snapshot file given with --sizes, or a
+//    built-in distribution typical of a long-running service.
+//  - large: blocks of 256KB to 4MB, with every page written.
+//
+// The allocators are the portable heap, the portable heap with its LFH front
+// end, the C runtime malloc and a size-class pool with per-thread caches
+// (see pool-allocator.h).
+//
+// Each run reports allocations per second, the p50 / p99 / p99.9 latency of
+// single HeapAlloc and HeapFree calls, timed on one operation in 16, and the
+// resident set above what the process used before the run: at its peak, and
+// at the end once every block has been freed, which is what the allocator
+// keeps for itself. --csv writes the results and --rss-csv the resident set
+// sampled every 100ms.
+//
+// Outside Visual Studio:
+//   g++ -O2 -pthread -o heap-benchmark heap-benchmark.cpp pool-allocator.cpp
+//     ../portable-heap/heap-*.cpp ../dump-heap-walk/heap-snapshot.cpp
+//
+
+#include "../portable-heap/heap-engine.h"
+#include "../dump-heap-walk/heap-snapshot.h"
+#include "../common/benchmark-util.h"
+#include "pool-allocator.h"
+
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#define MAXIMUM_THREADS                 256
+#define LATENCY_SAMPLE_MASK             15
+#define RSS_INTERVAL                    100
+
+#define CHURN_WINDOW                    1024
+#define CHURN_SIZE                      64
+#define MIXED_WINDOW                    4096
+#define LARGE_WINDOW                    4
+#define LARGE_MINIMUM_SIZE              (256 * 1024)
+#define LARGE_MAXIMUM_SIZE              (4 * 1024 * 1024)
+#define RING_SIZE                       1024
+#define PRODUCER_BATCH                  32
+
+//
+// Sizes are drawn from power-of-two buckets: bucket k holds the sizes in
+// (2^(k-1), 2^k], and a size is uniform within its bucket.
+//
+#define SIZE_BUCKETS                    25
+
+typedef struct _SIZE_DISTRIBUTION {
+    uint64_t Weights[SIZE_BUCKETS];
+    uint64_t Total;
+} SIZE_DISTRIBUTION, *PSIZE_DISTRIBUTION;
+
+//
+// Per mille. Most blocks of a long-running service are strings, small
+// objects and container nodes below 256 bytes, with a thin tail of buffers
+// up to a few hundred KB.
+//
+static const uint64_t DefaultWeights[SIZE_BUCKETS] = {
+    0, 0, 0, 0, 180, 220, 190, 140, 100, 60, 40, 25, 18, 10, 8, 5, 3, 1,
+};
+
+//
+// Allocators are used through a per-run instance and a per-thread context;
+// Free gets the size back, which the pool needs.
+//
+typedef struct _ALLOCATOR {
+    const char* Name;
+    void* (*Create)();
+    void (*Destroy)(void* Instance);
+    void* (*Attach)(void* Instance);
+    void (*Detach)(void* Context);
+    void* (*Alloc)(void* Context, size_t Size);
+    void (*Free)(void* Context, void* Mem, size_t Size);
+} ALLOCATOR, *PALLOCATOR;
+
+typedef struct _RING_SLOT {
+    void* Mem;
+    size_t Size;
+} RING_SLOT, *PRING_SLOT;
+
+//
+// Single producer, single consumer.
+//
+typedef struct _RING {
+    alignas(64) std::atomic<uint32_t> Head;
+    alignas(64) std::atomic<uint32_t> Tail;
+    RING_SLOT Slots[RING_SIZE];
+} RING, *PRING;
+
+typedef struct _RUN RUN, *PRUN;
+
+typedef struct alignas(64) _WORKER {
+    PRUN Run;
+    uint32_t Index;
+    void* Context;
+    uint64_t Random;
+    uint64_t Allocations;
+    uint64_t Frees;
+    uint64_t Failures;
+    uint64_t Latency[LATENCY_BUCKETS];
+} WORKER, *PWORKER;
+
+typedef void (*PWORKLOAD_ROUTINE)(PWORKER Worker);
+
+typedef struct _WORKLOAD {
+    const char* Name;
+    PWORKLOAD_ROUTINE Routine;
+} WORKLOAD, *PWORKLOAD;
+
+struct _RUN {
+    PWORKLOAD_ROUTINE Routine;
+    const ALLOCATOR* Allocator;
+    void* Instance;
+    const SIZE_DISTRIBUTION* Sizes;
+    uint32_t NumberOfThreads;
+    PWORKER Workers;
+    PRING Rings;
+    std::atomic<uint32_t> Ready;
+    std::atomic<bool> Start;
+    std::atomic<bool> Stop;
+};
+
+typedef struct _RESULTS {
+    double Seconds;
+    uint64_t Allocations;
+    uint64_t Failures;
+    uint64_t Latency[LATENCY_BUCKETS];
+    size_t PeakRss;
+    size_t EndRss;
+} RESULTS, *PRESULTS;
+
+static uint64_t NextRandom(PWORKER Worker)
+{
+    Worker->Random ^= Worker->Random << 13;
+    Worker->Random ^= Worker->Random >> 7;
+    Worker->Random ^= Worker->Random << 17;
+    return Worker->Random;
+}
+
+static size_t NextSize(PWORKER Worker)
+{
+    const SIZE_DISTRIBUTION* Sizes = Worker->Run->Sizes;
+    uint64_t Pick = NextRandom(Worker) % Sizes->Total;
+    uint32_t Bucket = 0;
+    size_t Lower;
+    size_t Upper;
+
+    while (Pick >= Sizes->Weights[Bucket]) {
+        Pick -= Sizes->Weights[Bucket];
+        ++Bucket;
+    }
+    Lower = Bucket == 0 ? 1 : ((size_t)1 << (Bucket - 1)) + 1;
+    Upper = (size_t)1 << Bucket;
+    return Lower + (size_t)(NextRandom(Worker) % (Upper - Lower + 1));
+}
+
+//
+// One allocation and one free in LATENCY_SAMPLE_MASK + 1 are timed: often
+// enough for the tail, rarely enough that reading the clock does not slow
+// the loop down.
+//
+static void* TimedAlloc(PWORKER Worker, size_t Size)
+{
+    const ALLOCATOR* Allocator = Worker->Run->Allocator;
+    uint64_t Start;
+    void* Mem;
+
+    if ((++Worker->Allocations & LATENCY_SAMPLE_MASK) != 0) {
+        Mem = Allocator->Alloc(Worker->Context, Size);
+    }
+    else {
+        Start = PhOsTimestamp();
+        Mem = Allocator->Alloc(Worker->Context, Size);
+        Worker->Latency[LatencyBucket(PhOsTimestamp() - Start)] += 1;
+    }
+    if (Mem == NULL) {
+        Worker->Failures += 1;
+    }
+    else {
+        *(volatile uint8_t*)Mem = 1;
+    }
+    return Mem;
+}
+
+static void TimedFree(PWORKER Worker, void* Mem, size_t Size)
+{
+    const ALLOCATOR* Allocator = Worker->Run->Allocator;
+    uint64_t Start;
+
+    if ((++Worker->Frees & LATENCY_SAMPLE_MASK) != 0) {
+        Allocator->Free(Worker->Context, Mem, Size);
+    }
+    else {
+        Start = PhOsTimestamp();
+        Allocator->Free(Worker->Context, Mem, Size);
+        Worker->Latency[LatencyBucket(PhOsTimestamp() - Start)] += 1;
+    }
+}
+
+static bool Stopping(PWORKER Worker)
+{
+    return Worker->Run->Stop.load(std::memory_order_relaxed);
+}
+
+//
+// Replaces a random block of the window until the run stops, then frees the
+// window. SizeRoutine is NULL for fixed-size blocks.
+//
+static void ReplaceInWindow(PWORKER Worker, uint32_t WindowSize, size_t (*SizeRoutine)(PWORKER), size_t FixedSize,
+    bool TouchPages)
+{
+    void** Blocks = (void**)calloc(WindowSize, sizeof(void*));
+    size_t* Sizes = (size_t*)calloc(WindowSize, sizeof(size_t));
+    uint32_t Slot;
+
+    if (Blocks == NULL || Sizes == NULL) {
+        Worker->Failures += 1;
+        free(Sizes);
+        free(Blocks);
+        return;
+    }
+
+    while (Stopping(Worker) == false) {
+        Slot = (uint32_t)(NextRandom(Worker) % WindowSize);
+        if (Blocks[Slot] != NULL) {
+            TimedFree(Worker, Blocks[Slot], Sizes[Slot]);
+        }
+        Sizes[Slot] = SizeRoutine != NULL ? SizeRoutine(Worker) : FixedSize;
+        Blocks[Slot] = TimedAlloc(Worker, Sizes[Slot]);
+        if (TouchPages && Blocks[Slot] != NULL) {
+            for (size_t Offset = 0; Offset < Sizes[Slot]; Offset += 4096) {
+                ((volatile uint8_t*)Blocks[Slot])[Offset] = 1;
+            }
+        }
+    }
+
+    for (Slot = 0; Slot < WindowSize; ++Slot) {
+        if (Blocks[Slot] != NULL) {
+            Worker->Run->Allocator->Free(Worker->Context, Blocks[Slot], Sizes[Slot]);
+        }
+    }
+    free(Sizes);
+    free(Blocks);
+}
+
+static size_t NextLargeSize(PWORKER Worker)
+{
+    return LARGE_MINIMUM_SIZE + (size_t)(NextRandom(Worker) % (LARGE_MAXIMUM_SIZE - LARGE_MINIMUM_SIZE + 1));
+}
+
+static void Churn(PWORKER Worker)
+{
+    ReplaceInWindow(Worker, CHURN_WINDOW, NULL, CHURN_SIZE, false);
+}
+
+static void Mixed(PWORKER Worker)
+{
+    ReplaceInWindow(Worker, MIXED_WINDOW, NextSize, 0, false);
+}
+
+static void Large(PWORKER Worker)
+{
+    ReplaceInWindow(Worker, LARGE_WINDOW, NextLargeSize, 0, true);
+}
+
+//
+// Worker i fills ring i + 1 and drains ring i, so every block is freed by
+// another thread than the one that allocated it; with a single thread the
+// ring leads back to itself. A full ring makes the producer skip its turn.
+//
+static void ProducerConsumer(PWORKER Worker)
+{
+    PRUN Run = Worker->Run;
+    PRING Outbox = &Run->Rings[(Worker->Index + 1) % Run->NumberOfThreads];
+    PRING Inbox = &Run->Rings[Worker->Index];
+    uint32_t Head;
+    uint32_t Tail;
+    uint32_t Count;
+
+    while (Stopping(Worker) == false) {
+        Tail = Outbox->Tail.load(std::memory_order_relaxed);
+        Head = Outbox->Head.load(std::memory_order_acquire);
+        for (Count = 0; Count < PRODUCER_BATCH && Tail - Head < RING_SIZE; ++Count) {
+            PRING_SLOT Slot = &Outbox->Slots[Tail % RING_SIZE];
+
+            Slot->Size = NextSize(Worker);
+            Slot->Mem = TimedAlloc(Worker, Slot->Size);
+            if (Slot->Mem == NULL) {
+                break;
+            }
+            ++Tail;
+        }
+        Outbox->Tail.store(Tail, std::memory_order_release);
+
+        Head = Inbox->Head.load(std::memory_order_relaxed);
+        Tail = Inbox->Tail.load(std::memory_order_acquire);
+        while (Head != Tail) {
+            PRING_SLOT Slot = &Inbox->Slots[Head % RING_SIZE];
+
+            TimedFree(Worker, Slot->Mem, Slot->Size);
+            ++Head;
+        }
+        Inbox->Head.store(Head, std::memory_order_release);
+    }
+}
+
+static const WORKLOAD Workloads[] = {
+    { "prodcons", ProducerConsumer },
+    { "churn", Churn },
+    { "mixed", Mixed },
+    { "large", Large },
+};
+
+static void* CreatePortableHeap()
+{
+    return PhHeapCreate(0, 0, 0);
+}
+
+static void* CreatePortableHeapLfh()
+{
+    PPH_HEAP hHeap = PhHeapCreate(0, 0, 0);
+
+    if (hHeap != NULL && PhHeapSetCompatibility(hHeap, PH_HEAP_COMPATIBILITY_LFH) == false) {
+        PhHeapDestroy(hHeap);
+        return NULL;
+    }
+    return hHeap;
+}
+
+static void DestroyPortableHeap(void* Instance)
+{
+    PhHeapDestroy((PPH_HEAP)Instance);
+}
+
+static void* SameContext(void* Instance)
+{
+    return Instance;
+}
+
+static void NoDetach(void* Context)
+{
+    (void)Context;
+}
+
+static void* PortableHeapAlloc(void* Context, size_t Size)
+{
+    return PhHeapAlloc((PPH_HEAP)Context, 0, Size);
+}
+
+static void PortableHeapFree(void* Context, void* Mem, size_t Size)
+{
+    (void)Size;
+
+    PhHeapFree((PPH_HEAP)Context, 0, Mem);
+}
+
+static void* CreateMalloc()
+{
+    static int Instance;
+
+    return &Instance;
+}
+
+static void DestroyMalloc(void* Instance)
+{
+    (void)Instance;
+}
+
+static void* MallocAlloc(void* Context, size_t Size)
+{
+    (void)Context;
+
+    return malloc(Size);
+}
+
+static void MallocFree(void* Context, void* Mem, size_t Size)
+{
+    (void)Context;
+    (void)Size;
+
+    free(Mem);
+}
+
+static void* CreatePool()
+{
+    return PoolCreate();
+}
+
+static void DestroyPool(void* Instance)
+{
+    PoolDestroy((PPOOL)Instance);
+}
+
+static void* AttachPool(void* Instance)
+{
+    return PoolAttachThread((PPOOL)Instance);
+}
+
+static void DetachPool(void* Context)
+{
+    PoolDetachThread((PPOOL_CACHE)Context);
+}
+
+static void* PoolAllocate(void* Context, size_t Size)
+{
+    return PoolAlloc((PPOOL_CACHE)Context, Size);
+}
+
+static void PoolRelease(void* Context, void* Mem, size_t Size)
+{
+    PoolFree((PPOOL_CACHE)Context, Mem, Size);
+}
+
+static const ALLOCATOR Allocators[] = {
+    { "nt-heap", CreatePortableHeap, DestroyPortableHeap, SameContext, NoDetach, PortableHeapAlloc, PortableHeapFree },
+    { "nt-lfh", CreatePortableHeapLfh, DestroyPortableHeap, SameContext, NoDetach, PortableHeapAlloc, PortableHeapFree },
+    { "malloc", CreateMalloc, DestroyMalloc, SameContext, NoDetach, MallocAlloc, MallocFree },
+    { "pool", CreatePool, DestroyPool, AttachPool, DetachPool, PoolAllocate, PoolRelease },
+};
+
+//
+// Builds the distribution from the busy blocks of every heap in a snapshot.
+// Subsegments are skipped: they hold blocks of their own that the snapshot
+// does not break down.
+//
+static bool LoadSizes(const char* FileName, PSIZE_DISTRIBUTION Sizes)
+{
+    HEAP_SNAPSHOT_READER Reader;
+    HEAP_SNAPSHOT_ENTRY Entry;
+    uint32_t Bucket;
+
+    if (HeapSnapshotOpen(&Reader, FileName) == false) {
+        printf("Failed to open %s as a heap snapshot.\n", FileName);
+        return false;
+    }
+
+    memset(Sizes, 0, sizeof(*Sizes));
+    while (HeapSnapshotNextHeap(&Reader)) {
+        while (HeapSnapshotNextEntry(&Reader, &Entry)) {
+            if ((Entry.Flags & PROCESS_HEAP_ENTRY_BUSY) == 0 || Entry.Size == 0 ||
+                (Entry.Flags & (PROCESS_HEAP_REGION | PROCESS_HEAP_UNCOMMITTED_RANGE | HEAP_WALK_SUBSEGMENT)) != 0) {
+                continue;
+            }
+            for (Bucket = 0; Bucket < SIZE_BUCKETS - 1 && ((uint64_t)1 << Bucket) < Entry.Size; ++Bucket) {
+            }
+            Sizes->Weights[Bucket] += 1;
+            Sizes->Total += 1;
+        }
+    }
+    if (Reader.Corrupt) {
+        printf("%s is truncated or corrupt.\n", FileName);
+        HeapSnapshotCloseReader(&Reader);
+        return false;
+    }
+    HeapSnapshotCloseReader(&Reader);
+
+    if (Sizes->Total == 0) {
+        printf("%s holds no busy blocks.\n", FileName);
+        return false;
+    }
+    printf("Sizes from %llu busy blocks of %s.\n\n", (unsigned long long)Sizes->Total, FileName);
+    return true;
+}
+
+static void RunWorker(void* Context)
+{
+    PWORKER Worker = (PWORKER)Context;
+    PRUN Run = Worker->Run;
+
+    Worker->Context = Run->Allocator->Attach(Run->Instance);
+    Run->Ready.fetch_add(1);
+    while (Run->Start.load() == false) {
+    }
+    if (Worker->Context != NULL) {
+        Run->Routine(Worker);
+    }
+    else {
+        Worker->Failures += 1;
+    }
+}
+
+//
+// Frees what is left in the rings once every thread has stopped, then lets
+// the threads detach: a pool cache only holds blocks of its own thread.
+//
+static void DrainRings(PRUN Run)
+{
+    void* Context = Run->Allocator->Attach(Run->Instance);
+    uint32_t Index;
+
+    for (Index = 0; Context != NULL && Index < Run->NumberOfThreads; ++Index) {
+        PRING Ring = &Run->Rings[Index];
+        uint32_t Head = Ring->Head.load();
+
+        for (; Head != Ring->Tail.load(); ++Head) {
+            Run->Allocator->Free(Context, Ring->Slots[Head % RING_SIZE].Mem, Ring->Slots[Head % RING_SIZE].Size);
+        }
+        Ring->Head.store(Head);
+    }
+    if (Context != NULL) {
+        Run->Allocator->Detach(Context);
+    }
+}
+
+static bool Measure(const WORKLOAD* Workload, const ALLOCATOR* Allocator, const SIZE_DISTRIBUTION* Sizes,
+    uint32_t NumberOfThreads, uint32_t Milliseconds, PRESULTS Results, size_t* RssSamples, uint32_t* NumberOfSamples)
+{
+    PH_THREAD Threads[MAXIMUM_THREADS];
+    RUN Run;
+    size_t BaseRss;
+    size_t Rss;
+    uint64_t Start;
+    uint64_t NextSample;
+    uint32_t Started;
+    uint32_t Index;
+
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+    BaseRss = PhOsResidentBytes();
+    memset(Results, 0, sizeof(*Results));
+    *NumberOfSamples = 0;
+
+    Run.Routine = Workload->Routine;
+    Run.Allocator = Allocator;
+    Run.Sizes = Sizes;
+    Run.NumberOfThreads = NumberOfThreads;
+    Run.Ready = 0;
+    Run.Start = false;
+    Run.Stop = false;
+    Run.Instance = Allocator->Create();
+    if (Run.Instance == NULL) {
+        printf("Failed to create the %s allocator.\n", Allocator->Name);
+        return false;
+    }
+
+    Run.Workers = new WORKER[NumberOfThreads]();
+    Run.Rings = new RING[NumberOfThreads]();
+    for (Index = 0; Index < NumberOfThreads; ++Index) {
+        Run.Workers[Index].Run = &Run;
+        Run.Workers[Index].Index = Index;
+        Run.Workers[Index].Random = 0x9e3779b97f4a7c15ull * (Index + 1);
+    }
+
+    for (Started = 0; Started < NumberOfThreads; ++Started) {
+        if (PhOsCreateThread(&Threads[Started], RunWorker, &Run.Workers[Started]) == false) {
+            break;
+        }
+    }
+    while (Run.Ready.load() != Started) {
+    }
+
+    Start = PhOsTimestamp();
+    NextSample = 0;
+    Run.Start.store(true);
+    while (Started == NumberOfThreads) {
+        uint64_t Elapsed = (PhOsTimestamp() - Start) / 1000000;
+
+        if (Elapsed >= NextSample) {
+            Rss = PhOsResidentBytes();
+            RssSamples[(*NumberOfSamples)++] = Rss > BaseRss ? Rss - BaseRss : 0;
+            NextSample += RSS_INTERVAL;
+        }
+        if (Elapsed >= Milliseconds) {
+            break;
+        }
+        PhOsSleep((uint32_t)(NextSample < Milliseconds ? NextSample : Milliseconds) - (uint32_t)Elapsed);
+    }
+    Run.Stop.store(true);
+    Results->Seconds = (PhOsTimestamp() - Start) / 1e9;
+
+    for (Index = 0; Index < Started; ++Index) {
+        PhOsJoinThread(&Threads[Index]);
+    }
+    DrainRings(&Run);
+    for (Index = 0; Index < Started; ++Index) {
+        PWORKER Worker = &Run.Workers[Index];
+
+        if (Worker->Context != NULL) {
+            Allocator->Detach(Worker->Context);
+        }
+        Results->Allocations += Worker->Allocations;
+        Results->Failures += Worker->Failures;
+        for (uint32_t Bucket = 0; Bucket < LATENCY_BUCKETS; ++Bucket) {
+            Results->Latency[Bucket] += Worker->Latency[Bucket];
+        }
+    }
+
+    Rss = PhOsResidentBytes();
+    Results->EndRss = Rss > BaseRss ? Rss - BaseRss : 0;
+    for (Index = 0; Index < *NumberOfSamples; ++Index) {
+        if (RssSamples[Index] > Results->PeakRss) {
+            Results->PeakRss = RssSamples[Index];
+        }
+    }
+    if (Results->EndRss > Results->PeakRss) {
+        Results->PeakRss = Results->EndRss;
+    }
+
+    Allocator->Destroy(Run.Instance);
+    delete[] Run.Rings;
+    delete[] Run.Workers;
+
+    if (Started != NumberOfThreads) {
+        printf("Failed to start %u threads.\n", NumberOfThreads);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    SIZE_DISTRIBUTION Sizes;
+    const char* WorkloadList = NULL;
+    const char* AllocatorList = NULL;
+    const char* SizesName = NULL;
+    const char* CsvName = NULL;
+    const char* RssCsvName = NULL;
+    FILE* Csv = NULL;
+    FILE* RssCsv = NULL;
+    uint32_t MaximumThreads = std::thread::hardware_concurrency();
+    uint32_t Milliseconds = 1000;
+    size_t* RssSamples;
+    uint32_t NumberOfSamples;
+    RESULTS Results;
+    int Result = 0;
+    int Index;
+
+    for (Index = 1; Index < argc; ++Index) {
+        if (strcmp(argv[Index], "--workload") == 0 && Index + 1 < argc) {
+            WorkloadList = argv[++Index];
+        }
+        else if (strcmp(argv[Index], "--allocator") == 0 && Index + 1 < argc) {
+            AllocatorList = argv[++Index];
+        }
+        else if (strcmp(argv[Index], "--threads") == 0 && Index + 1 < argc) {
+            MaximumThreads = (uint32_t)strtoul(argv[++Index], NULL, 0);
+        }
+        else if (strcmp(argv[Index], "--seconds") == 0 && Index + 1 < argc) {
+            Milliseconds = (uint32_t)(atof(argv[++Index]) * 1000);
+        }
+        else if (strcmp(argv[Index], "--sizes") == 0 && Index + 1 < argc) {
+            SizesName = argv[++Index];
+        }
+        else if (strcmp(argv[Index], "--csv") == 0 && Index + 1 < argc) {
+            CsvName = argv[++Index];
+        }
+        else if (strcmp(argv[Index], "--rss-csv") == 0 && Index + 1 < argc) {
+            RssCsvName = argv[++Index];
+        }
+        else {
+            break;
+        }
+    }
+    if (Index < argc || Milliseconds == 0) {
+        printf("Usage: heap-benchmark [--workload prodcons,churn,mixed,large] [--allocator nt-heap,nt-lfh,malloc,pool]\n" \
+            "                      [--threads maximum] [--seconds per run] [--sizes snapshot file]\n" \
+            "                      [--csv results file] [--rss-csv resident set file]\n");
+        return 1;
+    }
+    if (MaximumThreads == 0) {
+        MaximumThreads = 1;
+    }
+    if (MaximumThreads > MAXIMUM_THREADS) {
+        MaximumThreads = MAXIMUM_THREADS;
+    }
+
+    if (SizesName != NULL) {
+        if (LoadSizes(SizesName, &Sizes) == false) {
+            return 1;
+        }
+    }
+    else {
+        memcpy(Sizes.Weights, DefaultWeights, sizeof(DefaultWeights));
+        Sizes.Total = 0;
+        for (Index = 0; Index < SIZE_BUCKETS; ++Index) {
+            Sizes.Total += Sizes.Weights[Index];
+        }
+    }
+
+    if (CsvName != NULL) {
+        Csv = fopen(CsvName, "w");
+        if (Csv == NULL) {
+            printf("Failed to create %s.\n", CsvName);
+            return 1;
+        }
+        fprintf(Csv, "workload,allocator,threads,seconds,allocations_per_second,p50_ns,p99_ns,p999_ns," \
+            "peak_rss_bytes,end_rss_bytes,failures\n");
+    }
+    if (RssCsvName != NULL) {
+        RssCsv = fopen(RssCsvName, "w");
+        if (RssCsv == NULL) {
+            printf("Failed to create %s.\n", RssCsvName);
+            if (Csv != NULL) {
+                fclose(Csv);
+            }
+            return 1;
+        }
+        fprintf(RssCsv, "workload,allocator,threads,milliseconds,rss_bytes\n");
+    }
+
+    RssSamples = (size_t*)malloc((Milliseconds / RSS_INTERVAL + 2) * sizeof(size_t));
+    if (RssSamples == NULL) {
+        printf("Not enough memory.\n");
+        return 1;
+    }
+
+    printf("%-9s %-8s %7s %12s %8s %8s %9s %10s %10s\n",
+        "workload", "allocator", "threads", "allocs/s", "p50 ns", "p99 ns", "p99.9 ns", "peak RSS", "end RSS");
+
+    for (const WORKLOAD& Workload : Workloads) {
+        if (Selected(WorkloadList, Workload.Name) == false) {
+            continue;
+        }
+        for (const ALLOCATOR& Allocator : Allocators) {
+            if (Selected(AllocatorList, Allocator.Name) == false) {
+                continue;
+            }
+            for (uint32_t Threads = 1; ; Threads = Threads * 2 < MaximumThreads ? Threads * 2 : MaximumThreads) {
+                if (Measure(&Workload, &Allocator, &Sizes, Threads, Milliseconds, &Results, RssSamples,
+                    &NumberOfSamples) == false) {
+                    Result = 1;
+                    break;
+                }
+
+                printf("%-9s %-9s %6u %12.0f %8llu %8llu %9llu %8zuKB %8zuKB%s\n",
+                    Workload.Name, Allocator.Name, Threads, Results.Allocations / Results.Seconds,
+                    (unsigned long long)LatencyPercentile(Results.Latency, 50.0),
+                    (unsigned long long)LatencyPercentile(Results.Latency, 99.0),
+                    (unsigned long long)LatencyPercentile(Results.Latency, 99.9),
+                    Results.PeakRss / 1024, Results.EndRss / 1024,
+                    Results.Failures != 0 ? "  (allocation failures)" : "");
+
+                if (Csv != NULL) {
+                    fprintf(Csv, "%s,%s,%u,%.3f,%.0f,%llu,%llu,%llu,%zu,%zu,%llu\n",
+                        Workload.Name, Allocator.Name, Threads, Results.Seconds, Results.Allocations / Results.Seconds,
+                        (unsigned long long)LatencyPercentile(Results.Latency, 50.0),
+                        (unsigned long long)LatencyPercentile(Results.Latency, 99.0),
+                        (unsigned long long)LatencyPercentile(Results.Latency, 99.9),
+                        Results.PeakRss, Results.EndRss, (unsigned long long)Results.Failures);
+                }
+                if (RssCsv != NULL) {
+                    for (uint32_t Sample = 0; Sample < NumberOfSamples; ++Sample) {
+                        fprintf(RssCsv, "%s,%s,%u,%u,%zu\n", Workload.Name, Allocator.Name, Threads,
+                            Sample * RSS_INTERVAL, RssSamples[Sample]);
+                    }
+                }
+
+                if (Threads == MaximumThreads) {
+                    break;
+                }
+            }
+        }
+    }
+
+    free(RssSamples);
+    if (RssCsv != NULL) {
+        fclose(RssCsv);
+    }
+    if (Csv != NULL) {
+        fclose(Csv);
+    }
+    return Result;
+}
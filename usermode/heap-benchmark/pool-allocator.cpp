@@ -0,0 +1,205 @@
+// pool-allocator.cpp : A size-class pool with per-thread caches.
+//
+
+#include "pool-allocator.h"
+
+#include <new>
+#include <stdlib.h>
+
+typedef struct _POOL_BLOCK {
+    struct _POOL_BLOCK* Next;
+} POOL_BLOCK, *PPOOL_BLOCK;
+
+typedef struct _POOL_CHUNK {
+    struct _POOL_CHUNK* Next;
+    size_t Reserved;                // keeps the blocks 16-byte aligned
+} POOL_CHUNK, *PPOOL_CHUNK;
+
+typedef struct alignas(64) _POOL_CLASS {
+    PH_LOCK Lock;
+    PPOOL_BLOCK FreeBlocks;
+    PPOOL_CHUNK Chunks;
+} POOL_CLASS, *PPOOL_CLASS;
+
+struct _POOL {
+    POOL_CLASS Classes[POOL_CLASSES];
+};
+
+typedef struct _POOL_CACHE_LIST {
+    PPOOL_BLOCK Head;
+    uint32_t Count;
+} POOL_CACHE_LIST, *PPOOL_CACHE_LIST;
+
+struct _POOL_CACHE {
+    PPOOL Pool;
+    POOL_CACHE_LIST Classes[POOL_CLASSES];
+};
+
+static uint32_t ClassIndex(size_t Size)
+{
+    uint32_t Index = 0;
+
+    while (((size_t)POOL_MINIMUM_SIZE << Index) < Size) {
+        ++Index;
+    }
+    return Index;
+}
+
+PPOOL PoolCreate()
+{
+    PPOOL Pool = new (std::nothrow) POOL();
+    uint32_t Index;
+
+    if (Pool == NULL) {
+        return NULL;
+    }
+    for (Index = 0; Index < POOL_CLASSES; ++Index) {
+        PhLockInitialize(&Pool->Classes[Index].Lock);
+    }
+    return Pool;
+}
+
+void PoolDestroy(PPOOL Pool)
+{
+    uint32_t Index;
+
+    for (Index = 0; Index < POOL_CLASSES; ++Index) {
+        PPOOL_CHUNK Chunk = Pool->Classes[Index].Chunks;
+
+        while (Chunk != NULL) {
+            PPOOL_CHUNK Next = Chunk->Next;
+
+            free(Chunk);
+            Chunk = Next;
+        }
+        PhLockDelete(&Pool->Classes[Index].Lock);
+    }
+    delete Pool;
+}
+
+PPOOL_CACHE PoolAttachThread(PPOOL Pool)
+{
+    PPOOL_CACHE Cache = (PPOOL_CACHE)calloc(1, sizeof(POOL_CACHE));
+
+    if (Cache != NULL) {
+        Cache->Pool = Pool;
+    }
+    return Cache;
+}
+
+//
+// Moves the first Count blocks of the cache list to the shared list.
+//
+static void ReturnBlocks(PPOOL_CLASS Class, PPOOL_CACHE_LIST List, uint32_t Count)
+{
+    PPOOL_BLOCK First = List->Head;
+    PPOOL_BLOCK Last = First;
+    uint32_t Index;
+
+    for (Index = 1; Index < Count; ++Index) {
+        Last = Last->Next;
+    }
+    List->Head = Last->Next;
+    List->Count -= Count;
+
+    PhLockAcquire(&Class->Lock);
+    Last->Next = Class->FreeBlocks;
+    Class->FreeBlocks = First;
+    PhLockRelease(&Class->Lock);
+}
+
+void PoolDetachThread(PPOOL_CACHE Cache)
+{
+    uint32_t Index;
+
+    for (Index = 0; Index < POOL_CLASSES; ++Index) {
+        if (Cache->Classes[Index].Count != 0) {
+            ReturnBlocks(&Cache->Pool->Classes[Index], &Cache->Classes[Index], Cache->Classes[Index].Count);
+        }
+    }
+    free(Cache);
+}
+
+//
+// Takes up to POOL_BATCH blocks from the shared list, carving a new chunk
+// when it is empty. Chunks hold at least POOL_BATCH blocks.
+//
+static bool RefillCache(PPOOL_CLASS Class, PPOOL_CACHE_LIST List, size_t BlockSize)
+{
+    PPOOL_BLOCK Block;
+
+    PhLockAcquire(&Class->Lock);
+    if (Class->FreeBlocks == NULL) {
+        size_t ChunkSize = BlockSize * POOL_BATCH > POOL_CHUNK_SIZE ? BlockSize * POOL_BATCH : POOL_CHUNK_SIZE;
+        PPOOL_CHUNK Chunk = (PPOOL_CHUNK)malloc(sizeof(POOL_CHUNK) + ChunkSize);
+        size_t Index;
+
+        if (Chunk == NULL) {
+            PhLockRelease(&Class->Lock);
+            return false;
+        }
+        Chunk->Next = Class->Chunks;
+        Class->Chunks = Chunk;
+        for (Index = ChunkSize / BlockSize; Index-- != 0; ) {
+            Block = (PPOOL_BLOCK)((uint8_t*)(Chunk + 1) + Index * BlockSize);
+            Block->Next = Class->FreeBlocks;
+            Class->FreeBlocks = Block;
+        }
+    }
+    while (List->Count < POOL_BATCH && Class->FreeBlocks != NULL) {
+        Block = Class->FreeBlocks;
+        Class->FreeBlocks = Block->Next;
+        Block->Next = List->Head;
+        List->Head = Block;
+        List->Count += 1;
+    }
+    PhLockRelease(&Class->Lock);
+    return true;
+}
+
+void* PoolAlloc(PPOOL_CACHE Cache, size_t Size)
+{
+    uint32_t Index;
+    PPOOL_CACHE_LIST List;
+    PPOOL_BLOCK Block;
+
+    if (Size > POOL_MAXIMUM_SIZE) {
+        return malloc(Size);
+    }
+
+    Index = ClassIndex(Size);
+    List = &Cache->Classes[Index];
+    if (List->Head == NULL &&
+        RefillCache(&Cache->Pool->Classes[Index], List, (size_t)POOL_MINIMUM_SIZE << Index) == false) {
+        return NULL;
+    }
+    Block = List->Head;
+    List->Head = Block->Next;
+    List->Count -= 1;
+    return Block;
+}
+
+//
+// A cache holds at most two batches per class, so blocks freed by a thread
+// that never allocates that size flow back to the others.
+//
+void PoolFree(PPOOL_CACHE Cache, void* Mem, size_t Size)
+{
+    uint32_t Index;
+    PPOOL_CACHE_LIST List;
+    PPOOL_BLOCK Block = (PPOOL_BLOCK)Mem;
+
+    if (Size > POOL_MAXIMUM_SIZE) {
+        free(Mem);
+        return;
+    }
+
+    Index = ClassIndex(Size);
+    List = &Cache->Classes[Index];
+    Block->Next = List->Head;
+    List->Head = Block;
+    List->Count += 1;
+    if (List->Count >= 2 * POOL_BATCH) {
+        ReturnBlocks(&Cache->Pool->Classes[Index], List, POOL_BATCH);
+    }
+}
@@ -0,0 +1,41 @@
+// pool-allocator.h : A size-class pool with per-thread caches.
+//
+// Sizes up to POOL_MAXIMUM_SIZE are rounded up to a power of two, from 16
+// bytes. Each thread keeps a free list per class and only goes to the shared
+// pool, under that class's lock, to take or give back POOL_BATCH blocks at a
+// time. The shared pool carves new blocks out of chunks that are only
+// returned when the pool is destroyed, so its footprint never shrinks.
+//
+// Blocks carry no header: the caller passes the size back on free, like
+// sized delete. Larger sizes go to malloc.
+//
+
+#pragma once
+
+#include "../portable-heap/heap-os.h"
+
+#define POOL_MINIMUM_SIZE               16
+#define POOL_MAXIMUM_SIZE               (64 * 1024)
+#define POOL_CLASSES                    13
+#define POOL_BATCH                      32
+#define POOL_CHUNK_SIZE                 (1024 * 1024)
+
+typedef struct _POOL POOL, *PPOOL;
+typedef struct _POOL_CACHE POOL_CACHE, *PPOOL_CACHE;
+
+PPOOL PoolCreate();
+
+//
+// Every cache must have been detached first.
+//
+void PoolDestroy(PPOOL Pool);
+
+//
+// A cache belongs to one thread at a time. Detaching gives its blocks back
+// to the shared pool.
+//
+PPOOL_CACHE PoolAttachThread(PPOOL Pool);
+void PoolDetachThread(PPOOL_CACHE Cache);
+
+void* PoolAlloc(PPOOL_CACHE Cache, size_t Size);
+void PoolFree(PPOOL_CACHE Cache, void* Mem, size_t Size);
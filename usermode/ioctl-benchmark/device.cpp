@@ -0,0 +1,224 @@
+// device.cpp : DeviceIoControl on Windows, the user-mode shim elsewhere.
+//
+
+#include "device.h"
+
+#ifdef _WIN32
+
+struct _DEVICE_READ {
+    OVERLAPPED Overlapped;
+    uint32_t Error;                     // of ReadFile itself, when it failed
+};
+
+#else
+
+#include <atomic>
+#include <thread>
+
+//
+// The shim's side, declared with the layouts it uses rather than through its
+// headers, which stand in for the WDK and are C only. It is built with
+// -fshort-wchar, so its wide strings are char16_t here.
+//
+typedef struct _IO_STATUS_BLOCK {
+    union {
+        int32_t Status;
+        void* Pointer;
+    };
+    uintptr_t Information;
+} IO_STATUS_BLOCK;
+
+typedef int32_t (*PDRIVER_INITIALIZE)(void* DriverObject, void* RegistryPath);
+typedef void (*PIO_APC_ROUTINE)(void* ApcContext, IO_STATUS_BLOCK* IoStatusBlock, ULONG Reserved);
+
+extern "C" {
+int32_t DriverEntry(void* DriverObject, void* RegistryPath);
+int32_t WdmLoadDriver(PDRIVER_INITIALIZE DriverInit, const char16_t* DriverName, void** DriverObject);
+void WdmUnloadDriver(void* DriverObject);
+int32_t WdmOpenFile(const char16_t* FileName, void** FileObject);
+void WdmCloseFile(void* FileObject);
+int32_t WdmReadFile(void* FileObject, PIO_APC_ROUTINE ApcRoutine, void* ApcContext, IO_STATUS_BLOCK* IoStatusBlock,
+    void* Buffer, ULONG Length, void* ByteOffset);
+int32_t WdmDeviceIoControlFile(void* FileObject, void* ApcRoutine, void* ApcContext, IO_STATUS_BLOCK* IoStatusBlock,
+    ULONG IoControlCode, void* InputBuffer, ULONG InputBufferLength, void* OutputBuffer, ULONG OutputBufferLength);
+}
+
+static void* Driver;
+
+struct _DEVICE_READ {
+    IO_STATUS_BLOCK IoStatus;
+    std::atomic<bool> Completed;
+    uint32_t Error;                     // of WdmReadFile itself, when it failed
+};
+
+//
+// The shim calls it on the completing thread, once the I/O status block is
+// filled in, however the read completed.
+//
+static void ReadCompleted(void* ApcContext, IO_STATUS_BLOCK* IoStatusBlock, ULONG Reserved)
+{
+    (void)IoStatusBlock;
+    (void)Reserved;
+    ((PDEVICE_READ)ApcContext)->Completed.store(true, std::memory_order_release);
+}
+
+#endif
+
+bool DeviceLoad()
+{
+#ifdef _WIN32
+    return true;
+#else
+    return WdmLoadDriver(DriverEntry, u"\\Driver\\UnderTest", &Driver) >= 0;
+#endif
+}
+
+void DeviceUnload()
+{
+#ifndef _WIN32
+    WdmUnloadDriver(Driver);
+#endif
+}
+
+bool DeviceOpen(const char* Name, bool Overlapped, DEVICE_FILE* File)
+{
+#ifdef _WIN32
+    HANDLE Handle = CreateFileA(Name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, Overlapped ? FILE_FLAG_OVERLAPPED : 0, NULL);
+
+    *File = Handle;
+    return Handle != INVALID_HANDLE_VALUE;
+#else
+    char16_t WideName[256];
+    size_t Index;
+
+    (void)Overlapped;
+    for (Index = 0; Name[Index] != '\0' && Index + 1 < sizeof(WideName) / sizeof(WideName[0]); ++Index) {
+        WideName[Index] = (char16_t)(unsigned char)Name[Index];
+    }
+    WideName[Index] = u'\0';
+    return WdmOpenFile(WideName, File) >= 0;
+#endif
+}
+
+void DeviceClose(DEVICE_FILE File)
+{
+#ifdef _WIN32
+    CloseHandle(File);
+#else
+    WdmCloseFile(File);
+#endif
+}
+
+uint32_t DeviceControl(DEVICE_FILE File, uint32_t IoControlCode, void* InputBuffer, uint32_t InputBufferLength,
+    void* OutputBuffer, uint32_t OutputBufferLength, uint32_t* Returned)
+{
+#ifdef _WIN32
+    DWORD BytesReturned = 0;
+    BOOL Succeeded = DeviceIoControl(File, IoControlCode, InputBuffer, InputBufferLength, OutputBuffer,
+        OutputBufferLength, &BytesReturned, NULL);
+
+    *Returned = BytesReturned;
+    return Succeeded ? 0 : GetLastError();
+#else
+    IO_STATUS_BLOCK IoStatus = {};
+    int32_t Status = WdmDeviceIoControlFile(File, NULL, NULL, &IoStatus, IoControlCode, InputBuffer,
+        InputBufferLength, OutputBuffer, OutputBufferLength);
+
+    *Returned = (uint32_t)IoStatus.Information;
+    return Status >= 0 ? 0 : (uint32_t)Status;
+#endif
+}
+
+uint32_t DeviceRead(DEVICE_FILE File, void* Buffer, uint32_t Length, uint32_t* Returned)
+{
+#ifdef _WIN32
+    DWORD BytesRead = 0;
+    BOOL Succeeded = ReadFile(File, Buffer, Length, &BytesRead, NULL);
+
+    *Returned = BytesRead;
+    return Succeeded ? 0 : GetLastError();
+#else
+    IO_STATUS_BLOCK IoStatus = {};
+    int32_t Status = WdmReadFile(File, NULL, NULL, &IoStatus, Buffer, Length, NULL);
+
+    *Returned = (uint32_t)IoStatus.Information;
+    return Status >= 0 ? 0 : (uint32_t)Status;
+#endif
+}
+
+PDEVICE_READ DeviceReadCreate()
+{
+    PDEVICE_READ Read = new DEVICE_READ();
+
+#ifdef _WIN32
+    Read->Overlapped.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (Read->Overlapped.hEvent == NULL) {
+        delete Read;
+        return NULL;
+    }
+#endif
+    return Read;
+}
+
+void DeviceReadDelete(PDEVICE_READ Read)
+{
+#ifdef _WIN32
+    CloseHandle(Read->Overlapped.hEvent);
+#endif
+    delete Read;
+}
+
+uint32_t DeviceReadStart(DEVICE_FILE File, PDEVICE_READ Read, void* Buffer, uint32_t Length)
+{
+#ifdef _WIN32
+    Read->Error = 0;
+    if (ReadFile(File, Buffer, Length, NULL, &Read->Overlapped) == FALSE && GetLastError() != ERROR_IO_PENDING) {
+        Read->Error = GetLastError();
+    }
+    return Read->Error;
+#else
+    int32_t Status;
+
+    Read->Completed.store(false, std::memory_order_relaxed);
+    Read->Error = 0;
+    Status = WdmReadFile(File, ReadCompleted, Read, &Read->IoStatus, Buffer, Length, NULL);
+
+    //
+    // A read that failed and never completed has no completion to wait for.
+    //
+    if (Status < 0 && Read->Completed.load(std::memory_order_acquire) == false) {
+        Read->Error = (uint32_t)Status;
+        Read->Completed.store(true, std::memory_order_relaxed);
+    }
+    return Read->Error;
+#endif
+}
+
+uint32_t DeviceReadFinish(DEVICE_FILE File, PDEVICE_READ Read, uint32_t* Returned)
+{
+#ifdef _WIN32
+    DWORD BytesRead = 0;
+
+    *Returned = 0;
+    if (Read->Error != 0) {
+        return Read->Error;
+    }
+    if (GetOverlappedResult(File, &Read->Overlapped, &BytesRead, TRUE) == FALSE) {
+        return GetLastError();
+    }
+    *Returned = BytesRead;
+    return 0;
+#else
+    (void)File;
+    *Returned = 0;
+    while (Read->Completed.load(std::memory_order_acquire) == false) {
+        std::this_thread::yield();
+    }
+    if (Read->Error != 0) {
+        return Read->Error;
+    }
+    *Returned = (uint32_t)Read->IoStatus.Information;
+    return Read->IoStatus.Status >= 0 ? 0 : (uint32_t)Read->IoStatus.Status;
+#endif
+}
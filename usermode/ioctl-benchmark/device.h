@@ -0,0 +1,73 @@
+// device.h : The sample drivers' device, as the benchmark sees it.
+//
+// On Windows it is the installed driver, through CreateFile and
+// DeviceIoControl. Elsewhere it is the driver built against the user-mode
+// shim (sources/WdmShim) and linked into the benchmark, which loads it and
+// talks to it through the shim's I/O manager.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#else
+//
+// What Ioctl.h takes from windows.h and winioctl.h.
+//
+typedef uint8_t UCHAR;
+typedef uint32_t ULONG;
+typedef uint64_t ULONG64;
+typedef char16_t WCHAR;
+
+#define FIELD_OFFSET(Type, Field)       ((long)offsetof(Type, Field))
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+#define FILE_DEVICE_UNKNOWN             0x00000022
+#define METHOD_BUFFERED                 0
+#define METHOD_IN_DIRECT                1
+#define METHOD_OUT_DIRECT               2
+#define FILE_ANY_ACCESS                 0
+#define FILE_READ_DATA                  0x0001
+#define FILE_WRITE_DATA                 0x0002
+#endif
+
+#include "../../sources/DispatchIoctl/DispatchIoctl/Ioctl.h"
+
+typedef void* DEVICE_FILE;
+
+//
+// Loads the linked driver on the shim; the installed one needs nothing.
+//
+bool DeviceLoad();
+void DeviceUnload();
+
+//
+// An overlapped handle takes DeviceReadStart only; on the shim, every handle
+// takes everything.
+//
+bool DeviceOpen(const char* Name, bool Overlapped, DEVICE_FILE* File);
+void DeviceClose(DEVICE_FILE File);
+
+//
+// Synchronous. Return 0 on success, or else the Win32 error on Windows and
+// the NTSTATUS on the shim; *Returned is the number of bytes transferred.
+//
+uint32_t DeviceControl(DEVICE_FILE File, uint32_t IoControlCode, void* InputBuffer, uint32_t InputBufferLength,
+    void* OutputBuffer, uint32_t OutputBufferLength, uint32_t* Returned);
+uint32_t DeviceRead(DEVICE_FILE File, void* Buffer, uint32_t Length, uint32_t* Returned);
+
+//
+// A read in flight: DeviceReadStart issues it and returns at once,
+// DeviceReadFinish waits for it to complete. A DEVICE_READ carries one read
+// at a time, and any number of them can be in flight on a handle.
+//
+typedef struct _DEVICE_READ DEVICE_READ, *PDEVICE_READ;
+
+PDEVICE_READ DeviceReadCreate();
+void DeviceReadDelete(PDEVICE_READ Read);
+uint32_t DeviceReadStart(DEVICE_FILE File, PDEVICE_READ Read, void* Buffer, uint32_t Length);
+uint32_t DeviceReadFinish(DEVICE_FILE File, PDEVICE_READ Read, uint32_t* Returned);
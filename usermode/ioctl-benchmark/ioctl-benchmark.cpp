@@ -0,0 +1,632 @@
+// ioctl-benchmark.cpp : This file contains the 'main' function. Program execution begins and ends there.
+//
+// Drives the DispatchIoctl and DispatchPassThru devices with a mix of
+// requests from 1, 2, 4 ... threads, for each message size asked for, and
+// reports per request code the requests per second, the bytes per second the
+// device returned and the p50 / p99 / p99.9 latency of single calls, timed on
+// one call in 16. Failed calls are counted apart: they are not in the
+// requests per second, and their latency is left out. Results are meant
+// to be kept with --csv and compared run to run, as a baseline for changes
+// to the drivers.
+//
+// The mix is a weighted list of operations, drawn at random per call:
+//
+//  - send, recv: DEVICE_SEND of a message of --size bytes, DEVICE_RECV into
+//    a buffer of DEVICE_MAXIMUM_MESSAGE bytes, which holds any message and
+//    the driver's own reply when none is queued. Once DEVICE_QUEUE_LENGTH
+//    messages wait on a handle, send fails until a recv takes one.
+//  - batch: DEVICE_SEND_BATCH of --batch such messages; a call is a batch.
+//  - send-direct, recv-direct: DEVICE_SEND_DIRECT and DEVICE_RECV_DIRECT of
+//    a payload of --size bytes.
+//  - query: DEVICE_QUERY_PAYLOAD.
+//  - echo: DEVICE_SEND, then DEVICE_RECV_WAIT for the same message, which is
+//    the round trip of an inverted call. It needs a handle per thread and no
+//    recv in the mix, or another call may take the message it waits for.
+//  - read: ReadFile of --size bytes, for DispatchPassThru. With --depth n, a
+//    call is n reads issued together on an overlapped handle, which it waits
+//    for; open the device as \\.\dummydriverlink\pending for the driver to
+//    pend them, rather than complete each before the next is issued. Only
+//    read goes with --depth.
+//
+// Each thread has a handle of its own, unless --shared gives them a single
+// one; on Windows, a handle opened for synchronous I/O serializes its
+// requests, which --shared then measures too.
+//
+// Outside Visual Studio, against the driver built on the user-mode shim:
+//   gcc -c -O2 -fshort-wchar -fcommon -Wno-multichar -I ../../sources/WdmShim/include -I ../../sources/WdmShim
+//     ../../sources/WdmShim/WdmShim.c ../../sources/DispatchIoctl/DispatchIoctl/*.c
+//   g++ -O2 -pthread -o ioctl-benchmark ioctl-benchmark.cpp device.cpp *.o
+// or with ../../sources/DispatchPassThru/DispatchPassThru/*.c in place of
+// DispatchIoctl, which defines DriverEntry too.
+//
+
+#include "../common/benchmark-util.h"
+#include "device.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define MAXIMUM_THREADS                 256
+#define MAXIMUM_SIZES                   16
+#define MAXIMUM_DEPTH                   64
+#define LATENCY_SAMPLE_MASK             15
+
+#define DEFAULT_DEVICE                  "\\\\.\\dummydriverlink"
+#define DEFAULT_MIX                     "send,recv"
+#define DEFAULT_SIZE                    64
+#define DEFAULT_BATCH                   64
+
+typedef enum _OPERATION_TYPE {
+    OperationSend,
+    OperationRecv,
+    OperationBatch,
+    OperationSendDirect,
+    OperationRecvDirect,
+    OperationQuery,
+    OperationEcho,
+    OperationRead,
+    OperationMaximum
+} OPERATION_TYPE;
+
+typedef struct _OPERATION {
+    const char* Name;
+    uint32_t IoControlCode;             // 0 for a read
+} OPERATION, *POPERATION;
+
+static const OPERATION Operations[OperationMaximum] = {
+    { "send", DEVICE_SEND },
+    { "recv", DEVICE_RECV },
+    { "batch", DEVICE_SEND_BATCH },
+    { "send-direct", DEVICE_SEND_DIRECT },
+    { "recv-direct", DEVICE_RECV_DIRECT },
+    { "query", DEVICE_QUERY_PAYLOAD },
+    { "echo", DEVICE_RECV_WAIT },
+    { "read", 0 },
+};
+
+typedef struct _OPERATION_RESULTS {
+    uint64_t Calls;                     // failures included
+    uint64_t Failures;
+    uint64_t Bytes;                     // returned by the device
+    uint32_t FirstError;
+    uint64_t Latency[LATENCY_BUCKETS];
+} OPERATION_RESULTS, *POPERATION_RESULTS;
+
+typedef struct _RUN RUN, *PRUN;
+
+typedef struct alignas(64) _WORKER {
+    PRUN Run;
+    DEVICE_FILE File;
+    bool Opened;
+    uint64_t Random;
+    std::vector<uint8_t> Input;
+    std::vector<uint8_t> Output;
+    PDEVICE_READ Reads[MAXIMUM_DEPTH];
+    OPERATION_RESULTS Results[OperationMaximum];
+} WORKER, *PWORKER;
+
+struct _RUN {
+    const uint32_t* Weights;
+    uint32_t TotalWeight;
+    uint32_t Size;
+    uint32_t BatchCount;
+    uint32_t Depth;
+    uint32_t NumberOfThreads;
+    PWORKER Workers;
+    std::atomic<uint32_t> Ready;
+    std::atomic<bool> Start;
+    std::atomic<bool> Stop;
+};
+
+static uint64_t Timestamp()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t NextRandom(PWORKER Worker)
+{
+    Worker->Random ^= Worker->Random << 13;
+    Worker->Random ^= Worker->Random >> 7;
+    Worker->Random ^= Worker->Random << 17;
+    return Worker->Random;
+}
+
+static uint32_t NextOperation(PWORKER Worker)
+{
+    const RUN* Run = Worker->Run;
+    uint32_t Pick = (uint32_t)(NextRandom(Worker) % Run->TotalWeight);
+    uint32_t Type = 0;
+
+    while (Pick >= Run->Weights[Type]) {
+        Pick -= Run->Weights[Type];
+        ++Type;
+    }
+    return Type;
+}
+
+//
+// A wide string of Size bytes, terminator included, as the drivers print
+// what they are sent.
+//
+static void FillMessage(WCHAR* Message, uint32_t Size)
+{
+    uint32_t Index;
+
+    for (Index = 0; Index + 1 < Size / sizeof(WCHAR); ++Index) {
+        Message[Index] = (WCHAR)('a' + Index % 26);
+    }
+    if (Size >= sizeof(WCHAR)) {
+        Message[Index] = 0;
+    }
+}
+
+//
+// The input buffer holds the message for send and echo, the batch for
+// batch and the payload for send-direct, which all fit in the batch; the
+// output buffer whatever comes back, the statuses of a batch included, or
+// --depth reads.
+//
+static void PrepareBuffers(PWORKER Worker)
+{
+    const RUN* Run = Worker->Run;
+    uint32_t MessageSize = DEVICE_MESSAGE_SIZE(Run->Size);
+    uint32_t Index;
+
+    Worker->Input.assign(FIELD_OFFSET(DEVICE_BATCH, Messages) + (size_t)Run->BatchCount * MessageSize, 0);
+    Worker->Output.assign(Run->Size + Run->BatchCount * sizeof(int32_t) + sizeof(DEVICE_PAYLOAD_INFO) +
+        DEVICE_MAXIMUM_MESSAGE, 0);
+    if (Worker->Output.size() < (size_t)Run->Depth * Run->Size) {
+        Worker->Output.assign((size_t)Run->Depth * Run->Size, 0);
+    }
+
+    for (Index = 0; Index < Run->BatchCount; ++Index) {
+        PDEVICE_MESSAGE Message = (PDEVICE_MESSAGE)(Worker->Input.data() + FIELD_OFFSET(DEVICE_BATCH, Messages) +
+            (size_t)Index * MessageSize);
+
+        Message->Length = Run->Size;
+        FillMessage(Message->Data, Run->Size);
+    }
+    ((PDEVICE_BATCH)Worker->Input.data())->Count = Run->BatchCount;
+}
+
+//
+// Issues --depth reads, then waits for them all, so that they are in flight
+// together. Returns the first error.
+//
+static uint32_t ReadMany(PWORKER Worker, uint32_t* Returned)
+{
+    const RUN* Run = Worker->Run;
+    uint32_t Issued;
+    uint32_t Index;
+    uint32_t Error = 0;
+
+    *Returned = 0;
+    for (Issued = 0; Issued < Run->Depth; ++Issued) {
+        Error = DeviceReadStart(Worker->File, Worker->Reads[Issued], Worker->Output.data() + (size_t)Issued * Run->Size,
+            Run->Size);
+        if (Error != 0) {
+            break;
+        }
+    }
+    for (Index = 0; Index < Issued; ++Index) {
+        uint32_t Read;
+        uint32_t ReadError = DeviceReadFinish(Worker->File, Worker->Reads[Index], &Read);
+
+        *Returned += Read;
+        if (Error == 0) {
+            Error = ReadError;
+        }
+    }
+    return Error;
+}
+
+static uint32_t Call(PWORKER Worker, uint32_t Type, uint32_t* Returned)
+{
+    const RUN* Run = Worker->Run;
+    uint8_t* Input = Worker->Input.data();
+    uint8_t* Output = Worker->Output.data();
+    PDEVICE_MESSAGE Message = (PDEVICE_MESSAGE)(Input + FIELD_OFFSET(DEVICE_BATCH, Messages));
+    uint32_t Error;
+
+    switch (Type) {
+    case OperationSend:
+        return DeviceControl(Worker->File, DEVICE_SEND, Message->Data, Run->Size, NULL, 0, Returned);
+    case OperationRecv:
+        return DeviceControl(Worker->File, DEVICE_RECV, NULL, 0, Output, DEVICE_MAXIMUM_MESSAGE, Returned);
+    case OperationBatch:
+        return DeviceControl(Worker->File, DEVICE_SEND_BATCH, Input, (uint32_t)Worker->Input.size(), Output,
+            Run->BatchCount * sizeof(int32_t), Returned);
+    case OperationSendDirect:
+        return DeviceControl(Worker->File, DEVICE_SEND_DIRECT, NULL, 0, Input, Run->Size, Returned);
+    case OperationRecvDirect:
+        return DeviceControl(Worker->File, DEVICE_RECV_DIRECT, NULL, 0, Output, Run->Size, Returned);
+    case OperationQuery:
+        return DeviceControl(Worker->File, DEVICE_QUERY_PAYLOAD, NULL, 0, Output, sizeof(DEVICE_PAYLOAD_INFO),
+            Returned);
+    case OperationEcho:
+        Error = DeviceControl(Worker->File, DEVICE_SEND, Message->Data, Run->Size, NULL, 0, Returned);
+        if (Error != 0) {
+            return Error;
+        }
+        return DeviceControl(Worker->File, DEVICE_RECV_WAIT, NULL, 0, Output, Run->Size, Returned);
+    default:
+        if (Run->Depth > 1) {
+            return ReadMany(Worker, Returned);
+        }
+        return DeviceRead(Worker->File, Output, Run->Size, Returned);
+    }
+}
+
+static void RunWorker(PWORKER Worker)
+{
+    PRUN Run = Worker->Run;
+
+    Run->Ready.fetch_add(1);
+    while (Run->Start.load() == false) {
+    }
+    while (Run->Stop.load(std::memory_order_relaxed) == false) {
+        uint32_t Type = NextOperation(Worker);
+        POPERATION_RESULTS Results = &Worker->Results[Type];
+        uint32_t Returned = 0;
+        uint32_t Error;
+
+        //
+        // One call in LATENCY_SAMPLE_MASK + 1 is timed: often enough for the
+        // tail, rarely enough that reading the clock does not slow the loop
+        // down. A failure takes another path through the driver, so its time
+        // is not kept.
+        //
+        if ((++Results->Calls & LATENCY_SAMPLE_MASK) != 0) {
+            Error = Call(Worker, Type, &Returned);
+        }
+        else {
+            uint64_t Start = Timestamp();
+            uint64_t Elapsed;
+
+            Error = Call(Worker, Type, &Returned);
+            Elapsed = Timestamp() - Start;
+            if (Error == 0) {
+                Results->Latency[LatencyBucket(Elapsed)] += 1;
+            }
+        }
+        Results->Bytes += Returned;
+        if (Error != 0 && Results->Failures++ == 0) {
+            Results->FirstError = Error;
+        }
+    }
+}
+
+static bool Measure(const char* DeviceName, bool Shared, const uint32_t* Weights, uint32_t Size, uint32_t BatchCount,
+    uint32_t Depth, uint32_t NumberOfThreads, uint32_t Milliseconds, double* Seconds, POPERATION_RESULTS Results)
+{
+    std::vector<std::thread> Threads;
+    DEVICE_FILE SharedFile = NULL;
+    RUN Run;
+    uint64_t Start;
+    uint32_t Index;
+    bool Succeeded = true;
+
+    memset(Results, 0, OperationMaximum * sizeof(OPERATION_RESULTS));
+
+    Run.Weights = Weights;
+    Run.TotalWeight = 0;
+    for (Index = 0; Index < OperationMaximum; ++Index) {
+        Run.TotalWeight += Weights[Index];
+    }
+    Run.Size = Size;
+    Run.BatchCount = BatchCount;
+    Run.Depth = Depth;
+    Run.NumberOfThreads = NumberOfThreads;
+    Run.Ready = 0;
+    Run.Start = false;
+    Run.Stop = false;
+    Run.Workers = new WORKER[NumberOfThreads]();
+
+    if (Shared && DeviceOpen(DeviceName, Depth > 1, &SharedFile) == false) {
+        printf("Failed to open %s.\n", DeviceName);
+        delete[] Run.Workers;
+        return false;
+    }
+    for (Index = 0; Index < NumberOfThreads; ++Index) {
+        PWORKER Worker = &Run.Workers[Index];
+
+        Worker->Run = &Run;
+        Worker->Random = 0x9e3779b97f4a7c15ull * (Index + 1);
+        if (Shared) {
+            Worker->File = SharedFile;
+        }
+        else if ((Worker->Opened = DeviceOpen(DeviceName, Depth > 1, &Worker->File)) == false) {
+            printf("Failed to open %s.\n", DeviceName);
+            Succeeded = false;
+            break;
+        }
+        for (uint32_t Read = 0; Read < Depth && Depth > 1; ++Read) {
+            if ((Worker->Reads[Read] = DeviceReadCreate()) == NULL) {
+                printf("Failed to create the reads.\n");
+                Succeeded = false;
+                break;
+            }
+        }
+        if (Succeeded == false) {
+            break;
+        }
+        PrepareBuffers(Worker);
+    }
+
+    if (Succeeded) {
+        for (Index = 0; Index < NumberOfThreads; ++Index) {
+            Threads.emplace_back(RunWorker, &Run.Workers[Index]);
+        }
+        while (Run.Ready.load() != NumberOfThreads) {
+        }
+
+        Start = Timestamp();
+        Run.Start.store(true);
+        std::this_thread::sleep_for(std::chrono::milliseconds(Milliseconds));
+        Run.Stop.store(true);
+        for (std::thread& Thread : Threads) {
+            Thread.join();
+        }
+        *Seconds = (Timestamp() - Start) / 1e9;
+
+        for (Index = 0; Index < NumberOfThreads; ++Index) {
+            for (uint32_t Type = 0; Type < OperationMaximum; ++Type) {
+                POPERATION_RESULTS From = &Run.Workers[Index].Results[Type];
+
+                Results[Type].Calls += From->Calls;
+                Results[Type].Bytes += From->Bytes;
+                if (Results[Type].Failures == 0) {
+                    Results[Type].FirstError = From->FirstError;
+                }
+                Results[Type].Failures += From->Failures;
+                for (uint32_t Bucket = 0; Bucket < LATENCY_BUCKETS; ++Bucket) {
+                    Results[Type].Latency[Bucket] += From->Latency[Bucket];
+                }
+            }
+        }
+    }
+
+    for (Index = 0; Index < NumberOfThreads; ++Index) {
+        for (uint32_t Read = 0; Read < MAXIMUM_DEPTH; ++Read) {
+            if (Run.Workers[Index].Reads[Read] != NULL) {
+                DeviceReadDelete(Run.Workers[Index].Reads[Read]);
+            }
+        }
+        if (Run.Workers[Index].Opened) {
+            DeviceClose(Run.Workers[Index].File);
+        }
+    }
+    if (SharedFile != NULL) {
+        DeviceClose(SharedFile);
+    }
+    delete[] Run.Workers;
+    return Succeeded;
+}
+
+//
+// name[:weight],... with a weight of 1 by default.
+//
+static bool ParseMix(const char* Mix, uint32_t* Weights)
+{
+    const char* Item = Mix;
+
+    memset(Weights, 0, OperationMaximum * sizeof(uint32_t));
+    while (*Item != '\0') {
+        size_t Length = strcspn(Item, ":,");
+        uint32_t Weight = 1;
+        uint32_t Type;
+
+        for (Type = 0; Type < OperationMaximum; ++Type) {
+            if (strlen(Operations[Type].Name) == Length && strncmp(Item, Operations[Type].Name, Length) == 0) {
+                break;
+            }
+        }
+        if (Type == OperationMaximum) {
+            return false;
+        }
+        Item += Length;
+        if (*Item == ':') {
+            char* End;
+
+            Weight = (uint32_t)strtoul(Item + 1, &End, 0);
+            if (End == Item + 1 || Weight == 0 || Weight > 1000) {
+                return false;
+            }
+            Item = End;
+        }
+        Weights[Type] += Weight;
+        if (*Item == ',') {
+            ++Item;
+        }
+        else if (*Item != '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t ParseSizes(const char* List, uint32_t* Sizes)
+{
+    const char* Item = List;
+    uint32_t Count = 0;
+
+    while (*Item != '\0' && Count < MAXIMUM_SIZES) {
+        char* End;
+
+        Sizes[Count] = (uint32_t)strtoul(Item, &End, 0);
+        if (End == Item || Sizes[Count] < sizeof(WCHAR) || (*End != ',' && *End != '\0')) {
+            return 0;
+        }
+        ++Count;
+        Item = *End == ',' ? End + 1 : End;
+    }
+    return *Item == '\0' ? Count : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    static OPERATION_RESULTS Results[OperationMaximum];
+    uint32_t Weights[OperationMaximum];
+    uint32_t Sizes[MAXIMUM_SIZES] = { DEFAULT_SIZE };
+    uint32_t NumberOfSizes = 1;
+    const char* DeviceName = DEFAULT_DEVICE;
+    const char* Mix = DEFAULT_MIX;
+    const char* CsvName = NULL;
+    FILE* Csv = NULL;
+    uint32_t MaximumThreads = std::thread::hardware_concurrency();
+    uint32_t Milliseconds = 1000;
+    uint32_t BatchCount = DEFAULT_BATCH;
+    uint32_t Depth = 1;
+    bool Shared = false;
+    double Seconds = 0;
+    int Result = 0;
+    int Index;
+
+    for (Index = 1; Index < argc; ++Index) {
+        if (strcmp(argv[Index], "--device") == 0 && Index + 1 < argc) {
+            DeviceName = argv[++Index];
+        }
+        else if (strcmp(argv[Index], "--mix") == 0 && Index + 1 < argc) {
+            Mix = argv[++Index];
+        }
+        else if (strcmp(argv[Index], "--size") == 0 && Index + 1 < argc) {
+            NumberOfSizes = ParseSizes(argv[++Index], Sizes);
+            if (NumberOfSizes == 0) {
+                break;
+            }
+        }
+        else if (strcmp(argv[Index], "--batch") == 0 && Index + 1 < argc) {
+            BatchCount = (uint32_t)strtoul(argv[++Index], NULL, 0);
+        }
+        else if (strcmp(argv[Index], "--depth") == 0 && Index + 1 < argc) {
+            Depth = (uint32_t)strtoul(argv[++Index], NULL, 0);
+        }
+        else if (strcmp(argv[Index], "--threads") == 0 && Index + 1 < argc) {
+            MaximumThreads = (uint32_t)strtoul(argv[++Index], NULL, 0);
+        }
+        else if (strcmp(argv[Index], "--seconds") == 0 && Index + 1 < argc) {
+            Milliseconds = (uint32_t)(atof(argv[++Index]) * 1000);
+        }
+        else if (strcmp(argv[Index], "--shared") == 0) {
+            Shared = true;
+        }
+        else if (strcmp(argv[Index], "--csv") == 0 && Index + 1 < argc) {
+            CsvName = argv[++Index];
+        }
+        else {
+            break;
+        }
+    }
+    if (Index < argc || Milliseconds == 0 || BatchCount == 0 || BatchCount > DEVICE_MAXIMUM_BATCH || Depth == 0 ||
+        Depth > MAXIMUM_DEPTH || ParseMix(Mix, Weights) == false) {
+        printf("Usage: ioctl-benchmark [--device name] [--mix send,recv,batch,send-direct,recv-direct,query,echo,read]\n" \
+            "                       [--size bytes,...] [--batch messages] [--depth reads] [--threads maximum]\n" \
+            "                       [--seconds per run] [--shared] [--csv results file]\n" \
+            "An operation of the mix takes a weight as name:weight.\n");
+        return 1;
+    }
+    if (Weights[OperationEcho] != 0 && (Shared || Weights[OperationRecv] != 0)) {
+        printf("echo needs a handle per thread and no recv in the mix.\n");
+        return 1;
+    }
+    for (uint32_t Type = 0; Type < OperationMaximum && Depth > 1; ++Type) {
+        if ((Type == OperationRead) != (Weights[Type] != 0)) {
+            printf("--depth needs a mix of read only.\n");
+            return 1;
+        }
+    }
+    if (MaximumThreads == 0) {
+        MaximumThreads = 1;
+    }
+    if (MaximumThreads > MAXIMUM_THREADS) {
+        MaximumThreads = MAXIMUM_THREADS;
+    }
+
+    if (CsvName != NULL) {
+        Csv = fopen(CsvName, "w");
+        if (Csv == NULL) {
+            printf("Failed to create %s.\n", CsvName);
+            return 1;
+        }
+        fprintf(Csv, "size,threads,operation,code,seconds,calls,calls_per_second,bytes_per_second,p50_ns,p99_ns,p999_ns,failures," \
+            "first_error\n");
+    }
+    if (DeviceLoad() == false) {
+        printf("Failed to load the driver.\n");
+        if (Csv != NULL) {
+            fclose(Csv);
+        }
+        return 1;
+    }
+
+    printf("%-8s %7s %-12s %-10s %12s %9s %8s %8s %9s %9s\n",
+        "size", "threads", "operation", "code", "calls/s", "MB/s", "p50 ns", "p99 ns", "p99.9 ns", "failures");
+
+    for (uint32_t SizeIndex = 0; SizeIndex < NumberOfSizes && Result == 0; ++SizeIndex) {
+        for (uint32_t Threads = 1; ; Threads = Threads * 2 < MaximumThreads ? Threads * 2 : MaximumThreads) {
+            if (Measure(DeviceName, Shared, Weights, Sizes[SizeIndex], BatchCount, Depth, Threads, Milliseconds, &Seconds,
+                Results) == false) {
+                Result = 1;
+                break;
+            }
+
+            for (uint32_t Type = 0; Type < OperationMaximum; ++Type) {
+                const OPERATION_RESULTS* Operation = &Results[Type];
+                char Code[16];
+                char Failures[48];
+
+                if (Weights[Type] == 0) {
+                    continue;
+                }
+                if (Operations[Type].IoControlCode == 0) {
+                    snprintf(Code, sizeof(Code), "-");
+                }
+                else {
+                    snprintf(Code, sizeof(Code), "0x%08X", Operations[Type].IoControlCode);
+                }
+                if (Operation->Failures == 0) {
+                    snprintf(Failures, sizeof(Failures), "0");
+                }
+                else {
+                    snprintf(Failures, sizeof(Failures), "%llu (0x%08X)", (unsigned long long)Operation->Failures,
+                        Operation->FirstError);
+                }
+
+                printf("%-8u %7u %-12s %-10s %12.0f %9.1f %8llu %8llu %9llu %9s\n",
+                    Sizes[SizeIndex], Threads, Operations[Type].Name, Code,
+                    (Operation->Calls - Operation->Failures) / Seconds, Operation->Bytes / Seconds / 1e6,
+                    (unsigned long long)LatencyPercentile(Operation->Latency, 50.0),
+                    (unsigned long long)LatencyPercentile(Operation->Latency, 99.0),
+                    (unsigned long long)LatencyPercentile(Operation->Latency, 99.9),
+                    Failures);
+
+                if (Csv != NULL) {
+                    fprintf(Csv, "%u,%u,%s,%s,%.3f,%llu,%.0f,%.0f,%llu,%llu,%llu,%llu,0x%08X\n",
+                        Sizes[SizeIndex], Threads, Operations[Type].Name, Code, Seconds,
+                        (unsigned long long)(Operation->Calls - Operation->Failures),
+                        (Operation->Calls - Operation->Failures) / Seconds, Operation->Bytes / Seconds,
+                        (unsigned long long)LatencyPercentile(Operation->Latency, 50.0),
+                        (unsigned long long)LatencyPercentile(Operation->Latency, 99.0),
+                        (unsigned long long)LatencyPercentile(Operation->Latency, 99.9),
+                        (unsigned long long)Operation->Failures, Operation->FirstError);
+                }
+            }
+
+            if (Threads == MaximumThreads) {
+                break;
+            }
+        }
+    }
+
+    DeviceUnload();
+    if (Csv != NULL) {
+        fclose(Csv);
+    }
+    return Result;
+}
@@ -0,0 +1,835 @@
+// heap-engine.cpp : Segments, free lists and the heap walk.
+//
+
+#include "heap-internal.h"
+#include "heap-sampler.h"
+
+#include <new>
+
+static thread_local uint32_t PhLastError;
+
+uint32_t PhGetLastError()
+{
+    return PhLastError;
+}
+
+void PhpSetLastError(uint32_t Error)
+{
+    PhLastError = Error;
+}
+
+static uint32_t FindFirstSet(uint32_t Mask)
+{
+#ifdef _MSC_VER
+    unsigned long Index;
+
+    _BitScanForward(&Index, Mask);
+    return Index;
+#else
+    return (uint32_t)__builtin_ctz(Mask);
+#endif
+}
+
+//
+// Any block on an exact-size list at or above the wanted size fits. Only
+// the last list, which mixes sizes, has to be searched.
+//
+static PPH_ENTRY FindFreeEntry(PPH_HEAP Heap, uint32_t Size)
+{
+    uint32_t Index = FreeListIndex(Size);
+    PPH_LIST_ENTRY ListHead;
+    PPH_LIST_ENTRY Links;
+
+    while (Index < PH_FREE_LISTS - 1) {
+        uint32_t Mask = Heap->FreeListsInUse[Index / 32] & (~0u << (Index % 32));
+
+        if (Mask != 0) {
+            Index = (Index & ~31u) + FindFirstSet(Mask);
+            break;
+        }
+        Index = (Index & ~31u) + 32;
+    }
+    if (Index < PH_FREE_LISTS - 1) {
+        return &FreeEntryFromLinks(Heap->FreeLists[Index].Flink)->Entry;
+    }
+
+    ListHead = &Heap->FreeLists[PH_FREE_LISTS - 1];
+    for (Links = ListHead->Flink; Links != ListHead; Links = Links->Flink) {
+        PPH_ENTRY Entry = &FreeEntryFromLinks(Links)->Entry;
+
+        if (Entry->Size >= Size) {
+            return Entry;
+        }
+    }
+    return NULL;
+}
+
+//
+// Carves Size granules off the front of a free block that is already off
+// its list; the tail goes back on a free list unless too small to hold one.
+//
+static void SplitEntry(PPH_HEAP Heap, PPH_ENTRY Entry, uint32_t Size)
+{
+    uint32_t Remainder = Entry->Size - Size;
+    PPH_ENTRY Tail;
+
+    if (Remainder < PH_MINIMUM_BLOCK) {
+        return;
+    }
+
+    Tail = (PPH_ENTRY)((uint8_t*)Entry + (size_t)Size * PH_GRANULARITY);
+    memset(Tail, 0, sizeof(*Tail));
+    Tail->Size = Remainder;
+    Tail->PreviousSize = Size;
+    Tail->Flags = Entry->Flags & (PH_ENTRY_LAST | PH_ENTRY_DECOMMITTED);
+    Tail->SegmentIndex = Entry->SegmentIndex;
+    Tail->FreeEpoch = Entry->FreeEpoch;
+    Entry->Flags &= ~PH_ENTRY_LAST;
+    Entry->Size = Size;
+
+    if ((Tail->Flags & PH_ENTRY_LAST) != 0) {
+        Heap->Segments[Tail->SegmentIndex]->LastEntry = Tail;
+    }
+    else {
+        NextEntry(Tail)->PreviousSize = Remainder;
+    }
+    InsertFreeEntry(Heap, Tail);
+}
+
+//
+// Frees a block, merging it with free neighbours so that no two free blocks
+// are ever adjacent, unless the heap defers that to the trimmer.
+//
+static void CoalesceEntry(PPH_HEAP Heap, PPH_ENTRY Entry)
+{
+    Entry->Flags &= ~(PH_ENTRY_BUSY | PH_ENTRY_SAMPLED);
+    Entry->UnusedBytes = 0;
+    Entry->FreeEpoch = Heap->TrimEpoch;
+
+    if ((Heap->Flags & HEAP_DISABLE_COALESCE_ON_FREE) == 0) {
+        if ((Entry->Flags & PH_ENTRY_LAST) == 0) {
+            PPH_ENTRY Next = NextEntry(Entry);
+
+            if ((Next->Flags & PH_ENTRY_BUSY) == 0) {
+                RemoveFreeEntry(Heap, Next);
+                MergeFreeEntries(Heap, Entry, Next);
+            }
+        }
+        if (Entry->PreviousSize != 0) {
+            PPH_ENTRY Previous = PreviousEntry(Entry);
+
+            if ((Previous->Flags & PH_ENTRY_BUSY) == 0) {
+                RemoveFreeEntry(Heap, Previous);
+                MergeFreeEntries(Heap, Previous, Entry);
+                Entry = Previous;
+            }
+        }
+    }
+    InsertFreeEntry(Heap, Entry);
+}
+
+//
+// Lays out a segment whose first CommittedSize bytes are committed, with
+// its descriptor at Segment, and puts everything after it on a free list.
+//
+static void InitializeSegment(PPH_HEAP Heap, PPH_SEGMENT Segment, uint8_t* BaseAddress,
+    size_t ReservedSize, size_t CommittedSize)
+{
+    size_t BitmapSize = PhpCommitBitmapSize(ReservedSize);
+    PPH_ENTRY Entry = (PPH_ENTRY)ROUND_UP((uintptr_t)(Segment + 1) + BitmapSize, PH_GRANULARITY);
+
+    memset(Segment, 0, sizeof(*Segment) + BitmapSize);
+    Segment->BaseAddress = BaseAddress;
+    Segment->ReservedSize = ReservedSize;
+    Segment->CommittedSize = CommittedSize;
+    Segment->CommitBitmap = (uint32_t*)(Segment + 1);
+    Segment->SegmentIndex = Heap->NumberOfSegments;
+    PhpMarkCommitted(Segment, 0, CommittedSize);
+    Segment->FirstEntry = Entry;
+    Segment->LastEntry = Entry;
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->Size = (uint32_t)((BaseAddress + CommittedSize - (uint8_t*)Entry) / PH_GRANULARITY);
+    Entry->Flags = PH_ENTRY_LAST;
+    Entry->SegmentIndex = (uint8_t)Segment->SegmentIndex;
+    Entry->FreeEpoch = Heap->TrimEpoch;
+
+    Heap->Segments[Heap->NumberOfSegments++] = Segment;
+    InsertFreeEntry(Heap, Entry);
+}
+
+//
+// Commits enough of the segment's reserve to extend its last block to Size
+// granules, at least PH_COMMIT_GRANULARITY at a time.
+//
+static bool ExtendSegment(PPH_HEAP Heap, PPH_SEGMENT Segment, uint32_t Size)
+{
+    PPH_ENTRY Last = Segment->LastEntry;
+    size_t Needed = (size_t)Size * PH_GRANULARITY;
+    size_t Available = Segment->ReservedSize - Segment->CommittedSize;
+    size_t Commit;
+    PPH_ENTRY Entry;
+
+    if ((Last->Flags & PH_ENTRY_BUSY) == 0) {
+        Needed -= (size_t)Last->Size * PH_GRANULARITY;
+    }
+    Commit = ROUND_UP(Needed > PH_COMMIT_GRANULARITY ? Needed : PH_COMMIT_GRANULARITY, PhOsPageSize());
+    if (Commit > Available) {
+        Commit = Available;
+    }
+    if (Commit < Needed ||
+        PhOsCommit(Segment->BaseAddress + Segment->CommittedSize, Commit) == false) {
+        return false;
+    }
+
+    Entry = (PPH_ENTRY)(Segment->BaseAddress + Segment->CommittedSize);
+    PhpMarkCommitted(Segment, Segment->CommittedSize, Commit);
+    Segment->CommittedSize += Commit;
+    if ((Last->Flags & PH_ENTRY_BUSY) == 0) {
+        RemoveFreeEntry(Heap, Last);
+        Last->Size += (uint32_t)(Commit / PH_GRANULARITY);
+        InsertFreeEntry(Heap, Last);
+        return true;
+    }
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->Size = (uint32_t)(Commit / PH_GRANULARITY);
+    Entry->PreviousSize = Last->Size;
+    Entry->Flags = PH_ENTRY_LAST;
+    Entry->SegmentIndex = (uint8_t)Segment->SegmentIndex;
+    Entry->FreeEpoch = Heap->TrimEpoch;
+    Last->Flags &= ~PH_ENTRY_LAST;
+    Segment->LastEntry = Entry;
+    InsertFreeEntry(Heap, Entry);
+    return true;
+}
+
+static void* ReserveForHeap(uint32_t Options, uint32_t Node, size_t Size)
+{
+    if ((Options & PH_HEAP_PER_NODE_ARENAS) != 0) {
+        return PhOsReserveOnNode(Size, Node);
+    }
+    return PhOsReserve(Size);
+}
+
+static bool GrowHeap(PPH_HEAP Heap, uint32_t Size)
+{
+    size_t Needed = (size_t)Size * PH_GRANULARITY + sizeof(PH_SEGMENT) + PH_GRANULARITY;
+    size_t ReservedSize;
+    size_t CommittedSize;
+    uint8_t* BaseAddress;
+    uint32_t Index;
+
+    for (Index = 0; Index < Heap->NumberOfSegments; ++Index) {
+        PPH_SEGMENT Segment = Heap->Segments[Index];
+
+        if (Segment->CommittedSize < Segment->ReservedSize && ExtendSegment(Heap, Segment, Size)) {
+            return true;
+        }
+    }
+
+    //
+    // Fixed-size heaps never get a second segment.
+    //
+    if (Heap->MaximumSize != 0 || Heap->NumberOfSegments == PH_MAXIMUM_SEGMENTS) {
+        return false;
+    }
+
+    ReservedSize = Heap->NextSegmentReserve;
+    while (ReservedSize < Needed + PhpCommitBitmapSize(ReservedSize)) {
+        ReservedSize *= 2;
+    }
+    Needed += PhpCommitBitmapSize(ReservedSize);
+    CommittedSize = ROUND_UP(Needed > PH_COMMIT_GRANULARITY ? Needed : PH_COMMIT_GRANULARITY,
+        PhOsPageSize());
+    if (CommittedSize > ReservedSize) {
+        CommittedSize = ReservedSize;
+    }
+
+    BaseAddress = (uint8_t*)ReserveForHeap(Heap->Flags, Heap->Node, ReservedSize);
+    if (BaseAddress == NULL) {
+        return false;
+    }
+    if (PhOsCommit(BaseAddress, CommittedSize) == false) {
+        PhOsRelease(BaseAddress, ReservedSize);
+        return false;
+    }
+    InitializeSegment(Heap, (PPH_SEGMENT)BaseAddress, BaseAddress, ReservedSize, CommittedSize);
+
+    if (Heap->NextSegmentReserve < PH_MAXIMUM_SEGMENT_RESERVE) {
+        Heap->NextSegmentReserve *= 2;
+    }
+    return true;
+}
+
+static void* AllocateVirtualBlock(PPH_HEAP Heap, uint32_t Flags, size_t Bytes, bool Sample)
+{
+    size_t ReservedSize = ROUND_UP(sizeof(PH_VIRTUAL_BLOCK) + Bytes, PhOsPageSize());
+    PPH_VIRTUAL_BLOCK Block = (PPH_VIRTUAL_BLOCK)ReserveForHeap(Heap->Flags, Heap->Node, ReservedSize);
+
+    if (Block == NULL) {
+        return NULL;
+    }
+    if (PhOsCommit(Block, ReservedSize) == false) {
+        PhOsRelease(Block, ReservedSize);
+        return NULL;
+    }
+
+    //
+    // Fresh pages are already zeroed, so HEAP_ZERO_MEMORY costs nothing here.
+    //
+    Block->ReservedSize = ReservedSize;
+    Block->Size = Bytes;
+    Block->Entry.Flags = PH_ENTRY_BUSY | PH_ENTRY_VIRTUAL | (Sample ? PH_ENTRY_SAMPLED : 0);
+    Block->Entry.Node = (uint8_t)Heap->Node;
+
+    if ((Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockAcquire(&Heap->Lock);
+    }
+    InsertHeadList(&Heap->VirtualAllocdBlocks, &Block->Links);
+    Heap->Allocations += 1;
+    if ((Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockRelease(&Heap->Lock);
+    }
+    return &Block->Entry + 1;
+}
+
+static PPH_VIRTUAL_BLOCK VirtualBlockFromEntry(PPH_ENTRY Entry)
+{
+    return (PPH_VIRTUAL_BLOCK)((uint8_t*)Entry - offsetof(PH_VIRTUAL_BLOCK, Entry));
+}
+
+PPH_HEAP PhHeapCreate(uint32_t Options, size_t InitialSize, size_t MaximumSize)
+{
+    if ((Options & PH_HEAP_PER_NODE_ARENAS) != 0) {
+        return PhpCreateNodeHeap(Options, InitialSize, MaximumSize);
+    }
+    return PhpCreateHeap(Options, InitialSize, MaximumSize, 0);
+}
+
+PPH_HEAP PhpCreateHeap(uint32_t Options, size_t InitialSize, size_t MaximumSize, uint32_t Node)
+{
+    size_t PageSize = PhOsPageSize();
+    size_t ReservedSize;
+    size_t CommittedSize;
+    uint8_t* BaseAddress;
+    PPH_HEAP Heap;
+    uint32_t Index;
+
+    if (MaximumSize != 0 && InitialSize > MaximumSize) {
+        PhLastError = ERROR_INVALID_PARAMETER;
+        return NULL;
+    }
+
+    if (MaximumSize != 0) {
+        ReservedSize = ROUND_UP(MaximumSize, PageSize);
+    }
+    else {
+        ReservedSize = ROUND_UP(InitialSize, PH_COMMIT_GRANULARITY);
+        if (ReservedSize < PH_SEGMENT_RESERVE) {
+            ReservedSize = PH_SEGMENT_RESERVE;
+        }
+    }
+
+    //
+    // The heap descriptor and the first segment descriptor share the first
+    // committed pages, followed by the segment's commit bitmap and the first
+    // block.
+    //
+    CommittedSize = ROUND_UP(sizeof(PH_HEAP) + sizeof(PH_SEGMENT) + PhpCommitBitmapSize(ReservedSize) +
+        InitialSize + PH_GRANULARITY * 3, PageSize);
+    if (ReservedSize < CommittedSize) {
+        ReservedSize = CommittedSize;
+    }
+
+    BaseAddress = (uint8_t*)ReserveForHeap(Options, Node, ReservedSize);
+    if (BaseAddress == NULL) {
+        PhLastError = ERROR_NOT_ENOUGH_MEMORY;
+        return NULL;
+    }
+    if (PhOsCommit(BaseAddress, CommittedSize) == false) {
+        PhOsRelease(BaseAddress, ReservedSize);
+        PhLastError = ERROR_NOT_ENOUGH_MEMORY;
+        return NULL;
+    }
+
+    Heap = new (BaseAddress) PH_HEAP();
+    Heap->Signature = PH_HEAP_SIGNATURE;
+    Heap->Flags = Options;
+    Heap->MaximumSize = MaximumSize;
+    Heap->Node = Node;
+    Heap->NextSegmentReserve = ReservedSize * 2 < PH_MAXIMUM_SEGMENT_RESERVE ?
+        ReservedSize * 2 : PH_MAXIMUM_SEGMENT_RESERVE;
+    PhLockInitialize(&Heap->Lock);
+    for (Index = 0; Index < PH_FREE_LISTS; ++Index) {
+        InitializeListHead(&Heap->FreeLists[Index]);
+    }
+    InitializeListHead(&Heap->VirtualAllocdBlocks);
+
+    InitializeSegment(Heap, (PPH_SEGMENT)ROUND_UP((uintptr_t)(Heap + 1), PH_GRANULARITY),
+        BaseAddress, ReservedSize, CommittedSize);
+    return Heap;
+}
+
+bool PhHeapDestroy(PPH_HEAP Heap)
+{
+    uint32_t Index;
+
+    if (Heap == NULL || Heap->Signature != PH_HEAP_SIGNATURE) {
+        PhLastError = ERROR_INVALID_PARAMETER;
+        return false;
+    }
+    if (Heap->NumberOfArenas != 0) {
+        return PhpDestroyNodeHeap(Heap);
+    }
+
+    PhpStopTrimmer(Heap);
+    PhpLfhDestroy(Heap);
+    while (Heap->VirtualAllocdBlocks.Flink != &Heap->VirtualAllocdBlocks) {
+        PPH_VIRTUAL_BLOCK Block = (PPH_VIRTUAL_BLOCK)Heap->VirtualAllocdBlocks.Flink;
+
+        RemoveEntryList(&Block->Links);
+        PhOsRelease(Block, Block->ReservedSize);
+    }
+
+    //
+    // Segment 0 holds the heap itself, so it goes last.
+    //
+    Heap->Signature = 0;
+    PhLockDelete(&Heap->Lock);
+    for (Index = Heap->NumberOfSegments; Index-- != 0; ) {
+        PhOsRelease(Heap->Segments[Index]->BaseAddress, Heap->Segments[Index]->ReservedSize);
+    }
+    return true;
+}
+
+//
+// The back end: segments, or a reservation of its own for large blocks.
+// Sample only marks the block; recording it is up to the caller.
+//
+void* PhpAllocate(PPH_HEAP Heap, uint32_t Flags, size_t Bytes, bool Sample)
+{
+    PPH_ENTRY Entry;
+    uint32_t Size;
+    void* Mem;
+
+    if (Bytes >= PH_VIRTUAL_ALLOC_THRESHOLD && Heap->MaximumSize == 0) {
+        Mem = AllocateVirtualBlock(Heap, Flags, Bytes, Sample);
+        if (Mem == NULL) {
+            PhLastError = ERROR_NOT_ENOUGH_MEMORY;
+        }
+        return Mem;
+    }
+
+    Size = (uint32_t)((Bytes + sizeof(PH_ENTRY) + PH_GRANULARITY - 1) / PH_GRANULARITY);
+    if (Size < PH_MINIMUM_BLOCK) {
+        Size = PH_MINIMUM_BLOCK;
+    }
+
+    if ((Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockAcquire(&Heap->Lock);
+    }
+    if (Heap->RemoteFrees.load(std::memory_order_relaxed) != NULL) {
+        PhpDrainRemoteFrees(Heap);
+    }
+    Entry = FindFreeEntry(Heap, Size);
+    if (Entry == NULL && (Heap->Flags & HEAP_DISABLE_COALESCE_ON_FREE) != 0 &&
+        PhpCoalesceHeap(Heap) != 0) {
+        Entry = FindFreeEntry(Heap, Size);
+    }
+    if (Entry == NULL && GrowHeap(Heap, Size)) {
+        Entry = FindFreeEntry(Heap, Size);
+    }
+    if (Entry != NULL) {
+        RemoveFreeEntry(Heap, Entry);
+
+        //
+        // Blocks carved out of a trimmed run get their pages back first.
+        //
+        if ((Entry->Flags & PH_ENTRY_DECOMMITTED) != 0 && PhpRecommitEntry(Heap, Entry, Size) == false) {
+            InsertFreeEntry(Heap, Entry);
+            Entry = NULL;
+        }
+    }
+    if (Entry != NULL) {
+        SplitEntry(Heap, Entry, Size);
+        Entry->Flags &= ~PH_ENTRY_DECOMMITTED;
+        Entry->Flags |= PH_ENTRY_BUSY | (Sample ? PH_ENTRY_SAMPLED : 0);
+        Entry->UnusedBytes = (uint8_t)((size_t)Entry->Size * PH_GRANULARITY - sizeof(PH_ENTRY) - Bytes);
+        Entry->Node = (uint8_t)Heap->Node;
+        Heap->Allocations += 1;
+    }
+    if ((Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockRelease(&Heap->Lock);
+    }
+
+    if (Entry == NULL) {
+        PhLastError = ERROR_NOT_ENOUGH_MEMORY;
+        return NULL;
+    }
+
+    Mem = Entry + 1;
+    if ((Flags & HEAP_ZERO_MEMORY) != 0) {
+        memset(Mem, 0, Bytes);
+    }
+    return Mem;
+}
+
+void* PhHeapAlloc(PPH_HEAP Heap, uint32_t Flags, size_t Bytes)
+{
+    PPH_SAMPLER Sampler;
+    bool Sample;
+    void* Mem;
+
+    if (Heap->NumberOfArenas != 0) {
+        return PhpNodeHeapAlloc(Heap, Flags, Bytes);
+    }
+
+    Sampler = Heap->Sampler;
+    Sample = Sampler != NULL && PhSamplerShouldSample(Sampler, Bytes);
+    Flags |= Heap->Flags;
+    if (Bytes > (size_t)UINT32_MAX * PH_GRANULARITY / 2) {
+        PhLastError = ERROR_NOT_ENOUGH_MEMORY;
+        return NULL;
+    }
+
+    if (Heap->Lfh != NULL && Bytes <= PH_LFH_MAXIMUM_BYTES) {
+        Mem = PhpLfhAllocate(Heap, Bytes, Sample);
+        if (Mem != NULL && (Flags & HEAP_ZERO_MEMORY) != 0) {
+            memset(Mem, 0, Bytes);
+        }
+    }
+    else {
+        Mem = PhpAllocate(Heap, Flags, Bytes, Sample);
+    }
+
+    if (Mem != NULL && Sample) {
+        PhSamplerRecordAlloc(Sampler, Mem, Bytes);
+    }
+    return Mem;
+}
+
+bool PhHeapFree(PPH_HEAP Heap, uint32_t Flags, void* Mem)
+{
+    PPH_ENTRY Entry;
+    bool Virtual;
+
+    if (Mem == NULL) {
+        return true;
+    }
+    if (Heap->NumberOfArenas != 0) {
+        return PhpNodeHeapFree(Heap, Flags, Mem);
+    }
+
+    //
+    // LFH blocks never change their SegmentIndex, so this is safe to read
+    // before taking any lock.
+    //
+    Entry = (PPH_ENTRY)Mem - 1;
+    if (Entry->SegmentIndex == PH_LFH_SEGMENT_INDEX) {
+        return PhpLfhFree(Heap, Entry);
+    }
+
+    //
+    // Flags are read under the lock: growing a segment clears
+    // PH_ENTRY_LAST on whatever block was last, busy or not.
+    //
+    Flags |= Heap->Flags;
+    if ((Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockAcquire(&Heap->Lock);
+    }
+    if ((Entry->Flags & PH_ENTRY_BUSY) == 0 ||
+        ((Entry->Flags & PH_ENTRY_VIRTUAL) == 0 && Entry->SegmentIndex >= Heap->NumberOfSegments)) {
+        if ((Flags & HEAP_NO_SERIALIZE) == 0) {
+            PhLockRelease(&Heap->Lock);
+        }
+        PhLastError = ERROR_INVALID_PARAMETER;
+        return false;
+    }
+    Virtual = (Entry->Flags & PH_ENTRY_VIRTUAL) != 0;
+
+    //
+    // Recorded before the block goes back to the free lists, or the range
+    // to the OS, so the sampler never sees its next allocation ahead of
+    // this free.
+    //
+    if ((Entry->Flags & PH_ENTRY_SAMPLED) != 0 && Heap->Sampler != NULL) {
+        PhSamplerRecordFree(Heap->Sampler, Mem);
+    }
+    if (Virtual) {
+        RemoveEntryList(&VirtualBlockFromEntry(Entry)->Links);
+    }
+    else {
+        CoalesceEntry(Heap, Entry);
+    }
+    Heap->LocalFrees += 1;
+    if ((Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockRelease(&Heap->Lock);
+    }
+    if (Virtual) {
+        PhOsRelease(VirtualBlockFromEntry(Entry), VirtualBlockFromEntry(Entry)->ReservedSize);
+    }
+    return true;
+}
+
+size_t PhHeapSize(PPH_HEAP Heap, uint32_t Flags, const void* Mem)
+{
+    const PH_ENTRY* Entry = (const PH_ENTRY*)Mem - 1;
+    size_t Size = (size_t)-1;
+
+    if (Mem == NULL) {
+        PhLastError = ERROR_INVALID_PARAMETER;
+        return Size;
+    }
+    if (Heap->NumberOfArenas != 0) {
+        Heap = PhpHomeArena(Heap, Mem);
+        if (Heap == NULL) {
+            PhLastError = ERROR_INVALID_PARAMETER;
+            return Size;
+        }
+    }
+
+    if (Entry->SegmentIndex == PH_LFH_SEGMENT_INDEX) {
+        if ((Entry->Flags & PH_ENTRY_BUSY) != 0) {
+            return Entry->LfhBytes;
+        }
+        PhLastError = ERROR_INVALID_PARAMETER;
+        return Size;
+    }
+
+    Flags |= Heap->Flags;
+    if ((Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockAcquire(&Heap->Lock);
+    }
+    if ((Entry->Flags & PH_ENTRY_VIRTUAL) != 0) {
+        Size = VirtualBlockFromEntry((PPH_ENTRY)Entry)->Size;
+    }
+    else if ((Entry->Flags & PH_ENTRY_BUSY) != 0) {
+        Size = (size_t)Entry->Size * PH_GRANULARITY - sizeof(PH_ENTRY) - Entry->UnusedBytes;
+    }
+    if ((Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockRelease(&Heap->Lock);
+    }
+
+    if (Size == (size_t)-1) {
+        PhLastError = ERROR_INVALID_PARAMETER;
+    }
+    return Size;
+}
+
+//
+// A per-node heap is locked by locking every arena in node order, which also
+// settles their remote frees so that the walk sees them as free.
+//
+bool PhHeapLock(PPH_HEAP Heap)
+{
+    uint32_t Index;
+
+    for (Index = 0; Index < Heap->NumberOfArenas; ++Index) {
+        PhHeapLock(Heap->Arenas[Index]);
+    }
+    PhLockAcquire(&Heap->Lock);
+    if (Heap->RemoteFrees.load(std::memory_order_relaxed) != NULL) {
+        PhpDrainRemoteFrees(Heap);
+    }
+    return true;
+}
+
+bool PhHeapUnlock(PPH_HEAP Heap)
+{
+    uint32_t Index;
+
+    PhLockRelease(&Heap->Lock);
+    for (Index = Heap->NumberOfArenas; Index-- != 0; ) {
+        PhHeapUnlock(Heap->Arenas[Index]);
+    }
+    return true;
+}
+
+void PhHeapSetSampler(PPH_HEAP Heap, PPH_SAMPLER Sampler)
+{
+    uint32_t Index;
+
+    for (Index = 0; Index < Heap->NumberOfArenas; ++Index) {
+        Heap->Arenas[Index]->Sampler = Sampler;
+    }
+    Heap->Sampler = Sampler;
+}
+
+//
+// Frees the blocks other nodes queued on this arena. The caller holds the
+// lock. Blocks that fail the checks HeapFree would make are dropped, since
+// there is no caller left to return an error to.
+//
+void PhpDrainRemoteFrees(PPH_HEAP Heap)
+{
+    void* List = Heap->RemoteFrees.exchange(NULL, std::memory_order_acquire);
+
+    if (List == NULL) {
+        return;
+    }
+    Heap->RemoteBatches += 1;
+    while (List != NULL) {
+        void* Mem = List;
+        PPH_ENTRY Entry = (PPH_ENTRY)Mem - 1;
+
+        List = *(void**)Mem;
+        Heap->RemoteDrained += 1;
+        if ((Entry->Flags & PH_ENTRY_BUSY) == 0 ||
+            ((Entry->Flags & PH_ENTRY_VIRTUAL) == 0 && Entry->SegmentIndex >= Heap->NumberOfSegments)) {
+            continue;
+        }
+        if ((Entry->Flags & PH_ENTRY_SAMPLED) != 0 && Heap->Sampler != NULL) {
+            PhSamplerRecordFree(Heap->Sampler, Mem);
+        }
+
+        //
+        // Rare enough that releasing under the lock does not matter.
+        //
+        if ((Entry->Flags & PH_ENTRY_VIRTUAL) != 0) {
+            RemoveEntryList(&VirtualBlockFromEntry(Entry)->Links);
+            PhOsRelease(VirtualBlockFromEntry(Entry), VirtualBlockFromEntry(Entry)->ReservedSize);
+        }
+        else {
+            CoalesceEntry(Heap, Entry);
+        }
+    }
+}
+
+uint32_t PhHeapNumberOfNodes(PPH_HEAP Heap)
+{
+    return Heap->NumberOfArenas != 0 ? Heap->NumberOfArenas : 1;
+}
+
+bool PhHeapQueryNodeStats(PPH_HEAP Heap, uint32_t Node, PPH_NODE_STATS Stats)
+{
+    uint64_t Pushes;
+
+    if (Node >= PhHeapNumberOfNodes(Heap)) {
+        PhLastError = ERROR_INVALID_PARAMETER;
+        return false;
+    }
+    if (Heap->NumberOfArenas != 0) {
+        Heap = Heap->Arenas[Node];
+    }
+
+    if ((Heap->Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockAcquire(&Heap->Lock);
+    }
+    Pushes = Heap->RemotePushes.load(std::memory_order_relaxed);
+    Stats->Allocations = Heap->Allocations;
+    Stats->LocalFrees = Heap->LocalFrees;
+    Stats->RemoteFrees = Pushes;
+    Stats->RemoteBatches = Heap->RemoteBatches;
+    Stats->PendingRemoteFrees = Pushes - Heap->RemoteDrained;
+    if ((Heap->Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockRelease(&Heap->Lock);
+    }
+    return true;
+}
+
+static void WalkRegion(PPH_HEAP Heap, uint32_t SegmentIndex, PPH_HEAP_ENTRY Entry)
+{
+    PPH_SEGMENT Segment = Heap->Segments[SegmentIndex];
+
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->lpData = Segment->BaseAddress;
+    Entry->cbData = Segment->CommittedSize;
+    Entry->iRegionIndex = (uint8_t)SegmentIndex;
+    Entry->wFlags = PROCESS_HEAP_REGION;
+    Entry->Region.dwCommittedSize = Segment->CommittedSize - Segment->DecommittedBytes;
+    Entry->Region.dwUnCommittedSize = Segment->ReservedSize - Entry->Region.dwCommittedSize;
+    Entry->Region.lpFirstBlock = Segment->FirstEntry;
+    Entry->Region.lpLastBlock = Segment->BaseAddress + Segment->ReservedSize;
+}
+
+static void WalkBlock(PPH_ENTRY Block, PPH_HEAP_ENTRY Entry)
+{
+    memset(Entry, 0, sizeof(*Entry));
+    Entry->lpData = Block + 1;
+    if ((Block->Flags & PH_ENTRY_VIRTUAL) != 0) {
+        Entry->cbData = VirtualBlockFromEntry(Block)->Size;
+        Entry->cbOverhead = (uint8_t)sizeof(PH_VIRTUAL_BLOCK);
+    }
+    else {
+        Entry->cbData = (size_t)Block->Size * PH_GRANULARITY - sizeof(PH_ENTRY) - Block->UnusedBytes;
+        Entry->cbOverhead = (uint8_t)(sizeof(PH_ENTRY) + Block->UnusedBytes);
+        Entry->iRegionIndex = Block->SegmentIndex;
+    }
+    Entry->wFlags = (Block->Flags & PH_ENTRY_BUSY) != 0 ? PROCESS_HEAP_ENTRY_BUSY : 0;
+}
+
+//
+// Moves past the last block of a segment: its uncommitted range if it has
+// one, then the next segment, then the blocks allocated from the OS.
+//
+static bool WalkAfterSegment(PPH_HEAP Heap, uint32_t SegmentIndex, bool UncommittedDone,
+    PPH_HEAP_ENTRY Entry)
+{
+    PPH_SEGMENT Segment = Heap->Segments[SegmentIndex];
+
+    if (UncommittedDone == false && Segment->CommittedSize < Segment->ReservedSize) {
+        memset(Entry, 0, sizeof(*Entry));
+        Entry->lpData = Segment->BaseAddress + Segment->CommittedSize;
+        Entry->cbData = Segment->ReservedSize - Segment->CommittedSize;
+        Entry->iRegionIndex = (uint8_t)SegmentIndex;
+        Entry->wFlags = PROCESS_HEAP_UNCOMMITTED_RANGE;
+        return true;
+    }
+    if (SegmentIndex + 1 < Heap->NumberOfSegments) {
+        WalkRegion(Heap, SegmentIndex + 1, Entry);
+        return true;
+    }
+    if (Heap->VirtualAllocdBlocks.Flink != &Heap->VirtualAllocdBlocks) {
+        WalkBlock(&((PPH_VIRTUAL_BLOCK)Heap->VirtualAllocdBlocks.Flink)->Entry, Entry);
+        return true;
+    }
+    PhLastError = ERROR_NO_MORE_ITEMS;
+    return false;
+}
+
+static bool WalkArena(PPH_HEAP Heap, PPH_HEAP_ENTRY Entry)
+{
+    PPH_ENTRY Block;
+
+    if (Entry->lpData == NULL) {
+        WalkRegion(Heap, 0, Entry);
+        return true;
+    }
+    if ((Entry->wFlags & PROCESS_HEAP_REGION) != 0) {
+        WalkBlock(Heap->Segments[Entry->iRegionIndex]->FirstEntry, Entry);
+        return true;
+    }
+    if ((Entry->wFlags & PROCESS_HEAP_UNCOMMITTED_RANGE) != 0) {
+        return WalkAfterSegment(Heap, Entry->iRegionIndex, true, Entry);
+    }
+
+    Block = (PPH_ENTRY)Entry->lpData - 1;
+    if ((Block->Flags & PH_ENTRY_VIRTUAL) != 0) {
+        PPH_LIST_ENTRY Next = VirtualBlockFromEntry(Block)->Links.Flink;
+
+        if (Next == &Heap->VirtualAllocdBlocks) {
+            PhLastError = ERROR_NO_MORE_ITEMS;
+            return false;
+        }
+        WalkBlock(&((PPH_VIRTUAL_BLOCK)Next)->Entry, Entry);
+        return true;
+    }
+    if ((Block->Flags & PH_ENTRY_LAST) != 0) {
+        return WalkAfterSegment(Heap, Block->SegmentIndex, false, Entry);
+    }
+    WalkBlock(NextEntry(Block), Entry);
+    return true;
+}
+
+bool PhHeapWalk(PPH_HEAP Heap, PPH_HEAP_ENTRY Entry)
+{
+    if (Heap->NumberOfArenas != 0) {
+        return PhpNodeHeapWalk(Heap, Entry);
+    }
+    if (WalkArena(Heap, Entry) == false) {
+        return false;
+    }
+    Entry->dwNode = Heap->Node;
+    return true;
+}
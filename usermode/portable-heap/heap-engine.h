@@ -0,0 +1,198 @@
+// heap-engine.h : A portable heap modelled on the NT heap front end.
+//
+// The API mirrors HeapCreate / HeapAlloc / HeapFree / HeapWalk so that the
+// enumerate-heap sample runs unchanged against it, on Windows or Linux:
+//
+//  - A heap is a list of segments. Each segment reserves a range of address
+//    space and commits it from the bottom up as the heap grows; the rest is
+//    reported by the walk as an uncommitted range.
+//  - Blocks carry a 16-byte header with their size and the size of the block
+//    before them, in 16-byte granules, so neighbours coalesce on free.
+//  - Free blocks sit on 128 free lists: one per size below 2KB, plus one for
+//    everything larger. A bitmap finds the first non-empty list.
+//  - Allocations of PH_VIRTUAL_ALLOC_THRESHOLD bytes or more bypass the
+//    segments and get their own reservation, like VirtualAllocdBlocks.
+//  - An optional trimmer gives idle free pages back to the OS (see
+//    PhHeapTrim below).
+//  - PhHeapSetCompatibility turns on a low-fragmentation front end for
+//    blocks below 16KB, like HeapCompatibilityInformation = 2.
+//  - With PH_HEAP_PER_NODE_ARENAS the heap is a set of arenas, one per NUMA
+//    node, and each allocation comes from the arena of the caller's node
+//    (see PhHeapQueryNodeStats below).
+//
+
+#pragma once
+
+#include "heap-os.h"
+
+#ifndef _WIN32
+#define PROCESS_HEAP_REGION             0x0001
+#define PROCESS_HEAP_UNCOMMITTED_RANGE  0x0002
+#define PROCESS_HEAP_ENTRY_BUSY         0x0004
+#define PROCESS_HEAP_ENTRY_MOVEABLE     0x0010
+#define PROCESS_HEAP_ENTRY_DDESHARE     0x0020
+
+#define HEAP_NO_SERIALIZE               0x00000001
+#define HEAP_ZERO_MEMORY                0x00000008
+#define HEAP_DISABLE_COALESCE_ON_FREE   0x00000080
+
+#define ERROR_NOT_ENOUGH_MEMORY         8
+#define ERROR_INVALID_PARAMETER         87
+#define ERROR_NO_MORE_ITEMS             259
+#endif
+
+#define PH_GRANULARITY                  16
+#define PH_FREE_LISTS                   128
+#define PH_MAXIMUM_SEGMENTS             64
+#define PH_SEGMENT_RESERVE              (1024 * 1024)
+#define PH_MAXIMUM_SEGMENT_RESERVE      (256 * 1024 * 1024)
+#define PH_COMMIT_GRANULARITY           (64 * 1024)
+#define PH_VIRTUAL_ALLOC_THRESHOLD      0x7f000
+#define PH_MAXIMUM_NODES                PH_OS_MAXIMUM_NODES
+
+//
+// PhHeapCreate option, outside the range of the HEAP_* flags.
+//
+#define PH_HEAP_PER_NODE_ARENAS         0x01000000
+
+typedef struct _PH_HEAP PH_HEAP, *PPH_HEAP;
+typedef struct _PH_SAMPLER PH_SAMPLER, *PPH_SAMPLER;
+
+//
+// PROCESS_HEAP_ENTRY, with sizes widened to size_t for 64-bit heaps and the
+// NUMA node of the arena the entry belongs to appended.
+//
+typedef struct _PH_HEAP_ENTRY {
+    void* lpData;
+    size_t cbData;
+    uint8_t cbOverhead;
+    uint8_t iRegionIndex;
+    uint16_t wFlags;
+    union {
+        struct {
+            void* hMem;
+            uint32_t dwReserved[3];
+        } Block;
+        struct {
+            size_t dwCommittedSize;
+            size_t dwUnCommittedSize;
+            void* lpFirstBlock;
+            void* lpLastBlock;
+        } Region;
+    };
+    uint32_t dwNode;
+} PH_HEAP_ENTRY, *PPH_HEAP_ENTRY;
+
+//
+// Like the Win32 functions, failures return NULL / false and leave the reason
+// in the calling thread's last error.
+//
+uint32_t PhGetLastError();
+
+PPH_HEAP PhHeapCreate(uint32_t Options, size_t InitialSize, size_t MaximumSize);
+bool PhHeapDestroy(PPH_HEAP Heap);
+void* PhHeapAlloc(PPH_HEAP Heap, uint32_t Flags, size_t Bytes);
+bool PhHeapFree(PPH_HEAP Heap, uint32_t Flags, void* Mem);
+size_t PhHeapSize(PPH_HEAP Heap, uint32_t Flags, const void* Mem);
+bool PhHeapLock(PPH_HEAP Heap);
+bool PhHeapUnlock(PPH_HEAP Heap);
+
+//
+// Start with Entry->lpData set to NULL. Returns false with ERROR_NO_MORE_ITEMS
+// after the last entry. The heap must be locked for the whole walk.
+//
+bool PhHeapWalk(PPH_HEAP Heap, PPH_HEAP_ENTRY Entry);
+
+//
+// Low-fragmentation front end. Blocks below 16KB come from 64 size classes,
+// each carved out of subsegments (back-end blocks of 64KB or more) holding
+// blocks of a single size. Each class is split across a few affinity slots
+// with a lock of their own, so threads allocating the same size rarely meet,
+// and the back-end lock is only taken to get or return a subsegment. The
+// walk reports subsegments as single busy blocks, not their contents.
+//
+// Like on Windows it cannot be turned off again, and not on HEAP_NO_SERIALIZE
+// heaps. Turn it on before the heap is shared with other threads.
+//
+#define PH_HEAP_COMPATIBILITY_STANDARD  0
+#define PH_HEAP_COMPATIBILITY_LFH       2
+
+bool PhHeapSetCompatibility(PPH_HEAP Heap, uint32_t Mode);
+uint32_t PhHeapQueryCompatibility(PPH_HEAP Heap);
+
+//
+// Trimming. Each pass ages every free run by one; runs of at least
+// MinimumDecommitSize bytes that stayed free for MinimumIdlePasses passes
+// have their pages decommitted (MADV_DONTNEED / MEM_DECOMMIT), except the
+// page holding the block header. Pages are committed again when a block is
+// carved out of the run, which is the latency cost the stats report.
+//
+// Heaps created with HEAP_DISABLE_COALESCE_ON_FREE leave freed blocks as
+// they are, which keeps HeapFree short; each trim pass then coalesces
+// adjacent free blocks before looking for idle runs.
+//
+typedef struct _PH_TRIM_POLICY {
+    uint32_t IntervalMilliseconds;
+    uint32_t MinimumIdlePasses;
+    size_t MinimumDecommitSize;
+    size_t MaximumDecommitPerPass;      // 0 for no limit
+} PH_TRIM_POLICY, *PPH_TRIM_POLICY;
+
+#define PH_TRIM_DEFAULT_INTERVAL        1000
+#define PH_TRIM_DEFAULT_IDLE_PASSES     2
+#define PH_TRIM_DEFAULT_DECOMMIT_SIZE   (64 * 1024)
+
+typedef struct _PH_HEAP_TRIM_STATS {
+    uint64_t Passes;
+    uint64_t PassNanoseconds;
+    uint64_t CoalescedBlocks;
+    uint64_t DecommittedBytes;
+    uint64_t DecommittedRanges;
+    uint64_t RecommittedBytes;
+    uint64_t Recommits;
+    uint64_t RecommitNanoseconds;
+    uint64_t MaximumRecommitNanoseconds;
+    uint64_t CurrentDecommittedBytes;
+} PH_HEAP_TRIM_STATS, *PPH_HEAP_TRIM_STATS;
+
+//
+// Runs one pass on the calling thread and returns the bytes decommitted.
+// Policy may be NULL for the defaults.
+//
+size_t PhHeapTrim(PPH_HEAP Heap, const PH_TRIM_POLICY* Policy);
+
+//
+// Runs a pass every Policy->IntervalMilliseconds on a background thread
+// until PhHeapStopTrimmer or PhHeapDestroy.
+//
+bool PhHeapStartTrimmer(PPH_HEAP Heap, const PH_TRIM_POLICY* Policy);
+void PhHeapStopTrimmer(PPH_HEAP Heap);
+
+void PhHeapQueryTrimStats(PPH_HEAP Heap, PPH_HEAP_TRIM_STATS Stats);
+
+//
+// Per-node arenas. A block freed on a node other than its own is not freed
+// there and then: it is pushed on its home arena's remote-free queue with a
+// single compare-exchange, and the home arena frees the whole queue under
+// one lock acquisition the next time it allocates, is locked or trimmed.
+// A heap without PH_HEAP_PER_NODE_ARENAS reports everything under node 0.
+//
+// PhHeapLock on such a heap locks every arena, and PhHeapWalk walks them in
+// node order; PH_HEAP_ENTRY::dwNode tells them apart.
+//
+typedef struct _PH_NODE_STATS {
+    uint64_t Allocations;
+    uint64_t LocalFrees;
+    uint64_t RemoteFrees;
+    uint64_t RemoteBatches;
+    uint64_t PendingRemoteFrees;
+} PH_NODE_STATS, *PPH_NODE_STATS;
+
+uint32_t PhHeapNumberOfNodes(PPH_HEAP Heap);
+bool PhHeapQueryNodeStats(PPH_HEAP Heap, uint32_t Node, PPH_NODE_STATS Stats);
+
+//
+// Attaches an allocation sampler (see heap-sampler.h), or detaches it when
+// Sampler is NULL. The sampler must outlive the heap.
+//
+void PhHeapSetSampler(PPH_HEAP Heap, PPH_SAMPLER Sampler);
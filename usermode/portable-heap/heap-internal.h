@@ -0,0 +1,241 @@
+// heap-internal.h : Layouts and helpers shared by the heap engine sources.
+//
+
+#pragma once
+
+#include "heap-engine.h"
+
+#include <atomic>
+#include <string.h>
+
+#define PH_HEAP_SIGNATURE               0xffeeffee
+
+#define PH_ENTRY_BUSY                   0x01
+#define PH_ENTRY_VIRTUAL                0x02
+#define PH_ENTRY_LAST                   0x10
+#define PH_ENTRY_SAMPLED                0x20
+#define PH_ENTRY_DECOMMITTED            0x40
+
+#define PH_MINIMUM_BLOCK                2   // granules: header plus free list links
+
+//
+// SegmentIndex of blocks handed out by the LFH front end. Their
+// PreviousSize is the distance back to their subsegment instead.
+//
+#define PH_LFH_SEGMENT_INDEX            0xff
+#define PH_LFH_MAXIMUM_BYTES            (16 * 1024 - sizeof(PH_ENTRY))
+
+#define ROUND_UP(Value, Alignment)      (((Value) + (Alignment) - 1) & ~((size_t)(Alignment) - 1))
+#define ROUND_DOWN(Value, Alignment)    ((Value) & ~((size_t)(Alignment) - 1))
+
+typedef struct _PH_LIST_ENTRY {
+    struct _PH_LIST_ENTRY* Flink;
+    struct _PH_LIST_ENTRY* Blink;
+} PH_LIST_ENTRY, *PPH_LIST_ENTRY;
+
+//
+// Sizes are in granules and include the header. PreviousSize is 0 for the
+// first block of a segment. FreeEpoch is the trim pass during which a free
+// block last changed, which is how the trimmer ages free runs; LFH blocks
+// keep their requested size there instead, as their unused bytes can
+// exceed 255. Node is the home arena of a busy block; it never changes
+// while the block is busy, so it can be read without the lock.
+//
+typedef struct _PH_ENTRY {
+    uint32_t Size;
+    uint32_t PreviousSize;
+    uint8_t Flags;
+    uint8_t SegmentIndex;
+    uint8_t UnusedBytes;
+    uint8_t Node;
+    union {
+        uint32_t FreeEpoch;
+        uint32_t LfhBytes;
+    };
+} PH_ENTRY, *PPH_ENTRY;
+
+typedef struct _PH_FREE_ENTRY {
+    PH_ENTRY Entry;
+    PH_LIST_ENTRY FreeList;
+} PH_FREE_ENTRY, *PPH_FREE_ENTRY;
+
+//
+// CommitBitmap has one bit per page of the reserve, set while the page is
+// committed. Pages below CommittedSize are only clear when the trimmer has
+// decommitted them from inside a free block; DecommittedBytes counts those.
+//
+typedef struct _PH_SEGMENT {
+    uint8_t* BaseAddress;
+    size_t ReservedSize;
+    size_t CommittedSize;
+    size_t DecommittedBytes;
+    uint32_t* CommitBitmap;
+    PPH_ENTRY FirstEntry;
+    PPH_ENTRY LastEntry;
+    uint32_t SegmentIndex;
+} PH_SEGMENT, *PPH_SEGMENT;
+
+//
+// Header of a block allocated straight from the OS. Entry.Size is 0; the
+// requested size is kept here since it does not fit in granules.
+//
+typedef struct _PH_VIRTUAL_BLOCK {
+    PH_LIST_ENTRY Links;
+    size_t ReservedSize;
+    size_t Size;
+    PH_ENTRY Entry;
+} PH_VIRTUAL_BLOCK, *PPH_VIRTUAL_BLOCK;
+
+typedef struct _PH_TRIMMER PH_TRIMMER, *PPH_TRIMMER;
+typedef struct _PH_LFH PH_LFH, *PPH_LFH;
+
+//
+// A heap created with PH_HEAP_PER_NODE_ARENAS is only a table of arenas; it
+// has no segments of its own. Each arena is an ordinary heap whose
+// reservations prefer its node. RemoteFrees is a stack of blocks freed from
+// other nodes, linked through their first bytes.
+//
+struct _PH_HEAP {
+    uint32_t Signature;
+    uint32_t Flags;
+    size_t MaximumSize;
+    uint32_t Node;
+    uint32_t NumberOfArenas;
+    PPH_HEAP Arenas[PH_MAXIMUM_NODES];
+    alignas(64) std::atomic<void*> RemoteFrees;
+    std::atomic<uint64_t> RemotePushes;
+    alignas(64) uint64_t RemoteDrained;
+    uint64_t RemoteBatches;
+    uint64_t Allocations;
+    uint64_t LocalFrees;
+    PH_LOCK Lock;
+    PPH_SAMPLER Sampler;
+    PPH_LFH Lfh;
+    PPH_TRIMMER Trimmer;
+    uint32_t TrimEpoch;
+    PH_HEAP_TRIM_STATS TrimStats;
+    uint32_t NumberOfSegments;
+    size_t NextSegmentReserve;
+    PPH_SEGMENT Segments[PH_MAXIMUM_SEGMENTS];
+    uint32_t FreeListsInUse[PH_FREE_LISTS / 32];
+    PH_LIST_ENTRY FreeLists[PH_FREE_LISTS];
+    PH_LIST_ENTRY VirtualAllocdBlocks;
+};
+
+static_assert(sizeof(PH_ENTRY) == PH_GRANULARITY, "PH_ENTRY must be one granule");
+static_assert(sizeof(PH_FREE_ENTRY) <= PH_MINIMUM_BLOCK * PH_GRANULARITY, "PH_MINIMUM_BLOCK too small");
+static_assert(sizeof(PH_VIRTUAL_BLOCK) % PH_GRANULARITY == 0, "PH_VIRTUAL_BLOCK must end on a granule");
+
+inline void InitializeListHead(PPH_LIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead;
+    ListHead->Blink = ListHead;
+}
+
+inline void InsertHeadList(PPH_LIST_ENTRY ListHead, PPH_LIST_ENTRY Entry)
+{
+    Entry->Flink = ListHead->Flink;
+    Entry->Blink = ListHead;
+    ListHead->Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+inline bool RemoveEntryList(PPH_LIST_ENTRY Entry)
+{
+    PPH_LIST_ENTRY Flink = Entry->Flink;
+    PPH_LIST_ENTRY Blink = Entry->Blink;
+
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+    return Flink == Blink;
+}
+
+inline PPH_ENTRY NextEntry(PPH_ENTRY Entry)
+{
+    return (PPH_ENTRY)((uint8_t*)Entry + (size_t)Entry->Size * PH_GRANULARITY);
+}
+
+inline PPH_ENTRY PreviousEntry(PPH_ENTRY Entry)
+{
+    return (PPH_ENTRY)((uint8_t*)Entry - (size_t)Entry->PreviousSize * PH_GRANULARITY);
+}
+
+inline PPH_FREE_ENTRY FreeEntryFromLinks(PPH_LIST_ENTRY Links)
+{
+    return (PPH_FREE_ENTRY)((uint8_t*)Links - offsetof(PH_FREE_ENTRY, FreeList));
+}
+
+inline uint32_t FreeListIndex(uint32_t Size)
+{
+    return Size < PH_FREE_LISTS - 1 ? Size : PH_FREE_LISTS - 1;
+}
+
+inline void InsertFreeEntry(PPH_HEAP Heap, PPH_ENTRY Entry)
+{
+    uint32_t Index = FreeListIndex(Entry->Size);
+
+    InsertHeadList(&Heap->FreeLists[Index], &((PPH_FREE_ENTRY)Entry)->FreeList);
+    Heap->FreeListsInUse[Index / 32] |= 1u << (Index % 32);
+}
+
+inline void RemoveFreeEntry(PPH_HEAP Heap, PPH_ENTRY Entry)
+{
+    uint32_t Index = FreeListIndex(Entry->Size);
+
+    if (RemoveEntryList(&((PPH_FREE_ENTRY)Entry)->FreeList) &&
+        Heap->FreeLists[Index].Flink == &Heap->FreeLists[Index]) {
+        Heap->FreeListsInUse[Index / 32] &= ~(1u << (Index % 32));
+    }
+}
+
+//
+// Merges Next, a free block that directly follows the free block Entry,
+// into Entry. Both must be off their free lists. The merged run keeps the
+// age of its larger part.
+//
+inline void MergeFreeEntries(PPH_HEAP Heap, PPH_ENTRY Entry, PPH_ENTRY Next)
+{
+    if (Next->Size > Entry->Size) {
+        Entry->FreeEpoch = Next->FreeEpoch;
+    }
+    Entry->Size += Next->Size;
+    Entry->Flags |= Next->Flags & (PH_ENTRY_LAST | PH_ENTRY_DECOMMITTED);
+
+    if ((Entry->Flags & PH_ENTRY_LAST) != 0) {
+        Heap->Segments[Entry->SegmentIndex]->LastEntry = Entry;
+    }
+    else {
+        NextEntry(Entry)->PreviousSize = Entry->Size;
+    }
+}
+
+void PhpSetLastError(uint32_t Error);
+PPH_HEAP PhpCreateHeap(uint32_t Options, size_t InitialSize, size_t MaximumSize, uint32_t Node);
+void* PhpAllocate(PPH_HEAP Heap, uint32_t Flags, size_t Bytes, bool Sample);
+void PhpDrainRemoteFrees(PPH_HEAP Heap);
+
+//
+// heap-lfh.cpp: the low-fragmentation front end.
+//
+void* PhpLfhAllocate(PPH_HEAP Heap, size_t Bytes, bool Sample);
+bool PhpLfhFree(PPH_HEAP Heap, PPH_ENTRY Entry);
+void PhpLfhDestroy(PPH_HEAP Heap);
+
+//
+// heap-numa.cpp: the per-node arena table.
+//
+PPH_HEAP PhpCreateNodeHeap(uint32_t Options, size_t InitialSize, size_t MaximumSize);
+bool PhpDestroyNodeHeap(PPH_HEAP Heap);
+void* PhpNodeHeapAlloc(PPH_HEAP Heap, uint32_t Flags, size_t Bytes);
+bool PhpNodeHeapFree(PPH_HEAP Heap, uint32_t Flags, void* Mem);
+PPH_HEAP PhpHomeArena(PPH_HEAP Heap, const void* Mem);
+bool PhpNodeHeapWalk(PPH_HEAP Heap, PPH_HEAP_ENTRY Entry);
+
+//
+// heap-trim.cpp: page-level commit tracking.
+//
+size_t PhpCommitBitmapSize(size_t ReservedSize);
+void PhpMarkCommitted(PPH_SEGMENT Segment, size_t Offset, size_t Size);
+bool PhpRecommitEntry(PPH_HEAP Heap, PPH_ENTRY Entry, uint32_t Size);
+uint32_t PhpCoalesceHeap(PPH_HEAP Heap);
+void PhpStopTrimmer(PPH_HEAP Heap);
@@ -0,0 +1,288 @@
+// heap-lfh.cpp : The low-fragmentation front end.
+//
+// Sizes are rounded up to one of 64 classes: every granule up to 256 bytes,
+// then eight classes per power of two up to 16KB, as in the NT LFH. Each
+// class keeps a list of subsegments that still have free blocks; a
+// subsegment is one back-end allocation cut into equal blocks, which are
+// chained through their data while free. A thread sticks to one of
+// PH_LFH_AFFINITY_SLOTS copies of every class, so concurrent allocations of
+// the same size usually take different locks.
+//
+// LFH blocks carry a regular PH_ENTRY, so HeapFree and HeapSize find them
+// with no lookup: SegmentIndex marks them and PreviousSize leads back to the
+// subsegment, which knows its bucket.
+//
+
+#include "heap-internal.h"
+#include "heap-sampler.h"
+
+#include <atomic>
+#include <new>
+
+#define PH_LFH_BUCKETS                  64
+#define PH_LFH_AFFINITY_SLOTS           8
+#define PH_LFH_SUBSEGMENT_BYTES         (64 * 1024)
+#define PH_LFH_MINIMUM_BLOCKS           8
+
+typedef struct _PH_LFH_BUCKET PH_LFH_BUCKET, *PPH_LFH_BUCKET;
+
+typedef struct _PH_LFH_SUBSEGMENT {
+    PH_LIST_ENTRY Links;            // on the bucket's list while FreeCount != 0
+    PPH_LFH_BUCKET Bucket;
+    PPH_ENTRY FreeBlocks;
+    uint32_t BlockCount;
+    uint32_t FreeCount;
+} PH_LFH_SUBSEGMENT, *PPH_LFH_SUBSEGMENT;
+
+//
+// EmptySubsegments counts subsegments with every block free. One is kept
+// so that a size freed and allocated in turn does not go to the back end
+// every time; any further one is returned.
+//
+struct alignas(64) _PH_LFH_BUCKET {
+    PH_LOCK Lock;
+    PH_LIST_ENTRY Subsegments;
+    uint32_t BlockSize;             // granules, header included
+    uint32_t EmptySubsegments;
+};
+
+struct _PH_LFH {
+    PH_LFH_BUCKET Buckets[PH_LFH_AFFINITY_SLOTS][PH_LFH_BUCKETS];
+};
+
+static std::atomic<uint32_t> PhLfhNextAffinity;
+static thread_local uint32_t PhLfhAffinity = UINT32_MAX;
+
+//
+// Granules 1..16 map to buckets 0..15. Above that, each power of two range
+// [2^e, 2^(e+1)) is split in eight classes of 2^(e-3) granules.
+//
+static uint32_t BucketIndex(uint32_t Size)
+{
+    uint32_t Exponent = 4;
+
+    if (Size <= 16) {
+        return Size - 1;
+    }
+    while ((Size - 1) >> (Exponent + 1) != 0) {
+        ++Exponent;
+    }
+    return 16 + (Exponent - 4) * 8 + ((Size - 1 - (1u << Exponent)) >> (Exponent - 3));
+}
+
+static uint32_t BucketBlockSize(uint32_t Index)
+{
+    uint32_t Exponent;
+
+    if (Index < 16) {
+        return Index + 1 > PH_MINIMUM_BLOCK ? Index + 1 : PH_MINIMUM_BLOCK;
+    }
+    Exponent = 4 + (Index - 16) / 8;
+    return (1u << Exponent) + (((Index - 16) % 8 + 1) << (Exponent - 3));
+}
+
+static PPH_LFH_SUBSEGMENT SubsegmentFromEntry(PPH_ENTRY Entry)
+{
+    return (PPH_LFH_SUBSEGMENT)((uint8_t*)Entry - (size_t)Entry->PreviousSize * PH_GRANULARITY);
+}
+
+bool PhHeapSetCompatibility(PPH_HEAP Heap, uint32_t Mode)
+{
+    PPH_LFH Lfh;
+    uint32_t Slot;
+    uint32_t Index;
+
+    if (Heap->NumberOfArenas != 0) {
+        for (Index = 0; Index < Heap->NumberOfArenas; ++Index) {
+            if (PhHeapSetCompatibility(Heap->Arenas[Index], Mode) == false) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    if (Mode == PH_HEAP_COMPATIBILITY_STANDARD && Heap->Lfh == NULL) {
+        return true;
+    }
+    if (Mode != PH_HEAP_COMPATIBILITY_LFH || (Heap->Flags & HEAP_NO_SERIALIZE) != 0) {
+        PhpSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+    if (Heap->Lfh != NULL) {
+        return true;
+    }
+
+    Lfh = new (std::nothrow) PH_LFH();
+    if (Lfh == NULL) {
+        PhpSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+    for (Slot = 0; Slot < PH_LFH_AFFINITY_SLOTS; ++Slot) {
+        for (Index = 0; Index < PH_LFH_BUCKETS; ++Index) {
+            PPH_LFH_BUCKET Bucket = &Lfh->Buckets[Slot][Index];
+
+            PhLockInitialize(&Bucket->Lock);
+            InitializeListHead(&Bucket->Subsegments);
+            Bucket->BlockSize = BucketBlockSize(Index);
+        }
+    }
+    Heap->Lfh = Lfh;
+    return true;
+}
+
+uint32_t PhHeapQueryCompatibility(PPH_HEAP Heap)
+{
+    if (Heap->NumberOfArenas != 0) {
+        Heap = Heap->Arenas[0];
+    }
+    return Heap->Lfh != NULL ? PH_HEAP_COMPATIBILITY_LFH : PH_HEAP_COMPATIBILITY_STANDARD;
+}
+
+void PhpLfhDestroy(PPH_HEAP Heap)
+{
+    uint32_t Slot;
+    uint32_t Index;
+
+    if (Heap->Lfh == NULL) {
+        return;
+    }
+    for (Slot = 0; Slot < PH_LFH_AFFINITY_SLOTS; ++Slot) {
+        for (Index = 0; Index < PH_LFH_BUCKETS; ++Index) {
+            PhLockDelete(&Heap->Lfh->Buckets[Slot][Index].Lock);
+        }
+    }
+    delete Heap->Lfh;
+    Heap->Lfh = NULL;
+}
+
+//
+// Gets a subsegment from the back end and chains all of its blocks, lowest
+// address first.
+//
+static PPH_LFH_SUBSEGMENT CreateSubsegment(PPH_HEAP Heap, PPH_LFH_BUCKET Bucket)
+{
+    size_t BlockBytes = (size_t)Bucket->BlockSize * PH_GRANULARITY;
+    size_t HeaderBytes = ROUND_UP(sizeof(PH_LFH_SUBSEGMENT), PH_GRANULARITY);
+    uint32_t BlockCount = (uint32_t)(PH_LFH_SUBSEGMENT_BYTES / BlockBytes);
+    PPH_LFH_SUBSEGMENT Subsegment;
+    uint32_t Index;
+
+    if (BlockCount < PH_LFH_MINIMUM_BLOCKS) {
+        BlockCount = PH_LFH_MINIMUM_BLOCKS;
+    }
+    Subsegment = (PPH_LFH_SUBSEGMENT)PhpAllocate(Heap, 0, HeaderBytes + BlockCount * BlockBytes, false);
+    if (Subsegment == NULL) {
+        return NULL;
+    }
+
+    Subsegment->Bucket = Bucket;
+    Subsegment->FreeBlocks = NULL;
+    Subsegment->BlockCount = BlockCount;
+    Subsegment->FreeCount = BlockCount;
+    for (Index = BlockCount; Index-- != 0; ) {
+        PPH_ENTRY Entry = (PPH_ENTRY)((uint8_t*)Subsegment + HeaderBytes + Index * BlockBytes);
+
+        memset(Entry, 0, sizeof(*Entry));
+        Entry->Size = Bucket->BlockSize;
+        Entry->PreviousSize = (uint32_t)((HeaderBytes + Index * BlockBytes) / PH_GRANULARITY);
+        Entry->SegmentIndex = PH_LFH_SEGMENT_INDEX;
+        Entry->Node = (uint8_t)Heap->Node;
+        *(PPH_ENTRY*)(Entry + 1) = Subsegment->FreeBlocks;
+        Subsegment->FreeBlocks = Entry;
+    }
+    return Subsegment;
+}
+
+void* PhpLfhAllocate(PPH_HEAP Heap, size_t Bytes, bool Sample)
+{
+    uint32_t Size = (uint32_t)((Bytes + sizeof(PH_ENTRY) + PH_GRANULARITY - 1) / PH_GRANULARITY);
+    PPH_LFH_SUBSEGMENT Subsegment;
+    PPH_LFH_BUCKET Bucket;
+    PPH_ENTRY Entry;
+
+    if (PhLfhAffinity == UINT32_MAX) {
+        PhLfhAffinity = PhLfhNextAffinity.fetch_add(1, std::memory_order_relaxed) % PH_LFH_AFFINITY_SLOTS;
+    }
+    Bucket = &Heap->Lfh->Buckets[PhLfhAffinity][BucketIndex(Size)];
+
+    //
+    // The back end is called without the bucket lock held, so that a slow
+    // segment commit only stalls this thread.
+    //
+    PhLockAcquire(&Bucket->Lock);
+    while (Bucket->Subsegments.Flink == &Bucket->Subsegments) {
+        PhLockRelease(&Bucket->Lock);
+        Subsegment = CreateSubsegment(Heap, Bucket);
+        if (Subsegment == NULL) {
+            return NULL;
+        }
+        PhLockAcquire(&Bucket->Lock);
+        InsertHeadList(&Bucket->Subsegments, &Subsegment->Links);
+        Bucket->EmptySubsegments += 1;
+    }
+
+    Subsegment = (PPH_LFH_SUBSEGMENT)Bucket->Subsegments.Flink;
+    if (Subsegment->FreeCount == Subsegment->BlockCount) {
+        Bucket->EmptySubsegments -= 1;
+    }
+    Entry = Subsegment->FreeBlocks;
+    Subsegment->FreeBlocks = *(PPH_ENTRY*)(Entry + 1);
+    Subsegment->FreeCount -= 1;
+    if (Subsegment->FreeCount == 0) {
+        RemoveEntryList(&Subsegment->Links);
+    }
+    Entry->Flags = PH_ENTRY_BUSY | (Sample ? PH_ENTRY_SAMPLED : 0);
+    Entry->LfhBytes = (uint32_t)Bytes;
+    PhLockRelease(&Bucket->Lock);
+    return Entry + 1;
+}
+
+bool PhpLfhFree(PPH_HEAP Heap, PPH_ENTRY Entry)
+{
+    PPH_LFH_SUBSEGMENT Subsegment = SubsegmentFromEntry(Entry);
+    PPH_LFH_SUBSEGMENT Release = NULL;
+    PPH_LFH_BUCKET Bucket;
+
+    if (Heap->Lfh == NULL) {
+        PhpSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    Bucket = Subsegment->Bucket;
+    PhLockAcquire(&Bucket->Lock);
+    if ((Entry->Flags & PH_ENTRY_BUSY) == 0) {
+        PhLockRelease(&Bucket->Lock);
+        PhpSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    //
+    // Recorded before the block can be handed out again, so the sampler
+    // never sees its next allocation ahead of this free.
+    //
+    if ((Entry->Flags & PH_ENTRY_SAMPLED) != 0 && Heap->Sampler != NULL) {
+        PhSamplerRecordFree(Heap->Sampler, Entry + 1);
+    }
+    Entry->Flags = 0;
+    *(PPH_ENTRY*)(Entry + 1) = Subsegment->FreeBlocks;
+    Subsegment->FreeBlocks = Entry;
+    Subsegment->FreeCount += 1;
+    if (Subsegment->FreeCount == 1) {
+        InsertHeadList(&Bucket->Subsegments, &Subsegment->Links);
+    }
+    if (Subsegment->FreeCount == Subsegment->BlockCount) {
+        if (Bucket->EmptySubsegments != 0) {
+            RemoveEntryList(&Subsegment->Links);
+            Release = Subsegment;
+        }
+        else {
+            Bucket->EmptySubsegments += 1;
+        }
+    }
+    PhLockRelease(&Bucket->Lock);
+
+    if (Release != NULL) {
+        PhHeapFree(Heap, 0, Release);
+    }
+    return true;
+}
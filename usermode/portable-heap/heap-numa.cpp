@@ -0,0 +1,160 @@
+// heap-numa.cpp : Per-node arenas.
+//
+// A heap created with PH_HEAP_PER_NODE_ARENAS holds one ordinary heap per
+// NUMA node. Allocations go to the arena of the node the calling thread is
+// running on, so the memory is local to the thread that is most likely to
+// touch it. Each block records its home arena in its header.
+//
+// Frees from the home node take the arena lock as usual. Frees from any
+// other node must not contend on a remote lock, nor touch the remote free
+// lists and pull their cache lines across the interconnect, so they push the
+// block on the arena's remote-free stack instead. The arena picks the whole
+// stack up with one exchange and frees it as a batch under its lock.
+//
+
+#include "heap-internal.h"
+
+#include <new>
+
+PPH_HEAP PhpCreateNodeHeap(uint32_t Options, size_t InitialSize, size_t MaximumSize)
+{
+    size_t Size = ROUND_UP(sizeof(PH_HEAP), PhOsPageSize());
+    uint32_t NumberOfNodes = PhOsNumaNodeCount();
+    uint8_t* BaseAddress;
+    PPH_HEAP Heap;
+    uint32_t Node;
+
+    //
+    // Remote frees need every arena to be locked by its own users.
+    //
+    if ((Options & HEAP_NO_SERIALIZE) != 0) {
+        PhpSetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    BaseAddress = (uint8_t*)PhOsReserve(Size);
+    if (BaseAddress == NULL) {
+        PhpSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    if (PhOsCommit(BaseAddress, Size) == false) {
+        PhOsRelease(BaseAddress, Size);
+        PhpSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    Heap = new (BaseAddress) PH_HEAP();
+    Heap->Signature = PH_HEAP_SIGNATURE;
+    Heap->Flags = Options;
+    Heap->MaximumSize = MaximumSize;
+    PhLockInitialize(&Heap->Lock);
+    for (Node = 0; Node < NumberOfNodes; ++Node) {
+        Heap->Arenas[Node] = PhpCreateHeap(Options, InitialSize, MaximumSize, Node);
+        if (Heap->Arenas[Node] == NULL) {
+            PhpDestroyNodeHeap(Heap);
+            PhpSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return NULL;
+        }
+        Heap->NumberOfArenas = Node + 1;
+    }
+    return Heap;
+}
+
+bool PhpDestroyNodeHeap(PPH_HEAP Heap)
+{
+    uint32_t Index;
+
+    for (Index = 0; Index < Heap->NumberOfArenas; ++Index) {
+        PhHeapDestroy(Heap->Arenas[Index]);
+    }
+    Heap->Signature = 0;
+    PhLockDelete(&Heap->Lock);
+    PhOsRelease(Heap, ROUND_UP(sizeof(PH_HEAP), PhOsPageSize()));
+    return true;
+}
+
+//
+// Falls back to the other arenas in node order when the local one is out of
+// memory, which only happens with a fixed MaximumSize.
+//
+void* PhpNodeHeapAlloc(PPH_HEAP Heap, uint32_t Flags, size_t Bytes)
+{
+    uint32_t Node = PhOsCurrentNode();
+    uint32_t Index;
+    void* Mem;
+
+    if (Node >= Heap->NumberOfArenas) {
+        Node = 0;
+    }
+    Mem = PhHeapAlloc(Heap->Arenas[Node], Flags, Bytes);
+    for (Index = 0; Mem == NULL && Index < Heap->NumberOfArenas; ++Index) {
+        if (Index != Node) {
+            Mem = PhHeapAlloc(Heap->Arenas[Index], Flags, Bytes);
+        }
+    }
+    return Mem;
+}
+
+PPH_HEAP PhpHomeArena(PPH_HEAP Heap, const void* Mem)
+{
+    uint32_t Node = ((const PH_ENTRY*)Mem - 1)->Node;
+
+    return Node < Heap->NumberOfArenas ? Heap->Arenas[Node] : NULL;
+}
+
+bool PhpNodeHeapFree(PPH_HEAP Heap, uint32_t Flags, void* Mem)
+{
+    PPH_HEAP Arena = PhpHomeArena(Heap, Mem);
+    void* Head;
+
+    if (Arena == NULL) {
+        PhpSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    //
+    // LFH blocks go straight to their bucket: the queue is drained under
+    // the arena lock, which an LFH free may need to return a subsegment.
+    //
+    if (Arena->Node == PhOsCurrentNode() || ((PPH_ENTRY)Mem - 1)->SegmentIndex == PH_LFH_SEGMENT_INDEX) {
+        return PhHeapFree(Arena, Flags, Mem);
+    }
+
+    //
+    // The block is dead, so its first bytes can hold the link. The home
+    // arena only ever takes the whole stack at once, so a plain
+    // compare-exchange push has no ABA problem.
+    //
+    Head = Arena->RemoteFrees.load(std::memory_order_relaxed);
+    do {
+        *(void**)Mem = Head;
+    } while (Arena->RemoteFrees.compare_exchange_weak(Head, Mem,
+        std::memory_order_release, std::memory_order_relaxed) == false);
+    Arena->RemotePushes.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+//
+// Walks the arenas one after the other. The caller holds PhHeapLock on the
+// per-node heap, which locks every arena.
+//
+bool PhpNodeHeapWalk(PPH_HEAP Heap, PPH_HEAP_ENTRY Entry)
+{
+    uint32_t Node = 0;
+
+    if (Entry->lpData != NULL) {
+        Node = Entry->dwNode;
+        if (Node >= Heap->NumberOfArenas) {
+            PhpSetLastError(ERROR_INVALID_PARAMETER);
+            return false;
+        }
+        if (PhHeapWalk(Heap->Arenas[Node], Entry)) {
+            return true;
+        }
+        if (PhGetLastError() != ERROR_NO_MORE_ITEMS || ++Node == Heap->NumberOfArenas) {
+            return false;
+        }
+        Entry->lpData = NULL;
+    }
+    return PhHeapWalk(Heap->Arenas[Node], Entry);
+}
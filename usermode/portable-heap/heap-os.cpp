@@ -0,0 +1,458 @@
+// heap-os.cpp : Windows and POSIX implementations of the heap OS services.
+//
+
+#include "heap-os.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PH_OS_MAXIMUM_CPUS              4096
+#define PH_MPOL_PREFERRED               1   // <numaif.h> belongs to libnuma
+#endif
+
+size_t PhOsPageSize()
+{
+    static size_t PageSize;
+
+    if (PageSize == 0) {
+#ifdef _WIN32
+        SYSTEM_INFO SystemInfo;
+
+        GetSystemInfo(&SystemInfo);
+        PageSize = SystemInfo.dwPageSize;
+#else
+        PageSize = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    }
+    return PageSize;
+}
+
+void* PhOsReserve(size_t Size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(NULL, Size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    void* Address = mmap(NULL, Size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    return Address != MAP_FAILED ? Address : NULL;
+#endif
+}
+
+void* PhOsReserveOnNode(size_t Size, uint32_t Node)
+{
+#ifdef _WIN32
+    //
+    // The preferred node is kept with the reservation and applies to every
+    // later MEM_COMMIT in it.
+    //
+    if (PhOsNumaNodeCount() > 1) {
+        return VirtualAllocExNuma(GetCurrentProcess(), NULL, Size, MEM_RESERVE, PAGE_NOACCESS, Node);
+    }
+    return PhOsReserve(Size);
+#else
+    void* Address = PhOsReserve(Size);
+    unsigned long Mask = 1ul << (Node % (sizeof(unsigned long) * 8));
+
+    //
+    // The policy is attached to the range, so pages faulted in after the
+    // commit come from Node while it has free memory. The kernel counts
+    // maxnode one past the last bit it reads.
+    //
+    if (Address != NULL && PhOsNumaNodeCount() > 1) {
+        syscall(SYS_mbind, Address, Size, PH_MPOL_PREFERRED, &Mask, sizeof(Mask) * 8 + 1, 0);
+    }
+    return Address;
+#endif
+}
+
+bool PhOsCommit(void* Address, size_t Size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(Address, Size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+    return mprotect(Address, Size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+void PhOsDecommit(void* Address, size_t Size)
+{
+#ifdef _WIN32
+    VirtualFree(Address, Size, MEM_DECOMMIT);
+#else
+    //
+    // MADV_DONTNEED drops the pages right away, unlike MADV_FREE which only
+    // lets the kernel take them under pressure and would leave RSS unchanged.
+    //
+    madvise(Address, Size, MADV_DONTNEED);
+    mprotect(Address, Size, PROT_NONE);
+#endif
+}
+
+void PhOsRelease(void* Address, size_t Size)
+{
+#ifdef _WIN32
+    UNREFERENCED_PARAMETER(Size);
+    VirtualFree(Address, 0, MEM_RELEASE);
+#else
+    munmap(Address, Size);
+#endif
+}
+
+#ifndef _WIN32
+typedef struct _PH_OS_TOPOLOGY {
+    uint32_t NumberOfNodes;
+    uint8_t CpuNode[PH_OS_MAXIMUM_CPUS];
+} PH_OS_TOPOLOGY, *PPH_OS_TOPOLOGY;
+
+//
+// Reads /sys/devices/system/node/node<N>/cpulist, which holds ranges such as
+// "0-15,32-47", into a CPU to node table.
+//
+static PPH_OS_TOPOLOGY LoadTopology()
+{
+    static PH_OS_TOPOLOGY Topology;
+    uint32_t Node;
+
+    Topology.NumberOfNodes = 1;
+    for (Node = 0; Node < PH_OS_MAXIMUM_NODES; ++Node) {
+        char Path[64];
+        FILE* File;
+        unsigned First;
+        unsigned Last;
+        int Separator;
+
+        snprintf(Path, sizeof(Path), "/sys/devices/system/node/node%u/cpulist", Node);
+        File = fopen(Path, "r");
+        if (File == NULL) {
+            continue;
+        }
+        Topology.NumberOfNodes = Node + 1;
+        while (fscanf(File, "%u", &First) == 1) {
+            Last = First;
+            Separator = fgetc(File);
+            if (Separator == '-' && fscanf(File, "%u", &Last) == 1) {
+                Separator = fgetc(File);
+            }
+            for (; First <= Last && First < PH_OS_MAXIMUM_CPUS; ++First) {
+                Topology.CpuNode[First] = (uint8_t)Node;
+            }
+            if (Separator != ',') {
+                break;
+            }
+        }
+        fclose(File);
+    }
+    return &Topology;
+}
+
+static PPH_OS_TOPOLOGY GetTopology()
+{
+    static PPH_OS_TOPOLOGY Topology = LoadTopology();
+
+    return Topology;
+}
+#endif
+
+uint32_t PhOsNumaNodeCount()
+{
+#ifdef _WIN32
+    static uint32_t NumberOfNodes;
+    ULONG HighestNode;
+
+    if (NumberOfNodes == 0) {
+        if (GetNumaHighestNodeNumber(&HighestNode) == FALSE) {
+            HighestNode = 0;
+        }
+        NumberOfNodes = HighestNode + 1 < PH_OS_MAXIMUM_NODES ? HighestNode + 1 : PH_OS_MAXIMUM_NODES;
+    }
+    return NumberOfNodes;
+#else
+    return GetTopology()->NumberOfNodes;
+#endif
+}
+
+uint32_t PhOsCurrentNode()
+{
+#ifdef _WIN32
+    PROCESSOR_NUMBER Processor;
+    USHORT Node;
+
+    GetCurrentProcessorNumberEx(&Processor);
+    if (GetNumaProcessorNodeEx(&Processor, &Node) == FALSE || Node >= PhOsNumaNodeCount()) {
+        return 0;
+    }
+    return Node;
+#else
+    PPH_OS_TOPOLOGY Topology = GetTopology();
+    int Cpu;
+
+    //
+    // sched_getcpu is served from the vDSO, so this costs no system call.
+    //
+    if (Topology->NumberOfNodes == 1) {
+        return 0;
+    }
+    Cpu = sched_getcpu();
+    return Cpu >= 0 && Cpu < PH_OS_MAXIMUM_CPUS ? Topology->CpuNode[Cpu] : 0;
+#endif
+}
+
+uint64_t PhOsTimestamp()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER Frequency;
+    LARGE_INTEGER Counter;
+
+    if (Frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&Frequency);
+    }
+    QueryPerformanceCounter(&Counter);
+    return (uint64_t)(Counter.QuadPart / Frequency.QuadPart) * 1000000000ull +
+        (uint64_t)(Counter.QuadPart % Frequency.QuadPart) * 1000000000ull / (uint64_t)Frequency.QuadPart;
+#else
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (uint64_t)Now.tv_sec * 1000000000ull + (uint64_t)Now.tv_nsec;
+#endif
+}
+
+size_t PhOsResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS Counters;
+
+    if (K32GetProcessMemoryInfo(GetCurrentProcess(), &Counters, sizeof(Counters)) == FALSE) {
+        return 0;
+    }
+    return Counters.WorkingSetSize;
+#else
+    FILE* File = fopen("/proc/self/statm", "r");
+    unsigned long long Size;
+    unsigned long long Resident = 0;
+
+    if (File == NULL) {
+        return 0;
+    }
+    if (fscanf(File, "%llu %llu", &Size, &Resident) != 2) {
+        Resident = 0;
+    }
+    fclose(File);
+    return (size_t)Resident * PhOsPageSize();
+#endif
+}
+
+#if !defined(_WIN32) && defined(PH_FRAME_POINTER_STACKS)
+static thread_local uintptr_t PhOsStackTop;
+#endif
+
+//
+// backtrace() interprets the DWARF unwind tables frame by frame, which costs
+// microseconds per stack. Builds where every frame keeps its frame pointer
+// (-fno-omit-frame-pointer) can define PH_FRAME_POINTER_STACKS to follow the
+// frame pointer chain instead, about a hundred times cheaper; code built
+// without them ends the stacks that go through it. The chain's layout is the
+// same on x86-64 and ARM64.
+//
+uint32_t PhOsCaptureStack(uint32_t FramesToSkip, uint32_t FramesToCapture, void** Frames)
+{
+#ifdef _WIN32
+    return RtlCaptureStackBackTrace(FramesToSkip + 1, FramesToCapture, Frames, NULL);
+#elif defined(PH_FRAME_POINTER_STACKS)
+    uintptr_t* Frame = (uintptr_t*)__builtin_frame_address(0);
+    uint32_t Captured = 0;
+
+    if (PhOsStackTop == 0) {
+        pthread_attr_t Attributes;
+        void* StackBase;
+        size_t StackSize;
+
+        if (pthread_getattr_np(pthread_self(), &Attributes) != 0) {
+            return 0;
+        }
+        pthread_attr_getstack(&Attributes, &StackBase, &StackSize);
+        pthread_attr_destroy(&Attributes);
+        PhOsStackTop = (uintptr_t)StackBase + StackSize;
+    }
+
+    //
+    // Each frame starts with the caller's frame pointer and the return
+    // address. Links are only followed upwards and within the thread's
+    // stack, so a broken chain ends the walk instead of faulting.
+    //
+    while (Captured < FramesToCapture && Frame[1] != 0) {
+        uintptr_t* Next = (uintptr_t*)Frame[0];
+
+        if (FramesToSkip != 0) {
+            --FramesToSkip;
+        }
+        else {
+            Frames[Captured++] = (void*)Frame[1];
+        }
+        if (Next <= Frame || ((uintptr_t)Next & (sizeof(void*) - 1)) != 0 ||
+            (uintptr_t)(Next + 2) > PhOsStackTop) {
+            break;
+        }
+        Frame = Next;
+    }
+    return Captured;
+#else
+    void* Buffer[64];
+    int Captured;
+    uint32_t Skip = FramesToSkip + 1;
+
+    if (FramesToCapture + Skip > sizeof(Buffer) / sizeof(Buffer[0])) {
+        FramesToCapture = (uint32_t)(sizeof(Buffer) / sizeof(Buffer[0])) - Skip;
+    }
+    Captured = backtrace(Buffer, (int)(FramesToCapture + Skip));
+    if (Captured <= (int)Skip) {
+        return 0;
+    }
+    memcpy(Frames, Buffer + Skip, (Captured - Skip) * sizeof(void*));
+    return (uint32_t)Captured - Skip;
+#endif
+}
+
+void PhOsFormatAddress(const void* Address, char* Buffer, size_t BufferSize)
+{
+#ifdef _WIN32
+    HMODULE hModule;
+    char ModuleName[MAX_PATH];
+    const char* BaseName;
+
+    if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+            GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCSTR)Address, &hModule) == FALSE ||
+        GetModuleFileNameA(hModule, ModuleName, sizeof(ModuleName)) == 0) {
+        snprintf(Buffer, BufferSize, "%p", Address);
+        return;
+    }
+    BaseName = strrchr(ModuleName, '\\');
+    snprintf(Buffer, BufferSize, "%s+%#llx",
+        BaseName != NULL ? BaseName + 1 : ModuleName,
+        (unsigned long long)((const char*)Address - (const char*)hModule));
+#else
+    Dl_info Info;
+    const char* BaseName;
+
+    if (dladdr(Address, &Info) == 0 || Info.dli_fname == NULL) {
+        snprintf(Buffer, BufferSize, "%p", Address);
+        return;
+    }
+    BaseName = strrchr(Info.dli_fname, '/');
+    BaseName = BaseName != NULL ? BaseName + 1 : Info.dli_fname;
+    if (Info.dli_sname != NULL) {
+        snprintf(Buffer, BufferSize, "%s!%s+%#llx", BaseName, Info.dli_sname,
+            (unsigned long long)((const char*)Address - (const char*)Info.dli_saddr));
+    }
+    else {
+        snprintf(Buffer, BufferSize, "%s+%#llx", BaseName,
+            (unsigned long long)((const char*)Address - (const char*)Info.dli_fbase));
+    }
+#endif
+}
+
+typedef struct _PH_THREAD_START {
+    PPH_THREAD_ROUTINE Routine;
+    void* Context;
+} PH_THREAD_START, *PPH_THREAD_START;
+
+#ifdef _WIN32
+static DWORD WINAPI ThreadStart(LPVOID Parameter)
+#else
+static void* ThreadStart(void* Parameter)
+#endif
+{
+    PH_THREAD_START Start = *(PPH_THREAD_START)Parameter;
+
+    free(Parameter);
+    Start.Routine(Start.Context);
+    return 0;
+}
+
+bool PhOsCreateThread(PPH_THREAD Thread, PPH_THREAD_ROUTINE Routine, void* Context)
+{
+    PPH_THREAD_START Start = (PPH_THREAD_START)malloc(sizeof(*Start));
+
+    if (Start == NULL) {
+        return false;
+    }
+    Start->Routine = Routine;
+    Start->Context = Context;
+#ifdef _WIN32
+    Thread->hThread = CreateThread(NULL, 0, ThreadStart, Start, 0, NULL);
+    if (Thread->hThread == NULL) {
+#else
+    if (pthread_create(&Thread->Thread, NULL, ThreadStart, Start) != 0) {
+#endif
+        free(Start);
+        return false;
+    }
+    return true;
+}
+
+void PhOsJoinThread(PPH_THREAD Thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(Thread->hThread, INFINITE);
+    CloseHandle(Thread->hThread);
+#else
+    pthread_join(Thread->Thread, NULL);
+#endif
+}
+
+void PhOsSleep(uint32_t Milliseconds)
+{
+#ifdef _WIN32
+    Sleep(Milliseconds);
+#else
+    usleep((useconds_t)Milliseconds * 1000);
+#endif
+}
+
+void PhLockInitialize(PPH_LOCK Lock)
+{
+#ifdef _WIN32
+    InitializeSRWLock(&Lock->Lock);
+#else
+    pthread_mutex_init(&Lock->Lock, NULL);
+#endif
+}
+
+void PhLockAcquire(PPH_LOCK Lock)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&Lock->Lock);
+#else
+    pthread_mutex_lock(&Lock->Lock);
+#endif
+}
+
+void PhLockRelease(PPH_LOCK Lock)
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&Lock->Lock);
+#else
+    pthread_mutex_unlock(&Lock->Lock);
+#endif
+}
+
+void PhLockDelete(PPH_LOCK Lock)
+{
+#ifdef _WIN32
+    UNREFERENCED_PARAMETER(Lock);
+#else
+    pthread_mutex_destroy(&Lock->Lock);
+#endif
+}
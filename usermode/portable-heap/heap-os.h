@@ -0,0 +1,89 @@
+// heap-os.h : The few operating system services the portable heap relies on.
+//
+// VirtualAlloc and SRWLOCK on Windows, mmap and pthread elsewhere. Memory is
+// reserved and committed separately so a segment can grow in place, exactly
+// as the NT heap does with its uncommitted ranges.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+size_t PhOsPageSize();
+
+//
+// Reserve only takes address space; pages are usable once committed.
+// Decommitted pages read back as zeros when committed again.
+//
+void* PhOsReserve(size_t Size);
+void* PhOsReserveOnNode(size_t Size, uint32_t Node);
+bool PhOsCommit(void* Address, size_t Size);
+void PhOsDecommit(void* Address, size_t Size);
+void PhOsRelease(void* Address, size_t Size);
+
+//
+// NUMA topology. Nodes are numbered from 0 to PhOsNumaNodeCount() - 1, and a
+// machine without NUMA reports a single node. PhOsReserveOnNode prefers that
+// node for the pages committed in the range later on; it falls back to
+// PhOsReserve's placement when the OS will not honour the preference.
+//
+#define PH_OS_MAXIMUM_NODES             64
+
+uint32_t PhOsNumaNodeCount();
+uint32_t PhOsCurrentNode();
+
+//
+// Monotonic clock in nanoseconds.
+//
+uint64_t PhOsTimestamp();
+
+//
+// Resident set size of the process, 0 if unknown.
+//
+size_t PhOsResidentBytes();
+
+//
+// Return addresses of the calling thread, innermost first, not counting this
+// function and the FramesToSkip callers above it.
+//
+uint32_t PhOsCaptureStack(uint32_t FramesToSkip, uint32_t FramesToCapture, void** Frames);
+
+//
+// Formats a code address as module+offset, or module!symbol+offset when the
+// symbol is exported.
+//
+void PhOsFormatAddress(const void* Address, char* Buffer, size_t BufferSize);
+
+typedef struct _PH_THREAD {
+#ifdef _WIN32
+    HANDLE hThread;
+#else
+    pthread_t Thread;
+#endif
+} PH_THREAD, *PPH_THREAD;
+
+typedef void (*PPH_THREAD_ROUTINE)(void* Context);
+
+bool PhOsCreateThread(PPH_THREAD Thread, PPH_THREAD_ROUTINE Routine, void* Context);
+void PhOsJoinThread(PPH_THREAD Thread);
+void PhOsSleep(uint32_t Milliseconds);
+
+typedef struct _PH_LOCK {
+#ifdef _WIN32
+    SRWLOCK Lock;
+#else
+    pthread_mutex_t Lock;
+#endif
+} PH_LOCK, *PPH_LOCK;
+
+void PhLockInitialize(PPH_LOCK Lock);
+void PhLockAcquire(PPH_LOCK Lock);
+void PhLockRelease(PPH_LOCK Lock);
+void PhLockDelete(PPH_LOCK Lock);
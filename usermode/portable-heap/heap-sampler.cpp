@@ -0,0 +1,515 @@
+// heap-sampler.cpp : Sample ring and call-site aggregation.
+//
+
+#include "heap-sampler.h"
+
+#include <atomic>
+#include <math.h>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct _PH_SAMPLE_SLOT {
+    std::atomic<uint64_t> Sequence;
+    PH_SAMPLE Sample;
+} PH_SAMPLE_SLOT, *PPH_SAMPLE_SLOT;
+
+typedef struct _PH_CALL_SITE {
+    uint64_t Hash;
+    uint32_t Depth;
+    void* Frames[PH_SAMPLE_MAX_FRAMES];
+    uint64_t Samples;
+    uint64_t Frees;
+    uint64_t AllocatedBytes;
+    uint64_t FreedBytes;
+} PH_CALL_SITE, *PPH_CALL_SITE;
+
+//
+// A sampled block that has not been freed yet, and the call site it is
+// charged to.
+//
+typedef struct _PH_LIVE_SAMPLE {
+    uintptr_t Address;
+    uint32_t SiteIndex;
+    uint64_t Weight;
+} PH_LIVE_SAMPLE, *PPH_LIVE_SAMPLE;
+
+//
+// The ring is Vyukov's bounded queue: each slot's sequence number tells a
+// producer whether the slot is free for its lap, so producers only contend
+// on one atomic increment and never wait for each other.
+//
+struct _PH_SAMPLER {
+    size_t SampleInterval;
+    uint64_t RingMask;
+    PPH_SAMPLE_SLOT Ring;
+    alignas(64) std::atomic<uint64_t> EnqueuePosition;
+    alignas(64) std::atomic<uint64_t> Dropped;
+    alignas(64) PH_LOCK Lock;
+    uint64_t DequeuePosition;
+    uint64_t Samples;
+    uint64_t Frees;
+    PPH_CALL_SITE Sites;
+    uint32_t NumberOfSites;
+    uint32_t MaximumSites;
+    uint32_t* SiteTable;
+    uint32_t SiteTableMask;
+    PPH_LIVE_SAMPLE LiveTable;
+    uint32_t LiveTableMask;
+    uint32_t NumberOfLive;
+};
+
+PH_SAMPLER_THREAD_LOCAL int64_t PhSamplerBytesUntilSample;
+static thread_local uint64_t PhSamplerRandom;
+
+PPH_SAMPLER PhSamplerCreate(size_t SampleInterval, uint32_t RingCapacity)
+{
+    PPH_SAMPLER Sampler;
+    uint64_t Capacity = 2;
+    uint64_t Index;
+
+    while (Capacity < RingCapacity) {
+        Capacity *= 2;
+    }
+
+    Sampler = new (std::nothrow) PH_SAMPLER();
+    if (Sampler == NULL) {
+        return NULL;
+    }
+    Sampler->SampleInterval = SampleInterval != 0 ? SampleInterval : PH_SAMPLER_DEFAULT_INTERVAL;
+    Sampler->RingMask = Capacity - 1;
+    Sampler->Ring = new (std::nothrow) PH_SAMPLE_SLOT[Capacity];
+    Sampler->SiteTableMask = 1023;
+    Sampler->SiteTable = (uint32_t*)calloc(Sampler->SiteTableMask + 1, sizeof(uint32_t));
+    Sampler->LiveTableMask = 4095;
+    Sampler->LiveTable = (PPH_LIVE_SAMPLE)calloc(Sampler->LiveTableMask + 1, sizeof(PH_LIVE_SAMPLE));
+    if (Sampler->Ring == NULL || Sampler->SiteTable == NULL || Sampler->LiveTable == NULL) {
+        PhSamplerDestroy(Sampler);
+        return NULL;
+    }
+    for (Index = 0; Index < Capacity; ++Index) {
+        Sampler->Ring[Index].Sequence.store(Index, std::memory_order_relaxed);
+    }
+    PhLockInitialize(&Sampler->Lock);
+    return Sampler;
+}
+
+void PhSamplerDestroy(PPH_SAMPLER Sampler)
+{
+    if (Sampler->Ring != NULL && Sampler->SiteTable != NULL && Sampler->LiveTable != NULL) {
+        PhLockDelete(&Sampler->Lock);
+    }
+    delete[] Sampler->Ring;
+    free(Sampler->Sites);
+    free(Sampler->SiteTable);
+    free(Sampler->LiveTable);
+    delete Sampler;
+}
+
+//
+// Exponentially distributed countdown with mean SampleInterval, from a
+// per-thread xorshift64* generator.
+//
+static int64_t DrawInterval(PPH_SAMPLER Sampler)
+{
+    double Uniform;
+
+    PhSamplerRandom ^= PhSamplerRandom >> 12;
+    PhSamplerRandom ^= PhSamplerRandom << 25;
+    PhSamplerRandom ^= PhSamplerRandom >> 27;
+    Uniform = (double)((PhSamplerRandom * 0x2545f4914f6cdd1dull) >> 11) * (1.0 / 9007199254740992.0);
+    return (int64_t)(-log(1.0 - Uniform) * (double)Sampler->SampleInterval) + 1;
+}
+
+bool PhSamplerPickNext(PPH_SAMPLER Sampler, size_t Bytes)
+{
+    (void)Bytes;
+
+    //
+    // A thread's first allocation starts its countdown instead of being
+    // sampled, unless it is larger than the countdown itself.
+    //
+    if (PhSamplerRandom == 0) {
+        PhSamplerRandom = (PhOsTimestamp() ^ (uint64_t)(uintptr_t)&PhSamplerRandom) | 1;
+        PhSamplerBytesUntilSample += DrawInterval(Sampler);
+        if (PhSamplerBytesUntilSample >= 0) {
+            return false;
+        }
+    }
+    PhSamplerBytesUntilSample = DrawInterval(Sampler);
+    return true;
+}
+
+static void Enqueue(PPH_SAMPLER Sampler, const PH_SAMPLE* Sample)
+{
+    uint64_t Position = Sampler->EnqueuePosition.load(std::memory_order_relaxed);
+    PPH_SAMPLE_SLOT Slot;
+
+    for (;;) {
+        int64_t Difference;
+
+        Slot = &Sampler->Ring[Position & Sampler->RingMask];
+        Difference = (int64_t)(Slot->Sequence.load(std::memory_order_acquire) - Position);
+        if (Difference == 0) {
+            if (Sampler->EnqueuePosition.compare_exchange_weak(Position, Position + 1,
+                    std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (Difference < 0) {
+            Sampler->Dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else {
+            Position = Sampler->EnqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    //
+    // Only the captured frames are copied, which keeps frees cheap.
+    //
+    memcpy(&Slot->Sample, Sample, offsetof(PH_SAMPLE, Frames) + Sample->Depth * sizeof(void*));
+    Slot->Sequence.store(Position + 1, std::memory_order_release);
+}
+
+void PhSamplerRecordAlloc(PPH_SAMPLER Sampler, void* Address, size_t Size)
+{
+    PH_SAMPLE Sample;
+    double Probability = 1.0 - exp(-(double)Size / (double)Sampler->SampleInterval);
+
+    Sample.Timestamp = PhOsTimestamp();
+    Sample.Address = (uintptr_t)Address;
+    Sample.Size = Size;
+    Sample.Weight = Probability > 0.0 ? (uint64_t)((double)Size / Probability) : Sampler->SampleInterval;
+    Sample.Type = PH_SAMPLE_ALLOC;
+
+    //
+    // Skip this function and PhHeapAlloc so the innermost frame is the caller.
+    //
+    Sample.Depth = PhOsCaptureStack(2, PH_SAMPLE_MAX_FRAMES, Sample.Frames);
+    Enqueue(Sampler, &Sample);
+}
+
+void PhSamplerRecordFree(PPH_SAMPLER Sampler, void* Address)
+{
+    PH_SAMPLE Sample;
+
+    Sample.Timestamp = PhOsTimestamp();
+    Sample.Address = (uintptr_t)Address;
+    Sample.Size = 0;
+    Sample.Weight = 0;
+    Sample.Type = PH_SAMPLE_FREE;
+    Sample.Depth = 0;
+    Enqueue(Sampler, &Sample);
+}
+
+static uint64_t HashFrames(void* const* Frames, uint32_t Depth)
+{
+    uint64_t Hash = 0xcbf29ce484222325ull;
+    uint32_t Index;
+
+    for (Index = 0; Index < Depth; ++Index) {
+        Hash ^= (uint64_t)(uintptr_t)Frames[Index];
+        Hash *= 0x100000001b3ull;
+    }
+    return Hash ^ Depth;
+}
+
+static uint32_t HashAddress(uintptr_t Address)
+{
+    uint64_t Hash = (uint64_t)Address * 0x9e3779b97f4a7c15ull;
+
+    return (uint32_t)(Hash >> 32);
+}
+
+static bool GrowSiteTable(PPH_SAMPLER Sampler)
+{
+    uint32_t Mask = Sampler->SiteTableMask * 2 + 1;
+    uint32_t* Table = (uint32_t*)calloc(Mask + 1, sizeof(uint32_t));
+    uint32_t Index;
+
+    if (Table == NULL) {
+        return false;
+    }
+    for (Index = 0; Index < Sampler->NumberOfSites; ++Index) {
+        uint32_t Slot = (uint32_t)Sampler->Sites[Index].Hash & Mask;
+
+        while (Table[Slot] != 0) {
+            Slot = (Slot + 1) & Mask;
+        }
+        Table[Slot] = Index + 1;
+    }
+    free(Sampler->SiteTable);
+    Sampler->SiteTable = Table;
+    Sampler->SiteTableMask = Mask;
+    return true;
+}
+
+//
+// Returns the index of the call site for these frames, creating it if need
+// be, or UINT32_MAX when out of memory. The table holds index + 1.
+//
+static uint32_t LookupSite(PPH_SAMPLER Sampler, void* const* Frames, uint32_t Depth)
+{
+    uint64_t Hash = HashFrames(Frames, Depth);
+    uint32_t Slot = (uint32_t)Hash & Sampler->SiteTableMask;
+    PPH_CALL_SITE Site;
+
+    while (Sampler->SiteTable[Slot] != 0) {
+        Site = &Sampler->Sites[Sampler->SiteTable[Slot] - 1];
+        if (Site->Hash == Hash && Site->Depth == Depth &&
+            memcmp(Site->Frames, Frames, Depth * sizeof(void*)) == 0) {
+            return Sampler->SiteTable[Slot] - 1;
+        }
+        Slot = (Slot + 1) & Sampler->SiteTableMask;
+    }
+
+    if (Sampler->NumberOfSites == Sampler->MaximumSites) {
+        uint32_t MaximumSites = Sampler->MaximumSites != 0 ? Sampler->MaximumSites * 2 : 256;
+        PPH_CALL_SITE Sites = (PPH_CALL_SITE)realloc(Sampler->Sites, MaximumSites * sizeof(*Sites));
+
+        if (Sites == NULL) {
+            return UINT32_MAX;
+        }
+        Sampler->Sites = Sites;
+        Sampler->MaximumSites = MaximumSites;
+    }
+
+    Site = &Sampler->Sites[Sampler->NumberOfSites];
+    memset(Site, 0, sizeof(*Site));
+    Site->Hash = Hash;
+    Site->Depth = Depth;
+    memcpy(Site->Frames, Frames, Depth * sizeof(void*));
+    Sampler->SiteTable[Slot] = ++Sampler->NumberOfSites;
+
+    if (Sampler->NumberOfSites * 2 > Sampler->SiteTableMask && GrowSiteTable(Sampler) == false) {
+        return UINT32_MAX;
+    }
+    return Sampler->NumberOfSites - 1;
+}
+
+static PPH_LIVE_SAMPLE FindLive(PPH_SAMPLER Sampler, uintptr_t Address)
+{
+    uint32_t Slot = HashAddress(Address) & Sampler->LiveTableMask;
+
+    while (Sampler->LiveTable[Slot].Address != 0) {
+        if (Sampler->LiveTable[Slot].Address == Address) {
+            return &Sampler->LiveTable[Slot];
+        }
+        Slot = (Slot + 1) & Sampler->LiveTableMask;
+    }
+    return &Sampler->LiveTable[Slot];
+}
+
+//
+// Linear probing deletion: shift back the entries of the run that follows
+// so that lookups never stop at the hole.
+//
+static void RemoveLive(PPH_SAMPLER Sampler, PPH_LIVE_SAMPLE Live)
+{
+    uint32_t Hole = (uint32_t)(Live - Sampler->LiveTable);
+    uint32_t Slot = Hole;
+
+    for (;;) {
+        uint32_t Home;
+
+        Slot = (Slot + 1) & Sampler->LiveTableMask;
+        if (Sampler->LiveTable[Slot].Address == 0) {
+            break;
+        }
+        Home = HashAddress(Sampler->LiveTable[Slot].Address) & Sampler->LiveTableMask;
+        if (((Slot - Home) & Sampler->LiveTableMask) >= ((Slot - Hole) & Sampler->LiveTableMask)) {
+            Sampler->LiveTable[Hole] = Sampler->LiveTable[Slot];
+            Hole = Slot;
+        }
+    }
+    Sampler->LiveTable[Hole].Address = 0;
+    Sampler->NumberOfLive -= 1;
+}
+
+static bool GrowLiveTable(PPH_SAMPLER Sampler)
+{
+    PPH_LIVE_SAMPLE OldTable = Sampler->LiveTable;
+    uint32_t OldMask = Sampler->LiveTableMask;
+    uint32_t Index;
+
+    Sampler->LiveTable = (PPH_LIVE_SAMPLE)calloc((size_t)OldMask * 2 + 2, sizeof(PH_LIVE_SAMPLE));
+    if (Sampler->LiveTable == NULL) {
+        Sampler->LiveTable = OldTable;
+        return false;
+    }
+    Sampler->LiveTableMask = OldMask * 2 + 1;
+    for (Index = 0; Index <= OldMask; ++Index) {
+        if (OldTable[Index].Address != 0) {
+            *FindLive(Sampler, OldTable[Index].Address) = OldTable[Index];
+        }
+    }
+    free(OldTable);
+    return true;
+}
+
+static void ChargeFree(PPH_SAMPLER Sampler, PPH_LIVE_SAMPLE Live)
+{
+    PPH_CALL_SITE Site = &Sampler->Sites[Live->SiteIndex];
+
+    Site->Frees += 1;
+    Site->FreedBytes += Live->Weight;
+    Sampler->Frees += 1;
+    RemoveLive(Sampler, Live);
+}
+
+static void Aggregate(PPH_SAMPLER Sampler, const PH_SAMPLE* Sample)
+{
+    PPH_LIVE_SAMPLE Live = FindLive(Sampler, Sample->Address);
+    uint32_t SiteIndex;
+
+    //
+    // For a free this is the expected case. For an allocation it means the
+    // free of the previous block at this address was dropped with the ring
+    // full: close that block out rather than count the address twice.
+    //
+    if (Live->Address != 0) {
+        ChargeFree(Sampler, Live);
+    }
+    if (Sample->Type == PH_SAMPLE_FREE) {
+        return;
+    }
+
+    SiteIndex = LookupSite(Sampler, Sample->Frames, Sample->Depth);
+    if (SiteIndex == UINT32_MAX) {
+        Sampler->Dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Sampler->Sites[SiteIndex].Samples += 1;
+    Sampler->Sites[SiteIndex].AllocatedBytes += Sample->Weight;
+    Sampler->Samples += 1;
+
+    if ((Sampler->NumberOfLive + 1) * 2 > Sampler->LiveTableMask && GrowLiveTable(Sampler) == false) {
+        return;
+    }
+    Live = FindLive(Sampler, Sample->Address);
+    Live->Address = Sample->Address;
+    Live->SiteIndex = SiteIndex;
+    Live->Weight = Sample->Weight;
+    Sampler->NumberOfLive += 1;
+}
+
+uint32_t PhSamplerDrain(PPH_SAMPLER Sampler)
+{
+    uint32_t Drained = 0;
+
+    PhLockAcquire(&Sampler->Lock);
+    for (;;) {
+        PPH_SAMPLE_SLOT Slot = &Sampler->Ring[Sampler->DequeuePosition & Sampler->RingMask];
+
+        if (Slot->Sequence.load(std::memory_order_acquire) != Sampler->DequeuePosition + 1) {
+            break;
+        }
+        Aggregate(Sampler, &Slot->Sample);
+        Slot->Sequence.store(Sampler->DequeuePosition + Sampler->RingMask + 1, std::memory_order_release);
+        Sampler->DequeuePosition += 1;
+        Drained += 1;
+    }
+    PhLockRelease(&Sampler->Lock);
+    return Drained;
+}
+
+void PhSamplerQueryStats(PPH_SAMPLER Sampler, PPH_SAMPLER_STATS Stats)
+{
+    uint32_t Index;
+
+    PhLockAcquire(&Sampler->Lock);
+    Stats->Samples = Sampler->Samples;
+    Stats->Frees = Sampler->Frees;
+    Stats->Dropped = Sampler->Dropped.load(std::memory_order_relaxed);
+    Stats->CallSites = Sampler->NumberOfSites;
+    Stats->LiveBytes = 0;
+    for (Index = 0; Index < Sampler->NumberOfSites; ++Index) {
+        Stats->LiveBytes += Sampler->Sites[Index].AllocatedBytes - Sampler->Sites[Index].FreedBytes;
+    }
+    PhLockRelease(&Sampler->Lock);
+}
+
+typedef struct _PH_SITE_ORDER {
+    uint64_t LiveBytes;
+    uint32_t SiteIndex;
+} PH_SITE_ORDER, *PPH_SITE_ORDER;
+
+static int CompareSiteOrder(const void* Left, const void* Right)
+{
+    const PH_SITE_ORDER* A = (const PH_SITE_ORDER*)Left;
+    const PH_SITE_ORDER* B = (const PH_SITE_ORDER*)Right;
+
+    if (A->LiveBytes != B->LiveBytes) {
+        return A->LiveBytes > B->LiveBytes ? -1 : 1;
+    }
+    return A->SiteIndex < B->SiteIndex ? -1 : A->SiteIndex > B->SiteIndex;
+}
+
+bool PhSamplerExport(PPH_SAMPLER Sampler, FILE* File, uint32_t Format)
+{
+    PPH_SITE_ORDER Order;
+    char Symbol[256];
+    uint32_t Index;
+    uint32_t Frame;
+
+    PhSamplerDrain(Sampler);
+
+    PhLockAcquire(&Sampler->Lock);
+    Order = (PPH_SITE_ORDER)malloc((Sampler->NumberOfSites + 1) * sizeof(*Order));
+    if (Order == NULL) {
+        PhLockRelease(&Sampler->Lock);
+        return false;
+    }
+    for (Index = 0; Index < Sampler->NumberOfSites; ++Index) {
+        Order[Index].LiveBytes = Sampler->Sites[Index].AllocatedBytes - Sampler->Sites[Index].FreedBytes;
+        Order[Index].SiteIndex = Index;
+    }
+    qsort(Order, Sampler->NumberOfSites, sizeof(*Order), CompareSiteOrder);
+
+    if (Format == PH_PROFILE_TEXT) {
+        fprintf(File, "# heap profile: 1 sample every %llu bytes on average, %llu samples, " \
+            "%llu frees, %llu dropped\n",
+            (unsigned long long)Sampler->SampleInterval,
+            (unsigned long long)Sampler->Samples,
+            (unsigned long long)Sampler->Frees,
+            (unsigned long long)Sampler->Dropped.load(std::memory_order_relaxed));
+        fprintf(File, "# %14s %16s %8s %8s  stack (innermost first)\n",
+            "live bytes", "allocated bytes", "samples", "frees");
+    }
+
+    for (Index = 0; Index < Sampler->NumberOfSites; ++Index) {
+        PPH_CALL_SITE Site = &Sampler->Sites[Order[Index].SiteIndex];
+
+        if (Format == PH_PROFILE_COLLAPSED) {
+            if (Order[Index].LiveBytes == 0) {
+                continue;
+            }
+
+            //
+            // Collapsed stacks list the outermost frame first.
+            //
+            for (Frame = Site->Depth; Frame-- != 0; ) {
+                PhOsFormatAddress(Site->Frames[Frame], Symbol, sizeof(Symbol));
+                fprintf(File, "%s%s", Symbol, Frame != 0 ? ";" : "");
+            }
+            fprintf(File, " %llu\n", (unsigned long long)Order[Index].LiveBytes);
+            continue;
+        }
+
+        fprintf(File, "  %14llu %16llu %8llu %8llu ",
+            (unsigned long long)Order[Index].LiveBytes,
+            (unsigned long long)Site->AllocatedBytes,
+            (unsigned long long)Site->Samples,
+            (unsigned long long)Site->Frees);
+        for (Frame = 0; Frame < Site->Depth; ++Frame) {
+            PhOsFormatAddress(Site->Frames[Frame], Symbol, sizeof(Symbol));
+            fprintf(File, " %s", Symbol);
+        }
+        fprintf(File, "\n");
+    }
+    PhLockRelease(&Sampler->Lock);
+
+    free(Order);
+    return ferror(File) == 0;
+}
@@ -0,0 +1,109 @@
+// heap-sampler.h : Sampling allocation profiler for the portable heap.
+//
+// Instead of tracing every allocation, each thread counts down the bytes it
+// allocates and records a stack trace when the count crosses zero. The next
+// countdown is drawn from an exponential distribution with mean
+// SampleInterval, so sampling is a Poisson process over allocated bytes: a
+// block of Size bytes is sampled with probability 1 - exp(-Size / Interval),
+// and weighting each sample by the inverse of that probability makes the
+// per-call-site totals unbiased estimates of the real byte counts.
+//
+// The fast path is a thread-local subtraction. Samples go through a bounded
+// lock-free ring so allocating threads never wait; when the ring is full the
+// sample is dropped and counted. PhSamplerDrain aggregates the ring into
+// per-call-site profiles: frees of sampled blocks are matched to their
+// allocation so the profile shows live bytes, i.e. which call sites drive the
+// heap's growth, not only which ones allocate the most.
+//
+
+#pragma once
+
+#include "heap-engine.h"
+
+#include <stdio.h>
+
+//
+// A sample costs a stack capture, so the interval sets the overhead. The
+// default keeps it under 2% in portable-heap --profile, with either stack
+// walker.
+//
+#define PH_SAMPLE_MAX_FRAMES            24
+#define PH_SAMPLER_DEFAULT_INTERVAL     (2 * 1024 * 1024)
+#define PH_SAMPLER_DEFAULT_CAPACITY     4096
+
+#define PH_SAMPLE_ALLOC                 1
+#define PH_SAMPLE_FREE                  2
+
+#define PH_PROFILE_TEXT                 0
+#define PH_PROFILE_COLLAPSED            1
+
+typedef struct _PH_SAMPLE {
+    uint64_t Timestamp;
+    uintptr_t Address;
+    uint64_t Size;
+    uint64_t Weight;
+    uint32_t Type;
+    uint32_t Depth;
+    void* Frames[PH_SAMPLE_MAX_FRAMES];
+} PH_SAMPLE, *PPH_SAMPLE;
+
+typedef struct _PH_SAMPLER_STATS {
+    uint64_t Samples;
+    uint64_t Frees;
+    uint64_t Dropped;
+    uint64_t CallSites;
+    uint64_t LiveBytes;
+} PH_SAMPLER_STATS, *PPH_SAMPLER_STATS;
+
+//
+// RingCapacity is rounded up to a power of two.
+//
+PPH_SAMPLER PhSamplerCreate(size_t SampleInterval, uint32_t RingCapacity);
+void PhSamplerDestroy(PPH_SAMPLER Sampler);
+
+//
+// GCC and Clang read an extern thread_local through a call to a wrapper, in
+// case its definition needs dynamic initialization; __thread rules that out
+// and keeps the countdown a plain TLS access.
+//
+#ifdef _MSC_VER
+#define PH_SAMPLER_THREAD_LOCAL         thread_local
+#else
+#define PH_SAMPLER_THREAD_LOCAL         __thread
+#endif
+
+extern PH_SAMPLER_THREAD_LOCAL int64_t PhSamplerBytesUntilSample;
+
+bool PhSamplerPickNext(PPH_SAMPLER Sampler, size_t Bytes);
+
+//
+// Called by the heap for every allocation, before taking the heap lock.
+//
+inline bool PhSamplerShouldSample(PPH_SAMPLER Sampler, size_t Bytes)
+{
+    PhSamplerBytesUntilSample -= (int64_t)Bytes;
+    return PhSamplerBytesUntilSample < 0 && PhSamplerPickNext(Sampler, Bytes);
+}
+
+//
+// Called by the heap, outside its lock, for sampled blocks only.
+//
+void PhSamplerRecordAlloc(PPH_SAMPLER Sampler, void* Address, size_t Size);
+void PhSamplerRecordFree(PPH_SAMPLER Sampler, void* Address);
+
+//
+// Moves pending samples from the ring into the call-site profiles and
+// returns how many were consumed. Any thread may call it; concurrent callers
+// are serialized.
+//
+uint32_t PhSamplerDrain(PPH_SAMPLER Sampler);
+
+void PhSamplerQueryStats(PPH_SAMPLER Sampler, PPH_SAMPLER_STATS Stats);
+
+//
+// Drains, then writes the call sites ordered by live bytes. PH_PROFILE_TEXT
+// is one line per call site with its counters and symbolized frames;
+// PH_PROFILE_COLLAPSED is the "frame;frame;frame bytes" format that
+// flamegraph.pl and speedscope read, weighted by live bytes.
+//
+bool PhSamplerExport(PPH_SAMPLER Sampler, FILE* File, uint32_t Format);
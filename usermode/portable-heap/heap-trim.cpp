@@ -0,0 +1,396 @@
+// heap-trim.cpp : Giving idle free pages back to the OS.
+//
+// Every segment keeps a bitmap with one bit per page of its reserve. A trim
+// pass walks the blocks of each segment under the heap lock, coalescing
+// neighbours first when the heap defers that, and decommits the pages that
+// lie entirely inside free runs which have not changed for a few passes.
+// The page holding a free block's header and list links always stays
+// committed, so the free lists and the walk never touch a decommitted page.
+// Allocations carved out of such a run commit the pages they cover first.
+//
+
+#include "heap-internal.h"
+
+#include <atomic>
+#include <new>
+
+struct _PH_TRIMMER {
+    PPH_HEAP Heap;
+    PH_TRIM_POLICY Policy;
+    PH_THREAD Thread;
+    std::atomic<bool> Stop;
+};
+
+#define PH_TRIMMER_SLICE    50  // milliseconds between checks for Stop
+
+static const PH_TRIM_POLICY DefaultPolicy = {
+    PH_TRIM_DEFAULT_INTERVAL,
+    PH_TRIM_DEFAULT_IDLE_PASSES,
+    PH_TRIM_DEFAULT_DECOMMIT_SIZE,
+    0,
+};
+
+static bool TestPage(PPH_SEGMENT Segment, size_t Page)
+{
+    return (Segment->CommitBitmap[Page / 32] & (1u << (Page % 32))) != 0;
+}
+
+static void SetPages(PPH_SEGMENT Segment, size_t Page, size_t Count, bool Committed)
+{
+    for (; Count != 0; ++Page, --Count) {
+        if (Committed) {
+            Segment->CommitBitmap[Page / 32] |= 1u << (Page % 32);
+        }
+        else {
+            Segment->CommitBitmap[Page / 32] &= ~(1u << (Page % 32));
+        }
+    }
+}
+
+size_t PhpCommitBitmapSize(size_t ReservedSize)
+{
+    size_t Pages = (ReservedSize + PhOsPageSize() - 1) / PhOsPageSize();
+
+    return ROUND_UP((Pages + 31) / 32 * sizeof(uint32_t), PH_GRANULARITY);
+}
+
+void PhpMarkCommitted(PPH_SEGMENT Segment, size_t Offset, size_t Size)
+{
+    size_t PageSize = PhOsPageSize();
+
+    SetPages(Segment, Offset / PageSize, (Size + PageSize - 1) / PageSize, true);
+}
+
+//
+// Commits every decommitted page a block of Size granules at Entry will use,
+// including the header of the tail SplitEntry is about to write. Committing
+// only makes the pages accessible again; each still faults on first use, so
+// the pages are touched here, and the stats time the faults along with the
+// commit. They read as zero, so writing a zero changes nothing.
+//
+bool PhpRecommitEntry(PPH_HEAP Heap, PPH_ENTRY Entry, uint32_t Size)
+{
+    PPH_SEGMENT Segment = Heap->Segments[Entry->SegmentIndex];
+    size_t PageSize = PhOsPageSize();
+    size_t Offset = (uint8_t*)Entry - Segment->BaseAddress;
+    size_t End = Offset + (size_t)Size * PH_GRANULARITY + sizeof(PH_FREE_ENTRY);
+    size_t BlockEnd = Offset + (size_t)Entry->Size * PH_GRANULARITY;
+    size_t Page;
+    size_t LastPage;
+    size_t Index;
+    size_t Recommitted = 0;
+    uint64_t Start;
+    uint64_t Elapsed;
+
+    if (End > BlockEnd) {
+        End = BlockEnd;
+    }
+    Start = PhOsTimestamp();
+    LastPage = (End + PageSize - 1) / PageSize;
+    for (Page = Offset / PageSize; Page < LastPage; ) {
+        size_t Run = 0;
+
+        if (TestPage(Segment, Page)) {
+            ++Page;
+            continue;
+        }
+        while (Page + Run < LastPage && TestPage(Segment, Page + Run) == false) {
+            ++Run;
+        }
+        if (PhOsCommit(Segment->BaseAddress + Page * PageSize, Run * PageSize) == false) {
+            return false;
+        }
+        for (Index = 0; Index < Run; ++Index) {
+            *(volatile uint8_t*)(Segment->BaseAddress + (Page + Index) * PageSize) = 0;
+        }
+        SetPages(Segment, Page, Run, true);
+        Segment->DecommittedBytes -= Run * PageSize;
+        Recommitted += Run * PageSize;
+        Page += Run;
+    }
+    if (Recommitted == 0) {
+        return true;
+    }
+
+    Elapsed = PhOsTimestamp() - Start;
+    Heap->TrimStats.Recommits += 1;
+    Heap->TrimStats.RecommittedBytes += Recommitted;
+    Heap->TrimStats.RecommitNanoseconds += Elapsed;
+    if (Elapsed > Heap->TrimStats.MaximumRecommitNanoseconds) {
+        Heap->TrimStats.MaximumRecommitNanoseconds = Elapsed;
+    }
+    return true;
+}
+
+//
+// Decommits the committed pages strictly inside a free block, up to Budget
+// bytes, and returns how many bytes that was.
+//
+static size_t DecommitEntry(PPH_SEGMENT Segment, PPH_ENTRY Entry, size_t Budget)
+{
+    size_t PageSize = PhOsPageSize();
+    size_t Offset = (uint8_t*)Entry - Segment->BaseAddress;
+    size_t Page = ROUND_UP(Offset + sizeof(PH_FREE_ENTRY), PageSize) / PageSize;
+    size_t LastPage = ROUND_DOWN(Offset + (size_t)Entry->Size * PH_GRANULARITY, PageSize) / PageSize;
+    size_t Decommitted = 0;
+
+    while (Page < LastPage && Decommitted < Budget) {
+        size_t Run = 0;
+
+        if (TestPage(Segment, Page) == false) {
+            ++Page;
+            continue;
+        }
+        while (Page + Run < LastPage && TestPage(Segment, Page + Run) &&
+            Decommitted + (Run + 1) * PageSize <= Budget) {
+            ++Run;
+        }
+        if (Run == 0) {
+            break;
+        }
+        PhOsDecommit(Segment->BaseAddress + Page * PageSize, Run * PageSize);
+        SetPages(Segment, Page, Run, false);
+        Segment->DecommittedBytes += Run * PageSize;
+        Decommitted += Run * PageSize;
+        Page += Run;
+    }
+    if (Decommitted != 0) {
+        Entry->Flags |= PH_ENTRY_DECOMMITTED;
+    }
+    return Decommitted;
+}
+
+//
+// Merges every run of adjacent free blocks in a segment into one block.
+//
+static uint32_t CoalesceSegment(PPH_HEAP Heap, PPH_SEGMENT Segment)
+{
+    PPH_ENTRY Entry = Segment->FirstEntry;
+    uint32_t Merged = 0;
+
+    for (;;) {
+        if ((Entry->Flags & (PH_ENTRY_BUSY | PH_ENTRY_LAST)) == 0 &&
+            (NextEntry(Entry)->Flags & PH_ENTRY_BUSY) == 0) {
+            RemoveFreeEntry(Heap, Entry);
+            do {
+                PPH_ENTRY Next = NextEntry(Entry);
+
+                RemoveFreeEntry(Heap, Next);
+                MergeFreeEntries(Heap, Entry, Next);
+                ++Merged;
+            } while ((Entry->Flags & PH_ENTRY_LAST) == 0 && (NextEntry(Entry)->Flags & PH_ENTRY_BUSY) == 0);
+            InsertFreeEntry(Heap, Entry);
+        }
+        if ((Entry->Flags & PH_ENTRY_LAST) != 0) {
+            break;
+        }
+        Entry = NextEntry(Entry);
+    }
+    return Merged;
+}
+
+uint32_t PhpCoalesceHeap(PPH_HEAP Heap)
+{
+    uint32_t Merged = 0;
+    uint32_t Index;
+
+    for (Index = 0; Index < Heap->NumberOfSegments; ++Index) {
+        Merged += CoalesceSegment(Heap, Heap->Segments[Index]);
+    }
+    Heap->TrimStats.CoalescedBlocks += Merged;
+    return Merged;
+}
+
+size_t PhHeapTrim(PPH_HEAP Heap, const PH_TRIM_POLICY* Policy)
+{
+    size_t Minimum;
+    size_t Budget;
+    size_t Decommitted = 0;
+    uint64_t Start;
+    uint32_t Index;
+
+    if (Heap->NumberOfArenas != 0) {
+        for (Index = 0; Index < Heap->NumberOfArenas; ++Index) {
+            Decommitted += PhHeapTrim(Heap->Arenas[Index], Policy);
+        }
+        return Decommitted;
+    }
+
+    if (Policy == NULL) {
+        Policy = &DefaultPolicy;
+    }
+    Minimum = Policy->MinimumDecommitSize > PhOsPageSize() ? Policy->MinimumDecommitSize : PhOsPageSize();
+    Budget = Policy->MaximumDecommitPerPass != 0 ? Policy->MaximumDecommitPerPass : SIZE_MAX;
+
+    if ((Heap->Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockAcquire(&Heap->Lock);
+    }
+    Start = PhOsTimestamp();
+    PhpDrainRemoteFrees(Heap);
+    if ((Heap->Flags & HEAP_DISABLE_COALESCE_ON_FREE) != 0) {
+        PhpCoalesceHeap(Heap);
+    }
+
+    //
+    // Blocks freed during the previous pass carry the old epoch, so a run
+    // has to sit through MinimumIdlePasses whole intervals to qualify.
+    //
+    Heap->TrimEpoch += 1;
+    for (Index = 0; Index < Heap->NumberOfSegments && Decommitted < Budget; ++Index) {
+        PPH_SEGMENT Segment = Heap->Segments[Index];
+        PPH_ENTRY Entry = Segment->FirstEntry;
+
+        for (;;) {
+            if ((Entry->Flags & PH_ENTRY_BUSY) == 0 &&
+                (size_t)Entry->Size * PH_GRANULARITY >= Minimum &&
+                Heap->TrimEpoch - Entry->FreeEpoch >= Policy->MinimumIdlePasses) {
+                size_t Bytes = DecommitEntry(Segment, Entry, Budget - Decommitted);
+
+                if (Bytes != 0) {
+                    Decommitted += Bytes;
+                    Heap->TrimStats.DecommittedRanges += 1;
+                }
+            }
+            if ((Entry->Flags & PH_ENTRY_LAST) != 0 || Decommitted >= Budget) {
+                break;
+            }
+            Entry = NextEntry(Entry);
+        }
+    }
+    Heap->TrimStats.Passes += 1;
+    Heap->TrimStats.DecommittedBytes += Decommitted;
+    Heap->TrimStats.PassNanoseconds += PhOsTimestamp() - Start;
+    if ((Heap->Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockRelease(&Heap->Lock);
+    }
+    return Decommitted;
+}
+
+static void TrimmerThread(void* Context)
+{
+    PPH_TRIMMER Trimmer = (PPH_TRIMMER)Context;
+
+    while (Trimmer->Stop.load(std::memory_order_acquire) == false) {
+        uint32_t Slept = 0;
+
+        while (Slept < Trimmer->Policy.IntervalMilliseconds &&
+            Trimmer->Stop.load(std::memory_order_acquire) == false) {
+            uint32_t Slice = Trimmer->Policy.IntervalMilliseconds - Slept;
+
+            Slice = Slice < PH_TRIMMER_SLICE ? Slice : PH_TRIMMER_SLICE;
+            PhOsSleep(Slice);
+            Slept += Slice;
+        }
+        if (Trimmer->Stop.load(std::memory_order_acquire) == false) {
+            PhHeapTrim(Trimmer->Heap, &Trimmer->Policy);
+        }
+    }
+}
+
+bool PhHeapStartTrimmer(PPH_HEAP Heap, const PH_TRIM_POLICY* Policy)
+{
+    PPH_TRIMMER Trimmer;
+    uint32_t Index;
+
+    //
+    // Each arena of a per-node heap gets its own trimmer.
+    //
+    if (Heap->NumberOfArenas != 0) {
+        for (Index = 0; Index < Heap->NumberOfArenas; ++Index) {
+            if (PhHeapStartTrimmer(Heap->Arenas[Index], Policy) == false) {
+                PhHeapStopTrimmer(Heap);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //
+    // A background thread needs the heap lock to be taken by everyone else.
+    //
+    if (Heap->Trimmer != NULL || (Heap->Flags & HEAP_NO_SERIALIZE) != 0) {
+        PhpSetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    Trimmer = new (std::nothrow) PH_TRIMMER();
+    if (Trimmer == NULL) {
+        PhpSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+    Trimmer->Heap = Heap;
+    Trimmer->Policy = Policy != NULL ? *Policy : DefaultPolicy;
+    if (Trimmer->Policy.IntervalMilliseconds == 0) {
+        Trimmer->Policy.IntervalMilliseconds = PH_TRIM_DEFAULT_INTERVAL;
+    }
+    Trimmer->Stop.store(false, std::memory_order_relaxed);
+    if (PhOsCreateThread(&Trimmer->Thread, TrimmerThread, Trimmer) == false) {
+        PhpSetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        delete Trimmer;
+        return false;
+    }
+    Heap->Trimmer = Trimmer;
+    return true;
+}
+
+void PhpStopTrimmer(PPH_HEAP Heap)
+{
+    PPH_TRIMMER Trimmer = Heap->Trimmer;
+
+    if (Trimmer == NULL) {
+        return;
+    }
+    Trimmer->Stop.store(true, std::memory_order_release);
+    PhOsJoinThread(&Trimmer->Thread);
+    Heap->Trimmer = NULL;
+    delete Trimmer;
+}
+
+void PhHeapStopTrimmer(PPH_HEAP Heap)
+{
+    uint32_t Index;
+
+    for (Index = 0; Index < Heap->NumberOfArenas; ++Index) {
+        PhpStopTrimmer(Heap->Arenas[Index]);
+    }
+    PhpStopTrimmer(Heap);
+}
+
+void PhHeapQueryTrimStats(PPH_HEAP Heap, PPH_HEAP_TRIM_STATS Stats)
+{
+    uint32_t Index;
+
+    if (Heap->NumberOfArenas != 0) {
+        memset(Stats, 0, sizeof(*Stats));
+        for (Index = 0; Index < Heap->NumberOfArenas; ++Index) {
+            PH_HEAP_TRIM_STATS Arena;
+
+            PhHeapQueryTrimStats(Heap->Arenas[Index], &Arena);
+            Stats->Passes += Arena.Passes;
+            Stats->PassNanoseconds += Arena.PassNanoseconds;
+            Stats->CoalescedBlocks += Arena.CoalescedBlocks;
+            Stats->DecommittedBytes += Arena.DecommittedBytes;
+            Stats->DecommittedRanges += Arena.DecommittedRanges;
+            Stats->RecommittedBytes += Arena.RecommittedBytes;
+            Stats->Recommits += Arena.Recommits;
+            Stats->RecommitNanoseconds += Arena.RecommitNanoseconds;
+            if (Arena.MaximumRecommitNanoseconds > Stats->MaximumRecommitNanoseconds) {
+                Stats->MaximumRecommitNanoseconds = Arena.MaximumRecommitNanoseconds;
+            }
+            Stats->CurrentDecommittedBytes += Arena.CurrentDecommittedBytes;
+        }
+        return;
+    }
+
+    if ((Heap->Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockAcquire(&Heap->Lock);
+    }
+    *Stats = Heap->TrimStats;
+    Stats->CurrentDecommittedBytes = 0;
+    for (Index = 0; Index < Heap->NumberOfSegments; ++Index) {
+        Stats->CurrentDecommittedBytes += Heap->Segments[Index]->DecommittedBytes;
+    }
+    if ((Heap->Flags & HEAP_NO_SERIALIZE) == 0) {
+        PhLockRelease(&Heap->Lock);
+    }
+}
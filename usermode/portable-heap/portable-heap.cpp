@@ -0,0 +1,566 @@
+// portable-heap.cpp : This file contains the 'main' function. Program execution begins and ends there.
+//
+// The enumerate-heap sample, run against the portable heap engine instead of
+// HeapCreate / HeapWalk, so it behaves the same on Windows and Linux.
+//
+// With --profile the heap gets a sampling profiler attached: a workload
+// allocates from a few call sites, one of which leaks, and the aggregated
+// profile shows which call site the live bytes come from. The run ends by
+// timing the same allocation loop with and without the sampler to check its
+// overhead.
+//
+// With --trim a load peak fills the heap and then goes away; a background
+// trimmer hands the idle pages back, and the run shows the committed and
+// resident bytes before and after, then what it costs to commit them again.
+//
+// With --numa the heap keeps an arena per NUMA node. Worker threads allocate
+// from their own node and free what their neighbour allocated, and the walk
+// breaks the heap down by node.
+//
+// Outside Visual Studio:
+//   g++ -O2 -fno-omit-frame-pointer -DPH_FRAME_POINTER_STACKS -rdynamic -o portable-heap *.cpp
+// (-rdynamic lets dladdr name the functions in the profile, and frame
+// pointers make their stacks cheap to capture, see PhOsCaptureStack).
+//
+
+#include "heap-sampler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
+static int WalkHeap(PPH_HEAP hHeap)
+{
+    PH_HEAP_ENTRY Entry;
+
+    //
+    // Lock the heap to prevent other threads from accessing the heap
+    // during enumeration.
+    //
+    if (PhHeapLock(hHeap) == false) {
+        printf("Failed to lock heap with LastError %u.\n", PhGetLastError());
+        return 1;
+    }
+
+    printf("Walking heap %p...\n\n", (void*)hHeap);
+
+    Entry.lpData = NULL;
+    while (PhHeapWalk(hHeap, &Entry) != false) {
+        if ((Entry.wFlags & PROCESS_HEAP_ENTRY_BUSY) != 0) {
+            printf("Allocated block");
+
+            if ((Entry.wFlags & PROCESS_HEAP_ENTRY_MOVEABLE) != 0) {
+                printf(", movable with HANDLE %p", Entry.Block.hMem);
+            }
+
+            if ((Entry.wFlags & PROCESS_HEAP_ENTRY_DDESHARE) != 0) {
+                printf(", DDESHARE");
+            }
+        }
+        else if ((Entry.wFlags & PROCESS_HEAP_REGION) != 0) {
+            printf("Region\n  %zu bytes committed\n" \
+                "  %zu bytes uncommitted\n  First block address: %p\n" \
+                "  Last block address: %p\n",
+                Entry.Region.dwCommittedSize,
+                Entry.Region.dwUnCommittedSize,
+                Entry.Region.lpFirstBlock,
+                Entry.Region.lpLastBlock);
+        }
+        else if ((Entry.wFlags & PROCESS_HEAP_UNCOMMITTED_RANGE) != 0) {
+            printf("Uncommitted range\n");
+        }
+        else {
+            printf("Block\n");
+        }
+
+        printf("  Data portion begins at: %p\n  Size: %zu bytes\n" \
+            "  Overhead: %u bytes\n  Region index: %u\n\n",
+            Entry.lpData,
+            Entry.cbData,
+            Entry.cbOverhead,
+            Entry.iRegionIndex);
+    }
+    if (PhGetLastError() != ERROR_NO_MORE_ITEMS) {
+        printf("HeapWalk failed with LastError %u.\n", PhGetLastError());
+    }
+
+    if (PhHeapUnlock(hHeap) == false) {
+        printf("Failed to unlock heap with LastError %u.\n", PhGetLastError());
+    }
+    return 0;
+}
+
+//
+// Three call sites with distinct stacks: short-lived buffers, a cache that
+// keeps a bounded number of entries, and a registry that never frees. They
+// are not static so that dladdr can name them, and touch the block after
+// allocating it so the compiler cannot turn the call into a tail call and
+// drop their frame.
+//
+NOINLINE void* AllocateScratch(PPH_HEAP hHeap, size_t Size)
+{
+    char* Scratch = (char*)PhHeapAlloc(hHeap, 0, Size);
+
+    if (Scratch != NULL) {
+        Scratch[0] = 0;
+    }
+    return Scratch;
+}
+
+NOINLINE void* AllocateCacheEntry(PPH_HEAP hHeap, size_t Size)
+{
+    char* Entry = (char*)PhHeapAlloc(hHeap, 0, Size);
+
+    if (Entry != NULL) {
+        memset(Entry, 0, Size);
+    }
+    return Entry;
+}
+
+NOINLINE void* AllocateRegistryEntry(PPH_HEAP hHeap, size_t Size)
+{
+    char* Entry = (char*)PhHeapAlloc(hHeap, 0, Size);
+
+    if (Entry != NULL) {
+        memset(Entry, 0, Size);
+    }
+    return Entry;
+}
+
+#define CACHE_ENTRIES 512
+
+static void RunWorkload(PPH_HEAP hHeap, uint32_t Iterations)
+{
+    void* Cache[CACHE_ENTRIES];
+    uint32_t Index;
+
+    memset(Cache, 0, sizeof(Cache));
+    for (Index = 0; Index < Iterations; ++Index) {
+        void* Scratch = AllocateScratch(hHeap, 64 + (Index % 16) * 32);
+
+        PhHeapFree(hHeap, 0, Scratch);
+
+        PhHeapFree(hHeap, 0, Cache[Index % CACHE_ENTRIES]);
+        Cache[Index % CACHE_ENTRIES] = AllocateCacheEntry(hHeap, 256);
+
+        if (Index % 8 == 0) {
+            AllocateRegistryEntry(hHeap, 48);
+        }
+    }
+    for (Index = 0; Index < CACHE_ENTRIES; ++Index) {
+        PhHeapFree(hHeap, 0, Cache[Index]);
+    }
+}
+
+//
+// Allocation loop used to measure the sampler overhead: random sizes up to
+// 1KB with a sliding window of live blocks.
+//
+static double TimeAllocations(PPH_HEAP hHeap, uint32_t Iterations)
+{
+    void* Window[1024];
+    uint64_t Start;
+    uint32_t Random = 1;
+    uint32_t Index;
+
+    memset(Window, 0, sizeof(Window));
+    Start = PhOsTimestamp();
+    for (Index = 0; Index < Iterations; ++Index) {
+        Random = Random * 1664525 + 1013904223;
+        PhHeapFree(hHeap, 0, Window[Index % 1024]);
+        Window[Index % 1024] = PhHeapAlloc(hHeap, 0, 16 + (Random >> 22));
+    }
+    for (Index = 0; Index < 1024; ++Index) {
+        PhHeapFree(hHeap, 0, Window[Index]);
+    }
+    return (double)(PhOsTimestamp() - Start) / 1e9;
+}
+
+#define OVERHEAD_ROUNDS 101
+#define OVERHEAD_ALLOCATIONS 200000
+
+static int CompareDoubles(const void* Left, const void* Right)
+{
+    double A = *(const double*)Left;
+    double B = *(const double*)Right;
+
+    return A < B ? -1 : A > B;
+}
+
+static void PrintCommitted(PPH_HEAP hHeap, const char* Label)
+{
+    PH_HEAP_ENTRY Entry;
+    size_t Committed = 0;
+
+    PhHeapLock(hHeap);
+    Entry.lpData = NULL;
+    while (PhHeapWalk(hHeap, &Entry) != false) {
+        if ((Entry.wFlags & PROCESS_HEAP_REGION) != 0) {
+            Committed += Entry.Region.dwCommittedSize;
+        }
+    }
+    PhHeapUnlock(hHeap);
+
+    printf("%-22s %8zu KB committed in regions, %8zu KB resident\n",
+        Label, Committed / 1024, PhOsResidentBytes() / 1024);
+}
+
+#define PEAK_BLOCKS 16384
+#define PEAK_BLOCK_SIZE 4000
+
+static int Trim(uint32_t Options)
+{
+    PH_TRIM_POLICY Policy;
+    PH_HEAP_TRIM_STATS Stats;
+    PPH_HEAP hHeap;
+    void** Blocks;
+    uint32_t Index;
+
+    hHeap = PhHeapCreate(Options, 0, 0);
+    Blocks = (void**)calloc(PEAK_BLOCKS, sizeof(void*));
+    if (hHeap == NULL || Blocks == NULL) {
+        printf("Failed to create the heap.\n");
+        return 1;
+    }
+
+    //
+    // The peak: 64MB of small blocks, every one of them touched. Keeping
+    // every 64th block alive afterwards leaves the free space fragmented the
+    // way a real service would.
+    //
+    for (Index = 0; Index < PEAK_BLOCKS; ++Index) {
+        Blocks[Index] = PhHeapAlloc(hHeap, 0, PEAK_BLOCK_SIZE);
+        if (Blocks[Index] != NULL) {
+            memset(Blocks[Index], 0xab, PEAK_BLOCK_SIZE);
+        }
+    }
+    PrintCommitted(hHeap, "At the peak:");
+    for (Index = 0; Index < PEAK_BLOCKS; ++Index) {
+        if (Index % 64 != 0) {
+            PhHeapFree(hHeap, 0, Blocks[Index]);
+            Blocks[Index] = NULL;
+        }
+    }
+    PrintCommitted(hHeap, "After the peak:");
+
+    Policy.IntervalMilliseconds = 100;
+    Policy.MinimumIdlePasses = 2;
+    Policy.MinimumDecommitSize = PH_TRIM_DEFAULT_DECOMMIT_SIZE;
+    Policy.MaximumDecommitPerPass = 0;
+    if (PhHeapStartTrimmer(hHeap, &Policy) == false) {
+        printf("Failed to start the trimmer with LastError %u.\n", PhGetLastError());
+        return 1;
+    }
+    PhOsSleep(500);
+    PhHeapStopTrimmer(hHeap);
+    PrintCommitted(hHeap, "After trimming:");
+
+    PhHeapQueryTrimStats(hHeap, &Stats);
+    printf("\n%llu passes, %.1f us per pass, %llu blocks coalesced, %llu KB decommitted in %llu ranges\n",
+        (unsigned long long)Stats.Passes,
+        Stats.Passes != 0 ? (double)Stats.PassNanoseconds / Stats.Passes / 1e3 : 0.0,
+        (unsigned long long)Stats.CoalescedBlocks,
+        (unsigned long long)Stats.DecommittedBytes / 1024,
+        (unsigned long long)Stats.DecommittedRanges);
+
+    //
+    // The next peak pays for the pages it gets back.
+    //
+    for (Index = 0; Index < PEAK_BLOCKS; ++Index) {
+        if (Blocks[Index] == NULL) {
+            Blocks[Index] = PhHeapAlloc(hHeap, 0, PEAK_BLOCK_SIZE);
+            if (Blocks[Index] != NULL) {
+                memset(Blocks[Index], 0xcd, PEAK_BLOCK_SIZE);
+            }
+        }
+    }
+    PrintCommitted(hHeap, "\nAt the next peak:");
+
+    PhHeapQueryTrimStats(hHeap, &Stats);
+    printf("\n%llu recommits, %llu KB, %.2f us on average, %.2f us at most, %llu KB still decommitted\n",
+        (unsigned long long)Stats.Recommits,
+        (unsigned long long)Stats.RecommittedBytes / 1024,
+        Stats.Recommits != 0 ? (double)Stats.RecommitNanoseconds / Stats.Recommits / 1e3 : 0.0,
+        (double)Stats.MaximumRecommitNanoseconds / 1e3,
+        (unsigned long long)Stats.CurrentDecommittedBytes / 1024);
+
+    free(Blocks);
+    PhHeapDestroy(hHeap);
+    return 0;
+}
+
+#define NUMA_BLOCKS 20000
+
+typedef struct _NUMA_WORKER {
+    PPH_HEAP hHeap;
+    void** Allocated;
+    void** ToFree;
+    uint32_t Seed;
+} NUMA_WORKER, *PNUMA_WORKER;
+
+static void AllocateBlocks(void* Context)
+{
+    PNUMA_WORKER Worker = (PNUMA_WORKER)Context;
+    uint32_t Random = Worker->Seed;
+    uint32_t Index;
+
+    for (Index = 0; Index < NUMA_BLOCKS; ++Index) {
+        Random = Random * 1664525 + 1013904223;
+        Worker->Allocated[Index] = PhHeapAlloc(Worker->hHeap, 0, 16 + (Random >> 22));
+    }
+}
+
+//
+// Keeps every fourth block so the walk has live memory to attribute.
+//
+static void FreeNeighbourBlocks(void* Context)
+{
+    PNUMA_WORKER Worker = (PNUMA_WORKER)Context;
+    uint32_t Index;
+
+    for (Index = 0; Index < NUMA_BLOCKS; ++Index) {
+        if (Index % 4 != 0) {
+            PhHeapFree(Worker->hHeap, 0, Worker->ToFree[Index]);
+            Worker->ToFree[Index] = NULL;
+        }
+    }
+}
+
+static bool RunWorkers(PNUMA_WORKER Workers, uint32_t NumberOfWorkers, PPH_THREAD_ROUTINE Routine)
+{
+    PH_THREAD Threads[64];
+    uint32_t Index;
+
+    for (Index = 0; Index < NumberOfWorkers; ++Index) {
+        if (PhOsCreateThread(&Threads[Index], Routine, &Workers[Index]) == false) {
+            break;
+        }
+    }
+    for (uint32_t Started = Index; Started-- != 0; ) {
+        PhOsJoinThread(&Threads[Started]);
+    }
+    return Index == NumberOfWorkers;
+}
+
+typedef struct _NODE_USAGE {
+    uint32_t Regions;
+    size_t Committed;
+    size_t BusyBlocks;
+    size_t BusyBytes;
+    size_t FreeBytes;
+} NODE_USAGE, *PNODE_USAGE;
+
+static int Numa()
+{
+    NODE_USAGE Usage[PH_MAXIMUM_NODES];
+    NUMA_WORKER Workers[16];
+    PH_HEAP_ENTRY Entry;
+    PH_NODE_STATS Stats;
+    uint32_t NumberOfWorkers;
+    uint32_t Node;
+    uint32_t Index;
+    PPH_HEAP hHeap;
+
+    hHeap = PhHeapCreate(PH_HEAP_PER_NODE_ARENAS, 0, 0);
+    if (hHeap == NULL) {
+        printf("Failed to create a per-node heap with LastError %u.\n", PhGetLastError());
+        return 1;
+    }
+    NumberOfWorkers = PhHeapNumberOfNodes(hHeap) * 4;
+    NumberOfWorkers = NumberOfWorkers < 16 ? NumberOfWorkers : 16;
+    printf("%u NUMA node(s), %u workers\n\n", PhHeapNumberOfNodes(hHeap), NumberOfWorkers);
+
+    for (Index = 0; Index < NumberOfWorkers; ++Index) {
+        Workers[Index].hHeap = hHeap;
+        Workers[Index].Allocated = (void**)calloc(NUMA_BLOCKS, sizeof(void*));
+        Workers[Index].Seed = Index + 1;
+        if (Workers[Index].Allocated == NULL) {
+            printf("Out of memory.\n");
+            return 1;
+        }
+    }
+    for (Index = 0; Index < NumberOfWorkers; ++Index) {
+        Workers[Index].ToFree = Workers[(Index + 1) % NumberOfWorkers].Allocated;
+    }
+    if (RunWorkers(Workers, NumberOfWorkers, AllocateBlocks) == false ||
+        RunWorkers(Workers, NumberOfWorkers, FreeNeighbourBlocks) == false) {
+        printf("Failed to start the workers.\n");
+        return 1;
+    }
+
+    memset(Usage, 0, sizeof(Usage));
+    PhHeapLock(hHeap);
+    Entry.lpData = NULL;
+    while (PhHeapWalk(hHeap, &Entry) != false) {
+        PNODE_USAGE NodeUsage = &Usage[Entry.dwNode];
+
+        if ((Entry.wFlags & PROCESS_HEAP_REGION) != 0) {
+            NodeUsage->Regions += 1;
+            NodeUsage->Committed += Entry.Region.dwCommittedSize;
+        }
+        else if ((Entry.wFlags & PROCESS_HEAP_ENTRY_BUSY) != 0) {
+            NodeUsage->BusyBlocks += 1;
+            NodeUsage->BusyBytes += Entry.cbData;
+        }
+        else if ((Entry.wFlags & PROCESS_HEAP_UNCOMMITTED_RANGE) == 0) {
+            NodeUsage->FreeBytes += Entry.cbData;
+        }
+    }
+    PhHeapUnlock(hHeap);
+
+    printf("Node  Regions  Committed KB  Busy blocks   Busy KB   Free KB  Allocations  Local frees  " \
+        "Remote frees  Batches\n");
+    for (Node = 0; Node < PhHeapNumberOfNodes(hHeap); ++Node) {
+        PhHeapQueryNodeStats(hHeap, Node, &Stats);
+        printf("%4u  %7u  %12zu  %11zu  %8zu  %8zu  %11llu  %11llu  %12llu  %7llu\n",
+            Node,
+            Usage[Node].Regions,
+            Usage[Node].Committed / 1024,
+            Usage[Node].BusyBlocks,
+            Usage[Node].BusyBytes / 1024,
+            Usage[Node].FreeBytes / 1024,
+            (unsigned long long)Stats.Allocations,
+            (unsigned long long)Stats.LocalFrees,
+            (unsigned long long)Stats.RemoteFrees,
+            (unsigned long long)Stats.RemoteBatches);
+    }
+
+    for (Index = 0; Index < NumberOfWorkers; ++Index) {
+        free(Workers[Index].Allocated);
+    }
+    PhHeapDestroy(hHeap);
+    return 0;
+}
+
+static int Profile(size_t SampleInterval, const char* CollapsedName)
+{
+    PPH_SAMPLER Sampler;
+    PH_SAMPLER_STATS Stats;
+    PPH_HEAP hHeap;
+    double Baselines[OVERHEAD_ROUNDS];
+    double Ratios[OVERHEAD_ROUNDS];
+    uint32_t Round;
+
+    Sampler = PhSamplerCreate(SampleInterval, PH_SAMPLER_DEFAULT_CAPACITY);
+    hHeap = PhHeapCreate(0, 0, 0);
+    if (Sampler == NULL || hHeap == NULL) {
+        printf("Failed to create the heap and its sampler.\n");
+        return 1;
+    }
+
+    PhHeapSetSampler(hHeap, Sampler);
+    for (Round = 0; Round < 20; ++Round) {
+        RunWorkload(hHeap, 100000);
+
+        //
+        // A real service would drain from a background thread; the ring only
+        // needs draining often enough not to fill up.
+        //
+        PhSamplerDrain(Sampler);
+    }
+
+    PhSamplerQueryStats(Sampler, &Stats);
+    printf("%llu samples at one per %zu bytes, %llu call sites, %llu live bytes estimated, " \
+        "%llu dropped\n\n",
+        (unsigned long long)Stats.Samples,
+        SampleInterval,
+        (unsigned long long)Stats.CallSites,
+        (unsigned long long)Stats.LiveBytes,
+        (unsigned long long)Stats.Dropped);
+    PhSamplerExport(Sampler, stdout, PH_PROFILE_TEXT);
+
+    if (CollapsedName != NULL) {
+        FILE* File = fopen(CollapsedName, "w");
+
+        if (File == NULL || PhSamplerExport(Sampler, File, PH_PROFILE_COLLAPSED) == false) {
+            printf("Failed to write %s.\n", CollapsedName);
+        }
+        if (File != NULL) {
+            fclose(File);
+        }
+    }
+
+    //
+    // Alternate the two configurations in short rounds and take the median
+    // of the paired ratios: a preempted round only moves one ratio, and
+    // unlike the best of each, the median does not favour the rounds that
+    // happened to draw fewer samples.
+    //
+    for (Round = 0; Round < OVERHEAD_ROUNDS; ++Round) {
+        PhHeapSetSampler(hHeap, NULL);
+        Baselines[Round] = TimeAllocations(hHeap, OVERHEAD_ALLOCATIONS);
+
+        PhHeapSetSampler(hHeap, Sampler);
+        Ratios[Round] = TimeAllocations(hHeap, OVERHEAD_ALLOCATIONS) / Baselines[Round];
+        PhSamplerDrain(Sampler);
+    }
+    qsort(Baselines, OVERHEAD_ROUNDS, sizeof(double), CompareDoubles);
+    qsort(Ratios, OVERHEAD_ROUNDS, sizeof(double), CompareDoubles);
+    printf("\nSampling overhead: %.2f%% (median of %u rounds, %.1f ns per allocation without the sampler)\n",
+        100.0 * (Ratios[OVERHEAD_ROUNDS / 2] - 1.0),
+        OVERHEAD_ROUNDS,
+        Baselines[OVERHEAD_ROUNDS / 2] * 1e9 / OVERHEAD_ALLOCATIONS);
+
+    PhHeapDestroy(hHeap);
+    PhSamplerDestroy(Sampler);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    PPH_HEAP hHeap;
+    void* aBlocks[4];
+    uint32_t Index;
+    int Result;
+
+    if (argc > 1 && strcmp(argv[1], "--profile") == 0) {
+        size_t SampleInterval = argc > 2 ? (size_t)strtoull(argv[2], NULL, 0) : PH_SAMPLER_DEFAULT_INTERVAL;
+
+        return Profile(SampleInterval != 0 ? SampleInterval : PH_SAMPLER_DEFAULT_INTERVAL,
+            argc > 3 ? argv[3] : NULL);
+    }
+    if (argc > 1 && strcmp(argv[1], "--numa") == 0) {
+        return Numa();
+    }
+    if (argc > 1 && strcmp(argv[1], "--trim") == 0) {
+        return Trim(argc > 2 && strcmp(argv[2], "--defer-coalesce") == 0 ? HEAP_DISABLE_COALESCE_ON_FREE : 0);
+    }
+    if (argc > 1) {
+        printf("Usage: portable-heap [--profile [sample interval] [collapsed stacks file]]\n" \
+            "       portable-heap --trim [--defer-coalesce]\n" \
+            "       portable-heap --numa\n");
+        return 1;
+    }
+
+    //
+    // Create a new heap with default parameters.
+    //
+    hHeap = PhHeapCreate(0, 0, 0);
+    if (hHeap == NULL) {
+        printf("Failed to create a new heap with LastError %u.\n", PhGetLastError());
+        return 1;
+    }
+
+    //
+    // A few blocks so the walk has something to show: two busy blocks around
+    // a free one, and a block large enough to bypass the segments.
+    //
+    for (Index = 0; Index < 3; ++Index) {
+        aBlocks[Index] = PhHeapAlloc(hHeap, 0, 100 * (Index + 1));
+    }
+    aBlocks[3] = PhHeapAlloc(hHeap, 0, PH_VIRTUAL_ALLOC_THRESHOLD);
+    PhHeapFree(hHeap, 0, aBlocks[1]);
+
+    Result = WalkHeap(hHeap);
+
+    if (PhHeapDestroy(hHeap) == false) {
+        printf("Failed to destroy heap with LastError %u.\n", PhGetLastError());
+    }
+    return Result;
+}
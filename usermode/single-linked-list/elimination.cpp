@@ -0,0 +1,185 @@
+// elimination.cpp : An SList with an elimination array in front of its head.
+//
+
+#include "elimination.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ElpPause() _mm_pause()
+#else
+#define ElpPause()
+#endif
+
+//
+// How the calling thread uses the array, shared by every stack it uses:
+// Range is how many slots it picks from, Spins how long it waits in one.
+//
+typedef struct _ELIMINATION_THREAD {
+    uint32_t Range;
+    uint32_t Spins;
+    uint32_t Random;
+} ELIMINATION_THREAD, *PELIMINATION_THREAD;
+
+static thread_local ELIMINATION_THREAD ElCurrent = { 1, ELIMINATION_MINIMUM_SPINS, 0 };
+
+static PELIMINATION_SLOT PickSlot(PELIMINATION_STACK Stack, PELIMINATION_THREAD Thread)
+{
+    if (Thread->Random == 0) {
+        Thread->Random = (uint32_t)(uintptr_t)Thread | 1;
+    }
+    Thread->Random ^= Thread->Random << 13;
+    Thread->Random ^= Thread->Random >> 17;
+    Thread->Random ^= Thread->Random << 5;
+    return &Stack->Slots[Thread->Random % Thread->Range];
+}
+
+static void OnHeadSuccess(PELIMINATION_THREAD Thread)
+{
+    if (Thread->Spins > ELIMINATION_MINIMUM_SPINS) {
+        Thread->Spins /= 2;
+    }
+}
+
+static void OnCollision(PELIMINATION_THREAD Thread)
+{
+    if (Thread->Range < ELIMINATION_SLOTS) {
+        Thread->Range *= 2;
+    }
+}
+
+static void OnTimeout(PELIMINATION_SLOT Slot, PELIMINATION_THREAD Thread)
+{
+    Slot->Timeouts.fetch_add(1, std::memory_order_relaxed);
+    if (Thread->Range > 1) {
+        Thread->Range /= 2;
+    }
+    if (Thread->Spins < ELIMINATION_MAXIMUM_SPINS) {
+        Thread->Spins *= 2;
+    }
+}
+
+void ElInitialize(PELIMINATION_STACK Stack)
+{
+    uint32_t Index;
+
+    SlInitializeHead(&Stack->Header);
+    for (Index = 0; Index < ELIMINATION_SLOTS; ++Index) {
+        Stack->Slots[Index].Value.store(0, std::memory_order_relaxed);
+        Stack->Slots[Index].Eliminated.store(0, std::memory_order_relaxed);
+        Stack->Slots[Index].Timeouts.store(0, std::memory_order_relaxed);
+    }
+}
+
+//
+// Offers Entry in a slot and waits for a pop to take it. Returns false if
+// none did, with the offer withdrawn.
+//
+static bool OfferEntry(PELIMINATION_STACK Stack, PELIMINATION_THREAD Thread, PSL_ENTRY Entry)
+{
+    PELIMINATION_SLOT Slot = PickSlot(Stack, Thread);
+    uintptr_t Expected = 0;
+    uint32_t Spin;
+
+    if (Slot->Value.load(std::memory_order_relaxed) != 0 ||
+        Slot->Value.compare_exchange_strong(Expected, (uintptr_t)Entry, std::memory_order_release) == false) {
+        OnCollision(Thread);
+        return false;
+    }
+
+    for (Spin = 0; Spin < Thread->Spins; ++Spin) {
+        if (Slot->Value.load(std::memory_order_acquire) == ELIMINATION_TAKEN) {
+            break;
+        }
+        ElpPause();
+    }
+
+    //
+    // Withdrawing the offer fails only if a pop took it meanwhile.
+    //
+    Expected = (uintptr_t)Entry;
+    if (Spin == Thread->Spins && Slot->Value.compare_exchange_strong(Expected, 0, std::memory_order_relaxed)) {
+        OnTimeout(Slot, Thread);
+        return false;
+    }
+    Slot->Value.store(0, std::memory_order_release);
+    return true;
+}
+
+//
+// Waits in a slot for a push to offer an entry and takes it.
+//
+static PSL_ENTRY TakeEntry(PELIMINATION_STACK Stack, PELIMINATION_THREAD Thread)
+{
+    PELIMINATION_SLOT Slot = PickSlot(Stack, Thread);
+    uintptr_t Value;
+    uint32_t Spin;
+
+    for (Spin = 0; Spin < Thread->Spins; ++Spin) {
+        Value = Slot->Value.load(std::memory_order_acquire);
+        if (Value > ELIMINATION_TAKEN) {
+            if (Slot->Value.compare_exchange_strong(Value, ELIMINATION_TAKEN, std::memory_order_acquire)) {
+                Slot->Eliminated.fetch_add(1, std::memory_order_relaxed);
+                return (PSL_ENTRY)Value;
+            }
+            OnCollision(Thread);
+            return NULL;
+        }
+        ElpPause();
+    }
+    OnTimeout(Slot, Thread);
+    return NULL;
+}
+
+void ElPushEntry(PELIMINATION_STACK Stack, PSL_ENTRY Entry)
+{
+    PELIMINATION_THREAD Thread = &ElCurrent;
+
+    for (;;) {
+        if (SlTryPushEntry(&Stack->Header, Entry)) {
+            OnHeadSuccess(Thread);
+            return;
+        }
+        if (OfferEntry(Stack, Thread, Entry)) {
+            return;
+        }
+    }
+}
+
+PSL_ENTRY ElPopEntry(PELIMINATION_STACK Stack)
+{
+    PELIMINATION_THREAD Thread = &ElCurrent;
+    PSL_ENTRY Entry;
+
+    for (;;) {
+        if (SlTryPopEntry(&Stack->Header, &Entry)) {
+            OnHeadSuccess(Thread);
+            return Entry;
+        }
+        Entry = TakeEntry(Stack, Thread);
+        if (Entry != NULL) {
+            return Entry;
+        }
+    }
+}
+
+PSL_ENTRY ElFlush(PELIMINATION_STACK Stack)
+{
+    return SlFlush(&Stack->Header);
+}
+
+uint16_t ElQueryDepth(PELIMINATION_STACK Stack)
+{
+    return SlQueryDepth(&Stack->Header);
+}
+
+void ElQueryStats(PELIMINATION_STACK Stack, PELIMINATION_STATS Stats)
+{
+    uint32_t Index;
+
+    Stats->Eliminated = 0;
+    Stats->Timeouts = 0;
+    for (Index = 0; Index < ELIMINATION_SLOTS; ++Index) {
+        Stats->Eliminated += Stack->Slots[Index].Eliminated.load(std::memory_order_relaxed);
+        Stats->Timeouts += Stack->Slots[Index].Timeouts.load(std::memory_order_relaxed);
+    }
+}
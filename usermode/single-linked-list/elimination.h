@@ -0,0 +1,70 @@
+// elimination.h : An SList with an elimination array in front of its head.
+//
+// Under heavy contention most exchanges on an SList head fail and the head's
+// cache line bounces between every CPU. A push and a pop that overlap cancel
+// out, though, so they need not touch the head at all: when its exchange
+// fails, a push offers its entry in a random slot of the array and waits a
+// little, and a pop that fails looks for an offered entry there. A pair that
+// meets completes without the head; the others go back to it.
+//
+// Each thread adapts how it uses the array. Finding a slot taken by another
+// operation spreads it over more slots, waiting in vain narrows it down to
+// fewer, where partners are likelier; each failed wait also doubles how long
+// the next one lasts, which backs off from the head, and each exchange that
+// succeeds on the head halves it again.
+//
+// A thread that never loses an exchange never touches the array, so this
+// costs nothing over the SList without contention. The SList rules for
+// popped entries still apply (see slist.h).
+//
+
+#pragma once
+
+#include "slist.h"
+
+#include <atomic>
+
+#define ELIMINATION_SLOTS               16
+#define ELIMINATION_MINIMUM_SPINS       16
+#define ELIMINATION_MAXIMUM_SPINS       1024
+
+//
+// Value is 0 when the slot is free, the entry a push offers, or
+// ELIMINATION_TAKEN from when a pop takes that entry until the push sees
+// it. The counters live with the slot to keep them off the head's line.
+//
+#define ELIMINATION_TAKEN               1
+
+typedef struct alignas(64) _ELIMINATION_SLOT {
+    std::atomic<uintptr_t> Value;
+    std::atomic<uint64_t> Eliminated;
+    std::atomic<uint64_t> Timeouts;
+} ELIMINATION_SLOT, *PELIMINATION_SLOT;
+
+typedef struct _ELIMINATION_STACK {
+    alignas(64) SL_HEADER Header;
+    ELIMINATION_SLOT Slots[ELIMINATION_SLOTS];
+} ELIMINATION_STACK, *PELIMINATION_STACK;
+
+typedef struct _ELIMINATION_STATS {
+    uint64_t Eliminated;
+    uint64_t Timeouts;
+} ELIMINATION_STATS, *PELIMINATION_STATS;
+
+void ElInitialize(PELIMINATION_STACK Stack);
+
+void ElPushEntry(PELIMINATION_STACK Stack, PSL_ENTRY Entry);
+PSL_ENTRY ElPopEntry(PELIMINATION_STACK Stack);
+
+//
+// Entries offered in the array at the time are not part of the stack yet,
+// and are neither flushed nor counted.
+//
+PSL_ENTRY ElFlush(PELIMINATION_STACK Stack);
+uint16_t ElQueryDepth(PELIMINATION_STACK Stack);
+
+//
+// Eliminated counts push and pop pairs that met in the array, Timeouts the
+// waits there that ended without a partner.
+//
+void ElQueryStats(PELIMINATION_STACK Stack, PELIMINATION_STATS Stats);
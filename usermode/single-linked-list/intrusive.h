@@ -0,0 +1,215 @@
+// intrusive.h : Typed wrappers over the SList for structures that embed an
+// SL_ENTRY.
+//
+// Code using slist.h directly gets SL_ENTRY pointers back and has to turn
+// them into its own structures, with CONTAINING_RECORD or, when the entry is
+// the first member, a plain cast that silently breaks once someone adds a
+// member in front of it. Here the entry is named once, with
+// INTRUSIVE_ENTRY:
+//
+//     IntrusiveStack<INTRUSIVE_ENTRY(PROGRAM_ITEM, ItemEntry)> Stack;
+//
+//     Stack.Push(Item);
+//     for (PROGRAM_ITEM* Item : Stack.Flush()) {
+//         ...
+//     }
+//
+// and every conversion goes through FromEntry and ToEntry. The template
+// arguments are the structure and the offsetof of its entry, so both
+// conversions add or subtract a compile-time constant.
+//
+
+#pragma once
+
+#include "slist.h"
+
+#include <stddef.h>
+#include <type_traits>
+
+//
+// Only takes the member pointer to check that Member is an SL_ENTRY of
+// Type, which offsetof alone would not.
+//
+template <typename T>
+constexpr size_t IntrusiveEntryOffset(SL_ENTRY T::*, size_t Offset)
+{
+    return Offset;
+}
+
+#define INTRUSIVE_ENTRY(Type, Member) \
+    Type, IntrusiveEntryOffset(&Type::Member, offsetof(Type, Member))
+
+template <typename T, size_t Offset>
+struct IntrusiveTraits {
+    static_assert(std::is_standard_layout<T>::value,
+        "offsetof is only defined for standard-layout structures");
+
+    static PSL_ENTRY ToEntry(T* Item)
+    {
+        return (PSL_ENTRY)((char*)Item + Offset);
+    }
+
+    static T* FromEntry(PSL_ENTRY Entry)
+    {
+        return (T*)((char*)Entry - Offset);
+    }
+
+    //
+    // Links Item to Next, NULL to end a chain.
+    //
+    static void Link(T* Item, T* Next)
+    {
+        ToEntry(Item)->Next = Next != NULL ? ToEntry(Next) : NULL;
+    }
+};
+
+//
+// A NULL-terminated chain of items, as handed back by Flush and PopMany. It
+// belongs to whoever holds it, so walking it needs no synchronization; the
+// iterator reads the next link before yielding an item, so the loop body
+// may free or push the item it is given.
+//
+template <typename T, size_t Offset>
+class IntrusiveChain {
+public:
+    typedef IntrusiveTraits<T, Offset> Traits;
+
+    class Iterator {
+    public:
+        explicit Iterator(PSL_ENTRY Entry) : Current(Entry), Next(Entry != NULL ? Entry->Next : NULL)
+        {
+        }
+
+        T* operator*() const
+        {
+            return Traits::FromEntry(Current);
+        }
+
+        Iterator& operator++()
+        {
+            Current = Next;
+            Next = Current != NULL ? Current->Next : NULL;
+            return *this;
+        }
+
+        bool operator!=(const Iterator& Other) const
+        {
+            return Current != Other.Current;
+        }
+
+    private:
+        PSL_ENTRY Current;
+        PSL_ENTRY Next;
+    };
+
+    IntrusiveChain(PSL_ENTRY First, uint32_t Count) : First(First), Count(Count)
+    {
+    }
+
+    Iterator begin() const
+    {
+        return Iterator(First);
+    }
+
+    Iterator end() const
+    {
+        return Iterator(NULL);
+    }
+
+    bool IsEmpty() const
+    {
+        return First == NULL;
+    }
+
+    //
+    // The number of items, or UINT32_MAX when it was not counted, as for
+    // a flushed chain.
+    //
+    uint32_t QueryCount() const
+    {
+        return Count;
+    }
+
+private:
+    PSL_ENTRY First;
+    uint32_t Count;
+};
+
+template <typename T, size_t Offset>
+class IntrusiveStack {
+public:
+    typedef IntrusiveTraits<T, Offset> Traits;
+    typedef IntrusiveChain<T, Offset> Chain;
+
+    IntrusiveStack()
+    {
+        SlInitializeHead(&Header);
+    }
+
+    IntrusiveStack(const IntrusiveStack&) = delete;
+    IntrusiveStack& operator=(const IntrusiveStack&) = delete;
+
+    //
+    // Returns the item that was first before the push, or NULL.
+    //
+    T* Push(T* Item)
+    {
+        PSL_ENTRY Previous = SlPushEntry(&Header, Traits::ToEntry(Item));
+
+        return Previous != NULL ? Traits::FromEntry(Previous) : NULL;
+    }
+
+    T* Pop()
+    {
+        PSL_ENTRY Entry = SlPopEntry(&Header);
+
+        return Entry != NULL ? Traits::FromEntry(Entry) : NULL;
+    }
+
+    //
+    // Pushes Count items, already linked through their entries from First
+    // to Last, with a single exchange.
+    //
+    void PushChain(T* First, T* Last, uint32_t Count)
+    {
+        SlPushList(&Header, Traits::ToEntry(First), Traits::ToEntry(Last), Count);
+    }
+
+    Chain PopMany(uint32_t Count)
+    {
+        uint32_t Popped;
+        PSL_ENTRY First = SlPopEntries(&Header, Count, &Popped);
+
+        return Chain(First, Popped);
+    }
+
+    Chain Flush()
+    {
+        return Chain(SlFlush(&Header), UINT32_MAX);
+    }
+
+    uint16_t QueryDepth() const
+    {
+        return SlQueryDepth(&Header);
+    }
+
+    //
+    // Walks the items in place, first to last. Only safe while no other
+    // thread pops from the stack.
+    //
+    typename Chain::Iterator begin() const
+    {
+        SL_HEADER Copy;
+
+        SlpReadHeader(&Header, &Copy);
+        return typename Chain::Iterator(Copy.Next);
+    }
+
+    typename Chain::Iterator end() const
+    {
+        return typename Chain::Iterator(NULL);
+    }
+
+private:
+    SL_HEADER Header;
+};
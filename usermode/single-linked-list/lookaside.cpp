@@ -0,0 +1,253 @@
+// lookaside.cpp : Per-CPU lookaside lists of fixed-size buffers.
+//
+
+#include "lookaside.h"
+
+#include <new>
+#include <stdlib.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+static void* DefaultAllocate(size_t Size, void* Context)
+{
+    (void)Context;
+
+    return malloc(Size);
+}
+
+static void DefaultFree(void* Buffer, void* Context)
+{
+    (void)Context;
+
+    free(Buffer);
+}
+
+uint32_t LaCurrentCpu()
+{
+#ifdef _WIN32
+    return GetCurrentProcessorNumber();
+#else
+    int Cpu = sched_getcpu();
+
+    return Cpu >= 0 ? (uint32_t)Cpu : 0;
+#endif
+}
+
+static void InitializeList(PGENERAL_LOOKASIDE List, uint16_t MaximumDepth)
+{
+    SlInitializeHead(&List->ListHead);
+    List->Depth = LOOKASIDE_MINIMUM_DEPTH;
+    List->MaximumDepth = MaximumDepth;
+    List->TotalAllocates = 0;
+    List->AllocateMisses = 0;
+    List->TotalFrees = 0;
+    List->FreeMisses = 0;
+    List->LastTotalAllocates = 0;
+    List->LastAllocateMisses = 0;
+}
+
+bool LaInitialize(PLOOKASIDE_LIST_EX Lookaside, size_t Size, PLOOKASIDE_ALLOCATE Allocate, PLOOKASIDE_FREE Free,
+    void* Context, uint16_t MaximumDepth, uint32_t Flags)
+{
+    uint32_t Cpu;
+
+    if (MaximumDepth == 0) {
+        MaximumDepth = LOOKASIDE_DEFAULT_DEPTH;
+    }
+    if (MaximumDepth < LOOKASIDE_MINIMUM_DEPTH) {
+        MaximumDepth = LOOKASIDE_MINIMUM_DEPTH;
+    }
+
+    Lookaside->Size = Size > sizeof(SL_ENTRY) ? Size : sizeof(SL_ENTRY);
+    Lookaside->Allocate = Allocate != NULL ? Allocate : DefaultAllocate;
+    Lookaside->Free = Free != NULL ? Free : DefaultFree;
+    Lookaside->Context = Context;
+    Lookaside->Flags = Flags;
+    Lookaside->NumberOfCpus = std::thread::hardware_concurrency();
+    if (Lookaside->NumberOfCpus == 0) {
+        Lookaside->NumberOfCpus = 1;
+    }
+    Lookaside->PerCpu = new (std::nothrow) GENERAL_LOOKASIDE[Lookaside->NumberOfCpus];
+    if (Lookaside->PerCpu == NULL) {
+        return false;
+    }
+    for (Cpu = 0; Cpu < Lookaside->NumberOfCpus; ++Cpu) {
+        InitializeList(&Lookaside->PerCpu[Cpu], MaximumDepth);
+    }
+    InitializeList(&Lookaside->Global, MaximumDepth);
+    return true;
+}
+
+static void FreeList(PLOOKASIDE_LIST_EX Lookaside, PGENERAL_LOOKASIDE List)
+{
+    PSL_ENTRY Entry = SlFlush(&List->ListHead);
+
+    while (Entry != NULL) {
+        PSL_ENTRY Next = Entry->Next;
+
+        Lookaside->Free(Entry, Lookaside->Context);
+        Entry = Next;
+    }
+}
+
+void LaDelete(PLOOKASIDE_LIST_EX Lookaside)
+{
+    uint32_t Cpu;
+
+    for (Cpu = 0; Cpu < Lookaside->NumberOfCpus; ++Cpu) {
+        FreeList(Lookaside, &Lookaside->PerCpu[Cpu]);
+    }
+    FreeList(Lookaside, &Lookaside->Global);
+    delete[] Lookaside->PerCpu;
+    Lookaside->PerCpu = NULL;
+}
+
+static void* PopBuffer(PLOOKASIDE_LIST_EX Lookaside, PGENERAL_LOOKASIDE List)
+{
+    void* Buffer;
+
+    List->TotalAllocates.fetch_add(1, std::memory_order_relaxed);
+    if ((Lookaside->Flags & LOOKASIDE_RECLAIM) != 0) {
+        ReEnter();
+        Buffer = SlPopEntry(&List->ListHead);
+        ReLeave();
+    }
+    else {
+        Buffer = SlPopEntry(&List->ListHead);
+    }
+    if (Buffer == NULL) {
+        List->AllocateMisses.fetch_add(1, std::memory_order_relaxed);
+    }
+    return Buffer;
+}
+
+static void ReleaseBuffer(PLOOKASIDE_LIST_EX Lookaside, void* Buffer)
+{
+    if ((Lookaside->Flags & LOOKASIDE_RECLAIM) != 0) {
+        ReRetire(Buffer, Lookaside->Free, Lookaside->Context);
+    }
+    else {
+        Lookaside->Free(Buffer, Lookaside->Context);
+    }
+}
+
+void* LaAllocate(PLOOKASIDE_LIST_EX Lookaside)
+{
+    void* Buffer = PopBuffer(Lookaside, &Lookaside->PerCpu[LaCurrentCpu() % Lookaside->NumberOfCpus]);
+
+    if (Buffer == NULL) {
+        Buffer = PopBuffer(Lookaside, &Lookaside->Global);
+    }
+    if (Buffer == NULL) {
+        Buffer = Lookaside->Allocate(Lookaside->Size, Lookaside->Context);
+    }
+    return Buffer;
+}
+
+//
+// The depth check and the push are not atomic together, so a list can end
+// up a few entries over its depth under contention, as in the kernel.
+//
+void LaFree(PLOOKASIDE_LIST_EX Lookaside, void* Buffer)
+{
+    PGENERAL_LOOKASIDE List = &Lookaside->PerCpu[LaCurrentCpu() % Lookaside->NumberOfCpus];
+
+    List->TotalFrees.fetch_add(1, std::memory_order_relaxed);
+    if (SlQueryDepth(&List->ListHead) < List->Depth.load(std::memory_order_relaxed)) {
+        SlPushEntry(&List->ListHead, (PSL_ENTRY)Buffer);
+        return;
+    }
+    List->FreeMisses.fetch_add(1, std::memory_order_relaxed);
+
+    List = &Lookaside->Global;
+    List->TotalFrees.fetch_add(1, std::memory_order_relaxed);
+    if (SlQueryDepth(&List->ListHead) < List->Depth.load(std::memory_order_relaxed)) {
+        SlPushEntry(&List->ListHead, (PSL_ENTRY)Buffer);
+        return;
+    }
+    List->FreeMisses.fetch_add(1, std::memory_order_relaxed);
+    ReleaseBuffer(Lookaside, Buffer);
+}
+
+//
+// ExpComputeLookasideDepth: below 75 allocations since the last scan the
+// list is idle and loses 10 entries; below 0.5% misses it loses one;
+// otherwise it grows by up to 30 entries, more the more it misses and the
+// further it is from its maximum.
+//
+static void ComputeDepth(PGENERAL_LOOKASIDE List)
+{
+    uint32_t TotalAllocates = List->TotalAllocates.load(std::memory_order_relaxed);
+    uint32_t AllocateMisses = List->AllocateMisses.load(std::memory_order_relaxed);
+    uint32_t Allocates = TotalAllocates - List->LastTotalAllocates;
+    uint32_t Misses = AllocateMisses - List->LastAllocateMisses;
+    uint32_t Depth = List->Depth.load(std::memory_order_relaxed);
+    uint32_t Ratio;
+    uint32_t Target;
+
+    List->LastTotalAllocates = TotalAllocates;
+    List->LastAllocateMisses = AllocateMisses;
+
+    if (Allocates < 75) {
+        Depth = Depth > LOOKASIDE_MINIMUM_DEPTH + 10 ? Depth - 10 : LOOKASIDE_MINIMUM_DEPTH;
+    }
+    else {
+        Ratio = (uint32_t)((uint64_t)Misses * 1000 / Allocates);
+        if (Ratio < 5) {
+            Depth = Depth > LOOKASIDE_MINIMUM_DEPTH ? Depth - 1 : LOOKASIDE_MINIMUM_DEPTH;
+        }
+        else {
+            Target = Ratio * (List->MaximumDepth - Depth) / (1000 * 2) + 5;
+            Depth += Target < 30 ? Target : 30;
+            if (Depth > List->MaximumDepth) {
+                Depth = List->MaximumDepth;
+            }
+        }
+    }
+    List->Depth.store((uint16_t)Depth, std::memory_order_relaxed);
+}
+
+//
+// Pops what is above the list's depth with one exchange and retires it.
+//
+static void TrimList(PLOOKASIDE_LIST_EX Lookaside, PGENERAL_LOOKASIDE List)
+{
+    uint32_t Depth = SlQueryDepth(&List->ListHead);
+    uint32_t Target = List->Depth.load(std::memory_order_relaxed);
+    PSL_ENTRY Entry;
+    uint32_t Popped;
+
+    if (Depth <= Target) {
+        return;
+    }
+    ReEnter();
+    Entry = SlPopEntries(&List->ListHead, Depth - Target, &Popped);
+    ReLeave();
+    while (Entry != NULL) {
+        PSL_ENTRY Next = Entry->Next;
+
+        ReleaseBuffer(Lookaside, Entry);
+        Entry = Next;
+    }
+}
+
+void LaAdjustDepth(PLOOKASIDE_LIST_EX Lookaside)
+{
+    uint32_t Cpu;
+
+    for (Cpu = 0; Cpu < Lookaside->NumberOfCpus; ++Cpu) {
+        ComputeDepth(&Lookaside->PerCpu[Cpu]);
+        if ((Lookaside->Flags & LOOKASIDE_RECLAIM) != 0) {
+            TrimList(Lookaside, &Lookaside->PerCpu[Cpu]);
+        }
+    }
+    ComputeDepth(&Lookaside->Global);
+    if ((Lookaside->Flags & LOOKASIDE_RECLAIM) != 0) {
+        TrimList(Lookaside, &Lookaside->Global);
+    }
+}
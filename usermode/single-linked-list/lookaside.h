@@ -0,0 +1,92 @@
+// lookaside.h : Per-CPU lookaside lists of fixed-size buffers, modelled on
+// the kernel's LOOKASIDE_LIST_EX and ExAllocateFromLookasideListEx.
+//
+// Freed buffers are kept on SLists instead of going back to the allocator:
+// one per CPU, tried first, then one shared by all CPUs. Allocating is a pop
+// from the list of the CPU the thread runs on, which is usually in that
+// CPU's cache already; the allocate routine only runs when both lists are
+// empty, and the free routine when both are full.
+//
+// How full a list may get is its Depth, between LOOKASIDE_MINIMUM_DEPTH and
+// the MaximumDepth given at initialization. Like the kernel's balance set
+// manager, call LaAdjustDepth about once a second: lists that hardly miss
+// shrink, lists that miss grow in proportion to their miss rate, and idle
+// lists shrink quickly.
+//
+// The SList rules apply to the buffers (see slist.h): a buffer the free
+// routine releases may still be read by a concurrent pop. Either the
+// allocate routine returns memory that stays mapped while the list is in
+// use, which malloc does for buffers below its mmap threshold, or the list
+// is created with LOOKASIDE_RECLAIM: pops then run in reclamation critical
+// sections and released buffers are retired instead (see reclaim.h), which
+// also lets LaAdjustDepth hand the buffers above a list's depth back.
+//
+
+#pragma once
+
+#include "reclaim.h"
+#include "slist.h"
+
+#include <atomic>
+
+#define LOOKASIDE_MINIMUM_DEPTH         4
+#define LOOKASIDE_DEFAULT_DEPTH         256
+
+#define LOOKASIDE_RECLAIM               0x00000001
+
+typedef void* (*PLOOKASIDE_ALLOCATE)(size_t Size, void* Context);
+typedef void (*PLOOKASIDE_FREE)(void* Buffer, void* Context);
+
+//
+// One list with its counters, on a cache line of its own. The counters are
+// only bumped by the CPU the list belongs to, give or take a migration.
+//
+typedef struct alignas(64) _GENERAL_LOOKASIDE {
+    SL_HEADER ListHead;
+    std::atomic<uint16_t> Depth;
+    uint16_t MaximumDepth;
+    std::atomic<uint32_t> TotalAllocates;
+    std::atomic<uint32_t> AllocateMisses;
+    std::atomic<uint32_t> TotalFrees;
+    std::atomic<uint32_t> FreeMisses;
+    uint32_t LastTotalAllocates;
+    uint32_t LastAllocateMisses;
+} GENERAL_LOOKASIDE, *PGENERAL_LOOKASIDE;
+
+typedef struct _LOOKASIDE_LIST_EX {
+    size_t Size;
+    PLOOKASIDE_ALLOCATE Allocate;
+    PLOOKASIDE_FREE Free;
+    void* Context;
+    uint32_t Flags;
+    uint32_t NumberOfCpus;
+    PGENERAL_LOOKASIDE PerCpu;
+    GENERAL_LOOKASIDE Global;
+} LOOKASIDE_LIST_EX, *PLOOKASIDE_LIST_EX;
+
+//
+// Allocate and Free may be NULL for malloc and free. Size is rounded up to
+// hold an SL_ENTRY. MaximumDepth is per list, 0 for LOOKASIDE_DEFAULT_DEPTH.
+// With LOOKASIDE_RECLAIM, Context must stay valid until the threads that
+// freed to the list have synchronized or exited.
+//
+bool LaInitialize(PLOOKASIDE_LIST_EX Lookaside, size_t Size, PLOOKASIDE_ALLOCATE Allocate, PLOOKASIDE_FREE Free,
+    void* Context, uint16_t MaximumDepth, uint32_t Flags);
+
+//
+// Frees every buffer held by the lists. No other thread may be using them.
+//
+void LaDelete(PLOOKASIDE_LIST_EX Lookaside);
+
+void* LaAllocate(PLOOKASIDE_LIST_EX Lookaside);
+void LaFree(PLOOKASIDE_LIST_EX Lookaside, void* Buffer);
+
+//
+// Recomputes the depth of every list from its allocations and misses since
+// the previous call. With LOOKASIDE_RECLAIM, the buffers above the new depth
+// are popped and retired; otherwise a list above its depth drains as its
+// buffers are allocated.
+//
+void LaAdjustDepth(PLOOKASIDE_LIST_EX Lookaside);
+
+uint32_t LaCurrentCpu();
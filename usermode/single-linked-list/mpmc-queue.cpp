@@ -0,0 +1,148 @@
+// mpmc-queue.cpp : A bounded FIFO queue of SList entries for any number of
+// producers and consumers.
+//
+
+#include "mpmc-queue.h"
+
+#include <new>
+#include <thread>
+
+#define MQ_SPINS                        64
+
+bool MqInitialize(PMPMC_QUEUE Queue, size_t Capacity)
+{
+    size_t Size = 1;
+    size_t Index;
+
+    while (Size < Capacity) {
+        Size *= 2;
+    }
+    Queue->Cells = new (std::nothrow) MQ_CELL[Size];
+    if (Queue->Cells == NULL) {
+        return false;
+    }
+    for (Index = 0; Index < Size; ++Index) {
+        Queue->Cells[Index].Sequence.store(Index, std::memory_order_relaxed);
+        Queue->Cells[Index].Entry = NULL;
+    }
+    Queue->Mask = Size - 1;
+    Queue->EnqueuePosition.store(0, std::memory_order_relaxed);
+    Queue->DequeuePosition.store(0, std::memory_order_relaxed);
+    Queue->EnqueueWaiters.store(0, std::memory_order_relaxed);
+    Queue->DequeueWaiters.store(0, std::memory_order_relaxed);
+    Queue->EnqueueGeneration = 0;
+    Queue->DequeueGeneration = 0;
+    return true;
+}
+
+void MqDelete(PMPMC_QUEUE Queue)
+{
+    delete[] Queue->Cells;
+    Queue->Cells = NULL;
+}
+
+//
+// Sleepers wait for the generation of their side to move on. It only moves
+// under the lock, so a wake-up cannot fall between a sleeper's last look at
+// the ring and its wait.
+//
+void MqpWakeDequeuers(PMPMC_QUEUE Queue)
+{
+    std::lock_guard<std::mutex> Guard(Queue->Lock);
+
+    Queue->DequeueGeneration += 1;
+    Queue->NotEmpty.notify_all();
+}
+
+void MqpWakeEnqueuers(PMPMC_QUEUE Queue)
+{
+    std::lock_guard<std::mutex> Guard(Queue->Lock);
+
+    Queue->EnqueueGeneration += 1;
+    Queue->NotFull.notify_all();
+}
+
+//
+// Waits until Attempt succeeds: a few tries with yields in between, then
+// counted among Waiters and asleep between tries. The fence after counting
+// pairs with the one the other side places after publishing, so that
+// either the try sees the change or the other side sees a waiter and moves
+// the generation on. Attempt runs without the lock, since a successful one
+// wakes the other side.
+//
+template <typename ATTEMPT>
+static void Wait(PMPMC_QUEUE Queue, std::atomic<uint32_t>* Waiters, uint64_t* Generation,
+    std::condition_variable* Event, ATTEMPT Attempt)
+{
+    uint64_t Seen;
+    uint32_t Spin;
+
+    for (Spin = 0; Spin < MQ_SPINS; ++Spin) {
+        if (Attempt()) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    Waiters->fetch_add(1, std::memory_order_relaxed);
+    for (;;) {
+        std::unique_lock<std::mutex> Guard(Queue->Lock);
+
+        Seen = *Generation;
+        Guard.unlock();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (Attempt()) {
+            break;
+        }
+        Guard.lock();
+        while (*Generation == Seen) {
+            Event->wait(Guard);
+        }
+    }
+    Waiters->fetch_sub(1, std::memory_order_relaxed);
+}
+
+void MqEnqueueBatch(PMPMC_QUEUE Queue, PSL_ENTRY* Entries, size_t Count)
+{
+    size_t Done = 0;
+
+    Wait(Queue, &Queue->EnqueueWaiters, &Queue->EnqueueGeneration, &Queue->NotFull, [&]() {
+        Done += MqTryEnqueueBatch(Queue, Entries + Done, Count - Done);
+        return Done == Count;
+    });
+}
+
+size_t MqDequeueBatch(PMPMC_QUEUE Queue, PSL_ENTRY* Entries, size_t Count)
+{
+    size_t Done = 0;
+
+    if (Count == 0) {
+        return 0;
+    }
+    Wait(Queue, &Queue->DequeueWaiters, &Queue->DequeueGeneration, &Queue->NotEmpty, [&]() {
+        Done = MqTryDequeueBatch(Queue, Entries, Count);
+        return Done != 0;
+    });
+    return Done;
+}
+
+void MqEnqueue(PMPMC_QUEUE Queue, PSL_ENTRY Entry)
+{
+    MqEnqueueBatch(Queue, &Entry, 1);
+}
+
+PSL_ENTRY MqDequeue(PMPMC_QUEUE Queue)
+{
+    PSL_ENTRY Entry;
+
+    MqDequeueBatch(Queue, &Entry, 1);
+    return Entry;
+}
+
+size_t MqQueryCount(PMPMC_QUEUE Queue)
+{
+    size_t Dequeued = Queue->DequeuePosition.load(std::memory_order_relaxed);
+    size_t Enqueued = Queue->EnqueuePosition.load(std::memory_order_relaxed);
+
+    return Enqueued - Dequeued <= Queue->Mask + 1 ? Enqueued - Dequeued : 0;
+}
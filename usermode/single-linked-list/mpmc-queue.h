@@ -0,0 +1,196 @@
+// mpmc-queue.h : A bounded FIFO queue of SList entries for any number of
+// producers and consumers.
+//
+// The SList is LIFO, and grows as long as producers outrun consumers. This
+// queue keeps order and a fixed capacity, a power of two. It holds the same
+// entries, embedded in the caller's structures and found back with
+// CONTAINING_RECORD, but only stores pointers to them: an entry's Next field
+// is left alone, and entries can be freed as soon as they are dequeued.
+//
+// Each cell of the ring carries a sequence number saying whose turn it is.
+// The enqueue at position P may fill cell P % Capacity once its sequence is
+// P, and sets it to P + 1; the dequeue at P may then empty it, and sets it
+// to P + Capacity, the next enqueue's turn. Producers only contend on the
+// enqueue position and consumers on the dequeue position, each one
+// compare-exchange per operation, or per batch. Cells are a cache line each
+// so that neighbouring operations do not share lines.
+//
+// The Try functions never wait. MqEnqueue and MqDequeue wait for room or
+// for an entry, spinning briefly and then sleeping.
+//
+
+#pragma once
+
+#include "slist.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+typedef struct alignas(64) _MQ_CELL {
+    std::atomic<size_t> Sequence;
+    PSL_ENTRY Entry;
+} MQ_CELL, *PMQ_CELL;
+
+//
+// The waiter counts let producers and consumers skip the lock and the
+// condition variables unless someone sleeps. The generations are under the
+// lock.
+//
+typedef struct _MPMC_QUEUE {
+    alignas(64) std::atomic<size_t> EnqueuePosition;
+    alignas(64) std::atomic<size_t> DequeuePosition;
+    alignas(64) size_t Mask;
+    PMQ_CELL Cells;
+    std::atomic<uint32_t> EnqueueWaiters;
+    std::atomic<uint32_t> DequeueWaiters;
+    std::mutex Lock;
+    uint64_t EnqueueGeneration;
+    uint64_t DequeueGeneration;
+    std::condition_variable NotFull;
+    std::condition_variable NotEmpty;
+} MPMC_QUEUE, *PMPMC_QUEUE;
+
+//
+// Capacity is rounded up to a power of two. Returns false when out of
+// memory.
+//
+bool MqInitialize(PMPMC_QUEUE Queue, size_t Capacity);
+
+//
+// Entries still queued are dropped. No other thread may be using the queue.
+//
+void MqDelete(PMPMC_QUEUE Queue);
+
+void MqpWakeDequeuers(PMPMC_QUEUE Queue);
+void MqpWakeEnqueuers(PMPMC_QUEUE Queue);
+
+//
+// Claims up to Count consecutive positions starting at the one a thread of
+// the given side would take next, if their cells are ready for it, and
+// returns the first. Cells of a position are ready for an enqueue when
+// their sequence is the position, and for a dequeue when it is one more.
+//
+inline size_t MqpClaim(PMPMC_QUEUE Queue, std::atomic<size_t>* Position, size_t Ready, size_t Count,
+    size_t* Claimed)
+{
+    size_t First = Position->load(std::memory_order_relaxed);
+    size_t Available;
+
+    if (Count == 0) {
+        *Claimed = 0;
+        return First;
+    }
+    for (;;) {
+        for (Available = 0; Available < Count; ++Available) {
+            size_t Sequence = Queue->Cells[(First + Available) & Queue->Mask].Sequence.load(std::memory_order_acquire);
+
+            if (Sequence != First + Available + Ready) {
+                break;
+            }
+        }
+
+        //
+        // A sequence behind the position means the ring is full or empty
+        // from this side. One ahead of it means other threads claimed the
+        // position already, and First is stale.
+        //
+        if (Available == 0) {
+            size_t Sequence = Queue->Cells[First & Queue->Mask].Sequence.load(std::memory_order_acquire);
+
+            if ((intptr_t)(Sequence - (First + Ready)) < 0) {
+                *Claimed = 0;
+                return First;
+            }
+            First = Position->load(std::memory_order_relaxed);
+            continue;
+        }
+        if (Position->compare_exchange_weak(First, First + Available, std::memory_order_relaxed)) {
+            *Claimed = Available;
+            return First;
+        }
+    }
+}
+
+//
+// Enqueues up to Count entries in order, as many as there is room for, and
+// returns how many.
+//
+inline size_t MqTryEnqueueBatch(PMPMC_QUEUE Queue, PSL_ENTRY* Entries, size_t Count)
+{
+    size_t Claimed;
+    size_t First = MqpClaim(Queue, &Queue->EnqueuePosition, 0, Count, &Claimed);
+    size_t Index;
+
+    for (Index = 0; Index < Claimed; ++Index) {
+        PMQ_CELL Cell = &Queue->Cells[(First + Index) & Queue->Mask];
+
+        Cell->Entry = Entries[Index];
+        Cell->Sequence.store(First + Index + 1, std::memory_order_release);
+    }
+
+    //
+    // Pairs with the fence a consumer places between counting itself as a
+    // waiter and looking at the ring one last time before it sleeps.
+    //
+    if (Claimed != 0) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (Queue->DequeueWaiters.load(std::memory_order_relaxed) != 0) {
+            MqpWakeDequeuers(Queue);
+        }
+    }
+    return Claimed;
+}
+
+//
+// Dequeues up to Count entries, oldest first, and returns how many.
+//
+inline size_t MqTryDequeueBatch(PMPMC_QUEUE Queue, PSL_ENTRY* Entries, size_t Count)
+{
+    size_t Claimed;
+    size_t First = MqpClaim(Queue, &Queue->DequeuePosition, 1, Count, &Claimed);
+    size_t Index;
+
+    for (Index = 0; Index < Claimed; ++Index) {
+        PMQ_CELL Cell = &Queue->Cells[(First + Index) & Queue->Mask];
+
+        Entries[Index] = Cell->Entry;
+        Cell->Sequence.store(First + Index + Queue->Mask + 1, std::memory_order_release);
+    }
+    if (Claimed != 0) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (Queue->EnqueueWaiters.load(std::memory_order_relaxed) != 0) {
+            MqpWakeEnqueuers(Queue);
+        }
+    }
+    return Claimed;
+}
+
+inline bool MqTryEnqueue(PMPMC_QUEUE Queue, PSL_ENTRY Entry)
+{
+    return MqTryEnqueueBatch(Queue, &Entry, 1) != 0;
+}
+
+//
+// Returns NULL when the queue is empty.
+//
+inline PSL_ENTRY MqTryDequeue(PMPMC_QUEUE Queue)
+{
+    PSL_ENTRY Entry;
+
+    return MqTryDequeueBatch(Queue, &Entry, 1) != 0 ? Entry : NULL;
+}
+
+//
+// Wait until every entry is enqueued, or until at least one is dequeued.
+//
+void MqEnqueueBatch(PMPMC_QUEUE Queue, PSL_ENTRY* Entries, size_t Count);
+size_t MqDequeueBatch(PMPMC_QUEUE Queue, PSL_ENTRY* Entries, size_t Count);
+
+void MqEnqueue(PMPMC_QUEUE Queue, PSL_ENTRY Entry);
+PSL_ENTRY MqDequeue(PMPMC_QUEUE Queue);
+
+//
+// A snapshot, stale as soon as it is returned.
+//
+size_t MqQueryCount(PMPMC_QUEUE Queue);
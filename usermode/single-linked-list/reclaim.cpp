@@ -0,0 +1,276 @@
+// reclaim.cpp : Epoch-based reclamation for entries of lock-free lists.
+//
+// Each thread gets a record on a global list the first time it uses this
+// module. Records are never freed: a thread that exits leaves its record for
+// the next thread to reuse. The record's State is its epoch shifted left by
+// one, with the low bit set while inside a critical section.
+//
+
+#include "reclaim.h"
+
+#include <atomic>
+#include <stdlib.h>
+#include <thread>
+
+#define RECLAIM_EPOCHS                  3
+#define RECLAIM_ACTIVE                  1ull
+#define RECLAIM_RESERVE                 16
+
+typedef struct _RECLAIM_RETIRED {
+    void* Object;
+    PRECLAIM_FREE Free;
+    void* Context;
+} RECLAIM_RETIRED, *PRECLAIM_RETIRED;
+
+//
+// Objects retired by one thread during one epoch.
+//
+typedef struct _RECLAIM_LIMBO {
+    uint64_t Epoch;
+    PRECLAIM_RETIRED Objects;
+    uint32_t Count;
+    uint32_t Capacity;
+} RECLAIM_LIMBO, *PRECLAIM_LIMBO;
+
+//
+// The reserve holds objects retired inside a critical section when their
+// limbo could not grow. They are all freed together, once the latest of
+// them, retired in ReserveEpoch, is old enough.
+//
+typedef struct alignas(64) _RECLAIM_THREAD {
+    std::atomic<uint64_t> State;
+    std::atomic<bool> InUse;
+    struct _RECLAIM_THREAD* Next;
+    uint32_t Nesting;
+    uint32_t RetiredSinceCollect;
+    RECLAIM_LIMBO Limbo[RECLAIM_EPOCHS];
+    uint64_t ReserveEpoch;
+    uint32_t ReserveCount;
+    RECLAIM_RETIRED Reserve[RECLAIM_RESERVE];
+} RECLAIM_THREAD, *PRECLAIM_THREAD;
+
+//
+// Releases the calling thread's record when it exits.
+//
+struct RECLAIM_THREAD_SLOT {
+    PRECLAIM_THREAD Thread;
+    ~RECLAIM_THREAD_SLOT();
+};
+
+static std::atomic<uint64_t> ReGlobalEpoch;
+static std::atomic<PRECLAIM_THREAD> ReThreads;
+static std::atomic<uint64_t> ReRetired;
+static std::atomic<uint64_t> ReReclaimed;
+static std::atomic<uint64_t> ReLeaked;
+static thread_local RECLAIM_THREAD_SLOT ReCurrent;
+
+static PRECLAIM_THREAD CurrentThread()
+{
+    PRECLAIM_THREAD Thread = ReCurrent.Thread;
+    PRECLAIM_THREAD Head;
+    bool InUse;
+
+    if (Thread != NULL) {
+        return Thread;
+    }
+
+    for (Thread = ReThreads.load(std::memory_order_acquire); Thread != NULL; Thread = Thread->Next) {
+        InUse = false;
+        if (Thread->InUse.load(std::memory_order_relaxed) == false &&
+            Thread->InUse.compare_exchange_strong(InUse, true, std::memory_order_acquire)) {
+            ReCurrent.Thread = Thread;
+            return Thread;
+        }
+    }
+
+    //
+    // Out of memory here leaves no way to protect the caller, and nothing
+    // sensible to fall back to.
+    //
+    Thread = new RECLAIM_THREAD();
+    Thread->InUse.store(true, std::memory_order_relaxed);
+    Head = ReThreads.load(std::memory_order_relaxed);
+    do {
+        Thread->Next = Head;
+    } while (ReThreads.compare_exchange_weak(Head, Thread, std::memory_order_release, std::memory_order_relaxed) == false);
+    ReCurrent.Thread = Thread;
+    return Thread;
+}
+
+RECLAIM_THREAD_SLOT::~RECLAIM_THREAD_SLOT()
+{
+    if (Thread != NULL) {
+        ReSynchronize();
+        Thread->State.store(0, std::memory_order_release);
+        Thread->InUse.store(false, std::memory_order_release);
+        Thread = NULL;
+    }
+}
+
+void ReEnter()
+{
+    PRECLAIM_THREAD Thread = CurrentThread();
+
+    //
+    // The announcement must be visible before the list is read, hence the
+    // full fence: a plain store could sit in the store buffer past the
+    // reads that follow.
+    //
+    if (Thread->Nesting++ == 0) {
+        Thread->State.store((ReGlobalEpoch.load(std::memory_order_relaxed) << 1) | RECLAIM_ACTIVE,
+            std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+void ReLeave()
+{
+    PRECLAIM_THREAD Thread = ReCurrent.Thread;
+
+    if (--Thread->Nesting == 0) {
+        Thread->State.store(Thread->State.load(std::memory_order_relaxed) & ~RECLAIM_ACTIVE,
+            std::memory_order_release);
+    }
+}
+
+//
+// The epoch can move on once no thread is inside a critical section entered
+// during an earlier epoch.
+//
+static void TryAdvance()
+{
+    uint64_t Epoch;
+    PRECLAIM_THREAD Thread;
+
+    //
+    // Pairs with the fence in ReEnter: a thread this scan sees outside its
+    // critical section will see every unlink made before the scan.
+    //
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Epoch = ReGlobalEpoch.load(std::memory_order_seq_cst);
+
+    for (Thread = ReThreads.load(std::memory_order_acquire); Thread != NULL; Thread = Thread->Next) {
+        uint64_t State = Thread->State.load(std::memory_order_seq_cst);
+
+        if ((State & RECLAIM_ACTIVE) != 0 && (State >> 1) != Epoch) {
+            return;
+        }
+    }
+    ReGlobalEpoch.compare_exchange_strong(Epoch, Epoch + 1, std::memory_order_seq_cst);
+}
+
+static void FreeLimbo(PRECLAIM_LIMBO Limbo)
+{
+    uint32_t Index;
+
+    for (Index = 0; Index < Limbo->Count; ++Index) {
+        Limbo->Objects[Index].Free(Limbo->Objects[Index].Object, Limbo->Objects[Index].Context);
+    }
+    ReReclaimed.fetch_add(Limbo->Count, std::memory_order_relaxed);
+    Limbo->Count = 0;
+}
+
+static void FreeExpired(PRECLAIM_THREAD Thread)
+{
+    uint64_t Epoch = ReGlobalEpoch.load(std::memory_order_acquire);
+    uint32_t Index;
+
+    for (Index = 0; Index < RECLAIM_EPOCHS; ++Index) {
+        if (Thread->Limbo[Index].Count != 0 && Thread->Limbo[Index].Epoch + 2 <= Epoch) {
+            FreeLimbo(&Thread->Limbo[Index]);
+        }
+    }
+    if (Thread->ReserveCount != 0 && Thread->ReserveEpoch + 2 <= Epoch) {
+        for (Index = 0; Index < Thread->ReserveCount; ++Index) {
+            Thread->Reserve[Index].Free(Thread->Reserve[Index].Object, Thread->Reserve[Index].Context);
+        }
+        ReReclaimed.fetch_add(Thread->ReserveCount, std::memory_order_relaxed);
+        Thread->ReserveCount = 0;
+    }
+}
+
+void ReCollect()
+{
+    TryAdvance();
+    FreeExpired(CurrentThread());
+}
+
+void ReSynchronize()
+{
+    PRECLAIM_THREAD Thread = CurrentThread();
+    uint64_t Epoch = ReGlobalEpoch.load(std::memory_order_acquire);
+
+    while (ReGlobalEpoch.load(std::memory_order_acquire) < Epoch + 2) {
+        TryAdvance();
+        if (ReGlobalEpoch.load(std::memory_order_acquire) < Epoch + 2) {
+            std::this_thread::yield();
+        }
+    }
+    FreeExpired(Thread);
+}
+
+//
+// The limbo slot of an epoch last held objects from three epochs ago at
+// least, which are always safe to free by now.
+//
+void ReRetire(void* Object, PRECLAIM_FREE Free, void* Context)
+{
+    PRECLAIM_THREAD Thread = CurrentThread();
+    uint64_t Epoch = ReGlobalEpoch.load(std::memory_order_acquire);
+    PRECLAIM_LIMBO Limbo = &Thread->Limbo[Epoch % RECLAIM_EPOCHS];
+
+    if (Limbo->Epoch != Epoch) {
+        FreeLimbo(Limbo);
+        Limbo->Epoch = Epoch;
+    }
+    if (Limbo->Count == Limbo->Capacity) {
+        uint32_t Capacity = Limbo->Capacity != 0 ? Limbo->Capacity * 2 : RECLAIM_COLLECT_THRESHOLD;
+        PRECLAIM_RETIRED Objects = (PRECLAIM_RETIRED)realloc(Limbo->Objects, Capacity * sizeof(RECLAIM_RETIRED));
+
+        //
+        // Without room to file it, the object can only be freed after a
+        // grace period, which a thread inside a critical section would
+        // never see end: that one files it in the reserve instead.
+        //
+        if (Objects == NULL) {
+            ReRetired.fetch_add(1, std::memory_order_relaxed);
+            if (Thread->Nesting == 0) {
+                ReSynchronize();
+                Free(Object, Context);
+                ReReclaimed.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (Thread->ReserveCount < RECLAIM_RESERVE) {
+                Thread->Reserve[Thread->ReserveCount].Object = Object;
+                Thread->Reserve[Thread->ReserveCount].Free = Free;
+                Thread->Reserve[Thread->ReserveCount].Context = Context;
+                Thread->ReserveCount += 1;
+                Thread->ReserveEpoch = Epoch;
+            }
+            else {
+                ReLeaked.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+        Limbo->Objects = Objects;
+        Limbo->Capacity = Capacity;
+    }
+
+    Limbo->Objects[Limbo->Count].Object = Object;
+    Limbo->Objects[Limbo->Count].Free = Free;
+    Limbo->Objects[Limbo->Count].Context = Context;
+    Limbo->Count += 1;
+    ReRetired.fetch_add(1, std::memory_order_relaxed);
+
+    if (++Thread->RetiredSinceCollect >= RECLAIM_COLLECT_THRESHOLD) {
+        Thread->RetiredSinceCollect = 0;
+        ReCollect();
+    }
+}
+
+void ReQueryStats(PRECLAIM_STATS Stats)
+{
+    Stats->Epoch = ReGlobalEpoch.load(std::memory_order_relaxed);
+    Stats->Retired = ReRetired.load(std::memory_order_relaxed);
+    Stats->Reclaimed = ReReclaimed.load(std::memory_order_relaxed);
+    Stats->Leaked = ReLeaked.load(std::memory_order_relaxed);
+}
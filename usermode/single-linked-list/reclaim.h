@@ -0,0 +1,67 @@
+// reclaim.h : Epoch-based reclamation for entries of lock-free lists.
+//
+// A pop reads the Next field of the first entry before its exchange, so an
+// entry popped by one thread may still be read by another, and must not be
+// freed until every pop that could have seen it is over. Instead of freeing
+// it, retire it: it is freed once every thread that was inside a critical
+// section at the time has left it.
+//
+// The process has one global epoch. ReEnter announces the epoch the thread
+// runs in and ReLeave clears it; retired objects are filed under the epoch
+// they were retired in. The epoch moves on when every thread inside a
+// critical section has seen the current one, and objects retired two epochs
+// ago can then no longer be reached by anyone. So:
+//
+//     ReEnter();
+//     Entry = SlPopEntry(&ListHead);
+//     ReLeave();
+//     ...
+//     ReRetire(Entry, FreeRoutine, Context);
+//
+// Critical sections nest and must be short: a thread that stays inside one
+// holds back every reclamation. Pushes and flushes read no entry and need
+// none.
+//
+
+#pragma once
+
+#include <stdint.h>
+
+typedef void (*PRECLAIM_FREE)(void* Object, void* Context);
+
+typedef struct _RECLAIM_STATS {
+    uint64_t Epoch;
+    uint64_t Retired;
+    uint64_t Reclaimed;
+    uint64_t Leaked;                    // retired with no memory to file them
+} RECLAIM_STATS, *PRECLAIM_STATS;
+
+void ReEnter();
+void ReLeave();
+
+//
+// Object is freed by Free(Object, Context) later on, on the thread that
+// retired it. May be called inside or outside a critical section.
+//
+// Retiring takes memory. Outside a critical section, running out of it
+// makes ReRetire wait for a grace period and free the object itself. Inside
+// one, the object goes to a small per-thread reserve, and once that is full
+// too it is never freed, and only counted as Leaked.
+//
+void ReRetire(void* Object, PRECLAIM_FREE Free, void* Context);
+
+//
+// Tries to move the epoch on and frees what the calling thread retired that
+// is old enough. ReRetire calls it every RECLAIM_COLLECT_THRESHOLD objects.
+//
+#define RECLAIM_COLLECT_THRESHOLD       64
+
+void ReCollect();
+
+//
+// Waits until every object the calling thread retired so far is freed.
+// Must not be called inside a critical section. Threads call it on exit.
+//
+void ReSynchronize();
+
+void ReQueryStats(PRECLAIM_STATS Stats);
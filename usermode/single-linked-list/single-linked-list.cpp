@@ -1,92 +1,156 @@
 // single-linked-list.cpp : This file contains the 'main' function. Program execution begins and ends there.
 //
+// The InterlockedPushEntrySList sample, run against the portable SList in
+// slist.h so it behaves the same on Windows and Linux, and through the typed
+// wrappers of intrusive.h so that no SL_ENTRY is cast by hand. Items come
+// from a lookaside list (see lookaside.h), so those freed by the first pass
+// are recycled by the second one instead of going back to malloc; the ones
+// the lookaside list has no room for are retired and freed once no pop can
+// still read them (see reclaim.h).
+//
+// Outside Visual Studio:
+//   g++ -O2 -mcx16 -o single-linked-list single-linked-list.cpp lookaside.cpp reclaim.cpp
+//
+
+#include "intrusive.h"
+#include "lookaside.h"
 
-#include <windows.h>
-#include <malloc.h>
 #include <stdio.h>
 
-// Structure to be used for a list item; the first member is the 
-// SLIST_ENTRY structure, and additional members are used for data.
+// Structure to be used for a list item; one member is the SL_ENTRY
+// structure, and additional members are used for data. The entry need not
+// come first, as the stack below knows where it is.
 // Here, the data is simply a signature for testing purposes. 
 
 
 typedef struct _PROGRAM_ITEM {
-	SLIST_ENTRY ItemEntry;
-	ULONG Signature;
+	SL_ENTRY ItemEntry;
+	uint32_t Signature;
 } PROGRAM_ITEM, *PPROGRAM_ITEM;
 
+typedef IntrusiveStack<INTRUSIVE_ENTRY(PROGRAM_ITEM, ItemEntry)> PROGRAM_ITEM_STACK;
+
 int main()
 {
-	ULONG Count;
-	PSLIST_ENTRY pFirstEntry, pListEntry;
-	PSLIST_HEADER pListHead;
+	uint32_t Count;
+	PPROGRAM_ITEM pFirstItem, pLastItem;
+	PROGRAM_ITEM_STACK* pListHead;
 	PPROGRAM_ITEM pProgramItem;
+	LOOKASIDE_LIST_EX Lookaside;
+	RECLAIM_STATS ReclaimStats;
 
-	// Initialize the list header to a MEMORY_ALLOCATION_ALIGNMENT boundary.
-	pListHead = (PSLIST_HEADER)_aligned_malloc(sizeof(SLIST_HEADER),
-		MEMORY_ALLOCATION_ALIGNMENT);
-	if (NULL == pListHead)
+	if (LaInitialize(&Lookaside, sizeof(PROGRAM_ITEM), NULL, NULL, NULL, 0, LOOKASIDE_RECLAIM) == false)
 	{
 		printf("Memory allocation failed.\n");
 		return -1;
 	}
-	InitializeSListHead(pListHead);
+
+	// The list header must be aligned on twice the pointer size for the
+	// double-width compare-exchange, which new honours.
+	pListHead = new PROGRAM_ITEM_STACK;
 
 	// Insert 10 items into the list.
 	for (Count = 1; Count <= 10; Count += 1)
 	{
-		pProgramItem = (PPROGRAM_ITEM)_aligned_malloc(sizeof(PROGRAM_ITEM),
-			MEMORY_ALLOCATION_ALIGNMENT);
+		pProgramItem = (PPROGRAM_ITEM)LaAllocate(&Lookaside);
 		if (NULL == pProgramItem)
 		{
 			printf("Memory allocation failed.\n");
 			return -1;
 		}
 		pProgramItem->Signature = Count;
-		pFirstEntry = InterlockedPushEntrySList(pListHead,
-			&(pProgramItem->ItemEntry));
+		pFirstItem = pListHead->Push(pProgramItem);
 	}
 
 	// Walk though the list and print the content.
-	pFirstEntry = &(pListHead->Next);
-	while (pFirstEntry->Next != NULL) {
-		pFirstEntry = pFirstEntry->Next;
-		pProgramItem = CONTAINING_RECORD(pFirstEntry, PROGRAM_ITEM, ItemEntry);
-		printf("Signature is %d\n", pProgramItem->Signature);
+	for (PPROGRAM_ITEM pItem : *pListHead) {
+		printf("Signature is %u\n", pItem->Signature);
 	} 
 
 	// Remove 10 items from the list and display the signature.
 	for (Count = 10; Count >= 1; Count -= 1)
 	{
-		pListEntry = InterlockedPopEntrySList(pListHead);
+		pProgramItem = pListHead->Pop();
 
-		if (NULL == pListEntry)
+		if (NULL == pProgramItem)
 		{
 			printf("List is empty.\n");
 			return -1;
 		}
 
-		pProgramItem = (PPROGRAM_ITEM)pListEntry;
-		printf("Signature is %d\n", pProgramItem->Signature);
+		printf("Signature is %u\n", pProgramItem->Signature);
+
+		// Pop returns the item itself, wherever its SL_ENTRY sits,
+		// so it can go straight to the free function.
+
+		LaFree(&Lookaside, pProgramItem);
+	}
+
+	// Link 10 more items into a chain and push it with a single exchange,
+	// then take them back 4 at a time.
+	pFirstItem = NULL;
+	pLastItem = NULL;
+	for (Count = 11; Count <= 20; Count += 1)
+	{
+		pProgramItem = (PPROGRAM_ITEM)LaAllocate(&Lookaside);
+		if (NULL == pProgramItem)
+		{
+			printf("Memory allocation failed.\n");
+			return -1;
+		}
+		pProgramItem->Signature = Count;
+		PROGRAM_ITEM_STACK::Traits::Link(pProgramItem, pFirstItem);
+		pFirstItem = pProgramItem;
+		if (NULL == pLastItem)
+		{
+			pLastItem = pFirstItem;
+		}
+	}
+	pListHead->PushChain(pFirstItem, pLastItem, 10);
+	printf("Depth after pushing a chain is %u\n", pListHead->QueryDepth());
 
-		// This example assumes that the SLIST_ENTRY structure is the 
-		// first member of the structure. If your structure does not 
-		// follow this convention, you must compute the starting address 
-		// of the structure before calling the free function.
+	for (;;)
+	{
+		PROGRAM_ITEM_STACK::Chain Popped = pListHead->PopMany(4);
 
-		_aligned_free(pListEntry);
+		if (Popped.IsEmpty())
+		{
+			break;
+		}
+		printf("Popped %u items:", Popped.QueryCount());
+		for (PPROGRAM_ITEM pItem : Popped)
+		{
+			printf(" %u", pItem->Signature);
+			LaFree(&Lookaside, pItem);
+		}
+		printf("\n");
 	}
 
 	// Flush the list and verify that the items are gone.
-	pListEntry = InterlockedFlushSList(pListHead);
-	pFirstEntry = InterlockedPopEntrySList(pListHead);
-	if (pFirstEntry != NULL)
+	pListHead->Flush();
+	pFirstItem = pListHead->Pop();
+	if (pFirstItem != NULL)
 	{
 		printf("Error: List is not empty.\n");
 		return -1;
 	}
 
-	_aligned_free(pListHead);
+	delete pListHead;
+
+	// Allocations that missed every list went to malloc.
+	Count = 0;
+	for (uint32_t Cpu = 0; Cpu < Lookaside.NumberOfCpus; Cpu += 1)
+	{
+		Count += Lookaside.PerCpu[Cpu].TotalAllocates.load();
+	}
+	printf("Lookaside list: %u allocations, %u from malloc\n", Count, Lookaside.Global.AllocateMisses.load());
+	LaDelete(&Lookaside);
+
+	ReSynchronize();
+	ReQueryStats(&ReclaimStats);
+	printf("Reclamation: %llu items retired, %llu freed, %llu leaked\n",
+		(unsigned long long)ReclaimStats.Retired, (unsigned long long)ReclaimStats.Reclaimed,
+		(unsigned long long)ReclaimStats.Leaked);
 
 	return 1;
 }
\ No newline at end of file
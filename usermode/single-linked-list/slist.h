@@ -0,0 +1,293 @@
+// slist.h : A portable interlocked singly linked list, with the semantics of
+// the Win32 SList (InterlockedPushEntrySList and friends).
+//
+// The list head is two pointer-sized words: the first entry, and a 16-bit
+// depth next to a sequence number (48 bits on 64-bit targets, 16 on 32-bit
+// ones). Every push and pop replaces both words with one double-width
+// compare-exchange (cmpxchg16b on x64, cmpxchg8b on x86) and bumps the
+// sequence, so a pop that read First and First->Next cannot succeed if
+// First was popped and pushed back in the meantime: the ABA problem.
+// Chains of entries move with a single exchange as well: SlPushList,
+// SlPopEntries and SlFlush cost one atomic operation whatever their length.
+//
+// Entries are embedded in the caller's structures, as with SLIST_ENTRY, and
+// CONTAINING_RECORD gets back to the structure. Unlike on Windows they need
+// no 16-byte alignment, as the whole pointer is kept.
+//
+// As with the Win32 SList, a pop may read the Next field of an entry that
+// another thread has just popped. Popped entries can be reused for anything
+// that keeps the memory mapped, but not handed back to the OS while other
+// threads may still pop.
+//
+// GCC and Clang need -mcx16 on x64 for the compare-exchange to be inlined.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#elif UINTPTR_MAX == UINT64_MAX
+typedef unsigned __int128 SL_DOUBLE_WORD;
+#else
+typedef uint64_t SL_DOUBLE_WORD;
+#endif
+
+#ifndef CONTAINING_RECORD
+#define CONTAINING_RECORD(address, type, field) ((type*)((char*)(address) - offsetof(type, field)))
+#endif
+
+#define SL_SEQUENCE_BITS                (sizeof(void*) * 8 - 16)
+
+typedef struct _SL_ENTRY {
+    struct _SL_ENTRY* Next;
+} SL_ENTRY, *PSL_ENTRY;
+
+typedef union alignas(2 * sizeof(void*)) _SL_HEADER {
+    struct {
+        PSL_ENTRY Next;
+        uintptr_t Depth : 16;
+        uintptr_t Sequence : SL_SEQUENCE_BITS;
+    };
+    uintptr_t Words[2];
+} SL_HEADER, *PSL_HEADER;
+
+static_assert(sizeof(SL_HEADER) == 2 * sizeof(void*), "SL_HEADER must be two words");
+
+//
+// Reads both words without a lock. The copy may be torn, in which case the
+// compare-exchange that follows fails and the caller reads again.
+//
+inline void SlpReadHeader(const SL_HEADER* Header, PSL_HEADER Copy)
+{
+    const volatile uintptr_t* Words = Header->Words;
+
+    Copy->Words[1] = Words[1];
+    Copy->Words[0] = Words[0];
+}
+
+//
+// Replaces the header with Exchange if it still equals Comparand; on failure
+// Comparand gets the current value. Full barrier either way.
+//
+inline bool SlpCompareExchange(PSL_HEADER Header, PSL_HEADER Comparand, const SL_HEADER* Exchange)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    return _InterlockedCompareExchange128((volatile long long*)Header->Words, (long long)Exchange->Words[1],
+        (long long)Exchange->Words[0], (long long*)Comparand->Words) != 0;
+#elif defined(_MSC_VER)
+    long long Expected = ((long long)Comparand->Words[1] << 32) | Comparand->Words[0];
+    long long Value = ((long long)Exchange->Words[1] << 32) | Exchange->Words[0];
+    long long Current = _InterlockedCompareExchange64((volatile long long*)Header->Words, Value, Expected);
+
+    Comparand->Words[0] = (uintptr_t)Current;
+    Comparand->Words[1] = (uintptr_t)(Current >> 32);
+    return Current == Expected;
+#else
+    SL_DOUBLE_WORD Expected;
+    SL_DOUBLE_WORD Value;
+    SL_DOUBLE_WORD Current;
+
+    memcpy(&Expected, Comparand, sizeof(Expected));
+    memcpy(&Value, Exchange, sizeof(Value));
+    Current = __sync_val_compare_and_swap((SL_DOUBLE_WORD*)Header->Words, Expected, Value);
+    memcpy(Comparand, &Current, sizeof(Current));
+    return Current == Expected;
+#endif
+}
+
+inline void SlInitializeHead(PSL_HEADER Header)
+{
+    Header->Words[0] = 0;
+    Header->Words[1] = 0;
+}
+
+//
+// Returns the entry that was first before the push, like
+// InterlockedPushEntrySList.
+//
+inline PSL_ENTRY SlPushEntry(PSL_HEADER Header, PSL_ENTRY Entry)
+{
+    SL_HEADER Old;
+    SL_HEADER New;
+
+    SlpReadHeader(Header, &Old);
+    do {
+        Entry->Next = Old.Next;
+        New.Next = Entry;
+        New.Depth = Old.Depth + 1;
+        New.Sequence = Old.Sequence + 1;
+    } while (SlpCompareExchange(Header, &Old, &New) == false);
+    return Old.Next;
+}
+
+inline PSL_ENTRY SlPopEntry(PSL_HEADER Header)
+{
+    SL_HEADER Old;
+    SL_HEADER New;
+
+    SlpReadHeader(Header, &Old);
+    do {
+        if (Old.Next == NULL) {
+            return NULL;
+        }
+
+        //
+        // Old.Next may be popped and reused by another thread right now, in
+        // which case this reads garbage and the exchange fails.
+        //
+        New.Next = ((volatile SL_ENTRY*)Old.Next)->Next;
+        New.Depth = Old.Depth - 1;
+        New.Sequence = Old.Sequence + 1;
+    } while (SlpCompareExchange(Header, &Old, &New) == false);
+    return Old.Next;
+}
+
+//
+// Single attempts at a push or a pop, for callers that do something else
+// than retry when the exchange is lost to another thread: back off, count
+// contention, or try elsewhere. They return false only when the exchange
+// failed; a pop from an empty list succeeds with *Entry set to NULL.
+//
+inline bool SlTryPushEntry(PSL_HEADER Header, PSL_ENTRY Entry)
+{
+    SL_HEADER Old;
+    SL_HEADER New;
+
+    SlpReadHeader(Header, &Old);
+    Entry->Next = Old.Next;
+    New.Next = Entry;
+    New.Depth = Old.Depth + 1;
+    New.Sequence = Old.Sequence + 1;
+    return SlpCompareExchange(Header, &Old, &New);
+}
+
+inline bool SlTryPopEntry(PSL_HEADER Header, PSL_ENTRY* Entry)
+{
+    SL_HEADER Old;
+    SL_HEADER New;
+
+    SlpReadHeader(Header, &Old);
+    if (Old.Next == NULL) {
+        *Entry = NULL;
+        return true;
+    }
+    New.Next = ((volatile SL_ENTRY*)Old.Next)->Next;
+    New.Depth = Old.Depth - 1;
+    New.Sequence = Old.Sequence + 1;
+    if (SlpCompareExchange(Header, &Old, &New) == false) {
+        return false;
+    }
+    *Entry = Old.Next;
+    return true;
+}
+
+//
+// Takes every entry at once and returns them still chained, first entry
+// first, like InterlockedFlushSList.
+//
+inline PSL_ENTRY SlFlush(PSL_HEADER Header)
+{
+    SL_HEADER Old;
+    SL_HEADER New;
+
+    SlpReadHeader(Header, &Old);
+    do {
+        if (Old.Next == NULL) {
+            return NULL;
+        }
+        New.Next = NULL;
+        New.Depth = 0;
+        New.Sequence = Old.Sequence + 1;
+    } while (SlpCompareExchange(Header, &Old, &New) == false);
+    return Old.Next;
+}
+
+//
+// Pushes a chain of Count entries already linked from List to ListEnd with
+// a single exchange, like InterlockedPushListSListEx. Returns the entry
+// that was first before the push.
+//
+inline PSL_ENTRY SlPushList(PSL_HEADER Header, PSL_ENTRY List, PSL_ENTRY ListEnd, uint32_t Count)
+{
+    SL_HEADER Old;
+    SL_HEADER New;
+
+    SlpReadHeader(Header, &Old);
+    do {
+        ListEnd->Next = Old.Next;
+        New.Next = List;
+        New.Depth = Old.Depth + Count;
+        New.Sequence = Old.Sequence + 1;
+    } while (SlpCompareExchange(Header, &Old, &New) == false);
+    return Old.Next;
+}
+
+//
+// Pops up to Count entries with a single exchange and returns them chained
+// and NULL terminated, first entry first; *Popped gets how many.
+//
+// Walking past the first entry is only safe while none of the entries
+// walked so far has been popped, so the head is read again before following
+// each link: an unchanged sequence means the list has not changed at all.
+//
+inline PSL_ENTRY SlPopEntries(PSL_HEADER Header, uint32_t Count, uint32_t* Popped)
+{
+    SL_HEADER Old;
+    SL_HEADER New;
+    SL_HEADER Check;
+    PSL_ENTRY Last;
+    uint32_t Index;
+    bool Changed;
+
+    SlpReadHeader(Header, &Old);
+    for (;;) {
+        if (Old.Next == NULL || Count == 0) {
+            *Popped = 0;
+            return NULL;
+        }
+
+        Last = Old.Next;
+        Changed = false;
+        for (Index = 1; Index < Count; ++Index) {
+            PSL_ENTRY Next = ((volatile SL_ENTRY*)Last)->Next;
+
+            SlpReadHeader(Header, &Check);
+            if (Check.Words[0] != Old.Words[0] || Check.Words[1] != Old.Words[1]) {
+                Changed = true;
+                break;
+            }
+            if (Next == NULL) {
+                break;
+            }
+            Last = Next;
+        }
+        if (Changed) {
+            Old = Check;
+            continue;
+        }
+
+        New.Next = ((volatile SL_ENTRY*)Last)->Next;
+        New.Depth = Old.Depth - Index;
+        New.Sequence = Old.Sequence + 1;
+        if (SlpCompareExchange(Header, &Old, &New)) {
+            Last->Next = NULL;
+            *Popped = Index;
+            return Old.Next;
+        }
+    }
+}
+
+//
+// Like QueryDepthSList, the depth wraps past 65535 entries.
+//
+inline uint16_t SlQueryDepth(const SL_HEADER* Header)
+{
+    SL_HEADER Copy;
+
+    SlpReadHeader(Header, &Copy);
+    return (uint16_t)Copy.Depth;
+}
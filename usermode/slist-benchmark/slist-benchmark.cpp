@@ -0,0 +1,443 @@
+// slist-benchmark.cpp : This file contains the 'main' function. Program execution begins and ends there.
+//
+// Measures how the SList in ../single-linked-list/slist.h holds up as
+// threads are added, against the other ways of handing nodes between
+// threads:
+//
+//  - slist: the lock-free SList, one compare-exchange on the head per op.
+//  - mutex: a plain stack under a std::mutex.
+//  - elimination: the SList behind an elimination array, from
+//    ../single-linked-list/elimination.h: colliding pushes and pops hand
+//    nodes over in the array without touching the head.
+//  - ring: the bounded MPMC queue from ../single-linked-list/mpmc-queue.h.
+//
+// Every thread starts with NODES_PER_THREAD nodes of its own, and as many
+// more start in the container. Each op is a push of one of the thread's
+// nodes or a pop into them, picked at random with --push-percent pushes.
+// Runs go through 1, 2, 4 ... threads up to --threads and report ops per
+// second, the share of compare-exchanges that failed (for the mutex, of
+// acquisitions that found it taken; not visible from outside elimination.h
+// and mpmc-queue.h), the share of ops completed by elimination, and the
+// p50 / p99 latency of ops timed one in 16.
+//
+// Outside Visual Studio: g++ -O2 -mcx16 -pthread -o slist-benchmark slist-benchmark.cpp ../single-linked-list/elimination.cpp ../single-linked-list/mpmc-queue.cpp
+//
+
+#include "../common/benchmark-util.h"
+#include "../single-linked-list/elimination.h"
+#include "../single-linked-list/mpmc-queue.h"
+#include "../single-linked-list/slist.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#define MAXIMUM_THREADS                 256
+#define NODES_PER_THREAD                256
+#define LATENCY_SAMPLE_MASK             15
+
+typedef struct _RUN RUN, *PRUN;
+
+typedef struct alignas(64) _WORKER {
+    PRUN Run;
+    uint64_t Random;
+    uint64_t Operations;
+    uint64_t Attempts;
+    uint64_t Failures;
+    uint64_t Latency[LATENCY_BUCKETS];
+} WORKER, *PWORKER;
+
+//
+// Containers count their compare-exchange attempts and failures in the
+// calling worker, if they can see them. QueryEliminated is NULL for those
+// that do not eliminate.
+//
+typedef struct _CONTAINER {
+    const char* Name;
+    void* (*Create)(uint32_t Capacity);
+    void (*Destroy)(void* Instance);
+    void (*Push)(void* Instance, PSL_ENTRY Entry, PWORKER Worker);
+    PSL_ENTRY (*Pop)(void* Instance, PWORKER Worker);
+    uint64_t (*QueryEliminated)(void* Instance);
+} CONTAINER, *PCONTAINER;
+
+struct _RUN {
+    const CONTAINER* Container;
+    void* Instance;
+    uint32_t PushPercent;
+    std::atomic<uint32_t> Ready;
+    std::atomic<bool> Start;
+    std::atomic<bool> Stop;
+};
+
+static uint64_t NextRandom(PWORKER Worker)
+{
+    Worker->Random ^= Worker->Random << 13;
+    Worker->Random ^= Worker->Random >> 7;
+    Worker->Random ^= Worker->Random << 17;
+    return Worker->Random;
+}
+
+static void* CreateSList(uint32_t Capacity)
+{
+    PSL_HEADER Header = new SL_HEADER;
+
+    (void)Capacity;
+
+    SlInitializeHead(Header);
+    return Header;
+}
+
+static void DestroySList(void* Instance)
+{
+    delete (PSL_HEADER)Instance;
+}
+
+static void SListPush(void* Instance, PSL_ENTRY Entry, PWORKER Worker)
+{
+    for (;;) {
+        Worker->Attempts += 1;
+        if (SlTryPushEntry((PSL_HEADER)Instance, Entry)) {
+            return;
+        }
+        Worker->Failures += 1;
+    }
+}
+
+static PSL_ENTRY SListPop(void* Instance, PWORKER Worker)
+{
+    PSL_ENTRY Entry;
+
+    for (;;) {
+        Worker->Attempts += 1;
+        if (SlTryPopEntry((PSL_HEADER)Instance, &Entry)) {
+            return Entry;
+        }
+        Worker->Failures += 1;
+    }
+}
+
+typedef struct _MUTEX_STACK {
+    std::mutex Lock;
+    PSL_ENTRY Top;
+} MUTEX_STACK, *PMUTEX_STACK;
+
+static void* CreateMutexStack(uint32_t Capacity)
+{
+    (void)Capacity;
+
+    return new MUTEX_STACK();
+}
+
+static void DestroyMutexStack(void* Instance)
+{
+    delete (PMUTEX_STACK)Instance;
+}
+
+static void AcquireCounted(PMUTEX_STACK Stack, PWORKER Worker)
+{
+    Worker->Attempts += 1;
+    if (Stack->Lock.try_lock() == false) {
+        Worker->Failures += 1;
+        Stack->Lock.lock();
+    }
+}
+
+static void MutexPush(void* Instance, PSL_ENTRY Entry, PWORKER Worker)
+{
+    PMUTEX_STACK Stack = (PMUTEX_STACK)Instance;
+
+    AcquireCounted(Stack, Worker);
+    Entry->Next = Stack->Top;
+    Stack->Top = Entry;
+    Stack->Lock.unlock();
+}
+
+static PSL_ENTRY MutexPop(void* Instance, PWORKER Worker)
+{
+    PMUTEX_STACK Stack = (PMUTEX_STACK)Instance;
+    PSL_ENTRY Entry;
+
+    AcquireCounted(Stack, Worker);
+    Entry = Stack->Top;
+    if (Entry != NULL) {
+        Stack->Top = Entry->Next;
+    }
+    Stack->Lock.unlock();
+    return Entry;
+}
+
+static void* CreateEliminationStack(uint32_t Capacity)
+{
+    PELIMINATION_STACK Stack = new ELIMINATION_STACK;
+
+    (void)Capacity;
+
+    ElInitialize(Stack);
+    return Stack;
+}
+
+static void DestroyEliminationStack(void* Instance)
+{
+    delete (PELIMINATION_STACK)Instance;
+}
+
+static void EliminationPush(void* Instance, PSL_ENTRY Entry, PWORKER Worker)
+{
+    (void)Worker;
+
+    ElPushEntry((PELIMINATION_STACK)Instance, Entry);
+}
+
+static PSL_ENTRY EliminationPop(void* Instance, PWORKER Worker)
+{
+    (void)Worker;
+
+    return ElPopEntry((PELIMINATION_STACK)Instance);
+}
+
+static uint64_t EliminationQueryEliminated(void* Instance)
+{
+    ELIMINATION_STATS Stats;
+
+    ElQueryStats((PELIMINATION_STACK)Instance, &Stats);
+    return Stats.Eliminated;
+}
+
+//
+// The queue holds every node of the run, so it is never full.
+//
+static void* CreateQueue(uint32_t Capacity)
+{
+    PMPMC_QUEUE Queue = new MPMC_QUEUE;
+
+    if (MqInitialize(Queue, Capacity) == false) {
+        delete Queue;
+        return NULL;
+    }
+    return Queue;
+}
+
+static void DestroyQueue(void* Instance)
+{
+    MqDelete((PMPMC_QUEUE)Instance);
+    delete (PMPMC_QUEUE)Instance;
+}
+
+static void QueuePush(void* Instance, PSL_ENTRY Entry, PWORKER Worker)
+{
+    (void)Worker;
+
+    MqTryEnqueue((PMPMC_QUEUE)Instance, Entry);
+}
+
+static PSL_ENTRY QueuePop(void* Instance, PWORKER Worker)
+{
+    (void)Worker;
+
+    return MqTryDequeue((PMPMC_QUEUE)Instance);
+}
+
+static const CONTAINER Containers[] = {
+    { "slist", CreateSList, DestroySList, SListPush, SListPop, NULL },
+    { "mutex", CreateMutexStack, DestroyMutexStack, MutexPush, MutexPop, NULL },
+    { "elimination", CreateEliminationStack, DestroyEliminationStack, EliminationPush, EliminationPop,
+        EliminationQueryEliminated },
+    { "ring", CreateQueue, DestroyQueue, QueuePush, QueuePop, NULL },
+};
+
+static uint64_t Nanoseconds()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//
+// Nodes holds the thread's own nodes on entry, and has room for every node
+// of the run since pops can take any number of them.
+//
+static void RunWorker(PWORKER Worker, PSL_ENTRY* Nodes, uint32_t Count)
+{
+    PRUN Run = Worker->Run;
+    const CONTAINER* Container = Run->Container;
+    uint64_t Start = 0;
+    bool Timed;
+    bool Push;
+
+    Run->Ready.fetch_add(1);
+    while (Run->Start.load() == false) {
+    }
+
+    while (Run->Stop.load(std::memory_order_relaxed) == false) {
+        Push = NextRandom(Worker) % 100 < Run->PushPercent && Count != 0;
+        Timed = (++Worker->Operations & LATENCY_SAMPLE_MASK) == 0;
+        if (Timed) {
+            Start = Nanoseconds();
+        }
+        if (Push) {
+            Container->Push(Run->Instance, Nodes[--Count], Worker);
+        }
+        else {
+            PSL_ENTRY Entry = Container->Pop(Run->Instance, Worker);
+
+            if (Entry != NULL) {
+                Nodes[Count++] = Entry;
+            }
+        }
+        if (Timed) {
+            Worker->Latency[LatencyBucket(Nanoseconds() - Start)] += 1;
+        }
+    }
+}
+
+static bool Measure(const CONTAINER* Container, uint32_t NumberOfThreads, uint32_t PushPercent,
+    uint32_t Milliseconds)
+{
+    uint32_t TotalNodes = 2 * NODES_PER_THREAD * NumberOfThreads;
+    SL_ENTRY* Nodes = new SL_ENTRY[TotalNodes];
+    PSL_ENTRY* Local = new PSL_ENTRY[(size_t)TotalNodes * NumberOfThreads];
+    PWORKER Workers = new WORKER[NumberOfThreads]();
+    std::thread* Threads = new std::thread[NumberOfThreads];
+    uint64_t Operations = 0;
+    uint64_t Attempts = 0;
+    uint64_t Failures = 0;
+    uint64_t Eliminated = 0;
+    uint64_t* Latency = new uint64_t[LATENCY_BUCKETS]();
+    char FailText[16] = "-";
+    char EliminatedText[16] = "-";
+    uint64_t Start;
+    double Seconds;
+    RUN Run;
+    uint32_t Index;
+
+    Run.Container = Container;
+    Run.PushPercent = PushPercent;
+    Run.Ready = 0;
+    Run.Start = false;
+    Run.Stop = false;
+    Run.Instance = Container->Create(TotalNodes);
+    if (Run.Instance == NULL) {
+        printf("Out of memory creating %s for %u threads\n", Container->Name, NumberOfThreads);
+        delete[] Latency;
+        delete[] Threads;
+        delete[] Workers;
+        delete[] Local;
+        delete[] Nodes;
+        return false;
+    }
+
+    for (Index = 0; Index < NumberOfThreads; ++Index) {
+        Workers[Index].Run = &Run;
+        Workers[Index].Random = 0x9e3779b97f4a7c15ull * (Index + 1);
+        for (uint32_t Node = 0; Node < NODES_PER_THREAD; ++Node) {
+            Local[(size_t)Index * TotalNodes + Node] = &Nodes[Index * NODES_PER_THREAD + Node];
+            Container->Push(Run.Instance, &Nodes[(NumberOfThreads + Index) * NODES_PER_THREAD + Node], &Workers[Index]);
+        }
+        Workers[Index].Attempts = 0;
+        Workers[Index].Failures = 0;
+    }
+
+    for (Index = 0; Index < NumberOfThreads; ++Index) {
+        Threads[Index] = std::thread(RunWorker, &Workers[Index], &Local[(size_t)Index * TotalNodes], NODES_PER_THREAD);
+    }
+    while (Run.Ready.load() != NumberOfThreads) {
+    }
+    Start = Nanoseconds();
+    Run.Start.store(true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(Milliseconds));
+    Run.Stop.store(true);
+    Seconds = (Nanoseconds() - Start) / 1e9;
+    for (Index = 0; Index < NumberOfThreads; ++Index) {
+        Threads[Index].join();
+        Operations += Workers[Index].Operations;
+        Attempts += Workers[Index].Attempts;
+        Failures += Workers[Index].Failures;
+        for (uint32_t Bucket = 0; Bucket < LATENCY_BUCKETS; ++Bucket) {
+            Latency[Bucket] += Workers[Index].Latency[Bucket];
+        }
+    }
+
+
+    //
+    // Each elimination completes a push and a pop.
+    //
+    if (Attempts != 0) {
+        snprintf(FailText, sizeof(FailText), "%.2f%%", 100.0 * Failures / Attempts);
+    }
+    if (Container->QueryEliminated != NULL && Operations != 0) {
+        Eliminated = 2 * Container->QueryEliminated(Run.Instance);
+        snprintf(EliminatedText, sizeof(EliminatedText), "%.2f%%", 100.0 * Eliminated / Operations);
+    }
+    printf("%-12s %7u %6u%% %12.0f %9s %11s %8llu %8llu\n",
+        Container->Name, NumberOfThreads, PushPercent, Operations / Seconds, FailText, EliminatedText,
+        (unsigned long long)LatencyPercentile(Latency, 50.0),
+        (unsigned long long)LatencyPercentile(Latency, 99.0));
+
+    Container->Destroy(Run.Instance);
+    delete[] Latency;
+    delete[] Threads;
+    delete[] Workers;
+    delete[] Local;
+    delete[] Nodes;
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* ContainerList = NULL;
+    uint32_t MaximumThreads = std::thread::hardware_concurrency();
+    uint32_t Milliseconds = 1000;
+    uint32_t PushPercent = 50;
+    int Index;
+
+    for (Index = 1; Index < argc; ++Index) {
+        if (strcmp(argv[Index], "--container") == 0 && Index + 1 < argc) {
+            ContainerList = argv[++Index];
+        }
+        else if (strcmp(argv[Index], "--threads") == 0 && Index + 1 < argc) {
+            MaximumThreads = (uint32_t)strtoul(argv[++Index], NULL, 0);
+        }
+        else if (strcmp(argv[Index], "--seconds") == 0 && Index + 1 < argc) {
+            Milliseconds = (uint32_t)(atof(argv[++Index]) * 1000);
+        }
+        else if (strcmp(argv[Index], "--push-percent") == 0 && Index + 1 < argc) {
+            PushPercent = (uint32_t)strtoul(argv[++Index], NULL, 0);
+        }
+        else {
+            break;
+        }
+    }
+    if (Index < argc || Milliseconds == 0 || PushPercent > 100) {
+        printf("Usage: slist-benchmark [--container slist,mutex,elimination,ring] [--threads maximum]\n" \
+            "                       [--seconds per run] [--push-percent 0-100]\n");
+        return 1;
+    }
+    if (MaximumThreads == 0) {
+        MaximumThreads = 1;
+    }
+    if (MaximumThreads > MAXIMUM_THREADS) {
+        MaximumThreads = MAXIMUM_THREADS;
+    }
+
+    printf("%-12s %7s %7s %12s %9s %11s %8s %8s\n",
+        "container", "threads", "push", "ops/s", "CAS fail", "eliminated", "p50 ns", "p99 ns");
+
+    for (const CONTAINER& Container : Containers) {
+        if (Selected(ContainerList, Container.Name) == false) {
+            continue;
+        }
+        for (uint32_t Threads = 1; ; Threads = Threads * 2 < MaximumThreads ? Threads * 2 : MaximumThreads) {
+            if (Measure(&Container, Threads, PushPercent, Milliseconds) == false) {
+                return 1;
+            }
+            if (Threads == MaximumThreads) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
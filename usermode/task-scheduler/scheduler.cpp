@@ -0,0 +1,320 @@
+// scheduler.cpp : A work-stealing task scheduler for fork/join code.
+//
+
+#include "scheduler.h"
+
+#include <chrono>
+#include <new>
+
+//
+// Rounds of looking for work before an idle worker parks, and victims tried
+// per round for each worker.
+//
+#define TS_SPINS                        64
+#define TS_STEAL_ATTEMPTS               2
+
+//
+// How long a thread other than a worker sleeps between checks of the group
+// it waits for, once it has spun TS_SPINS times.
+//
+#define TS_EXTERNAL_WAIT_US             100
+
+static thread_local PTS_WORKER TsCurrentWorker;
+
+static void Count(std::atomic<uint64_t>* Counter)
+{
+    Counter->store(Counter->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+static uint32_t NextRandom(PTS_WORKER Worker)
+{
+    Worker->Random ^= Worker->Random << 13;
+    Worker->Random ^= Worker->Random >> 17;
+    Worker->Random ^= Worker->Random << 5;
+    return Worker->Random;
+}
+
+static PTS_WORKER CurrentWorker(PTASK_SCHEDULER Scheduler)
+{
+    PTS_WORKER Worker = TsCurrentWorker;
+
+    return Worker != NULL && Worker->Scheduler == Scheduler ? Worker : NULL;
+}
+
+//
+// Called after publishing work. The fence pairs with the one a worker
+// places between counting itself as a sleeper and looking for work one last
+// time, so either that look finds the work or this sees the sleeper.
+//
+static void WakeWorker(PTASK_SCHEDULER Scheduler)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (Scheduler->Sleepers.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> Guard(Scheduler->Lock);
+
+        Scheduler->WakeGeneration += 1;
+    }
+    Scheduler->Wake.notify_one();
+}
+
+//
+// The group is read before the routine runs: once the count drops to zero
+// the waiter may free the task.
+//
+static void RunTask(PTASK_SCHEDULER Scheduler, PTS_WORKER Worker, PSL_ENTRY Entry)
+{
+    PTASK Task = CONTAINING_RECORD(Entry, TASK, Entry);
+    PTASK_GROUP Group = Task->Group;
+
+    Task->Routine(Scheduler, Task);
+    Count(&Worker->Executed);
+    Group->Pending.fetch_sub(1, std::memory_order_release);
+}
+
+//
+// Takes the whole injection queue with one exchange, keeps the first task
+// and moves the others to the worker's deque for the others to steal. A
+// flush reads no entry, so tasks freed meanwhile are never touched, which a
+// pop could not promise.
+//
+static PSL_ENTRY TakeInjected(PTASK_SCHEDULER Scheduler, PTS_WORKER Worker)
+{
+    PSL_ENTRY First = SlFlush(&Scheduler->Injection);
+    PSL_ENTRY Entry;
+    PSL_ENTRY Next;
+
+    if (First == NULL) {
+        return NULL;
+    }
+    for (Entry = First->Next; Entry != NULL; Entry = Next) {
+        Next = Entry->Next;
+        if (WdPush(&Worker->Deque, Entry) == false) {
+            SlPushEntry(&Scheduler->Injection, Entry);
+        }
+    }
+    if (First->Next != NULL) {
+        WakeWorker(Scheduler);
+    }
+    return First;
+}
+
+static PSL_ENTRY StealTask(PTASK_SCHEDULER Scheduler, PTS_WORKER Worker)
+{
+    uint32_t Attempt;
+    PTS_WORKER Victim;
+    PSL_ENTRY Entry;
+    bool Lost;
+
+    if (Scheduler->NumberOfWorkers < 2) {
+        return NULL;
+    }
+    for (Attempt = 0; Attempt < TS_STEAL_ATTEMPTS * Scheduler->NumberOfWorkers; ++Attempt) {
+        Victim = &Scheduler->Workers[NextRandom(Worker) % Scheduler->NumberOfWorkers];
+        if (Victim == Worker) {
+            continue;
+        }
+        Count(&Worker->StealAttempts);
+        Entry = WdSteal(&Victim->Deque, &Lost);
+        if (Entry != NULL) {
+            Count(&Worker->Steals);
+            return Entry;
+        }
+    }
+    return NULL;
+}
+
+static PSL_ENTRY FindTask(PTASK_SCHEDULER Scheduler, PTS_WORKER Worker)
+{
+    PSL_ENTRY Entry = WdPop(&Worker->Deque);
+
+    if (Entry == NULL) {
+        Entry = TakeInjected(Scheduler, Worker);
+    }
+    if (Entry == NULL) {
+        Entry = StealTask(Scheduler, Worker);
+    }
+    return Entry;
+}
+
+static bool HasWork(PTASK_SCHEDULER Scheduler)
+{
+    SL_HEADER Injection;
+    uint32_t Index;
+
+    SlpReadHeader(&Scheduler->Injection, &Injection);
+    if (Injection.Next != NULL) {
+        return true;
+    }
+    for (Index = 0; Index < Scheduler->NumberOfWorkers; ++Index) {
+        if (WdIsEmpty(&Scheduler->Workers[Index].Deque) == false) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void Park(PTASK_SCHEDULER Scheduler, PTS_WORKER Worker)
+{
+    std::unique_lock<std::mutex> Guard(Scheduler->Lock);
+    uint64_t Seen = Scheduler->WakeGeneration;
+
+    Guard.unlock();
+    Scheduler->Sleepers.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (Scheduler->Stop.load(std::memory_order_relaxed) == false && HasWork(Scheduler) == false) {
+        Count(&Worker->Parks);
+        Guard.lock();
+        while (Scheduler->WakeGeneration == Seen) {
+            Scheduler->Wake.wait(Guard);
+        }
+        Guard.unlock();
+    }
+    Scheduler->Sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static void WorkerMain(PTS_WORKER Worker)
+{
+    PTASK_SCHEDULER Scheduler = Worker->Scheduler;
+    uint32_t Idle = 0;
+    PSL_ENTRY Entry;
+
+    TsCurrentWorker = Worker;
+    while (Scheduler->Stop.load(std::memory_order_relaxed) == false) {
+        Entry = FindTask(Scheduler, Worker);
+        if (Entry != NULL) {
+            RunTask(Scheduler, Worker, Entry);
+            Idle = 0;
+            continue;
+        }
+        if (++Idle < TS_SPINS) {
+            std::this_thread::yield();
+            continue;
+        }
+        Park(Scheduler, Worker);
+        Idle = 0;
+    }
+    TsCurrentWorker = NULL;
+}
+
+bool TsInitialize(PTASK_SCHEDULER Scheduler, uint32_t NumberOfWorkers)
+{
+    uint32_t Index;
+
+    if (NumberOfWorkers == 0) {
+        NumberOfWorkers = std::thread::hardware_concurrency();
+    }
+    if (NumberOfWorkers == 0) {
+        NumberOfWorkers = 1;
+    }
+
+    Scheduler->Workers = new (std::nothrow) TS_WORKER[NumberOfWorkers]();
+    if (Scheduler->Workers == NULL) {
+        return false;
+    }
+    for (Index = 0; Index < NumberOfWorkers; ++Index) {
+        if (WdInitialize(&Scheduler->Workers[Index].Deque) == false) {
+            while (Index-- != 0) {
+                WdDelete(&Scheduler->Workers[Index].Deque);
+            }
+            delete[] Scheduler->Workers;
+            Scheduler->Workers = NULL;
+            return false;
+        }
+        Scheduler->Workers[Index].Scheduler = Scheduler;
+        Scheduler->Workers[Index].Random = 2654435761u * (Index + 1) | 1;
+    }
+
+    Scheduler->NumberOfWorkers = NumberOfWorkers;
+    SlInitializeHead(&Scheduler->Injection);
+    Scheduler->Sleepers.store(0, std::memory_order_relaxed);
+    Scheduler->Stop.store(false, std::memory_order_relaxed);
+    Scheduler->WakeGeneration = 0;
+    for (Index = 0; Index < NumberOfWorkers; ++Index) {
+        Scheduler->Workers[Index].Thread = std::thread(WorkerMain, &Scheduler->Workers[Index]);
+    }
+    return true;
+}
+
+void TsDelete(PTASK_SCHEDULER Scheduler)
+{
+    uint32_t Index;
+
+    Scheduler->Stop.store(true, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> Guard(Scheduler->Lock);
+
+        Scheduler->WakeGeneration += 1;
+    }
+    Scheduler->Wake.notify_all();
+
+    for (Index = 0; Index < Scheduler->NumberOfWorkers; ++Index) {
+        Scheduler->Workers[Index].Thread.join();
+        WdDelete(&Scheduler->Workers[Index].Deque);
+    }
+    delete[] Scheduler->Workers;
+    Scheduler->Workers = NULL;
+}
+
+//
+// On a worker the task goes to its own deque; anywhere else, or if the
+// deque cannot grow, to the injection queue.
+//
+void TsSpawn(PTASK_SCHEDULER Scheduler, PTASK_GROUP Group, PTASK Task, PTASK_ROUTINE Routine)
+{
+    PTS_WORKER Worker = CurrentWorker(Scheduler);
+
+    Task->Routine = Routine;
+    Task->Group = Group;
+    Group->Pending.fetch_add(1, std::memory_order_relaxed);
+    if (Worker == NULL || WdPush(&Worker->Deque, &Task->Entry) == false) {
+        SlPushEntry(&Scheduler->Injection, &Task->Entry);
+    }
+    WakeWorker(Scheduler);
+}
+
+//
+// A worker runs whatever it finds meanwhile, its own tasks first, which are
+// usually the group's. Other threads only wait.
+//
+void TsWait(PTASK_SCHEDULER Scheduler, PTASK_GROUP Group)
+{
+    PTS_WORKER Worker = CurrentWorker(Scheduler);
+    uint32_t Spin = 0;
+    PSL_ENTRY Entry;
+
+    while (Group->Pending.load(std::memory_order_acquire) != 0) {
+        if (Worker != NULL) {
+            Entry = FindTask(Scheduler, Worker);
+            if (Entry != NULL) {
+                RunTask(Scheduler, Worker, Entry);
+                continue;
+            }
+            std::this_thread::yield();
+        }
+        else if (++Spin < TS_SPINS) {
+            std::this_thread::yield();
+        }
+        else {
+            std::this_thread::sleep_for(std::chrono::microseconds(TS_EXTERNAL_WAIT_US));
+        }
+    }
+}
+
+void TsQueryStats(PTASK_SCHEDULER Scheduler, PTS_STATS Stats)
+{
+    uint32_t Index;
+
+    Stats->Executed = 0;
+    Stats->Steals = 0;
+    Stats->StealAttempts = 0;
+    Stats->Parks = 0;
+    for (Index = 0; Index < Scheduler->NumberOfWorkers; ++Index) {
+        Stats->Executed += Scheduler->Workers[Index].Executed.load(std::memory_order_relaxed);
+        Stats->Steals += Scheduler->Workers[Index].Steals.load(std::memory_order_relaxed);
+        Stats->StealAttempts += Scheduler->Workers[Index].StealAttempts.load(std::memory_order_relaxed);
+        Stats->Parks += Scheduler->Workers[Index].Parks.load(std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,108 @@
+// scheduler.h : A work-stealing task scheduler for fork/join code.
+//
+// Each worker thread owns a work-stealing deque (see work-stealing-deque.h).
+// Tasks spawned on a worker go to the bottom of its own deque and are run
+// from there, newest first, which keeps the data a task just touched in its
+// cache; a worker with nothing left steals the oldest task of a random
+// victim. Tasks spawned from other threads go to an injection queue, an
+// SList, which idle workers empty with a single exchange and spread over
+// their deques. Workers that find nothing anywhere spin for a while and then
+// park, and spawning wakes one of them.
+//
+// Tasks are intrusive like SList entries: a TASK is embedded in the
+// caller's structure, which the routine gets back with CONTAINING_RECORD.
+// The scheduler never allocates or frees them; a task's memory must stay
+// valid until its group has been waited for. Every task belongs to a group,
+// and TsWait returns once every task spawned in the group is done. On a
+// worker, TsWait runs other tasks meanwhile, so fork/join code can keep
+// tasks and groups on the stack:
+//
+//     TsInitializeGroup(&Group);
+//     TsSpawn(Scheduler, &Group, &Left.Task, SumRoutine);
+//     Sum(&Right);
+//     TsWait(Scheduler, &Group);
+//
+
+#pragma once
+
+#include "work-stealing-deque.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+typedef struct _TASK TASK, *PTASK;
+typedef struct _TASK_SCHEDULER TASK_SCHEDULER, *PTASK_SCHEDULER;
+
+typedef void (*PTASK_ROUTINE)(PTASK_SCHEDULER Scheduler, PTASK Task);
+
+typedef struct _TASK_GROUP {
+    std::atomic<uint32_t> Pending;
+} TASK_GROUP, *PTASK_GROUP;
+
+struct _TASK {
+    SL_ENTRY Entry;
+    PTASK_ROUTINE Routine;
+    PTASK_GROUP Group;
+};
+
+//
+// Counters are only written by the worker they belong to.
+//
+typedef struct alignas(64) _TS_WORKER {
+    WS_DEQUE Deque;
+    PTASK_SCHEDULER Scheduler;
+    uint32_t Random;
+    std::atomic<uint64_t> Executed;
+    std::atomic<uint64_t> Steals;
+    std::atomic<uint64_t> StealAttempts;
+    std::atomic<uint64_t> Parks;
+    std::thread Thread;
+} TS_WORKER, *PTS_WORKER;
+
+//
+// Parked workers wait for WakeGeneration, under Lock, to move on; Sleepers
+// lets spawning skip the lock when nobody is parked.
+//
+struct _TASK_SCHEDULER {
+    uint32_t NumberOfWorkers;
+    PTS_WORKER Workers;
+    alignas(64) SL_HEADER Injection;
+    alignas(64) std::atomic<uint32_t> Sleepers;
+    std::atomic<bool> Stop;
+    std::mutex Lock;
+    uint64_t WakeGeneration;
+    std::condition_variable Wake;
+};
+
+typedef struct _TS_STATS {
+    uint64_t Executed;
+    uint64_t Steals;
+    uint64_t StealAttempts;
+    uint64_t Parks;
+} TS_STATS, *PTS_STATS;
+
+//
+// Starts NumberOfWorkers threads, 0 for one per CPU. Returns false when out
+// of memory.
+//
+bool TsInitialize(PTASK_SCHEDULER Scheduler, uint32_t NumberOfWorkers);
+
+//
+// Stops and joins the workers. Every group must have been waited for.
+//
+void TsDelete(PTASK_SCHEDULER Scheduler);
+
+inline void TsInitializeGroup(PTASK_GROUP Group)
+{
+    Group->Pending.store(0, std::memory_order_relaxed);
+}
+
+void TsSpawn(PTASK_SCHEDULER Scheduler, PTASK_GROUP Group, PTASK Task, PTASK_ROUTINE Routine);
+void TsWait(PTASK_SCHEDULER Scheduler, PTASK_GROUP Group);
+
+//
+// Sums the counters of every worker. Exact once the scheduler is idle.
+//
+void TsQueryStats(PTASK_SCHEDULER Scheduler, PTS_STATS Stats);
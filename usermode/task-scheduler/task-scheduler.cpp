@@ -0,0 +1,298 @@
+// task-scheduler.cpp : This file contains the 'main' function. Program execution begins and ends there.
+//
+// Throughput and scaling of the work-stealing scheduler in scheduler.h on
+// recursive fork/join workloads:
+//
+//  - fib: the naive Fibonacci recursion, one task per call above --cutoff.
+//    Almost no work per task, so this measures what spawning, stealing and
+//    joining cost.
+//  - reduce: a sum over --elements values, split in halves down to --grain
+//    values per task, with a few multiplications per value. Plenty of work
+//    per task, so this measures how close to linear the scheduler scales.
+//
+// Each workload runs --runs times on 1, 2, 4 ... workers up to --workers,
+// and the fastest run is reported with its task rate, its speedup over one
+// worker, and the steals and parks it took. Results are checked against a
+// serial computation.
+//
+// Outside Visual Studio: g++ -O2 -mcx16 -pthread -o task-scheduler task-scheduler.cpp scheduler.cpp
+//
+
+#include "../common/benchmark-util.h"
+#include "scheduler.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXIMUM_WORKERS                 256
+
+typedef struct _FIB_TASK {
+    TASK Task;
+    uint32_t N;
+    uint64_t Result;
+} FIB_TASK, *PFIB_TASK;
+
+typedef struct _REDUCE_TASK {
+    TASK Task;
+    const uint64_t* Values;
+    size_t Count;
+    uint64_t Result;
+} REDUCE_TASK, *PREDUCE_TASK;
+
+typedef struct _OPTIONS {
+    uint32_t Fib;
+    uint32_t Cutoff;
+    size_t Elements;
+    size_t Grain;
+    uint64_t* Values;
+} OPTIONS, *POPTIONS;
+
+static OPTIONS Options;
+
+static uint64_t FibSerial(uint32_t N)
+{
+    return N < 2 ? N : FibSerial(N - 1) + FibSerial(N - 2);
+}
+
+static uint64_t Fib(PTASK_SCHEDULER Scheduler, uint32_t N);
+
+static void FibRoutine(PTASK_SCHEDULER Scheduler, PTASK Task)
+{
+    PFIB_TASK Fib = CONTAINING_RECORD(Task, FIB_TASK, Task);
+
+    Fib->Result = ::Fib(Scheduler, Fib->N);
+}
+
+static uint64_t Fib(PTASK_SCHEDULER Scheduler, uint32_t N)
+{
+    TASK_GROUP Group;
+    FIB_TASK Child;
+    uint64_t Result;
+
+    if (N <= Options.Cutoff) {
+        return FibSerial(N);
+    }
+    TsInitializeGroup(&Group);
+    Child.N = N - 1;
+    TsSpawn(Scheduler, &Group, &Child.Task, FibRoutine);
+    Result = Fib(Scheduler, N - 2);
+    TsWait(Scheduler, &Group);
+    return Result + Child.Result;
+}
+
+//
+// The splitmix64 finalizer, as the work done per value.
+//
+static uint64_t Mix(uint64_t Value)
+{
+    Value = (Value ^ (Value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    Value = (Value ^ (Value >> 27)) * 0x94d049bb133111ebull;
+    return Value ^ (Value >> 31);
+}
+
+static uint64_t ReduceSerial(const uint64_t* Values, size_t Count)
+{
+    uint64_t Result = 0;
+    size_t Index;
+
+    for (Index = 0; Index < Count; ++Index) {
+        Result += Mix(Values[Index]);
+    }
+    return Result;
+}
+
+static uint64_t Reduce(PTASK_SCHEDULER Scheduler, const uint64_t* Values, size_t Count);
+
+static void ReduceRoutine(PTASK_SCHEDULER Scheduler, PTASK Task)
+{
+    PREDUCE_TASK Reduce = CONTAINING_RECORD(Task, REDUCE_TASK, Task);
+
+    Reduce->Result = ::Reduce(Scheduler, Reduce->Values, Reduce->Count);
+}
+
+static uint64_t Reduce(PTASK_SCHEDULER Scheduler, const uint64_t* Values, size_t Count)
+{
+    TASK_GROUP Group;
+    REDUCE_TASK Left;
+    uint64_t Result;
+
+    if (Count <= Options.Grain) {
+        return ReduceSerial(Values, Count);
+    }
+    TsInitializeGroup(&Group);
+    Left.Values = Values;
+    Left.Count = Count / 2;
+    TsSpawn(Scheduler, &Group, &Left.Task, ReduceRoutine);
+    Result = Reduce(Scheduler, Values + Count / 2, Count - Count / 2);
+    TsWait(Scheduler, &Group);
+    return Result + Left.Result;
+}
+
+typedef struct _WORKLOAD {
+    const char* Name;
+    PTASK_ROUTINE Routine;
+    uint64_t Expected;
+    double BaselineMs;
+} WORKLOAD, *PWORKLOAD;
+
+//
+// The root task is spawned from the main thread, so it goes through the
+// injection queue and the main thread waits without running tasks.
+//
+static uint64_t RunRoot(PTASK_SCHEDULER Scheduler, PWORKLOAD Workload)
+{
+    TASK_GROUP Group;
+    union {
+        FIB_TASK Fib;
+        REDUCE_TASK Reduce;
+    } Root;
+
+    TsInitializeGroup(&Group);
+    if (Workload->Routine == FibRoutine) {
+        Root.Fib.N = Options.Fib;
+        TsSpawn(Scheduler, &Group, &Root.Fib.Task, FibRoutine);
+        TsWait(Scheduler, &Group);
+        return Root.Fib.Result;
+    }
+    Root.Reduce.Values = Options.Values;
+    Root.Reduce.Count = Options.Elements;
+    TsSpawn(Scheduler, &Group, &Root.Reduce.Task, ReduceRoutine);
+    TsWait(Scheduler, &Group);
+    return Root.Reduce.Result;
+}
+
+static bool Measure(PTASK_SCHEDULER Scheduler, PWORKLOAD Workload, uint32_t Runs)
+{
+    double BestMs = 0;
+    TS_STATS Best = {};
+    TS_STATS Before;
+    TS_STATS After;
+    uint32_t Run;
+
+    for (Run = 0; Run < Runs; ++Run) {
+        std::chrono::steady_clock::time_point Start;
+        double Ms;
+        uint64_t Result;
+
+        TsQueryStats(Scheduler, &Before);
+        Start = std::chrono::steady_clock::now();
+        Result = RunRoot(Scheduler, Workload);
+        Ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+        TsQueryStats(Scheduler, &After);
+
+        if (Result != Workload->Expected) {
+            printf("%s: got %llu instead of %llu\n", Workload->Name, (unsigned long long)Result,
+                (unsigned long long)Workload->Expected);
+            return false;
+        }
+        if (Run == 0 || Ms < BestMs) {
+            BestMs = Ms;
+            Best.Executed = After.Executed - Before.Executed;
+            Best.Steals = After.Steals - Before.Steals;
+            Best.StealAttempts = After.StealAttempts - Before.StealAttempts;
+            Best.Parks = After.Parks - Before.Parks;
+        }
+    }
+
+    if (Workload->BaselineMs == 0) {
+        Workload->BaselineMs = BestMs;
+    }
+    printf("%-8s %7u %10.2f %12.0f %8.2fx %10llu %10llu %8llu\n",
+        Workload->Name, Scheduler->NumberOfWorkers, BestMs, Best.Executed / (BestMs / 1000),
+        Workload->BaselineMs / BestMs, (unsigned long long)Best.Steals,
+        (unsigned long long)Best.StealAttempts, (unsigned long long)Best.Parks);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    WORKLOAD Workloads[] = {
+        { "fib", FibRoutine, 0, 0 },
+        { "reduce", ReduceRoutine, 0, 0 },
+    };
+    const char* WorkloadList = NULL;
+    uint32_t MaximumWorkers = std::thread::hardware_concurrency();
+    uint32_t Runs = 3;
+    TASK_SCHEDULER Scheduler;
+    size_t Element;
+    int Index;
+
+    Options.Fib = 32;
+    Options.Cutoff = 10;
+    Options.Elements = (size_t)1 << 24;
+    Options.Grain = 8192;
+
+    for (Index = 1; Index < argc; ++Index) {
+        if (strcmp(argv[Index], "--workload") == 0 && Index + 1 < argc) {
+            WorkloadList = argv[++Index];
+        }
+        else if (strcmp(argv[Index], "--workers") == 0 && Index + 1 < argc) {
+            MaximumWorkers = (uint32_t)strtoul(argv[++Index], NULL, 0);
+        }
+        else if (strcmp(argv[Index], "--runs") == 0 && Index + 1 < argc) {
+            Runs = (uint32_t)strtoul(argv[++Index], NULL, 0);
+        }
+        else if (strcmp(argv[Index], "--fib") == 0 && Index + 1 < argc) {
+            Options.Fib = (uint32_t)strtoul(argv[++Index], NULL, 0);
+        }
+        else if (strcmp(argv[Index], "--cutoff") == 0 && Index + 1 < argc) {
+            Options.Cutoff = (uint32_t)strtoul(argv[++Index], NULL, 0);
+        }
+        else if (strcmp(argv[Index], "--elements") == 0 && Index + 1 < argc) {
+            Options.Elements = (size_t)strtoull(argv[++Index], NULL, 0);
+        }
+        else if (strcmp(argv[Index], "--grain") == 0 && Index + 1 < argc) {
+            Options.Grain = (size_t)strtoull(argv[++Index], NULL, 0);
+        }
+        else {
+            break;
+        }
+    }
+    if (Index < argc || Runs == 0 || Options.Fib > 60 || Options.Cutoff < 1 || Options.Grain == 0) {
+        printf("Usage: task-scheduler [--workload fib,reduce] [--workers maximum] [--runs count]\n" \
+            "                      [--fib n] [--cutoff n] [--elements count] [--grain count]\n");
+        return 1;
+    }
+    if (MaximumWorkers == 0) {
+        MaximumWorkers = 1;
+    }
+    if (MaximumWorkers > MAXIMUM_WORKERS) {
+        MaximumWorkers = MAXIMUM_WORKERS;
+    }
+
+    Options.Values = new (std::nothrow) uint64_t[Options.Elements];
+    if (Options.Values == NULL) {
+        printf("Out of memory for %zu elements\n", Options.Elements);
+        return 1;
+    }
+    for (Element = 0; Element < Options.Elements; ++Element) {
+        Options.Values[Element] = Element;
+    }
+    Workloads[0].Expected = FibSerial(Options.Fib);
+    Workloads[1].Expected = ReduceSerial(Options.Values, Options.Elements);
+
+    printf("%-8s %7s %10s %12s %9s %10s %10s %8s\n",
+        "workload", "workers", "best ms", "tasks/s", "speedup", "steals", "attempts", "parks");
+
+    for (uint32_t Workers = 1; ; Workers = Workers * 2 < MaximumWorkers ? Workers * 2 : MaximumWorkers) {
+        if (TsInitialize(&Scheduler, Workers) == false) {
+            printf("Out of memory starting %u workers\n", Workers);
+            return 1;
+        }
+        for (WORKLOAD& Workload : Workloads) {
+            if (Selected(WorkloadList, Workload.Name) && Measure(&Scheduler, &Workload, Runs) == false) {
+                TsDelete(&Scheduler);
+                return 1;
+            }
+        }
+        TsDelete(&Scheduler);
+        if (Workers == MaximumWorkers) {
+            break;
+        }
+    }
+
+    delete[] Options.Values;
+    return 0;
+}
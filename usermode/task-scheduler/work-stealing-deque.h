@@ -0,0 +1,186 @@
+// work-stealing-deque.h : A Chase-Lev work-stealing deque of SList entries.
+//
+// One thread, the owner, pushes and pops at the bottom like a stack; any
+// other thread may steal from the top. The owner only contends with thieves
+// for the last entry, so pushing and popping cost no atomic read-modify-write
+// at all otherwise, and a thief takes the oldest entry, which in fork/join
+// code is the root of the largest piece of work left.
+//
+// The entries live in a circular array that doubles when full. A thief may
+// still be reading an array the owner just replaced, so replaced arrays are
+// kept until the deque is deleted; together they are never larger than the
+// current one.
+//
+// The memory orders follow "Correct and Efficient Work-Stealing for Weak
+// Memory Models" (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013). The release
+// fence in the push is not a release store of Bottom for a reason: a thief
+// may read Bottom as a later pop restored it, and must still see the entry.
+// As with the MPMC queue, only pointers to entries are stored and their
+// Next field is left alone.
+//
+
+#pragma once
+
+#include "../single-linked-list/slist.h"
+
+#include <atomic>
+#include <new>
+
+#define WS_INITIAL_SIZE                 256
+
+typedef struct _WS_ARRAY {
+    struct _WS_ARRAY* Previous;
+    int64_t Mask;
+    std::atomic<PSL_ENTRY> Entries[1];
+} WS_ARRAY, *PWS_ARRAY;
+
+typedef struct _WS_DEQUE {
+    alignas(64) std::atomic<int64_t> Top;
+    alignas(64) std::atomic<int64_t> Bottom;
+    std::atomic<PWS_ARRAY> Array;
+} WS_DEQUE, *PWS_DEQUE;
+
+inline PWS_ARRAY WdpAllocateArray(int64_t Size, PWS_ARRAY Previous)
+{
+    PWS_ARRAY Array = (PWS_ARRAY)::operator new(sizeof(WS_ARRAY) + (Size - 1) * sizeof(std::atomic<PSL_ENTRY>),
+        std::nothrow);
+    int64_t Index;
+
+    if (Array == NULL) {
+        return NULL;
+    }
+    Array->Previous = Previous;
+    Array->Mask = Size - 1;
+    for (Index = 0; Index < Size; ++Index) {
+        new (&Array->Entries[Index]) std::atomic<PSL_ENTRY>(NULL);
+    }
+    return Array;
+}
+
+inline bool WdInitialize(PWS_DEQUE Deque)
+{
+    PWS_ARRAY Array = WdpAllocateArray(WS_INITIAL_SIZE, NULL);
+
+    if (Array == NULL) {
+        return false;
+    }
+    Deque->Top.store(0, std::memory_order_relaxed);
+    Deque->Bottom.store(0, std::memory_order_relaxed);
+    Deque->Array.store(Array, std::memory_order_relaxed);
+    return true;
+}
+
+inline void WdDelete(PWS_DEQUE Deque)
+{
+    PWS_ARRAY Array = Deque->Array.load(std::memory_order_relaxed);
+
+    while (Array != NULL) {
+        PWS_ARRAY Previous = Array->Previous;
+
+        ::operator delete(Array);
+        Array = Previous;
+    }
+    Deque->Array.store(NULL, std::memory_order_relaxed);
+}
+
+//
+// Owner only. Returns false if the array was full and could not grow.
+//
+inline bool WdPush(PWS_DEQUE Deque, PSL_ENTRY Entry)
+{
+    int64_t Bottom = Deque->Bottom.load(std::memory_order_relaxed);
+    int64_t Top = Deque->Top.load(std::memory_order_acquire);
+    PWS_ARRAY Array = Deque->Array.load(std::memory_order_relaxed);
+
+    if (Bottom - Top > Array->Mask) {
+        PWS_ARRAY Grown = WdpAllocateArray(2 * (Array->Mask + 1), Array);
+        int64_t Index;
+
+        if (Grown == NULL) {
+            return false;
+        }
+        for (Index = Top; Index < Bottom; ++Index) {
+            Grown->Entries[Index & Grown->Mask].store(
+                Array->Entries[Index & Array->Mask].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        Deque->Array.store(Grown, std::memory_order_release);
+        Array = Grown;
+    }
+    Array->Entries[Bottom & Array->Mask].store(Entry, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    Deque->Bottom.store(Bottom + 1, std::memory_order_relaxed);
+    return true;
+}
+
+//
+// Owner only. Takes the newest entry, or returns NULL when the deque is
+// empty or a thief took the last one.
+//
+inline PSL_ENTRY WdPop(PWS_DEQUE Deque)
+{
+    int64_t Bottom = Deque->Bottom.load(std::memory_order_relaxed) - 1;
+    PWS_ARRAY Array = Deque->Array.load(std::memory_order_relaxed);
+    PSL_ENTRY Entry = NULL;
+    int64_t Top;
+
+    //
+    // Claims the bottom entry before looking at Top, so that a thief
+    // either sees the claim or the owner sees the theft.
+    //
+    Deque->Bottom.store(Bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Top = Deque->Top.load(std::memory_order_relaxed);
+
+    if (Top <= Bottom) {
+        Entry = Array->Entries[Bottom & Array->Mask].load(std::memory_order_relaxed);
+        if (Top == Bottom) {
+            if (Deque->Top.compare_exchange_strong(Top, Top + 1, std::memory_order_seq_cst,
+                std::memory_order_relaxed) == false) {
+                Entry = NULL;
+            }
+            Deque->Bottom.store(Bottom + 1, std::memory_order_relaxed);
+        }
+    }
+    else {
+        Deque->Bottom.store(Bottom + 1, std::memory_order_relaxed);
+    }
+    return Entry;
+}
+
+//
+// Any thread. Takes the oldest entry, or returns NULL when the deque is
+// empty or when another thread won the race for it; *Lost tells which.
+//
+inline PSL_ENTRY WdSteal(PWS_DEQUE Deque, bool* Lost)
+{
+    int64_t Top = Deque->Top.load(std::memory_order_acquire);
+    int64_t Bottom;
+    PWS_ARRAY Array;
+    PSL_ENTRY Entry;
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Bottom = Deque->Bottom.load(std::memory_order_acquire);
+    *Lost = false;
+    if (Top >= Bottom) {
+        return NULL;
+    }
+
+    Array = Deque->Array.load(std::memory_order_acquire);
+    Entry = Array->Entries[Top & Array->Mask].load(std::memory_order_relaxed);
+    if (Deque->Top.compare_exchange_strong(Top, Top + 1, std::memory_order_seq_cst,
+        std::memory_order_relaxed) == false) {
+        *Lost = true;
+        return NULL;
+    }
+    return Entry;
+}
+
+//
+// Any thread. A snapshot, stale as soon as it is returned.
+//
+inline bool WdIsEmpty(PWS_DEQUE Deque)
+{
+    int64_t Top = Deque->Top.load(std::memory_order_relaxed);
+
+    return Deque->Bottom.load(std::memory_order_relaxed) <= Top;
+}